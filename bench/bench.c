@@ -0,0 +1,500 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cai/allocator.h"
+#include "cai/criterion.h"
+#include "cai/kernel.h"
+#include "cai/layer.h"
+#include "cai/matrix.h"
+#include "cai/network.h"
+#include "cai/thread.h"
+
+#define BENCH_REPETITIONS 25
+#define BENCH_TARGET_NS 2000000.0
+#define BENCH_THRESHOLD 0.10
+#define BENCH_LINE 512
+
+/*
+ * bench_baseline is one record read back from a stored report.
+ */
+typedef struct bench_baseline {
+  char name[64];
+  double median_ns;
+  long allocations;
+} bench_baseline;
+
+/*
+ * bench_state holds the options and the comparison for one run.
+ */
+typedef struct bench_state {
+  const char *filter;
+  int repetitions;
+  double threshold;
+  bench_baseline *baseline;
+  int baseline_count;
+  int regressions;
+  int records;
+  FILE *out;
+} bench_state;
+
+static bench_state state = {NULL, BENCH_REPETITIONS, BENCH_THRESHOLD, NULL, 0, 0, 0, NULL};
+
+/*
+ * bench_now returns a monotonic time in nanoseconds.
+ */
+static double bench_now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec * 1e9 + (double)t.tv_nsec;
+}
+
+/*
+ * bench_allocations returns the allocations made so far through the global
+ * allocator and the system allocator, counting each allocator once.
+ */
+static long bench_allocations() {
+  allocator *a = cai_allocator_get(), *s = allocator_system();
+  return (long)(a->allocations + (a != s ? s->allocations : 0));
+}
+
+static int bench_order(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * bench_find returns the baseline record named name, or NULL.
+ */
+static bench_baseline *bench_find(const char *name) {
+  int i;
+  for (i = 0; i < state.baseline_count; i++) {
+    if (strcmp(state.baseline[i].name, name) == 0) {
+      return &state.baseline[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * bench_measure times run(context) and writes one JSON record. Each
+ * repetition runs enough iterations to last about BENCH_TARGET_NS, the
+ * reported times are per iteration, flops of 0 omits the GFLOP/s.
+ */
+static void bench_measure(const char *name, void (*run)(void *), void *context, double flops) {
+  double *samples, start, once, median, p99;
+  long iterations, allocations, k;
+  bench_baseline *b;
+  int r;
+
+  if (state.filter != NULL && strstr(name, state.filter) == NULL) {
+    return;
+  }
+  samples = malloc(state.repetitions * sizeof(*samples));
+  if (samples == NULL) {
+    perror("Out of memory\n");
+    exit(1);
+  }
+
+  // Warm up the caches, pack buffers and lazily created outputs.
+  start = bench_now();
+  run(context);
+  once = bench_now() - start;
+  iterations = once >= BENCH_TARGET_NS ? 1 : (long)(BENCH_TARGET_NS / (once > 1.0 ? once : 1.0));
+
+  allocations = bench_allocations();
+  for (r = 0; r < state.repetitions; r++) {
+    start = bench_now();
+    for (k = 0; k < iterations; k++) {
+      run(context);
+    }
+    samples[r] = (bench_now() - start) / (double)iterations;
+  }
+  allocations = (bench_allocations() - allocations) / ((long)state.repetitions * iterations);
+
+  qsort(samples, state.repetitions, sizeof(*samples), bench_order);
+  median = samples[state.repetitions / 2];
+  p99 = samples[(int)(0.99 * (state.repetitions - 1) + 0.5)];
+
+  fprintf(state.out, "%s    {\"name\": \"%s\", \"repetitions\": %d, \"iterations\": %ld, "
+    "\"median_ns\": %.1f, \"p99_ns\": %.1f, \"min_ns\": %.1f",
+    state.records++ > 0 ? ",\n" : "", name, state.repetitions, iterations, median, p99, samples[0]);
+  if (flops > 0) {
+    fprintf(state.out, ", \"gflops\": %.3f", flops / median);
+  }
+  fprintf(state.out, ", \"allocations\": %ld", allocations);
+
+  b = bench_find(name);
+  if (b != NULL) {
+    double change = b->median_ns > 0 ? median / b->median_ns - 1.0 : 0.0;
+    int regression = change > state.threshold || allocations > b->allocations;
+    fprintf(state.out, ", \"baseline_median_ns\": %.1f, \"change\": %.4f, \"regression\": %s",
+      b->median_ns, change, regression ? "true" : "false");
+    if (regression) {
+      fprintf(stderr, "bench: %s regressed, %.1f ns against %.1f ns, %ld allocations against %ld\n",
+        name, median, b->median_ns, allocations, b->allocations);
+      state.regressions++;
+    }
+  }
+  fprintf(state.out, "}");
+  fflush(state.out);
+  free(samples);
+}
+
+/*
+ * bench_load reads the records of a report written by this program, one
+ * record per line.
+ */
+static int bench_load(const char *path) {
+  char line[BENCH_LINE];
+  int capacity = 0;
+  FILE *f = fopen(path, "r");
+
+  if (f == NULL) {
+    fprintf(stderr, "bench_load: cannot open %s\n", path);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char *name = strstr(line, "\"name\": \""), *median = strstr(line, "\"median_ns\": ");
+    char *allocations = strstr(line, "\"allocations\": "), *end;
+    bench_baseline *b;
+    if (name == NULL || median == NULL || allocations == NULL) {
+      continue;
+    }
+    if (state.baseline_count == capacity) {
+      capacity = capacity > 0 ? 2 * capacity : 64;
+      b = realloc(state.baseline, capacity * sizeof(*b));
+      if (b == NULL) {
+        perror("Out of memory\n");
+        fclose(f);
+        return -1;
+      }
+      state.baseline = b;
+    }
+    b = &state.baseline[state.baseline_count++];
+    name += strlen("\"name\": \"");
+    end = strchr(name, '"');
+    if (end == NULL || end - name >= (long)sizeof(b->name)) {
+      state.baseline_count--;
+      continue;
+    }
+    memcpy(b->name, name, end - name);
+    b->name[end - name] = '\0';
+    b->median_ns = strtod(median + strlen("\"median_ns\": "), NULL);
+    b->allocations = strtol(allocations + strlen("\"allocations\": "), NULL, 10);
+  }
+  fclose(f);
+  return 0;
+}
+
+/*
+ * Kernel benchmarks.
+ */
+typedef struct bench_matrices {
+  matrix *a;
+  matrix *b;
+  matrix *c;
+} bench_matrices;
+
+static void bench_run_multiply(void *context) {
+  bench_matrices *m = context;
+  matrix_multiply_into(m->a, m->b, m->c);
+}
+
+static void bench_run_add(void *context) {
+  bench_matrices *m = context;
+  matrix_add_into(m->a, m->b, m->c);
+}
+
+static void bench_run_scale(void *context) {
+  bench_matrices *m = context;
+  matrix_scale_into(m->a, 0.5f, m->c);
+}
+
+static void bench_multiply(int rows, int inner, int columns) {
+  char name[64];
+  bench_matrices m;
+  m.a = matrix_create(rows, inner, matrix_random);
+  m.b = matrix_create(inner, columns, matrix_random);
+  m.c = matrix_create(rows, columns, NULL);
+  snprintf(name, sizeof(name), "matrix_multiply/%dx%dx%d", rows, inner, columns);
+  bench_measure(name, bench_run_multiply, &m, 2.0 * rows * inner * columns);
+  matrix_free(m.a);
+  matrix_free(m.b);
+  matrix_free(m.c);
+}
+
+static void bench_elementwise(int rows, int columns) {
+  char name[64];
+  bench_matrices m;
+  m.a = matrix_create(rows, columns, matrix_random);
+  m.b = matrix_create(rows, columns, matrix_random);
+  m.c = matrix_create(rows, columns, NULL);
+  snprintf(name, sizeof(name), "matrix_add/%dx%d", rows, columns);
+  bench_measure(name, bench_run_add, &m, (double)rows * columns);
+  snprintf(name, sizeof(name), "matrix_scale/%dx%d", rows, columns);
+  bench_measure(name, bench_run_scale, &m, (double)rows * columns);
+  matrix_free(m.a);
+  matrix_free(m.b);
+  matrix_free(m.c);
+}
+
+typedef struct bench_layer {
+  layer *layer;
+  matrix *input;
+  matrix *gradient;
+} bench_layer;
+
+static void bench_run_layer_forward(void *context) {
+  bench_layer *b = context;
+  layer_forward(b->layer, b->input);
+}
+
+static void bench_run_layer_backward(void *context) {
+  bench_layer *b = context;
+  layer_backward(b->layer, b->input, b->gradient);
+}
+
+static void bench_activation(int type, const char *label, int rows, int columns) {
+  char name[64];
+  bench_layer b;
+  b.layer = layer_create_type(type, 0, rows, rows);
+  b.input = matrix_create(rows, columns, matrix_random);
+  b.gradient = matrix_create(rows, columns, matrix_random);
+  layer_forward(b.layer, b.input);
+  snprintf(name, sizeof(name), "activation/%s/forward/%dx%d", label, rows, columns);
+  bench_measure(name, bench_run_layer_forward, &b, 0);
+  snprintf(name, sizeof(name), "activation/%s/backward/%dx%d", label, rows, columns);
+  bench_measure(name, bench_run_layer_backward, &b, 0);
+  layer_free(b.layer);
+  matrix_free(b.input);
+  matrix_free(b.gradient);
+}
+
+static void bench_run_layer_update(void *context) {
+  bench_layer *b = context;
+  layer_update(b->layer, b->input, b->gradient, 1);
+}
+
+/*
+ * bench_convolution measures a 3x3 same convolution of channels to filters and
+ * a 2x2 max pool over a height x width image, batch images at a time.
+ */
+static void bench_convolution(int height, int width, int channels, int filters, int batch) {
+  double flops = 2.0 * height * width * filters * 9 * channels * batch;
+  char name[64];
+  bench_layer b;
+  b.layer = layer_create_conv2d(ACTIVATION_RELU, layer_random,
+    convolution_create(height, width, channels, filters, 3, 1, 1, 1));
+  b.input = matrix_create(b.layer->input_size, batch, matrix_random);
+  b.gradient = matrix_create(b.layer->output_size, batch, matrix_random);
+  layer_forward(b.layer, b.input);
+  snprintf(name, sizeof(name), "conv2d/forward/%dx%dx%d-%d/%d", height, width, channels, filters, batch);
+  bench_measure(name, bench_run_layer_forward, &b, flops);
+  snprintf(name, sizeof(name), "conv2d/backward/%dx%dx%d-%d/%d", height, width, channels, filters, batch);
+  bench_measure(name, bench_run_layer_backward, &b, flops);
+  snprintf(name, sizeof(name), "conv2d/update/%dx%dx%d-%d/%d", height, width, channels, filters, batch);
+  bench_measure(name, bench_run_layer_update, &b, flops);
+  layer_free(b.layer);
+  matrix_free(b.input);
+  matrix_free(b.gradient);
+
+  b.layer = layer_create_pool(CONVOLUTION_MAX, convolution_create(height, width, channels, channels, 2, 2, 0, 1));
+  b.input = matrix_create(b.layer->input_size, batch, matrix_random);
+  b.gradient = matrix_create(b.layer->output_size, batch, matrix_random);
+  layer_forward(b.layer, b.input);
+  snprintf(name, sizeof(name), "max_pool/forward/%dx%dx%d/%d", height, width, channels, batch);
+  bench_measure(name, bench_run_layer_forward, &b, 0);
+  snprintf(name, sizeof(name), "max_pool/backward/%dx%dx%d/%d", height, width, channels, batch);
+  bench_measure(name, bench_run_layer_backward, &b, 0);
+  layer_free(b.layer);
+  matrix_free(b.input);
+  matrix_free(b.gradient);
+}
+
+typedef struct bench_criterion {
+  criterion *criterion;
+  matrix *output;
+  matrix *target;
+} bench_criterion;
+
+static void bench_run_criterion_forward(void *context) {
+  bench_criterion *b = context;
+  criterion_forward(b->criterion, b->output, b->target);
+}
+
+static void bench_run_criterion_backward(void *context) {
+  bench_criterion *b = context;
+  criterion_backward(b->criterion, b->output, b->target);
+}
+
+static void bench_run_criterion_fused(void *context) {
+  bench_criterion *b = context;
+  criterion_forward_backward(b->criterion, b->output, b->target);
+}
+
+static void bench_criterion_case(
+  const char *label,
+  matrix *(*output)(matrix *, matrix *, matrix *),
+  matrix *(*gradient)(matrix *, matrix *, matrix *),
+  int rows,
+  int columns
+) {
+  char name[64];
+  bench_criterion b;
+  int j;
+  b.criterion = criterion_create(output, gradient);
+  b.output = matrix_create(rows, columns, matrix_random);
+  b.target = matrix_create(rows, columns, NULL);
+  for (j = 0; j < columns; j++) {
+    matrix_at(b.target, j % rows, j) = 1;
+  }
+  snprintf(name, sizeof(name), "criterion/%s/forward/%dx%d", label, rows, columns);
+  bench_measure(name, bench_run_criterion_forward, &b, 0);
+  snprintf(name, sizeof(name), "criterion/%s/backward/%dx%d", label, rows, columns);
+  bench_measure(name, bench_run_criterion_backward, &b, 0);
+  snprintf(name, sizeof(name), "criterion/%s/forward_backward/%dx%d", label, rows, columns);
+  bench_measure(name, bench_run_criterion_fused, &b, 0);
+  criterion_free(b.criterion);
+  matrix_free(b.output);
+  matrix_free(b.target);
+}
+
+/*
+ * End to end benchmarks of a compiled dense MLP.
+ */
+typedef struct bench_network {
+  network *network;
+  matrix *input;
+  matrix *gradient;
+} bench_network;
+
+static void bench_run_forward(void *context) {
+  bench_network *b = context;
+  network_forward(b->network, b->input);
+}
+
+static void bench_run_backward(void *context) {
+  bench_network *b = context;
+  network_backward(b->network, b->input, b->gradient);
+}
+
+static void bench_run_update(void *context) {
+  bench_network *b = context;
+  network_update(b->network, 0.0f);
+}
+
+static void bench_mlp(const char *label, const int *sizes, int count, int batch) {
+  char name[64];
+  bench_network b;
+  double flops = 0;
+  int i;
+
+  b.network = network_create();
+  for (i = 0; i + 1 < count; i++) {
+    network_layer_add(b.network, layer_create_dense(
+      i + 2 < count ? ACTIVATION_RELU : ACTIVATION_NONE, layer_random, sizes[i], sizes[i + 1]));
+    flops += 2.0 * sizes[i] * sizes[i + 1] * batch;
+  }
+  if (network_compile(b.network, sizes[0], batch) == NULL) {
+    network_free(b.network);
+    return;
+  }
+  b.input = matrix_create(sizes[0], batch, matrix_random);
+  b.gradient = matrix_create(sizes[count - 1], batch, matrix_random);
+  network_forward(b.network, b.input);
+
+  snprintf(name, sizeof(name), "network_forward/%s/%d", label, batch);
+  bench_measure(name, bench_run_forward, &b, flops);
+  snprintf(name, sizeof(name), "network_backward/%s/%d", label, batch);
+  bench_measure(name, bench_run_backward, &b, 2.0 * flops);
+  snprintf(name, sizeof(name), "network_update/%s/%d", label, batch);
+  bench_measure(name, bench_run_update, &b, 0);
+
+  matrix_free(b.input);
+  matrix_free(b.gradient);
+  network_free(b.network);
+}
+
+static void bench_usage(const char *program) {
+  fprintf(stderr,
+    "usage: %s [--filter substring] [--repetitions n] [--output report.json]\n"
+    "          [--compare baseline.json] [--threshold fraction]\n", program);
+}
+
+int main(int argc, char **argv) {
+  static const struct { int type; const char *label; } activations[] = {
+    {LAYER_SIGMOID, "sigmoid"}, {LAYER_TANH, "tanh"}, {LAYER_RELU, "relu"},
+    {LAYER_LEAKY_RELU, "leaky_relu"}, {LAYER_GELU, "gelu"}, {LAYER_SOFTPLUS, "softplus"}
+  };
+  static const int small[] = {64, 128, 128, 10};
+  static const int medium[] = {784, 512, 512, 10};
+  static const int large[] = {1024, 1024, 1024, 1024};
+  static const int batches[] = {1, 32, 256};
+  const char *output = NULL;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      state.filter = argv[++i];
+    } else if (strcmp(argv[i], "--repetitions") == 0 && i + 1 < argc) {
+      state.repetitions = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+      output = argv[++i];
+    } else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+      if (bench_load(argv[++i]) != 0) {
+        return 2;
+      }
+    } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+      state.threshold = atof(argv[++i]);
+    } else {
+      bench_usage(argv[0]);
+      return 2;
+    }
+  }
+  if (state.repetitions <= 0) {
+    bench_usage(argv[0]);
+    return 2;
+  }
+  state.out = output != NULL ? fopen(output, "w") : stdout;
+  if (state.out == NULL) {
+    fprintf(stderr, "bench: cannot open %s\n", output);
+    return 2;
+  }
+
+  fprintf(state.out, "{\n  \"threads\": %d,\n  \"isa\": \"%s\",\n  \"repetitions\": %d,\n  \"benchmarks\": [\n",
+    cai_threads_get(), cai_kernel_isa(), state.repetitions);
+
+  for (i = 64; i <= 1024; i *= 2) {
+    bench_multiply(i, i, i);
+  }
+  bench_multiply(1024, 1024, 1);
+  bench_multiply(1024, 1024, 16);
+  bench_multiply(4096, 256, 64);
+  bench_multiply(64, 4096, 64);
+  bench_multiply(10, 512, 256);
+
+  bench_elementwise(1024, 1024);
+  for (i = 0; i < (int)(sizeof(activations) / sizeof(*activations)); i++) {
+    bench_activation(activations[i].type, activations[i].label, 1024, 256);
+  }
+  bench_criterion_case("mse", criterion_forward_mse, criterion_backward_mse, 64, 1024);
+  bench_criterion_case("cross_entropy", criterion_forward_cross_entropy,
+    criterion_backward_cross_entropy, 32768, 32);
+  bench_criterion_case("bce_logits", criterion_forward_bce_logits, criterion_backward_bce_logits, 64, 1024);
+  bench_convolution(28, 28, 1, 16, 32);
+  bench_convolution(32, 32, 16, 32, 32);
+
+  for (i = 0; i < (int)(sizeof(batches) / sizeof(*batches)); i++) {
+    bench_mlp("64-128-128-10", small, 4, batches[i]);
+    bench_mlp("784-512-512-10", medium, 4, batches[i]);
+    bench_mlp("1024-1024-1024-1024", large, 4, batches[i]);
+  }
+
+  fprintf(state.out, "\n  ],\n  \"regressions\": %d\n}\n", state.regressions);
+  if (state.out != stdout) {
+    fclose(state.out);
+  }
+  free(state.baseline);
+  return state.regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,36 @@
+#include "activation.h"
+#include "kernel.h"
+
+/*
+ * The activations run on the kernels of the instruction set picked at load,
+ * see kernel_activation.h for the approximations and their errors.
+ */
+
+/*
+ * activation_exp writes e^x into y.
+ */
+void activation_exp(float *y, const float *x, long n) {
+  kernel_get()->activation_exp(y, x, n);
+}
+
+/*
+ * activation_log writes the natural log of x into y, x must be positive.
+ */
+void activation_log(float *y, const float *x, long n) {
+  kernel_get()->activation_log(y, x, n);
+}
+
+/*
+ * activation_forward writes kind(x) into y, y may alias x.
+ */
+void activation_forward(int kind, float *y, const float *x, long n) {
+  kernel_get()->activation_forward(kind, y, x, n);
+}
+
+/*
+ * activation_backward writes dy * kind'(x) into dx given the forward input x
+ * and output y, dx may alias dy.
+ */
+void activation_backward(int kind, float *dx, const float *dy, const float *x, const float *y, long n) {
+  kernel_get()->activation_backward(kind, dx, dy, x, y, n);
+}
@@ -0,0 +1,21 @@
+#ifndef __ACTIVATION_H_
+#define __ACTIVATION_H_
+
+#define ACTIVATION_LEAKY_RELU_SLOPE 0.01f
+
+enum {
+  ACTIVATION_NONE,
+  ACTIVATION_SIGMOID,
+  ACTIVATION_TANH,
+  ACTIVATION_RELU,
+  ACTIVATION_LEAKY_RELU,
+  ACTIVATION_GELU,
+  ACTIVATION_SOFTPLUS
+};
+
+void activation_exp(float *y, const float *x, long n);
+void activation_log(float *y, const float *x, long n);
+void activation_forward(int kind, float *y, const float *x, long n);
+void activation_backward(int kind, float *dx, const float *dy, const float *x, const float *y, long n);
+
+#endif
@@ -0,0 +1,384 @@
+#include "allocator.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ALLOCATOR_BUCKETS 48
+
+typedef struct allocator_arena {
+  pthread_mutex_t lock;
+  char *base;
+  size_t capacity;
+  size_t used;
+  allocator_block *overflow;
+  size_t overflow_bytes;
+} allocator_arena;
+
+typedef struct allocator_pool {
+  pthread_mutex_t lock;
+  allocator_block *buckets[ALLOCATOR_BUCKETS];
+  allocator_block *blocks;
+} allocator_pool;
+
+static allocator *allocator_current = NULL;
+
+/*
+ * allocator_count adds value to a counter, counters may be shared between threads.
+ */
+static void allocator_count(size_t *counter, size_t value) {
+  __atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+}
+
+/*
+ * allocator_round rounds size up to a multiple of ALLOCATOR_ALIGNMENT.
+ */
+static size_t allocator_round(size_t size) {
+  return (size + ALLOCATOR_ALIGNMENT - 1) & ~(size_t)(ALLOCATOR_ALIGNMENT - 1);
+}
+
+/*
+ * allocator_system_block returns an aligned block with room for size bytes
+ * after its header, straight from the system.
+ */
+static allocator_block *allocator_system_block(allocator *a, size_t size) {
+  void *pointer;
+  if (posix_memalign(&pointer, ALLOCATOR_ALIGNMENT, ALLOCATOR_ALIGNMENT + allocator_round(size)) != 0) {
+    return NULL;
+  }
+  allocator_count(&a->system_allocations, 1);
+  allocator_block *b = (allocator_block *)pointer;
+  b->next = b->chain = NULL;
+  b->size = size;
+  return b;
+}
+
+/*
+ * allocator_system_release
+ */
+static void allocator_system_release(allocator *a, allocator_block *b) {
+  allocator_count(&a->system_releases, 1);
+  free(b);
+}
+
+static allocator allocator_system_instance = {
+  &allocator_system_block,
+  &allocator_system_release,
+  NULL,
+  NULL,
+  NULL,
+  0, 0, 0, 0, 0, 0, 0
+};
+
+/*
+ * allocator_system returns the malloc backed allocator everything uses by default.
+ */
+allocator *allocator_system() {
+  return &allocator_system_instance;
+}
+
+/*
+ * allocator_create
+ */
+static allocator *allocator_create(
+  allocator_block *(*allocate)(allocator *, size_t),
+  void (*release)(allocator *, allocator_block *),
+  void (*reset)(allocator *),
+  void (*destroy)(allocator *),
+  void *state
+) {
+  allocator *a;
+  if ((a = calloc(1, sizeof(*a))) == NULL) {
+    perror("Out of memory\n");
+    return NULL;
+  }
+  a->allocate = allocate;
+  a->release = release;
+  a->reset = reset;
+  a->destroy = destroy;
+  a->state = state;
+  return a;
+}
+
+/*
+ * allocator_arena_allocate bumps through the arena, spilling to the system when
+ * the arena is full until the next reset grows it.
+ */
+static allocator_block *allocator_arena_allocate(allocator *a, size_t size) {
+  allocator_arena *arena = (allocator_arena *)a->state;
+  size_t need = ALLOCATOR_ALIGNMENT + allocator_round(size);
+  allocator_block *b;
+  pthread_mutex_lock(&arena->lock);
+  if (arena->used + need <= arena->capacity) {
+    b = (allocator_block *)(arena->base + arena->used);
+    arena->used += need;
+    pthread_mutex_unlock(&arena->lock);
+    b->next = b->chain = NULL;
+    b->size = size;
+    return b;
+  }
+  if ((b = allocator_system_block(a, size)) != NULL) {
+    b->next = arena->overflow;
+    arena->overflow = b;
+    arena->overflow_bytes += need;
+  }
+  pthread_mutex_unlock(&arena->lock);
+  return b;
+}
+
+/*
+ * allocator_arena_release is a no-op, arena memory comes back on reset.
+ */
+static void allocator_arena_release(allocator *a, allocator_block *b) {
+  (void)a;
+  (void)b;
+}
+
+/*
+ * allocator_arena_reset rewinds the arena. If the last cycle overflowed, the
+ * arena is regrown to fit it, so a repeating workload settles on one buffer.
+ */
+static void allocator_arena_reset(allocator *a) {
+  allocator_arena *arena = (allocator_arena *)a->state;
+  pthread_mutex_lock(&arena->lock);
+  if (arena->overflow != NULL) {
+    while (arena->overflow != NULL) {
+      allocator_block *next = arena->overflow->next;
+      allocator_system_release(a, arena->overflow);
+      arena->overflow = next;
+    }
+    void *base;
+    size_t capacity = arena->capacity + arena->overflow_bytes;
+    if (posix_memalign(&base, ALLOCATOR_ALIGNMENT, capacity) == 0) {
+      free(arena->base);
+      allocator_count(&a->system_releases, 1);
+      allocator_count(&a->system_allocations, 1);
+      arena->base = (char *)base;
+      arena->capacity = capacity;
+    }
+    arena->overflow_bytes = 0;
+  }
+  arena->used = 0;
+  pthread_mutex_unlock(&arena->lock);
+}
+
+/*
+ * allocator_arena_destroy
+ */
+static void allocator_arena_destroy(allocator *a) {
+  allocator_arena *arena = (allocator_arena *)a->state;
+  allocator_arena_reset(a);
+  pthread_mutex_destroy(&arena->lock);
+  free(arena->base);
+  free(arena);
+}
+
+/*
+ * allocator_arena_create returns a bump allocator for per step temporaries,
+ * everything allocated from it is invalidated by allocator_reset.
+ */
+allocator *allocator_arena_create(size_t capacity) {
+  allocator_arena *arena;
+  void *base = NULL;
+  if ((arena = calloc(1, sizeof(*arena))) == NULL) {
+    perror("Out of memory\n");
+    return NULL;
+  }
+  capacity = allocator_round(capacity);
+  if (capacity > 0 && posix_memalign(&base, ALLOCATOR_ALIGNMENT, capacity) != 0) {
+    perror("Out of memory\n");
+    free(arena);
+    return NULL;
+  }
+  arena->base = (char *)base;
+  arena->capacity = capacity;
+  pthread_mutex_init(&arena->lock, NULL);
+  allocator *a = allocator_create(
+    &allocator_arena_allocate,
+    &allocator_arena_release,
+    &allocator_arena_reset,
+    &allocator_arena_destroy,
+    arena
+  );
+  if (a == NULL) {
+    pthread_mutex_destroy(&arena->lock);
+    free(base);
+    free(arena);
+    return NULL;
+  }
+  a->system_allocations = capacity > 0 ? 1 : 0;
+  return a;
+}
+
+/*
+ * allocator_pool_bucket returns the power of two size class for size.
+ */
+static int allocator_pool_bucket(size_t size) {
+  int bucket = 6;
+  while (bucket < ALLOCATOR_BUCKETS - 1 && ((size_t)1 << bucket) < size) {
+    bucket++;
+  }
+  return bucket;
+}
+
+/*
+ * allocator_pool_allocate reuses a released block of the same size class when
+ * there is one.
+ */
+static allocator_block *allocator_pool_allocate(allocator *a, size_t size) {
+  allocator_pool *pool = (allocator_pool *)a->state;
+  int bucket = allocator_pool_bucket(size);
+  pthread_mutex_lock(&pool->lock);
+  allocator_block *b = pool->buckets[bucket];
+  if (b != NULL) {
+    pool->buckets[bucket] = b->next;
+  } else if ((b = allocator_system_block(a, (size_t)1 << bucket)) != NULL) {
+    b->chain = pool->blocks;
+    pool->blocks = b;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return b;
+}
+
+/*
+ * allocator_pool_release returns b to its size class.
+ */
+static void allocator_pool_release(allocator *a, allocator_block *b) {
+  allocator_pool *pool = (allocator_pool *)a->state;
+  int bucket = allocator_pool_bucket(b->size);
+  pthread_mutex_lock(&pool->lock);
+  b->next = pool->buckets[bucket];
+  pool->buckets[bucket] = b;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * allocator_pool_destroy
+ */
+static void allocator_pool_destroy(allocator *a) {
+  allocator_pool *pool = (allocator_pool *)a->state;
+  while (pool->blocks != NULL) {
+    allocator_block *next = pool->blocks->chain;
+    allocator_system_release(a, pool->blocks);
+    pool->blocks = next;
+  }
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+/*
+ * allocator_pool_create returns an allocator that recycles released blocks by
+ * power of two size class, so buffers of a shape seen before never reach malloc.
+ */
+allocator *allocator_pool_create() {
+  allocator_pool *pool;
+  if ((pool = calloc(1, sizeof(*pool))) == NULL) {
+    perror("Out of memory\n");
+    return NULL;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  allocator *a = allocator_create(
+    &allocator_pool_allocate,
+    &allocator_pool_release,
+    NULL,
+    &allocator_pool_destroy,
+    pool
+  );
+  if (a == NULL) {
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+  }
+  return a;
+}
+
+/*
+ * allocator_allocate returns size bytes aligned to ALLOCATOR_ALIGNMENT from a.
+ */
+void *allocator_allocate(allocator *a, size_t size) {
+  allocator_block *b;
+  if ((b = a->allocate(a, size)) == NULL) {
+    return NULL;
+  }
+  b->owner = a;
+  allocator_count(&a->allocations, 1);
+  allocator_count(&a->allocated_bytes, b->size);
+  size_t bytes = __atomic_add_fetch(&a->bytes, b->size, __ATOMIC_RELAXED);
+  size_t peak = __atomic_load_n(&a->peak_bytes, __ATOMIC_RELAXED);
+  while (bytes > peak &&
+    !__atomic_compare_exchange_n(&a->peak_bytes, &peak, bytes, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  return (char *)b + ALLOCATOR_ALIGNMENT;
+}
+
+/*
+ * allocator_release hands pointer back to the allocator it came from.
+ */
+void allocator_release(void *pointer) {
+  if (pointer == NULL) {
+    return;
+  }
+  allocator_block *b = (allocator_block *)((char *)pointer - ALLOCATOR_ALIGNMENT);
+  allocator *a = b->owner;
+  allocator_count(&a->releases, 1);
+  __atomic_sub_fetch(&a->bytes, b->size, __ATOMIC_RELAXED);
+  a->release(a, b);
+}
+
+/*
+ * allocator_owner returns the allocator pointer was allocated from.
+ */
+allocator *allocator_owner(void *pointer) {
+  return ((allocator_block *)((char *)pointer - ALLOCATOR_ALIGNMENT))->owner;
+}
+
+/*
+ * allocator_reset invalidates everything allocated from an arena, other
+ * allocators ignore it.
+ */
+void allocator_reset(allocator *a) {
+  if (a->reset != NULL) {
+    a->reset(a);
+    __atomic_store_n(&a->bytes, 0, __ATOMIC_RELAXED);
+  }
+}
+
+/*
+ * allocator_counters_zero
+ */
+void allocator_counters_zero(allocator *a) {
+  a->allocations = a->releases = a->allocated_bytes = 0;
+  a->system_allocations = a->system_releases = 0;
+  a->peak_bytes = a->bytes;
+}
+
+/*
+ * allocator_free releases a and all the memory it holds, the system allocator
+ * is never freed.
+ */
+void allocator_free(allocator *a) {
+  if (a == NULL || a == &allocator_system_instance) {
+    return;
+  }
+  allocator *current = a;
+  __atomic_compare_exchange_n(&allocator_current, &current, NULL, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+  a->destroy(a);
+  free(a);
+  a = NULL;
+}
+
+/*
+ * cai_allocator_set makes a the allocator every later allocation comes from,
+ * NULL restores the system allocator. Returns the previous one.
+ */
+allocator *cai_allocator_set(allocator *a) {
+  allocator *previous = __atomic_exchange_n(&allocator_current, a, __ATOMIC_ACQ_REL);
+  return previous != NULL ? previous : &allocator_system_instance;
+}
+
+/*
+ * cai_allocator_get
+ */
+allocator *cai_allocator_get() {
+  allocator *a = __atomic_load_n(&allocator_current, __ATOMIC_ACQUIRE);
+  return a != NULL ? a : &allocator_system_instance;
+}
@@ -0,0 +1,48 @@
+#ifndef __ALLOCATOR_H_
+#define __ALLOCATOR_H_
+#include <stddef.h>
+
+#define ALLOCATOR_ALIGNMENT 64
+
+typedef struct allocator_block {
+  struct allocator *owner;
+  struct allocator_block *next;
+  struct allocator_block *chain;
+  size_t size;
+} allocator_block;
+
+/*
+ * allocator hands out aligned blocks. allocator_allocate and allocator_release
+ * are safe to call from any number of threads at once, on any allocator.
+ * allocator_reset, allocator_counters_zero and allocator_free are not, they
+ * must not overlap with other calls on the same allocator. cai_allocator_set
+ * is atomic, but allocations already in flight keep the allocator they read.
+ */
+typedef struct allocator {
+  allocator_block *(*allocate)(struct allocator *a, size_t size);
+  void (*release)(struct allocator *a, allocator_block *b);
+  void (*reset)(struct allocator *a);
+  void (*destroy)(struct allocator *a);
+  void *state;
+  size_t allocations;
+  size_t releases;
+  size_t system_allocations;
+  size_t system_releases;
+  size_t bytes;
+  size_t peak_bytes;
+  size_t allocated_bytes;
+} allocator;
+
+allocator *allocator_system();
+allocator *allocator_arena_create(size_t capacity);
+allocator *allocator_pool_create();
+void *allocator_allocate(allocator *a, size_t size);
+void allocator_release(void *pointer);
+allocator *allocator_owner(void *pointer);
+void allocator_reset(allocator *a);
+void allocator_counters_zero(allocator *a);
+void allocator_free(allocator *a);
+allocator *cai_allocator_set(allocator *a);
+allocator *cai_allocator_get();
+
+#endif
@@ -0,0 +1,553 @@
+#include "autotune.h"
+#include "kernel.h"
+#include "layer.h"
+#include "list.h"
+#include "matrix.h"
+#include "network.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#if defined(__APPLE__)
+#include <sys/sysctl.h>
+#endif
+
+/*
+ * AUTOTUNE_BUDGET is the seconds one candidate is timed for at most, the best
+ * of the runs counts so a preempted run doesn't decide.
+ */
+#define AUTOTUNE_BUDGET 0.05
+#define AUTOTUNE_RUNS 5
+#define AUTOTUNE_LINE 512
+
+/*
+ * AUTOTUNE_BLOCKING bounds each blocking dimension read from a cache, and
+ * AUTOTUNE_PANEL the floats of one packed panel, so a corrupt line can't make
+ * the GEMM allocate gigabytes.
+ */
+#define AUTOTUNE_BLOCKING (1 << 16)
+#define AUTOTUNE_PANEL (1L << 24)
+
+/*
+ * autotune_entry is the tuned blocking of one m x n x k shape. sequence is 0
+ * while the slot is free, odd while the blocking is being written and even
+ * once it is published, so a GEMM can read it without the lock while another
+ * thread adds or replaces shapes.
+ */
+typedef struct autotune_entry {
+  unsigned int sequence;
+  int m;
+  int n;
+  int k;
+  matrix_blocking blocking;
+  float gflops;
+} autotune_entry;
+
+static autotune_entry autotune_table[AUTOTUNE_ENTRIES];
+static int autotune_count = 0;
+static int autotune_enabled = 0;
+static char autotune_model[128];
+static pthread_mutex_t autotune_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t autotune_tuning = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t autotune_once = PTHREAD_ONCE_INIT;
+
+/*
+ * autotune_trial is the blocking being timed on this thread, autotune_running
+ * keeps the products of a tuning run from tuning themselves.
+ */
+static __thread const matrix_blocking *autotune_trial = NULL;
+static __thread int autotune_running = 0;
+
+/*
+ * autotune_cpu_detect fills autotune_model with the processor brand string, from
+ * cpuid on x86 and the operating system elsewhere.
+ */
+static void autotune_cpu_detect() {
+  char *model = autotune_model;
+  int i;
+  model[0] = '\0';
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int brand[12];
+  if (__get_cpuid_max(0x80000000, NULL) >= 0x80000004) {
+    for (i = 0; i < 3; i++) {
+      __get_cpuid(0x80000002 + i, &brand[i * 4], &brand[i * 4 + 1], &brand[i * 4 + 2], &brand[i * 4 + 3]);
+    }
+    memcpy(model, brand, sizeof(brand));
+    model[sizeof(brand)] = '\0';
+  }
+#elif defined(__APPLE__)
+  size_t size = sizeof(autotune_model);
+  if (sysctlbyname("machdep.cpu.brand_string", model, &size, NULL, 0) != 0) {
+    model[0] = '\0';
+  }
+#else
+  char line[AUTOTUNE_LINE];
+  FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+  while (cpuinfo != NULL && model[0] == '\0' && fgets(line, sizeof(line), cpuinfo) != NULL) {
+    char *value = strchr(line, ':');
+    if (value != NULL && (strncmp(line, "model name", 10) == 0 || strncmp(line, "CPU part", 8) == 0)) {
+      snprintf(model, sizeof(autotune_model), "%s", value + 1);
+    }
+  }
+  if (cpuinfo != NULL) {
+    fclose(cpuinfo);
+  }
+#endif
+  /* The model is a field of the cache lines, so it is trimmed and tab free. */
+  for (i = 0; model[i] != '\0'; i++) {
+    if (model[i] == '\t' || model[i] == '\n') {
+      model[i] = ' ';
+    }
+  }
+  while (i > 0 && model[i - 1] == ' ') {
+    model[--i] = '\0';
+  }
+  for (i = 0; model[i] == ' '; i++) {
+  }
+  memmove(model, model + i, strlen(model + i) + 1);
+  if (model[0] == '\0') {
+    strcpy(model, "unknown");
+  }
+}
+
+/*
+ * autotune_path returns the cache file, CAI_AUTOTUNE_CACHE or ~/.cai_autotune,
+ * NULL when CAI_AUTOTUNE_CACHE is empty to keep the tuning in memory.
+ */
+static char *autotune_path() {
+  static char path[AUTOTUNE_LINE];
+  char *cache = getenv("CAI_AUTOTUNE_CACHE");
+  char *home = getenv("HOME");
+  if (cache != NULL) {
+    return cache[0] != '\0' ? cache : NULL;
+  }
+  if (home == NULL) {
+    return NULL;
+  }
+  snprintf(path, sizeof(path), "%s/.cai_autotune", home);
+  return path;
+}
+
+static int autotune_read(char *path);
+
+/*
+ * autotune_init detects the processor and loads the cache once per process,
+ * CAI_AUTOTUNE turns tuning at first use on.
+ */
+static void autotune_init() {
+  char *enabled = getenv("CAI_AUTOTUNE");
+  char *path = autotune_path();
+  autotune_cpu_detect();
+  autotune_enabled = enabled != NULL && atoi(enabled) != 0;
+  if (path != NULL) {
+    autotune_read(path);
+  }
+}
+
+static unsigned int autotune_hash(int m, int n, int k) {
+  return ((unsigned int)m * 73856093u ^ (unsigned int)n * 19349663u ^ (unsigned int)k * 83492791u) %
+    AUTOTUNE_ENTRIES;
+}
+
+/*
+ * autotune_find returns the entry of shape m x n x k, or NULL. It doesn't lock,
+ * the shape of an entry is set before it is published and entries are never
+ * removed. Its blocking is read with autotune_entry_load.
+ */
+static autotune_entry *autotune_find(int m, int n, int k) {
+  unsigned int slot = autotune_hash(m, n, k);
+  autotune_entry *e;
+  while (__atomic_load_n(&(e = &autotune_table[slot])->sequence, __ATOMIC_ACQUIRE) != 0) {
+    if (e->m == m && e->n == n && e->k == k) {
+      return e;
+    }
+    slot = (slot + 1) % AUTOTUNE_ENTRIES;
+  }
+  return NULL;
+}
+
+/*
+ * autotune_entry_load returns the blocking of e and its gflops when gflops isn't
+ * NULL, read again when a writer changed them meanwhile.
+ */
+static matrix_blocking autotune_entry_load(autotune_entry *e, float *gflops) {
+  matrix_blocking blocking;
+  unsigned int before, after;
+  float speed;
+  do {
+    before = __atomic_load_n(&e->sequence, __ATOMIC_ACQUIRE);
+    blocking.mc = __atomic_load_n(&e->blocking.mc, __ATOMIC_RELAXED);
+    blocking.kc = __atomic_load_n(&e->blocking.kc, __ATOMIC_RELAXED);
+    blocking.nc = __atomic_load_n(&e->blocking.nc, __ATOMIC_RELAXED);
+    __atomic_load(&e->gflops, &speed, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&e->sequence, __ATOMIC_RELAXED);
+  } while ((before & 1) != 0 || before != after);
+  if (gflops != NULL) {
+    *gflops = speed;
+  }
+  return blocking;
+}
+
+/*
+ * autotune_entry_store writes the blocking and gflops of e and publishes them,
+ * under autotune_lock. The shape of a new entry is set before.
+ */
+static void autotune_entry_store(autotune_entry *e, matrix_blocking blocking, float gflops) {
+  unsigned int sequence = e->sequence;
+  __atomic_store_n(&e->sequence, sequence + 1, __ATOMIC_RELEASE);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&e->blocking.mc, blocking.mc, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->blocking.kc, blocking.kc, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->blocking.nc, blocking.nc, __ATOMIC_RELAXED);
+  __atomic_store(&e->gflops, &gflops, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * autotune_insert records blocking for shape m x n x k, replacing an earlier
+ * one, and reports whether there was room for it.
+ */
+static int autotune_insert(int m, int n, int k, matrix_blocking blocking, float gflops) {
+  autotune_entry *e;
+  unsigned int slot;
+  pthread_mutex_lock(&autotune_lock);
+  if ((e = autotune_find(m, n, k)) != NULL) {
+    autotune_entry_store(e, blocking, gflops);
+    pthread_mutex_unlock(&autotune_lock);
+    return 1;
+  }
+  if (autotune_count >= AUTOTUNE_ENTRIES / 2) {
+    pthread_mutex_unlock(&autotune_lock);
+    return 0;
+  }
+  for (slot = autotune_hash(m, n, k); autotune_table[slot].sequence != 0; slot = (slot + 1) % AUTOTUNE_ENTRIES) {
+  }
+  e = &autotune_table[slot];
+  e->m = m;
+  e->n = n;
+  e->k = k;
+  autotune_entry_store(e, blocking, gflops);
+  autotune_count++;
+  pthread_mutex_unlock(&autotune_lock);
+  return 1;
+}
+
+/*
+ * autotune_lookup returns the blocking the GEMM uses for an m x n x k product,
+ * the tuned one when there is one. Unknown shapes are tuned on the spot when
+ * tuning at first use is on, and keep the default blocking otherwise.
+ */
+matrix_blocking autotune_lookup(int m, int n, int k) {
+  autotune_entry *e;
+  if (autotune_trial != NULL) {
+    return *autotune_trial;
+  }
+  pthread_once(&autotune_once, &autotune_init);
+  if ((e = autotune_find(m, n, k)) != NULL) {
+    return autotune_entry_load(e, NULL);
+  }
+  if (autotune_enabled && !autotune_running) {
+    matrix_blocking blocking = cai_autotune_shape(m, n, k);
+    if (autotune_find(m, n, k) != NULL) {
+      cai_autotune_save(NULL);
+    }
+    return blocking;
+  }
+  return matrix_gemm_blocking();
+}
+
+static double autotune_now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+/*
+ * autotune_time returns the fastest of a few runs of c = a * b with blocking,
+ * after one run to warm the caches and the pack buffers.
+ */
+static double autotune_time(matrix_blocking blocking, matrix *a, matrix *b, matrix *c) {
+  double best = 0, total = 0;
+  int run;
+  autotune_trial = &blocking;
+  matrix_gemm(0, 0, 1, a, b, 0, c);
+  for (run = 0; run < AUTOTUNE_RUNS && (run < 2 || total < AUTOTUNE_BUDGET); run++) {
+    double start = autotune_now(), elapsed;
+    matrix_gemm(0, 0, 1, a, b, 0, c);
+    elapsed = autotune_now() - start;
+    best = run == 0 || elapsed < best ? elapsed : best;
+    total += elapsed;
+  }
+  autotune_trial = NULL;
+  return best;
+}
+
+/*
+ * autotune_search times the candidates of one blocking dimension of best and
+ * keeps the fastest. Candidates that clip to the same panel as the current one
+ * are skipped, and a candidate has to win by 2% to move off the current one, so
+ * timing noise doesn't pick the blocking.
+ */
+static void autotune_search(
+  matrix_blocking *best,
+  double *best_time,
+  int *field,
+  int extent,
+  const int *candidates,
+  int count,
+  matrix *a,
+  matrix *b,
+  matrix *c
+) {
+  int i, current = *field;
+  for (i = 0; i < count; i++) {
+    int candidate = candidates[i];
+    double time;
+    if ((candidate < extent ? candidate : extent) == (current < extent ? current : extent)) {
+      continue;
+    }
+    *field = candidate;
+    time = autotune_time(*best, a, b, c);
+    if (time < *best_time * 0.98) {
+      *best_time = time;
+      current = candidate;
+    }
+  }
+  *field = current;
+}
+
+/*
+ * cai_autotune_shape tunes the blocking of m x n x k products and records it,
+ * one dimension at a time from the default: KC, then MC, then NC, each over a
+ * few multiples of its default. The MC candidates stay multiples of the default
+ * over 24, a whole number of register tiles. Products that don't run on the
+ * packed path keep the default and aren't recorded. Shapes tuned already return
+ * right away.
+ */
+matrix_blocking cai_autotune_shape(int m, int n, int k) {
+  matrix_blocking defaults = matrix_gemm_blocking(), best = defaults;
+  int kc[] = {defaults.kc / 2, defaults.kc * 3 / 4, defaults.kc, defaults.kc * 3 / 2, defaults.kc * 2};
+  int mc[] = {defaults.mc / 3, defaults.mc * 2 / 3, defaults.mc, defaults.mc * 4 / 3, defaults.mc * 2};
+  int nc[] = {defaults.nc / 4, defaults.nc / 2, defaults.nc};
+  matrix *a = NULL, *b = NULL, *c = NULL;
+  autotune_entry *e;
+  double best_time;
+
+  pthread_once(&autotune_once, &autotune_init);
+  if (!matrix_gemm_packed(m, n, k)) {
+    return best;
+  }
+  pthread_mutex_lock(&autotune_tuning);
+  if ((e = autotune_find(m, n, k)) != NULL) {
+    best = autotune_entry_load(e, NULL);
+  } else if (autotune_count < AUTOTUNE_ENTRIES / 2 &&
+      (a = matrix_create(m, k, matrix_random)) != NULL &&
+      (b = matrix_create(k, n, matrix_random)) != NULL &&
+      (c = matrix_create(m, n, NULL)) != NULL) {
+    autotune_running = 1;
+    best_time = autotune_time(best, a, b, c);
+    autotune_search(&best, &best_time, &best.kc, k, kc, 5, a, b, c);
+    autotune_search(&best, &best_time, &best.mc, m, mc, 5, a, b, c);
+    autotune_search(&best, &best_time, &best.nc, n, nc, 3, a, b, c);
+    autotune_running = 0;
+    autotune_insert(m, n, k, best, (float)(2e-9 * m * n * k / best_time));
+  }
+  pthread_mutex_unlock(&autotune_tuning);
+  if (a != NULL) {
+    matrix_free(a);
+  }
+  if (b != NULL) {
+    matrix_free(b);
+  }
+  if (c != NULL) {
+    matrix_free(c);
+  }
+  return best;
+}
+
+/*
+ * cai_autotune tunes the GEMM shapes the linear and dense layers of n run at a
+ * batch of batch columns: the forward product, the backward one and the weight
+ * gradient. The tuning is saved to the cache, it returns the number of shapes
+ * tuned, 0 when all of them were known already, or -1.
+ */
+int cai_autotune(network *n, int batch) {
+  list_node *node;
+  int tuned = 0, i;
+  if (n == NULL || batch <= 0) {
+    fprintf(stderr, "cai_autotune: expected a network and a positive batch\n");
+    return -1;
+  }
+  pthread_once(&autotune_once, &autotune_init);
+  list_for_each(n->layers, node) {
+    layer *l = (layer *)node->value;
+    int type = layer_type(l);
+    int shapes[3][3] = {
+      {l->output_size, batch, l->input_size},
+      {l->input_size, batch, l->output_size},
+      {l->output_size, l->input_size, batch}
+    };
+    if (type != LAYER_LINEAR && type != LAYER_DENSE) {
+      continue;
+    }
+    for (i = 0; i < 3; i++) {
+      if (matrix_gemm_packed(shapes[i][0], shapes[i][1], shapes[i][2]) &&
+          autotune_find(shapes[i][0], shapes[i][1], shapes[i][2]) == NULL) {
+        cai_autotune_shape(shapes[i][0], shapes[i][1], shapes[i][2]);
+        tuned += autotune_find(shapes[i][0], shapes[i][1], shapes[i][2]) != NULL;
+      }
+    }
+  }
+  if (tuned > 0) {
+    cai_autotune_save(NULL);
+  }
+  return tuned;
+}
+
+/*
+ * cai_autotune_set turns tuning unknown shapes at their first GEMM on or off and
+ * returns the previous setting. Tuning holds that GEMM up for a few dozen runs
+ * of the shape.
+ */
+int cai_autotune_set(int enabled) {
+  int previous;
+  pthread_once(&autotune_once, &autotune_init);
+  previous = autotune_enabled;
+  autotune_enabled = enabled != 0;
+  return previous;
+}
+
+/*
+ * autotune_parse splits a cache line into the processor, the instruction set,
+ * the shape and the blocking, and reports whether it is well formed. Blockings
+ * that are zero, negative or past AUTOTUNE_BLOCKING and AUTOTUNE_PANEL aren't.
+ */
+static int autotune_parse(char *line, char **model, char **isa, int shape[3], matrix_blocking *blocking, float *gflops) {
+  char *fields[5];
+  int i;
+  fields[0] = line;
+  for (i = 1; i < 5; i++) {
+    if ((fields[i] = strchr(fields[i - 1], '\t')) == NULL) {
+      return 0;
+    }
+    *fields[i]++ = '\0';
+  }
+  *model = fields[0];
+  *isa = fields[1];
+  return sscanf(fields[2], "%d %d %d", &shape[0], &shape[1], &shape[2]) == 3 &&
+    sscanf(fields[3], "%d %d %d", &blocking->mc, &blocking->kc, &blocking->nc) == 3 &&
+    sscanf(fields[4], "%f", gflops) == 1 &&
+    blocking->mc > 0 && blocking->kc > 0 && blocking->nc > 0 &&
+    blocking->mc <= AUTOTUNE_BLOCKING && blocking->kc <= AUTOTUNE_BLOCKING && blocking->nc <= AUTOTUNE_BLOCKING &&
+    (long)blocking->mc * blocking->kc <= AUTOTUNE_PANEL && (long)blocking->kc * blocking->nc <= AUTOTUNE_PANEL;
+}
+
+/*
+ * autotune_read adds the blockings tuned on this processor from the cache at
+ * path, lines of other processors are skipped.
+ */
+static int autotune_read(char *path) {
+  char line[AUTOTUNE_LINE];
+  int loaded = 0;
+  FILE *file;
+  if ((file = fopen(path, "r")) == NULL) {
+    return -1;
+  }
+  while (fgets(line, sizeof(line), file) != NULL) {
+    char *model, *isa;
+    int shape[3];
+    matrix_blocking blocking;
+    float gflops;
+    line[strcspn(line, "\n")] = '\0';
+    if (line[0] == '#' || !autotune_parse(line, &model, &isa, shape, &blocking, &gflops)) {
+      continue;
+    }
+    if (strcmp(model, autotune_model) == 0 && strcmp(isa, cai_kernel_isa()) == 0) {
+      loaded += autotune_insert(shape[0], shape[1], shape[2], blocking, gflops);
+    }
+  }
+  fclose(file);
+  return loaded;
+}
+
+/*
+ * cai_autotune_load adds the blockings tuned on this processor from the cache
+ * at path, on top of the default cache loaded at startup. It returns the number
+ * of shapes loaded, or -1 when path can't be read.
+ */
+int cai_autotune_load(char *path) {
+  pthread_once(&autotune_once, &autotune_init);
+  return path != NULL ? autotune_read(path) : -1;
+}
+
+/*
+ * cai_autotune_save writes the tuned blockings to the cache at path, or the
+ * default cache when path is NULL. Lines of other processors and shapes not
+ * tuned here are kept, so one cache can serve several machines. The cache is
+ * written aside and renamed over, readers never see half of it. It returns the
+ * number of lines written, or -1.
+ */
+int cai_autotune_save(char *path) {
+  char line[AUTOTUNE_LINE], kept[AUTOTUNE_LINE], temporary[AUTOTUNE_LINE];
+  int written = 0, i;
+  FILE *in, *out;
+  pthread_once(&autotune_once, &autotune_init);
+  if (path == NULL && (path = autotune_path()) == NULL) {
+    return -1;
+  }
+  snprintf(temporary, sizeof(temporary), "%s.%ld", path, (long)getpid());
+  if ((out = fopen(temporary, "w")) == NULL) {
+    fprintf(stderr, "cai_autotune_save: can't write %s\n", temporary);
+    return -1;
+  }
+  fprintf(out, "# cai autotune: cpu\tisa\tm n k\tmc kc nc\tgflops\n");
+  if ((in = fopen(path, "r")) != NULL) {
+    while (fgets(line, sizeof(line), in) != NULL) {
+      char *model, *isa;
+      int shape[3];
+      matrix_blocking blocking;
+      float gflops;
+      line[strcspn(line, "\n")] = '\0';
+      strcpy(kept, line);
+      if (line[0] == '#' || !autotune_parse(line, &model, &isa, shape, &blocking, &gflops)) {
+        continue;
+      }
+      if (strcmp(model, autotune_model) != 0 || strcmp(isa, cai_kernel_isa()) != 0 ||
+          autotune_find(shape[0], shape[1], shape[2]) == NULL) {
+        fprintf(out, "%s\n", kept);
+        written++;
+      }
+    }
+    fclose(in);
+  }
+  for (i = 0; i < AUTOTUNE_ENTRIES; i++) {
+    autotune_entry *e = &autotune_table[i];
+    if (__atomic_load_n(&e->sequence, __ATOMIC_ACQUIRE) != 0) {
+      float gflops;
+      matrix_blocking blocking = autotune_entry_load(e, &gflops);
+      fprintf(out, "%s\t%s\t%d %d %d\t%d %d %d\t%.2f\n", autotune_model, cai_kernel_isa(),
+        e->m, e->n, e->k, blocking.mc, blocking.kc, blocking.nc, gflops);
+      written++;
+    }
+  }
+  if (fclose(out) != 0 || rename(temporary, path) != 0) {
+    fprintf(stderr, "cai_autotune_save: can't write %s\n", path);
+    remove(temporary);
+    return -1;
+  }
+  return written;
+}
+
+/*
+ * cai_autotune_cpu returns the processor model the cache is keyed by.
+ */
+const char *cai_autotune_cpu() {
+  pthread_once(&autotune_once, &autotune_init);
+  return autotune_model;
+}
@@ -0,0 +1,20 @@
+#ifndef __AUTOTUNE_H_
+#define __AUTOTUNE_H_
+#include "matrix.h"
+#include "network.h"
+
+/*
+ * AUTOTUNE_ENTRIES bounds the GEMM shapes kept in memory, tuning stops adding
+ * shapes once half of them are taken.
+ */
+#define AUTOTUNE_ENTRIES 1024
+
+matrix_blocking autotune_lookup(int m, int n, int k);
+matrix_blocking cai_autotune_shape(int m, int n, int k);
+int cai_autotune(network *n, int batch);
+int cai_autotune_set(int enabled);
+int cai_autotune_load(char *path);
+int cai_autotune_save(char *path);
+const char *cai_autotune_cpu();
+
+#endif
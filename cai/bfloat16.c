@@ -0,0 +1,53 @@
+#include "bfloat16.h"
+
+/*
+ * Conversions between float and bfloat16 arrays, vectorized with the widest
+ * vector unit the compiler targets. Widening is a shift, narrowing rounds to
+ * nearest even with the same bit trick as bfloat16_round.
+ */
+#if defined(__AVX512F__)
+#define BFLOAT16_VECTOR 16
+#elif defined(__AVX__)
+#define BFLOAT16_VECTOR 8
+#else
+#define BFLOAT16_VECTOR 4
+#endif
+
+typedef uint32_t bfloat16_wide __attribute__((vector_size(BFLOAT16_VECTOR * sizeof(uint32_t))));
+typedef uint16_t bfloat16_narrow __attribute__((vector_size(BFLOAT16_VECTOR * sizeof(uint16_t))));
+
+/*
+ * bfloat16_encode rounds n floats of x into y.
+ */
+void bfloat16_encode(bfloat16 *y, const float *x, long n) {
+  long i = 0;
+  for (; i + BFLOAT16_VECTOR <= n; i += BFLOAT16_VECTOR) {
+    bfloat16_wide u, nan;
+    bfloat16_narrow v;
+    memcpy(&u, x + i, sizeof(u));
+    nan = (bfloat16_wide)((u & 0x7fffffff) > 0x7f800000);
+    u = ((u + 0x7fff + ((u >> 16) & 1)) & ~nan) | ((u | 0x400000) & nan);
+    v = __builtin_convertvector(u >> 16, bfloat16_narrow);
+    memcpy(y + i, &v, sizeof(v));
+  }
+  for (; i < n; i++) {
+    y[i] = bfloat16_round(x[i]);
+  }
+}
+
+/*
+ * bfloat16_decode widens n bfloat16 of x into y.
+ */
+void bfloat16_decode(float *y, const bfloat16 *x, long n) {
+  long i = 0;
+  for (; i + BFLOAT16_VECTOR <= n; i += BFLOAT16_VECTOR) {
+    bfloat16_narrow v;
+    bfloat16_wide u;
+    memcpy(&v, x + i, sizeof(v));
+    u = __builtin_convertvector(v, bfloat16_wide) << 16;
+    memcpy(y + i, &u, sizeof(u));
+  }
+  for (; i < n; i++) {
+    y[i] = bfloat16_float(x[i]);
+  }
+}
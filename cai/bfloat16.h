@@ -0,0 +1,37 @@
+#ifndef __BFLOAT16_H_
+#define __BFLOAT16_H_
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * bfloat16 is the upper half of an IEEE float, the same 8 bit exponent with a
+ * 7 bit mantissa, so it covers the float range at half the bytes.
+ */
+typedef uint16_t bfloat16;
+
+/*
+ * bfloat16_round rounds x to the nearest bfloat16, ties to even, keeping NaNs.
+ */
+static inline bfloat16 bfloat16_round(float x) {
+  uint32_t u;
+  memcpy(&u, &x, sizeof(u));
+  if ((u & 0x7fffffff) > 0x7f800000) {
+    return (bfloat16)((u >> 16) | 0x40);
+  }
+  return (bfloat16)((u + 0x7fff + ((u >> 16) & 1)) >> 16);
+}
+
+/*
+ * bfloat16_float widens x to a float, exactly.
+ */
+static inline float bfloat16_float(bfloat16 x) {
+  uint32_t u = (uint32_t)x << 16;
+  float f;
+  memcpy(&f, &u, sizeof(f));
+  return f;
+}
+
+void bfloat16_encode(bfloat16 *y, const float *x, long n);
+void bfloat16_decode(float *y, const bfloat16 *x, long n);
+
+#endif
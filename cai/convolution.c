@@ -0,0 +1,596 @@
+#include "convolution.h"
+#include "allocator.h"
+#include "matrix.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__AVX512F__)
+#define CONVOLUTION_VECTOR 16
+#elif defined(__AVX__)
+#define CONVOLUTION_VECTOR 8
+#else
+#define CONVOLUTION_VECTOR 4
+#endif
+
+typedef float convolution_vector __attribute__((vector_size(CONVOLUTION_VECTOR * sizeof(float))));
+typedef int convolution_mask __attribute__((vector_size(CONVOLUTION_VECTOR * sizeof(float))));
+
+static inline convolution_vector convolution_load(const float *p) {
+  convolution_vector v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline void convolution_store(float *p, convolution_vector v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+/*
+ * convolution_create checks the geometry and computes the output size, the
+ * kernel spans dilation * (kernel - 1) + 1 pixels and the image is padded with
+ * padding zeros on every side. The padding must be narrower than the kernel
+ * span, so no window lies entirely in it.
+ */
+convolution *convolution_create(
+  int height,
+  int width,
+  int channels,
+  int filters,
+  int kernel,
+  int stride,
+  int padding,
+  int dilation
+) {
+  convolution *c;
+  int extent = dilation * (kernel - 1) + 1;
+  if (height <= 0 || width <= 0 || channels <= 0 || filters <= 0 ||
+      kernel <= 0 || stride <= 0 || padding < 0 || dilation <= 0) {
+    fprintf(stderr, "convolution_create: invalid geometry\n");
+    return NULL;
+  }
+  if (padding >= extent) {
+    fprintf(stderr, "convolution_create: padding %d leaves windows of the %d pixel kernel empty\n",
+      padding, extent);
+    return NULL;
+  }
+  if (height + 2 * padding < extent || width + 2 * padding < extent) {
+    fprintf(stderr, "convolution_create: kernel spans %d pixels, the padded image is %dx%d\n",
+      extent, height + 2 * padding, width + 2 * padding);
+    return NULL;
+  }
+  if ((c = allocator_allocate(cai_allocator_get(), sizeof(*c))) == NULL) {
+    perror("Out of memory\n");
+    return NULL;
+  }
+  c->height = height;
+  c->width = width;
+  c->channels = channels;
+  c->filters = filters;
+  c->kernel = kernel;
+  c->stride = stride;
+  c->padding = padding;
+  c->dilation = dilation;
+  c->output_height = (height + 2 * padding - extent) / stride + 1;
+  c->output_width = (width + 2 * padding - extent) / stride + 1;
+  return c;
+}
+
+/*
+ * convolution_copy
+ */
+convolution *convolution_copy(convolution *c) {
+  convolution *r;
+  if ((r = allocator_allocate(cai_allocator_get(), sizeof(*r))) == NULL) {
+    perror("Out of memory\n");
+    return NULL;
+  }
+  *r = *c;
+  return r;
+}
+
+/*
+ * convolution_input_size
+ */
+int convolution_input_size(convolution *c) {
+  return c->height * c->width * c->channels;
+}
+
+/*
+ * convolution_output_size
+ */
+int convolution_output_size(convolution *c) {
+  return c->output_height * c->output_width * c->filters;
+}
+
+static pthread_key_t convolution_key;
+static pthread_once_t convolution_once = PTHREAD_ONCE_INIT;
+static __thread float *convolution_scratch = NULL;
+static __thread long convolution_capacity = 0;
+
+static void convolution_scratch_free(void *storage) {
+  allocator_release(storage);
+}
+
+static void convolution_key_create(void) {
+  pthread_key_create(&convolution_key, &convolution_scratch_free);
+}
+
+/*
+ * convolution_buffer returns the workspace of the calling thread, grown to at
+ * least count floats. It is released when the thread exits.
+ */
+static float *convolution_buffer(long count) {
+  if (count > convolution_capacity) {
+    float *storage = allocator_allocate(allocator_system(), count * sizeof(float));
+    if (storage == NULL) {
+      perror("Out of memory\n");
+      return NULL;
+    }
+    pthread_once(&convolution_once, &convolution_key_create);
+    if (convolution_scratch != NULL) {
+      allocator_release(convolution_scratch);
+    }
+    pthread_setspecific(convolution_key, storage);
+    convolution_scratch = storage;
+    convolution_capacity = count;
+  }
+  return convolution_scratch;
+}
+
+/*
+ * convolution_tile returns how many output positions fit in CONVOLUTION_TILE
+ * floats of workspace at rows floats per position and sample, at least one.
+ */
+static int convolution_tile(convolution *c, long rows, int columns) {
+  long positions = (long)c->output_height * c->output_width;
+  long tile = CONVOLUTION_TILE / (rows * columns > 0 ? rows * columns : 1);
+  return tile < 1 ? 1 : tile > positions ? (int)positions : (int)tile;
+}
+
+/*
+ * convolution_tap returns the input row of the first channel under tap (i, j)
+ * of the kernel at output position, or -1 when it falls into the padding.
+ */
+static inline long convolution_tap(convolution *c, long position, int i, int j) {
+  int h = (int)(position / c->output_width) * c->stride - c->padding + i * c->dilation;
+  int w = (int)(position % c->output_width) * c->stride - c->padding + j * c->dilation;
+  if (h < 0 || h >= c->height || w < 0 || w >= c->width) {
+    return -1;
+  }
+  return ((long)h * c->width + w) * c->channels;
+}
+
+/*
+ * convolution_row returns row i of m, in place when m holds contiguous floats,
+ * otherwise loaded into buffer.
+ */
+static inline float *convolution_row(matrix *m, long i, float *buffer) {
+  if (m->type == MATRIX_FLOAT32 && m->column_stride == 1) {
+    return matrix_element(m, i, 0);
+  }
+  matrix_load_row(m, i, 0, m->columns, buffer);
+  return buffer;
+}
+
+/*
+ * convolution_row_add adds x to row i of m, through buffer when m doesn't hold
+ * contiguous floats.
+ */
+static inline void convolution_row_add(matrix *m, long i, const float *x, float *buffer) {
+  float *y = convolution_row(m, i, buffer);
+  int k = 0;
+  for (; k + CONVOLUTION_VECTOR <= m->columns; k += CONVOLUTION_VECTOR) {
+    convolution_store(y + k, convolution_load(y + k) + convolution_load(x + k));
+  }
+  for (; k < m->columns; k++) {
+    y[k] += x[k];
+  }
+  if (y == buffer) {
+    matrix_store_row(m, i, 0, m->columns, buffer);
+  }
+}
+
+/*
+ * convolution_zero clears m a row at a time, zero is a row of zeros.
+ */
+static void convolution_zero(matrix *m, float *zero) {
+  int i;
+  if (m->type == MATRIX_FLOAT32) {
+    matrix_fill(m, 0);
+    return;
+  }
+  memset(zero, 0, m->columns * sizeof(float));
+  for (i = 0; i < m->rows; i++) {
+    matrix_store_row(m, i, 0, m->columns, zero);
+  }
+}
+
+/*
+ * convolution_columns lowers count output positions from first on into the
+ * im2col tile columns, kernel * kernel * channels rows of count * samples,
+ * position t of sample n in column t * samples + n.
+ */
+static void convolution_columns(convolution *c, matrix *input, long first, int count, float *columns) {
+  long stride = (long)count * input->columns;
+  int t, i, j, k;
+  for (t = 0; t < count; t++) {
+    for (i = 0; i < c->kernel; i++) {
+      for (j = 0; j < c->kernel; j++) {
+        long row = convolution_tap(c, first + t, i, j);
+        float *y = columns + (long)(i * c->kernel + j) * c->channels * stride + (long)t * input->columns;
+        for (k = 0; k < c->channels; k++, y += stride) {
+          if (row < 0) {
+            memset(y, 0, input->columns * sizeof(float));
+          } else {
+            matrix_load_row(input, row + k, 0, input->columns, y);
+          }
+        }
+      }
+    }
+  }
+}
+
+/*
+ * convolution_deltas gathers the rows of delta for count output positions from
+ * first on into tile, filters rows laid out like convolution_columns.
+ */
+static void convolution_deltas(convolution *c, matrix *delta, long first, int count, float *tile) {
+  long stride = (long)count * delta->columns;
+  int t, k;
+  for (t = 0; t < count; t++) {
+    for (k = 0; k < c->filters; k++) {
+      matrix_load_row(delta, (first + t) * c->filters + k, 0, delta->columns,
+        tile + k * stride + (long)t * delta->columns);
+    }
+  }
+}
+
+/*
+ * convolution_shape checks that m is an input, or an output with output set,
+ * of c.
+ */
+static int convolution_shape(convolution *c, matrix *m, int output, const char *name) {
+  int rows = output ? convolution_output_size(c) : convolution_input_size(c);
+  if (m->rows != rows) {
+    fprintf(stderr, "%s: %s has %d rows, the geometry needs %d\n",
+      name, output ? "output" : "input", m->rows, rows);
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * convolution_forward writes activation(weights * im2col(input) + biases) into
+ * output, weights being filters x kernel * kernel * channels. The positions are
+ * lowered a tile at a time, each tile one fused GEMM whose rows are scattered
+ * back to NHWC.
+ */
+matrix *convolution_forward(
+  convolution *c,
+  matrix *weights,
+  matrix *input,
+  matrix *output,
+  matrix *biases,
+  int activation
+) {
+  long positions = (long)c->output_height * c->output_width, first;
+  int samples = input->columns, size = weights->columns, tile, t, k;
+  float *buffer;
+
+  if (!convolution_shape(c, input, 0, "convolution_forward") ||
+      !convolution_shape(c, output, 1, "convolution_forward")) {
+    return NULL;
+  }
+  if (samples == 0) {
+    return output;
+  }
+  tile = convolution_tile(c, size + c->filters, samples);
+  if ((buffer = convolution_buffer((long)(size + c->filters) * tile * samples)) == NULL) {
+    return NULL;
+  }
+  for (first = 0; first < positions; first += tile) {
+    int count = positions - first < tile ? (int)(positions - first) : tile;
+    int width = count * samples;
+    matrix columns = {size, width, width, 1, buffer, NULL, NULL, 0, MATRIX_FLOAT32};
+    matrix product = {c->filters, width, width, 1, buffer + (long)size * width, NULL, NULL, 0, MATRIX_FLOAT32};
+    convolution_columns(c, input, first, count, columns.data);
+    if (matrix_gemm_fused(0, 0, 1, weights, &columns, 0, &product, biases, activation) == NULL) {
+      return NULL;
+    }
+    for (t = 0; t < count; t++) {
+      for (k = 0; k < c->filters; k++) {
+        matrix_store_row(output, (first + t) * c->filters + k, 0, samples,
+          product.data + (long)k * width + (long)t * samples);
+      }
+    }
+  }
+  return output;
+}
+
+/*
+ * convolution_backward writes the gradient w.r.t the input into result from
+ * delta, the gradient w.r.t the output before the activation. Each tile is one
+ * weights^T * delta GEMM folded back onto the input rows it was lowered from.
+ */
+matrix *convolution_backward(convolution *c, matrix *weights, matrix *delta, matrix *result) {
+  long positions = (long)c->output_height * c->output_width, first;
+  int samples = delta->columns, size = weights->columns, tile, t, i, j, k;
+  float *buffer, *row;
+
+  if (!convolution_shape(c, delta, 1, "convolution_backward") ||
+      !convolution_shape(c, result, 0, "convolution_backward")) {
+    return NULL;
+  }
+  if (samples == 0) {
+    return result;
+  }
+  tile = convolution_tile(c, size + c->filters, samples);
+  if ((buffer = convolution_buffer((long)(size + c->filters) * tile * samples + samples)) == NULL) {
+    return NULL;
+  }
+  row = buffer + (long)(size + c->filters) * tile * samples;
+  convolution_zero(result, row);
+  for (first = 0; first < positions; first += tile) {
+    int count = positions - first < tile ? (int)(positions - first) : tile;
+    int width = count * samples;
+    matrix deltas = {c->filters, width, width, 1, buffer, NULL, NULL, 0, MATRIX_FLOAT32};
+    matrix columns = {size, width, width, 1, buffer + (long)c->filters * width, NULL, NULL, 0, MATRIX_FLOAT32};
+    convolution_deltas(c, delta, first, count, deltas.data);
+    if (matrix_gemm(1, 0, 1, weights, &deltas, 0, &columns) == NULL) {
+      return NULL;
+    }
+    for (t = 0; t < count; t++) {
+      for (i = 0; i < c->kernel; i++) {
+        for (j = 0; j < c->kernel; j++) {
+          long input = convolution_tap(c, first + t, i, j);
+          const float *x = columns.data + (long)(i * c->kernel + j) * c->channels * width + (long)t * samples;
+          if (input < 0) {
+            continue;
+          }
+          for (k = 0; k < c->channels; k++, x += width) {
+            convolution_row_add(result, input + k, x, row);
+          }
+        }
+      }
+    }
+  }
+  return result;
+}
+
+/*
+ * convolution_update accumulates scale * delta * im2col(input)^T into
+ * gradient_weights and the sums of delta per filter into gradient_biases.
+ */
+matrix *convolution_update(
+  convolution *c,
+  matrix *gradient_weights,
+  matrix *gradient_biases,
+  matrix *input,
+  matrix *delta,
+  float scale
+) {
+  long positions = (long)c->output_height * c->output_width, first;
+  int samples = input->columns, size = gradient_weights->columns, tile, k;
+  float *buffer;
+
+  if (!convolution_shape(c, input, 0, "convolution_update") ||
+      !convolution_shape(c, delta, 1, "convolution_update")) {
+    return NULL;
+  }
+  if (samples == 0) {
+    return gradient_weights;
+  }
+  tile = convolution_tile(c, size + c->filters, samples);
+  if ((buffer = convolution_buffer((long)(size + c->filters) * tile * samples)) == NULL) {
+    return NULL;
+  }
+  for (first = 0; first < positions; first += tile) {
+    int count = positions - first < tile ? (int)(positions - first) : tile;
+    int width = count * samples;
+    matrix deltas = {c->filters, width, width, 1, buffer, NULL, NULL, 0, MATRIX_FLOAT32};
+    matrix columns = {size, width, width, 1, buffer + (long)c->filters * width, NULL, NULL, 0, MATRIX_FLOAT32};
+    convolution_deltas(c, delta, first, count, deltas.data);
+    convolution_columns(c, input, first, count, columns.data);
+    if (matrix_gemm(0, 1, scale, &deltas, &columns, 1, gradient_weights) == NULL) {
+      return NULL;
+    }
+    for (k = 0; k < c->filters; k++) {
+      const float *x = deltas.data + (long)k * width;
+      float sum = 0;
+      int j;
+      for (j = 0; j < width; j++) {
+        sum += x[j];
+      }
+      matrix_at(gradient_biases, k, 0) += scale * sum;
+    }
+  }
+  return gradient_weights;
+}
+
+/*
+ * convolution_reduce folds x into sum, the max or the sum of both.
+ */
+static inline void convolution_reduce(int kind, const float *x, float *sum, int count) {
+  int n = 0;
+  if (kind == CONVOLUTION_MAX) {
+    for (; n + CONVOLUTION_VECTOR <= count; n += CONVOLUTION_VECTOR) {
+      convolution_vector a = convolution_load(x + n), b = convolution_load(sum + n);
+      convolution_mask m = a > b;
+      convolution_store(sum + n, (convolution_vector)((m & (convolution_mask)a) | (~m & (convolution_mask)b)));
+    }
+    for (; n < count; n++) {
+      sum[n] = x[n] > sum[n] ? x[n] : sum[n];
+    }
+    return;
+  }
+  for (; n + CONVOLUTION_VECTOR <= count; n += CONVOLUTION_VECTOR) {
+    convolution_store(sum + n, convolution_load(sum + n) + convolution_load(x + n));
+  }
+  for (; n < count; n++) {
+    sum[n] += x[n];
+  }
+}
+
+/*
+ * convolution_pool writes the max or average of every window of input into
+ * output, per channel. Padding is never part of a window, an average divides
+ * by the pixels the window covers. A window whose dilated taps all miss the
+ * image outputs 0.
+ */
+matrix *convolution_pool(convolution *c, int kind, matrix *input, matrix *output) {
+  long positions = (long)c->output_height * c->output_width, p;
+  int samples = input->columns, i, j, k, n;
+  float *buffer, *sum, *x;
+
+  if (!convolution_shape(c, input, 0, "convolution_pool") ||
+      !convolution_shape(c, output, 1, "convolution_pool")) {
+    return NULL;
+  }
+  if (samples == 0) {
+    return output;
+  }
+  if ((buffer = convolution_buffer(2L * samples)) == NULL) {
+    return NULL;
+  }
+  sum = buffer + samples;
+  for (p = 0; p < positions; p++) {
+    for (k = 0; k < c->channels; k++) {
+      int count = 0;
+      for (i = 0; i < c->kernel; i++) {
+        for (j = 0; j < c->kernel; j++) {
+          long row = convolution_tap(c, p, i, j);
+          if (row < 0) {
+            continue;
+          }
+          x = convolution_row(input, row + k, buffer);
+          if (count++ == 0) {
+            memcpy(sum, x, samples * sizeof(float));
+          } else {
+            convolution_reduce(kind, x, sum, samples);
+          }
+        }
+      }
+      if (count == 0) {
+        memset(sum, 0, samples * sizeof(float));
+      } else if (kind == CONVOLUTION_AVERAGE) {
+        float inverse = 1.0f / count;
+        for (n = 0; n < samples; n++) {
+          sum[n] *= inverse;
+        }
+      }
+      matrix_store_row(output, p * c->channels + k, 0, samples, sum);
+    }
+  }
+  return output;
+}
+
+/*
+ * convolution_route adds the gradient g to result for the samples whose input
+ * x is the max y and that are still pending, and clears them, without branches.
+ */
+static inline void convolution_route(
+  const float *x,
+  const float *y,
+  const float *g,
+  float *result,
+  float *pending,
+  int count
+) {
+  int n = 0;
+  for (; n + CONVOLUTION_VECTOR <= count; n += CONVOLUTION_VECTOR) {
+    convolution_vector p = convolution_load(pending + n);
+    convolution_mask m = (convolution_load(x + n) == convolution_load(y + n)) & (p != 0);
+    convolution_store(result + n, convolution_load(result + n) +
+      (convolution_vector)(m & (convolution_mask)convolution_load(g + n)));
+    convolution_store(pending + n, (convolution_vector)(~m & (convolution_mask)p));
+  }
+  for (; n < count; n++) {
+    int hit = pending[n] != 0 && x[n] == y[n];
+    result[n] += hit ? g[n] : 0;
+    pending[n] = hit ? 0 : pending[n];
+  }
+}
+
+/*
+ * convolution_pool_backward writes the gradient w.r.t the input of
+ * convolution_pool into result. A max routes the gradient to the first pixel
+ * of the window that equals the output, an average spreads it evenly.
+ */
+matrix *convolution_pool_backward(
+  convolution *c,
+  int kind,
+  matrix *input,
+  matrix *output,
+  matrix *gradient,
+  matrix *result
+) {
+  long positions = (long)c->output_height * c->output_width, p;
+  int samples = input->columns, i, j, k, n;
+  float *buffer, *y = NULL, *g, *add, *pending, *row;
+
+  if (!convolution_shape(c, input, 0, "convolution_pool_backward") ||
+      !convolution_shape(c, gradient, 1, "convolution_pool_backward") ||
+      !convolution_shape(c, result, 0, "convolution_pool_backward")) {
+    return NULL;
+  }
+  if (samples == 0) {
+    return result;
+  }
+  if ((buffer = convolution_buffer(6L * samples)) == NULL) {
+    return NULL;
+  }
+  add = buffer + 3L * samples;
+  pending = buffer + 4L * samples;
+  row = buffer + 5L * samples;
+  convolution_zero(result, row);
+  for (p = 0; p < positions; p++) {
+    for (k = 0; k < c->channels; k++) {
+      long output_row = p * c->channels + k;
+      float scale = 1;
+      g = convolution_row(gradient, output_row, buffer + samples);
+      if (kind == CONVOLUTION_MAX) {
+        y = convolution_row(output, output_row, buffer + 2L * samples);
+        for (n = 0; n < samples; n++) {
+          pending[n] = 1;
+        }
+      } else {
+        int count = 0;
+        for (i = 0; i < c->kernel; i++) {
+          for (j = 0; j < c->kernel; j++) {
+            count += convolution_tap(c, p, i, j) >= 0;
+          }
+        }
+        scale = count == 0 ? 0 : 1.0f / count;
+        for (n = 0; n < samples; n++) {
+          add[n] = g[n] * scale;
+        }
+      }
+      for (i = 0; i < c->kernel; i++) {
+        for (j = 0; j < c->kernel; j++) {
+          long input_row = convolution_tap(c, p, i, j);
+          if (input_row < 0) {
+            continue;
+          }
+          if (kind == CONVOLUTION_MAX) {
+            float *r = convolution_row(result, input_row + k, row);
+            convolution_route(convolution_row(input, input_row + k, buffer), y, g, r, pending, samples);
+            if (r == row) {
+              matrix_store_row(result, input_row + k, 0, samples, row);
+            }
+          } else {
+            convolution_row_add(result, input_row + k, add, row);
+          }
+        }
+      }
+    }
+  }
+  return result;
+}
+
+/*
+ * convolution_free
+ */
+void convolution_free(convolution *c) {
+  allocator_release(c);
+}
@@ -0,0 +1,77 @@
+#ifndef __CONVOLUTION_H_
+#define __CONVOLUTION_H_
+#include "matrix.h"
+
+/*
+ * CONVOLUTION_TILE bounds the im2col workspace of one call in floats, the
+ * output positions are lowered onto the GEMM as many at a time as fit.
+ */
+#define CONVOLUTION_TILE 65536
+
+enum {
+  CONVOLUTION_MAX,
+  CONVOLUTION_AVERAGE
+};
+
+/*
+ * convolution is the geometry of a 2D convolution or pooling over an NHWC
+ * image, one sample per column with feature (h * width + w) * channels + c.
+ * The output is NHWC as well, filters channels of output_height x
+ * output_width, filters is channels for pooling. It is only read while
+ * running, so threads can share it.
+ */
+typedef struct convolution {
+  int height;
+  int width;
+  int channels;
+  int filters;
+  int kernel;
+  int stride;
+  int padding;
+  int dilation;
+  int output_height;
+  int output_width;
+} convolution;
+
+convolution *convolution_create(
+  int height,
+  int width,
+  int channels,
+  int filters,
+  int kernel,
+  int stride,
+  int padding,
+  int dilation
+);
+convolution *convolution_copy(convolution *c);
+int convolution_input_size(convolution *c);
+int convolution_output_size(convolution *c);
+matrix *convolution_forward(
+  convolution *c,
+  matrix *weights,
+  matrix *input,
+  matrix *output,
+  matrix *biases,
+  int activation
+);
+matrix *convolution_backward(convolution *c, matrix *weights, matrix *delta, matrix *result);
+matrix *convolution_update(
+  convolution *c,
+  matrix *gradient_weights,
+  matrix *gradient_biases,
+  matrix *input,
+  matrix *delta,
+  float scale
+);
+matrix *convolution_pool(convolution *c, int kind, matrix *input, matrix *output);
+matrix *convolution_pool_backward(
+  convolution *c,
+  int kind,
+  matrix *input,
+  matrix *output,
+  matrix *gradient,
+  matrix *result
+);
+void convolution_free(convolution *c);
+
+#endif
@@ -1,88 +1,531 @@
 #include "matrix.h"
 #include "criterion.h"
+#include "allocator.h"
+#include "thread.h"
+#include "profile.h"
+#include "activation.h"
+#include "kernel.h"
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+/*
+ * criterion_types pairs the built in loss and gradient callbacks with the
+ * function computing both in one pass.
+ */
+static const struct {
+  matrix *(*output)(matrix *, matrix *, matrix *);
+  matrix *(*gradient)(matrix *, matrix *, matrix *);
+  matrix *(*fused)(matrix *, matrix *, matrix *, matrix *);
+} criterion_types[] = {
+  {&criterion_forward_mse, &criterion_backward_mse, &criterion_mse},
+  {&criterion_forward_cross_entropy, &criterion_backward_cross_entropy, &criterion_cross_entropy},
+  {&criterion_forward_bce_logits, &criterion_backward_bce_logits, &criterion_bce_logits}
+};
+
 /*
  * criterion_create
  */
 criterion *criterion_create(
-  matrix *(*criterion_output)(matrix *, matrix *),
-  matrix *(*criterion_gradient)(matrix *, matrix *)
+  matrix *(*criterion_output)(matrix *, matrix *, matrix *),
+  matrix *(*criterion_gradient)(matrix *, matrix *, matrix *)
 ) {
   criterion *c;
-  if ((c = malloc(sizeof(*c))) == NULL) {
+  int i;
+  if ((c = allocator_allocate(cai_allocator_get(), sizeof(*c))) == NULL) {
     perror("Out of memory\n");
     return NULL;
   }
   c->criterion_output = criterion_output;
   c->criterion_gradient = criterion_gradient;
-  c->output = NULL;
-  c->gradient = NULL;
+  c->criterion_fused = NULL;
+  for (i = 0; i < (int)(sizeof(criterion_types) / sizeof(*criterion_types)); i++) {
+    if (criterion_types[i].output == criterion_output && criterion_types[i].gradient == criterion_gradient) {
+      c->criterion_fused = criterion_types[i].fused;
+    }
+  }
+  c->output = matrix_create(1, 1, NULL);
+  c->gradient = matrix_create(1, 1, NULL);
+  c->widened = matrix_create(1, 1, NULL);
   return c;
 }
 
 /*
- * criterion_forward calculates the 1d-loss
+ * criterion_widen returns output as floats, widened into c->widened when it
+ * holds bfloat16, so the criterion functions only ever see floats.
+ */
+static matrix *criterion_widen(criterion *c, matrix *output) {
+  if (output->type == MATRIX_FLOAT32) {
+    return output;
+  }
+  if (matrix_resize(c->widened, output->rows, output->columns) == NULL) {
+    return NULL;
+  }
+  return matrix_copy_into(output, c->widened);
+}
+
+/*
+ * criterion_forward calculates the 1d-loss into c->output and returns it
  */
 matrix *criterion_forward(criterion *c, matrix *output, matrix *target) {
-  if (c->output == NULL) {
-    c->output = malloc(sizeof(*output));
+  profile_mark mark;
+  matrix *loss;
+  profile_begin(&mark);
+  if ((output = criterion_widen(c, output)) == NULL) {
+    return NULL;
+  }
+  loss = c->criterion_output(output, target, c->output);
+  if (mark.active) {
+    double size = (double)output->rows * output->columns;
+    profile_stop(&mark, PROFILE_LOSS, -1, NULL, 3 * size, 2 * size * sizeof(float));
   }
-  *c->output = *c->criterion_output(output, target);
-  return matrix_copy(c->output);
+  return loss;
 }
 
 /*
- * criterion_backward calculates the gradient w.r.t the output
+ * criterion_backward calculates the gradient w.r.t the output into c->gradient
+ * and returns it
  */
 matrix *criterion_backward(criterion *c, matrix *output, matrix *target) {
-  if (c->gradient == NULL) {
-    c->gradient = malloc(sizeof(*output));
+  profile_mark mark;
+  matrix *gradient;
+  profile_begin(&mark);
+  if (matrix_resize(c->gradient, output->rows, output->columns) == NULL ||
+      (output = criterion_widen(c, output)) == NULL) {
+    return NULL;
+  }
+  gradient = c->criterion_gradient(output, target, c->gradient);
+  if (mark.active) {
+    double size = (double)output->rows * output->columns;
+    profile_stop(&mark, PROFILE_LOSS_GRADIENT, -1, NULL, 2 * size, 3 * size * sizeof(float));
   }
-  *c->gradient = *c->criterion_gradient(output, target);
-  return matrix_copy(c->gradient);
+  return gradient;
 }
 
 /*
- * criterion_forward_mse, calculate the mse loss
+ * criterion_forward_backward calculates the loss into c->output and the
+ * gradient into c->gradient, in one pass when c has a fused function, and
+ * returns the gradient.
  */
-matrix *criterion_forward_mse(matrix *output, matrix *target) {
+matrix *criterion_forward_backward(criterion *c, matrix *output, matrix *target) {
+  profile_mark mark;
+  matrix *gradient;
+  profile_begin(&mark);
+  if (matrix_resize(c->gradient, output->rows, output->columns) == NULL ||
+      (output = criterion_widen(c, output)) == NULL) {
+    return NULL;
+  }
+  if (c->criterion_fused != NULL) {
+    gradient = c->criterion_fused(output, target, c->output, c->gradient);
+  } else if (c->criterion_output(output, target, c->output) == NULL) {
+    gradient = NULL;
+  } else {
+    gradient = c->criterion_gradient(output, target, c->gradient);
+  }
+  if (mark.active) {
+    double size = (double)output->rows * output->columns;
+    profile_stop(&mark, PROFILE_LOSS_GRADIENT, -1, NULL, 5 * size, 3 * size * sizeof(float));
+  }
+  return gradient;
+}
+
+#define CRITERION_BLOCKS 256
+#define CRITERION_COLUMNS 64
+#define CRITERION_ROW 256
+
+typedef struct criterion_elementwise {
+  float *output;
+  float *target;
+  float *result;
+  float norm;
+  long size;
+  long block;
+  float *gradient;
+} criterion_elementwise;
+
+/*
+ * criterion_mse_range sums the squared errors of blocks [begin, end), and
+ * writes their gradient too when e->gradient is set.
+ */
+static void criterion_mse_range(void *context, long begin, long end) {
+  criterion_elementwise *e = (criterion_elementwise *)context;
+  long b;
+  for (b = begin; b < end; b++) {
+    long first = b * e->block;
+    long last = (b + 1) * e->block < e->size ? (b + 1) * e->block : e->size;
+    e->result[b] = kernel_get()->mse(e->output + first, e->target + first,
+      e->gradient == NULL ? NULL : e->gradient + first, e->norm, last - first);
+  }
+}
+
+static void criterion_mse_gradient_range(void *context, long begin, long end) {
+  criterion_elementwise *e = (criterion_elementwise *)context;
+  kernel_get()->mse(e->output + begin, e->target + begin, e->result + begin, e->norm, end - begin);
+}
+
+/*
+ * criterion_forward_mse, calculate the mse loss averaged over the features and
+ * the batch columns
+ */
+matrix *criterion_forward_mse(matrix *output, matrix *target, matrix *loss) {
   int i, j;
   float error = 0.0, sum = 0.0;
-  matrix *c = matrix_create(1, 1, NULL);
+  if (matrix_contiguous(output) && matrix_contiguous(target)) {
+    float partial[CRITERION_BLOCKS];
+    long size = (long)output->rows * output->columns;
+    long block = size / CRITERION_BLOCKS > THREAD_GRAIN ? size / CRITERION_BLOCKS + 1 : THREAD_GRAIN;
+    long blocks = (size + block - 1) / block;
+    criterion_elementwise e = {output->data, target->data, partial, 0, size, block, NULL};
+    thread_parallel_for(blocks, 1, &criterion_mse_range, &e);
+    for (i = 0; i < blocks; i++) {
+      sum += partial[i];
+    }
+    matrix_at(loss, 0, 0) = sum / ((float)output->rows * (float)output->columns);
+    return loss;
+  }
   for (i = 0; i < output->rows; i++) {
     for (j = 0; j < output->columns; j++) {
-      error = output->data[i][j] - target->data[i][j];
+      error = matrix_at(output, i, j) - matrix_at(target, i, j);
       sum += error * error;
     }
   }
-  c->data[0][0] = sum / (float)output->rows;
-  return c;
+  matrix_at(loss, 0, 0) = sum / ((float)output->rows * (float)output->columns);
+  return loss;
 }
 
 /*
  * criterion_backward_mse
  */
-matrix *criterion_backward_mse(matrix *output, matrix *target) {
+matrix *criterion_backward_mse(matrix *output, matrix *target, matrix *gradient) {
   int i, j;
-  float norm = 2.0 / (float)output->rows;
-  matrix *gradient = matrix_create(output->rows, output->columns, NULL);
+  float norm = 2.0 / ((float)output->rows * (float)output->columns);
+  if (matrix_contiguous(output) && matrix_contiguous(target) && matrix_contiguous(gradient)) {
+    criterion_elementwise e = {output->data, target->data, gradient->data, norm, 0, 0, NULL};
+    thread_parallel_for((long)output->rows * output->columns, THREAD_GRAIN, &criterion_mse_gradient_range, &e);
+    return gradient;
+  }
   for (i = 0; i < output->rows; i++) {
     for (j = 0; j < output->columns; j++) {
-      gradient->data[i][j] = norm * (output->data[i][j] - target->data[i][j]);
+      matrix_at(gradient, i, j) = norm * (matrix_at(output, i, j) - matrix_at(target, i, j));
     }
   }
   return gradient;
 }
 
+/*
+ * criterion_mse calculates the mse loss and its gradient in one pass.
+ */
+matrix *criterion_mse(matrix *output, matrix *target, matrix *loss, matrix *gradient) {
+  int i;
+  float sum = 0.0;
+  if (matrix_contiguous(output) && matrix_contiguous(target) && matrix_contiguous(gradient)) {
+    float partial[CRITERION_BLOCKS];
+    long size = (long)output->rows * output->columns;
+    long block = size / CRITERION_BLOCKS > THREAD_GRAIN ? size / CRITERION_BLOCKS + 1 : THREAD_GRAIN;
+    long blocks = (size + block - 1) / block;
+    criterion_elementwise e = {
+      output->data, target->data, partial, 2.0 / (float)size, size, block, gradient->data
+    };
+    thread_parallel_for(blocks, 1, &criterion_mse_range, &e);
+    for (i = 0; i < blocks; i++) {
+      sum += partial[i];
+    }
+    matrix_at(loss, 0, 0) = sum / (float)size;
+    return gradient;
+  }
+  if (criterion_forward_mse(output, target, loss) == NULL) {
+    return NULL;
+  }
+  return criterion_backward_mse(output, target, gradient);
+}
+
+/*
+ * criterion_fused is one pass of a classification loss over blocks of span
+ * batch columns (cross entropy) or feature rows (binary cross entropy). Each
+ * block writes its loss to partial, invalid flags a class index out of range.
+ */
+typedef struct criterion_fused {
+  matrix *output;
+  matrix *target;
+  matrix *gradient;
+  float *partial;
+  float norm;
+  int span;
+  int indices;
+  int invalid;
+} criterion_fused;
+
+/*
+ * criterion_row returns count floats of row i of m from column j on, in place
+ * when m holds contiguous floats, otherwise loaded into buffer.
+ */
+static inline float *criterion_row(matrix *m, int i, int j, int count, float *buffer) {
+  if (m->type == MATRIX_FLOAT32 && m->column_stride == 1) {
+    return matrix_element(m, i, j);
+  }
+  matrix_load_row(m, i, j, count, buffer);
+  return buffer;
+}
+
+/*
+ * criterion_cross_entropy_range works on CRITERION_COLUMNS samples at a time,
+ * vectorized across the samples: the max of each column, then e^(x - max)
+ * with the sums and the target dot products, stored in the gradient, then the
+ * gradient (softmax * mass - target) * norm, where mass is the target's sum.
+ */
+static void criterion_cross_entropy_range(void *context, long begin, long end) {
+  criterion_fused *f = (criterion_fused *)context;
+  matrix *output = f->output, *target = f->target, *gradient = f->gradient;
+  float x[CRITERION_COLUMNS], t[CRITERION_COLUMNS], e[CRITERION_COLUMNS];
+  float top[CRITERION_COLUMNS], sum[CRITERION_COLUMNS], dot[CRITERION_COLUMNS], mass[CRITERION_COLUMNS];
+  float *xr, *tr, *er;
+  int label[CRITERION_COLUMNS];
+  long b;
+  int i, j, k, w;
+
+  for (b = begin; b < end; b++) {
+    int first = (int)(b * f->span);
+    int last = first + f->span < output->columns ? first + f->span : output->columns;
+    float loss = 0;
+    for (i = first; i < last; i += CRITERION_COLUMNS) {
+      w = last - i < CRITERION_COLUMNS ? last - i : CRITERION_COLUMNS;
+      for (j = 0; j < w; j++) {
+        top[j] = -INFINITY;
+        sum[j] = dot[j] = 0;
+        mass[j] = f->indices ? 1 : 0;
+      }
+      if (f->indices) {
+        tr = criterion_row(target, 0, i, w, t);
+        for (j = 0; j < w; j++) {
+          label[j] = (int)tr[j];
+          if (label[j] < 0 || label[j] >= output->rows || (float)label[j] != tr[j]) {
+            f->invalid = 1;
+            label[j] = 0;
+          }
+        }
+      }
+      for (k = 0; k < output->rows; k++) {
+        xr = criterion_row(output, k, i, w, x);
+        for (j = 0; j < w; j++) {
+          top[j] = xr[j] > top[j] ? xr[j] : top[j];
+        }
+      }
+      for (k = 0; k < output->rows; k++) {
+        xr = criterion_row(output, k, i, w, x);
+        er = gradient != NULL && gradient->column_stride == 1 ? matrix_element(gradient, k, i) : e;
+        for (j = 0; j < w; j++) {
+          er[j] = xr[j] - top[j];
+        }
+        activation_exp(er, er, w);
+        if (f->indices) {
+          for (j = 0; j < w; j++) {
+            sum[j] += er[j];
+            dot[j] += label[j] == k ? xr[j] : 0;
+          }
+        } else {
+          tr = criterion_row(target, k, i, w, t);
+          for (j = 0; j < w; j++) {
+            sum[j] += er[j];
+            dot[j] += tr[j] * xr[j];
+            mass[j] += tr[j];
+          }
+        }
+        if (gradient != NULL && er == e) {
+          matrix_store_row(gradient, k, i, w, e);
+        }
+      }
+      for (j = 0; j < w; j++) {
+        loss += mass[j] * (top[j] + logf(sum[j])) - dot[j];
+        sum[j] = f->norm * mass[j] / sum[j];
+      }
+      if (gradient == NULL) {
+        continue;
+      }
+      for (k = 0; k < output->rows; k++) {
+        er = criterion_row(gradient, k, i, w, e);
+        if (f->indices) {
+          for (j = 0; j < w; j++) {
+            er[j] = er[j] * sum[j] - (label[j] == k ? f->norm : 0);
+          }
+        } else {
+          tr = criterion_row(target, k, i, w, t);
+          for (j = 0; j < w; j++) {
+            er[j] = er[j] * sum[j] - f->norm * tr[j];
+          }
+        }
+        if (er == e) {
+          matrix_store_row(gradient, k, i, w, e);
+        }
+      }
+    }
+    f->partial[b] = loss;
+  }
+}
+
+/*
+ * criterion_cross_entropy calculates the softmax cross entropy of the logits
+ * in output, averaged over the batch columns, and its gradient w.r.t the
+ * logits in one pass. The softmax is taken down each column with the max
+ * subtracted, so large logits don't overflow. target is either probabilities
+ * shaped like output or a single row of class indices. gradient may be NULL.
+ */
+matrix *criterion_cross_entropy(matrix *output, matrix *target, matrix *loss, matrix *gradient) {
+  float partial[CRITERION_BLOCKS], sum = 0;
+  int span = CRITERION_COLUMNS, blocks, i;
+  criterion_fused f;
+
+  if (target->columns != output->columns || (target->rows != output->rows && target->rows != 1)) {
+    fprintf(stderr, "criterion_cross_entropy: target (%d, %d) doesn't match output (%d, %d)\n",
+      target->rows, target->columns, output->rows, output->columns);
+    return NULL;
+  }
+  while ((output->columns + span - 1) / span > CRITERION_BLOCKS) {
+    span *= 2;
+  }
+  blocks = (output->columns + span - 1) / span;
+  f.output = output;
+  f.target = target;
+  f.gradient = gradient;
+  f.partial = partial;
+  f.norm = 1.0f / (float)output->columns;
+  f.span = span;
+  f.indices = target->rows == 1 && output->rows > 1;
+  f.invalid = 0;
+  thread_parallel_for(blocks, 1, &criterion_cross_entropy_range, &f);
+  if (f.invalid) {
+    fprintf(stderr, "criterion_cross_entropy: class indices must be integers in [0, %d)\n", output->rows);
+    return NULL;
+  }
+  for (i = 0; i < blocks; i++) {
+    sum += partial[i];
+  }
+  matrix_at(loss, 0, 0) = sum / (float)output->columns;
+  return gradient != NULL ? gradient : loss;
+}
+
+/*
+ * criterion_forward_cross_entropy, see criterion_cross_entropy
+ */
+matrix *criterion_forward_cross_entropy(matrix *output, matrix *target, matrix *loss) {
+  return criterion_cross_entropy(output, target, loss, NULL);
+}
+
+/*
+ * criterion_backward_cross_entropy, see criterion_cross_entropy
+ */
+matrix *criterion_backward_cross_entropy(matrix *output, matrix *target, matrix *gradient) {
+  float loss;
+  matrix scalar = {1, 1, 1, 1, &loss, NULL, NULL, 0, MATRIX_FLOAT32};
+  return criterion_cross_entropy(output, target, &scalar, gradient);
+}
+
+/*
+ * criterion_bce_logits_range works on span rows a block, CRITERION_ROW
+ * columns at a time, with the loss max(x, 0) - x * t + log(1 + e^-|x|) and
+ * the gradient (sigmoid(x) - t) * norm, sharing e^-|x| between the two.
+ */
+static void criterion_bce_logits_range(void *context, long begin, long end) {
+  criterion_fused *f = (criterion_fused *)context;
+  matrix *output = f->output, *target = f->target, *gradient = f->gradient;
+  float x[CRITERION_ROW], t[CRITERION_ROW], e[CRITERION_ROW], s[CRITERION_ROW];
+  long b;
+  int i, j, k, w;
+
+  for (b = begin; b < end; b++) {
+    int first = (int)(b * f->span);
+    int last = first + f->span < output->rows ? first + f->span : output->rows;
+    float loss = 0;
+    for (k = first; k < last; k++) {
+      for (i = 0; i < output->columns; i += CRITERION_ROW) {
+        w = output->columns - i < CRITERION_ROW ? output->columns - i : CRITERION_ROW;
+        matrix_load_row(output, k, i, w, x);
+        matrix_load_row(target, k, i, w, t);
+        for (j = 0; j < w; j++) {
+          e[j] = -fabsf(x[j]);
+        }
+        activation_exp(e, e, w);
+        for (j = 0; j < w; j++) {
+          s[j] = 1 + e[j];
+        }
+        activation_log(s, s, w);
+        for (j = 0; j < w; j++) {
+          loss += (x[j] > 0 ? x[j] : 0) - x[j] * t[j] + s[j];
+        }
+        if (gradient == NULL) {
+          continue;
+        }
+        for (j = 0; j < w; j++) {
+          float r = 1 / (1 + e[j]);
+          e[j] = f->norm * ((x[j] >= 0 ? r : e[j] * r) - t[j]);
+        }
+        matrix_store_row(gradient, k, i, w, e);
+      }
+    }
+    f->partial[b] = loss;
+  }
+}
+
+/*
+ * criterion_bce_logits calculates the binary cross entropy of the sigmoid of
+ * the logits in output against target probabilities, averaged over the
+ * features and the batch columns, and its gradient w.r.t the logits in one
+ * pass, without ever taking the log of a saturated sigmoid. gradient may be
+ * NULL.
+ */
+matrix *criterion_bce_logits(matrix *output, matrix *target, matrix *loss, matrix *gradient) {
+  float partial[CRITERION_BLOCKS], sum = 0;
+  long size = (long)output->rows * output->columns;
+  int span, blocks, i;
+  criterion_fused f;
+
+  if (target->rows != output->rows || target->columns != output->columns) {
+    fprintf(stderr, "criterion_bce_logits: target (%d, %d) doesn't match output (%d, %d)\n",
+      target->rows, target->columns, output->rows, output->columns);
+    return NULL;
+  }
+  span = (int)((THREAD_GRAIN + output->columns - 1) / output->columns);
+  while ((output->rows + span - 1) / span > CRITERION_BLOCKS) {
+    span *= 2;
+  }
+  blocks = (output->rows + span - 1) / span;
+  f.output = output;
+  f.target = target;
+  f.gradient = gradient;
+  f.partial = partial;
+  f.norm = 1.0f / (float)size;
+  f.span = span;
+  f.indices = f.invalid = 0;
+  thread_parallel_for(blocks, 1, &criterion_bce_logits_range, &f);
+  for (i = 0; i < blocks; i++) {
+    sum += partial[i];
+  }
+  matrix_at(loss, 0, 0) = sum / (float)size;
+  return gradient != NULL ? gradient : loss;
+}
+
+/*
+ * criterion_forward_bce_logits, see criterion_bce_logits
+ */
+matrix *criterion_forward_bce_logits(matrix *output, matrix *target, matrix *loss) {
+  return criterion_bce_logits(output, target, loss, NULL);
+}
+
+/*
+ * criterion_backward_bce_logits, see criterion_bce_logits
+ */
+matrix *criterion_backward_bce_logits(matrix *output, matrix *target, matrix *gradient) {
+  float loss;
+  matrix scalar = {1, 1, 1, 1, &loss, NULL, NULL, 0, MATRIX_FLOAT32};
+  return criterion_bce_logits(output, target, &scalar, gradient);
+}
+
 /*
  * criterion_free
  */
 void criterion_free(criterion *c) {
-  free(c->gradient);
-  free(c->output);
-  free(c);
+  matrix_free(c->gradient);
+  matrix_free(c->output);
+  matrix_free(c->widened);
+  allocator_release(c);
   c = NULL;
 }
@@ -2,21 +2,36 @@
 #define __CRITERION_H__
 #include "matrix.h"
 
+/*
+ * criterion computes a loss into output and its gradient w.r.t the network
+ * output into gradient. criterion_fused computes both in one pass, it's set
+ * for the built in criteria and NULL for custom ones.
+ */
 typedef struct criterion {
-  matrix *(*criterion_output)(matrix *, matrix *);
-  matrix *(*criterion_gradient)(matrix *, matrix *);
+  matrix *(*criterion_output)(matrix *output, matrix *target, matrix *loss);
+  matrix *(*criterion_gradient)(matrix *output, matrix *target, matrix *gradient);
+  matrix *(*criterion_fused)(matrix *output, matrix *target, matrix *loss, matrix *gradient);
   matrix *gradient;
   matrix *output;
+  matrix *widened;
 } criterion;
 
 criterion *criterion_create(
-  matrix *(*criterion_output)(matrix *, matrix *),
-  matrix *(*criterion_gradient)(matrix *, matrix *)
+  matrix *(*criterion_output)(matrix *output, matrix *target, matrix *loss),
+  matrix *(*criterion_gradient)(matrix *output, matrix *target, matrix *gradient)
 );
-matrix *criterion_forward(criterion *c, matrix *output, matrix *targets);
-matrix *criterion_backward(criterion *c, matrix *output, matrix *targets);
-matrix *criterion_forward_mse(matrix *output, matrix *target);
-matrix *criterion_backward_mse(matrix *output, matrix *target);
+matrix *criterion_forward(criterion *c, matrix *output, matrix *target);
+matrix *criterion_backward(criterion *c, matrix *output, matrix *target);
+matrix *criterion_forward_backward(criterion *c, matrix *output, matrix *target);
+matrix *criterion_forward_mse(matrix *output, matrix *target, matrix *loss);
+matrix *criterion_backward_mse(matrix *output, matrix *target, matrix *gradient);
+matrix *criterion_mse(matrix *output, matrix *target, matrix *loss, matrix *gradient);
+matrix *criterion_forward_cross_entropy(matrix *output, matrix *target, matrix *loss);
+matrix *criterion_backward_cross_entropy(matrix *output, matrix *target, matrix *gradient);
+matrix *criterion_cross_entropy(matrix *output, matrix *target, matrix *loss, matrix *gradient);
+matrix *criterion_forward_bce_logits(matrix *output, matrix *target, matrix *loss);
+matrix *criterion_backward_bce_logits(matrix *output, matrix *target, matrix *gradient);
+matrix *criterion_bce_logits(matrix *output, matrix *target, matrix *loss, matrix *gradient);
 void criterion_free(criterion *c);
 
 #endif
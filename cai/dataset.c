@@ -0,0 +1,418 @@
+#include "dataset.h"
+#include "matrix.h"
+#include "allocator.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DATASET_MAGIC "CAIDATA"
+#define DATASET_VERSION 1
+#define DATASET_ENDIAN 0x01020304
+
+/*
+ * dataset_header starts a dataset file, followed by count samples, each the
+ * features floats of one input and then the labels floats of its target.
+ */
+typedef struct dataset_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t endian;
+  uint64_t count;
+  uint32_t features;
+  uint32_t labels;
+  uint8_t reserved[32];
+} dataset_header;
+
+/*
+ * dataset_write writes the columns of inputs, and of targets unless it's NULL,
+ * as the samples of a dataset file. Returns 0 on success.
+ */
+int dataset_write(char *path, matrix *inputs, matrix *targets) {
+  dataset_header header;
+  FILE *file;
+  float *sample;
+  int features = inputs->rows, labels = targets != NULL ? targets->rows : 0;
+  int i, j, ok = 1;
+
+  if (targets != NULL && targets->columns != inputs->columns) {
+    fprintf(stderr, "dataset_write: %d inputs but %d targets\n", inputs->columns, targets->columns);
+    return -1;
+  }
+  if ((sample = allocator_allocate(cai_allocator_get(), (features + labels) * sizeof(float))) == NULL) {
+    perror("Out of memory\n");
+    return -1;
+  }
+  if ((file = fopen(path, "wb")) == NULL) {
+    perror("dataset_write");
+    allocator_release(sample);
+    return -1;
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, DATASET_MAGIC, sizeof(DATASET_MAGIC));
+  header.version = DATASET_VERSION;
+  header.endian = DATASET_ENDIAN;
+  header.count = inputs->columns;
+  header.features = features;
+  header.labels = labels;
+  ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  for (j = 0; ok && j < inputs->columns; j++) {
+    for (i = 0; i < features; i++) {
+      sample[i] = matrix_at(inputs, i, j);
+    }
+    for (i = 0; i < labels; i++) {
+      sample[features + i] = matrix_at(targets, i, j);
+    }
+    ok = fwrite(sample, sizeof(float), features + labels, file) == (size_t)(features + labels);
+  }
+  ok = fclose(file) == 0 && ok;
+  allocator_release(sample);
+  if (!ok) {
+    fprintf(stderr, "dataset_write: failed to write %s\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * dataset_random is xorshift64*, each dataset has its own state so shuffling
+ * doesn't touch rand().
+ */
+static uint64_t dataset_random(dataset *d) {
+  d->random ^= d->random >> 12;
+  d->random ^= d->random << 25;
+  d->random ^= d->random >> 27;
+  return d->random * 0x2545f4914f6cdd1dULL;
+}
+
+/*
+ * dataset_chunk returns the records of chunk c, straight from the mapping or
+ * read into d->chunk, and their count in records. Returns NULL on read errors.
+ */
+static float *dataset_chunk(dataset *d, long c, long *records) {
+  long first = c * d->chunk_records;
+  long bytes, done = 0;
+  off_t offset = sizeof(dataset_header) + first * d->record * sizeof(float);
+  *records = d->count - first < d->chunk_records ? d->count - first : d->chunk_records;
+  if (d->mapping != NULL) {
+    return (float *)(d->mapping + offset);
+  }
+  bytes = *records * d->record * sizeof(float);
+  while (done < bytes) {
+    ssize_t size = pread(d->file, (char *)d->chunk + done, bytes - done, offset + done);
+    if (size <= 0) {
+      return NULL;
+    }
+    done += size;
+  }
+  return d->chunk;
+}
+
+/*
+ * dataset_acquire waits for a free batch buffer and returns it, or NULL once
+ * the dataset is being freed.
+ */
+static dataset_batch *dataset_acquire(dataset *d) {
+  dataset_batch *b = NULL;
+  pthread_mutex_lock(&d->lock);
+  while (!d->stop && d->filled == DATASET_BUFFERS) {
+    pthread_cond_wait(&d->consumed, &d->lock);
+  }
+  if (!d->stop) {
+    b = &d->batches[(d->head + d->filled) % DATASET_BUFFERS];
+  }
+  pthread_mutex_unlock(&d->lock);
+  return b;
+}
+
+/*
+ * dataset_shrink narrows a batch filled at full width to its first columns,
+ * moving each row down to the packed stride before resizing.
+ */
+static void dataset_shrink(matrix *m, int columns) {
+  int i;
+  for (i = 1; i < m->rows; i++) {
+    memmove(m->data + (long)i * columns, matrix_element(m, i, 0), columns * sizeof(float));
+  }
+  matrix_resize(m, m->rows, columns);
+}
+
+/*
+ * dataset_publish hands the batch buffer taken by dataset_acquire to the reader.
+ */
+static void dataset_publish(dataset *d, dataset_batch *b, int columns) {
+  if (columns > 0 && columns < d->batch) {
+    dataset_shrink(b->inputs, columns);
+    if (b->targets != NULL) {
+      dataset_shrink(b->targets, columns);
+    }
+  }
+  b->columns = columns;
+  pthread_mutex_lock(&d->lock);
+  d->filled++;
+  pthread_cond_signal(&d->produced);
+  pthread_mutex_unlock(&d->lock);
+}
+
+/*
+ * dataset_emit copies one sample into the batch being assembled, publishing it
+ * once full. Returns 0 once the dataset is being freed.
+ */
+static int dataset_emit(dataset *d, dataset_batch **b, int *columns, const float *sample) {
+  int i;
+  if (*b == NULL) {
+    if ((*b = dataset_acquire(d)) == NULL) {
+      return 0;
+    }
+    matrix_resize((*b)->inputs, d->features, d->batch);
+    if ((*b)->targets != NULL) {
+      matrix_resize((*b)->targets, d->labels, d->batch);
+    }
+    *columns = 0;
+  }
+  for (i = 0; i < d->features; i++) {
+    matrix_at((*b)->inputs, i, *columns) = sample[i];
+  }
+  for (i = 0; i < d->labels; i++) {
+    matrix_at((*b)->targets, i, *columns) = sample[d->features + i];
+  }
+  if (++*columns == d->batch) {
+    dataset_publish(d, *b, *columns);
+    *b = NULL;
+  }
+  return 1;
+}
+
+/*
+ * dataset_epoch produces one shuffled pass over the samples. Chunks are read
+ * whole in a random order, and samples go through a window of d->window
+ * samples, each emitted sample replaced by the next one read. A window of 0
+ * reads the chunks and samples in file order. The epoch ends with an empty
+ * batch, or with a batch of -1 columns when a read fails.
+ */
+static int dataset_epoch(dataset *d) {
+  dataset_batch *b = NULL;
+  long c, r, held = 0;
+  int columns = 0;
+
+  for (c = d->window > 0 ? d->chunk_count - 1 : 0; c > 0; c--) {
+    long k = (long)(dataset_random(d) % (uint64_t)(c + 1));
+    long swap = d->chunks[c];
+    d->chunks[c] = d->chunks[k];
+    d->chunks[k] = swap;
+  }
+  for (c = 0; c < d->chunk_count; c++) {
+    long records;
+    float *chunk = dataset_chunk(d, d->chunks[c], &records);
+    if (chunk == NULL) {
+      perror("dataset_next");
+      if (b == NULL && (b = dataset_acquire(d)) == NULL) {
+        return 0;
+      }
+      dataset_publish(d, b, -1);
+      return 1;
+    }
+    for (r = 0; r < records; r++) {
+      float *sample = chunk + r * d->record;
+      if (held < d->window) {
+        memcpy(d->samples + held * d->record, sample, d->record * sizeof(float));
+        held++;
+        continue;
+      }
+      if (d->window > 0) {
+        float *slot = d->samples + (long)(dataset_random(d) % (uint64_t)d->window) * d->record;
+        if (!dataset_emit(d, &b, &columns, slot)) {
+          return 0;
+        }
+        memcpy(slot, sample, d->record * sizeof(float));
+      } else if (!dataset_emit(d, &b, &columns, sample)) {
+        return 0;
+      }
+    }
+  }
+  while (held > 0) {
+    float *slot = d->samples + (long)(dataset_random(d) % (uint64_t)held) * d->record;
+    if (!dataset_emit(d, &b, &columns, slot)) {
+      return 0;
+    }
+    memcpy(slot, d->samples + (held - 1) * d->record, d->record * sizeof(float));
+    held--;
+  }
+  if (b != NULL) {
+    dataset_publish(d, b, columns);
+  }
+  if ((b = dataset_acquire(d)) == NULL) {
+    return 0;
+  }
+  dataset_publish(d, b, 0);
+  return 1;
+}
+
+/*
+ * dataset_run assembles batches epoch after epoch until the dataset is freed.
+ */
+static void *dataset_run(void *argument) {
+  dataset *d = (dataset *)argument;
+  while (dataset_epoch(d)) {
+  }
+  return NULL;
+}
+
+/*
+ * dataset_open opens a dataset file for reading in batches of up to batch samples,
+ * shuffled through a window of window samples, 0 keeps the file order. Files
+ * up to half the physical memory are mapped, larger ones are read a chunk at a
+ * time. A background thread assembles batches into DATASET_BUFFERS buffers
+ * ahead of dataset_next.
+ */
+dataset *dataset_open(char *path, int batch, int window, unsigned long seed) {
+  dataset_header header;
+  struct stat status;
+  dataset *d;
+  long c, memory = sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+  int i, file;
+
+  if ((file = open(path, O_RDONLY)) < 0 || fstat(file, &status) != 0 ||
+      pread(file, &header, sizeof(header), 0) != sizeof(header)) {
+    perror("dataset_open");
+    if (file >= 0) {
+      close(file);
+    }
+    return NULL;
+  }
+  if (memcmp(header.magic, DATASET_MAGIC, sizeof(DATASET_MAGIC)) != 0 ||
+      header.version > DATASET_VERSION || header.endian != DATASET_ENDIAN ||
+      header.features == 0 || header.count == 0 || (uint64_t)status.st_size !=
+      sizeof(header) + header.count * (header.features + header.labels) * sizeof(float)) {
+    fprintf(stderr, "dataset_open: %s isn't a version %d dataset\n", path, DATASET_VERSION);
+    close(file);
+    return NULL;
+  }
+  if (batch <= 0 || window < 0) {
+    fprintf(stderr, "dataset_open: invalid batch %d or window %d\n", batch, window);
+    close(file);
+    return NULL;
+  }
+  if ((d = allocator_allocate(cai_allocator_get(), sizeof(*d))) == NULL) {
+    perror("Out of memory\n");
+    close(file);
+    return NULL;
+  }
+  memset(d, 0, sizeof(*d));
+  d->features = header.features;
+  d->labels = header.labels;
+  d->batch = batch;
+  d->window = window;
+  d->count = header.count;
+  d->record = header.features + header.labels;
+  d->file = file;
+  d->random = seed * 0x9e3779b97f4a7c15ULL + 1;
+  d->chunk_records = DATASET_CHUNK / (d->record * sizeof(float));
+  d->chunk_records = d->chunk_records > 0 ? d->chunk_records : 1;
+  d->chunk_count = (d->count + d->chunk_records - 1) / d->chunk_records;
+  if (status.st_size <= memory / 2) {
+    d->mapping = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    if (d->mapping == MAP_FAILED) {
+      d->mapping = NULL;
+    } else {
+      d->mapping_size = status.st_size;
+      madvise(d->mapping, d->mapping_size, MADV_WILLNEED);
+    }
+  }
+  if (d->mapping == NULL) {
+    d->chunk = allocator_allocate(cai_allocator_get(), d->chunk_records * d->record * sizeof(float));
+  }
+  d->chunks = allocator_allocate(cai_allocator_get(), d->chunk_count * sizeof(long));
+  d->samples = allocator_allocate(cai_allocator_get(), (window + 1) * d->record * sizeof(float));
+  if ((d->mapping == NULL && d->chunk == NULL) || d->chunks == NULL || d->samples == NULL) {
+    perror("Out of memory\n");
+    dataset_free(d);
+    return NULL;
+  }
+  for (c = 0; c < d->chunk_count; c++) {
+    d->chunks[c] = c;
+  }
+  for (i = 0; i < DATASET_BUFFERS; i++) {
+    d->batches[i].inputs = matrix_create(d->features, batch, NULL);
+    d->batches[i].targets = d->labels > 0 ? matrix_create(d->labels, batch, NULL) : NULL;
+    if (d->batches[i].inputs == NULL || (d->labels > 0 && d->batches[i].targets == NULL)) {
+      dataset_free(d);
+      return NULL;
+    }
+  }
+  pthread_mutex_init(&d->lock, NULL);
+  pthread_cond_init(&d->produced, NULL);
+  pthread_cond_init(&d->consumed, NULL);
+  if (pthread_create(&d->thread, NULL, &dataset_run, d) != 0) {
+    perror("dataset_open");
+    dataset_free(d);
+    return NULL;
+  }
+  d->started = 1;
+  return d;
+}
+
+/*
+ * dataset_next hands out the next batch as features x columns inputs and
+ * labels x columns targets, NULL without labels, and returns columns. The
+ * matrices belong to the dataset and stay valid until the next call. Returns 0
+ * at the end of each epoch, the call after that starts the next one, and -1
+ * when reading the file failed.
+ */
+int dataset_next(dataset *d, matrix **inputs, matrix **targets) {
+  dataset_batch *b;
+  pthread_mutex_lock(&d->lock);
+  if (d->holding) {
+    d->head = (d->head + 1) % DATASET_BUFFERS;
+    d->filled--;
+    d->holding = 0;
+    pthread_cond_signal(&d->consumed);
+  }
+  while (d->filled == 0) {
+    pthread_cond_wait(&d->produced, &d->lock);
+  }
+  b = &d->batches[d->head];
+  d->holding = 1;
+  pthread_mutex_unlock(&d->lock);
+  *inputs = b->columns > 0 ? b->inputs : NULL;
+  if (targets != NULL) {
+    *targets = b->columns > 0 ? b->targets : NULL;
+  }
+  return b->columns;
+}
+
+/*
+ * dataset_free stops the background thread and releases d.
+ */
+void dataset_free(dataset *d) {
+  int i;
+  if (d->started) {
+    pthread_mutex_lock(&d->lock);
+    d->stop = 1;
+    pthread_cond_broadcast(&d->consumed);
+    pthread_mutex_unlock(&d->lock);
+    pthread_join(d->thread, NULL);
+    pthread_mutex_destroy(&d->lock);
+    pthread_cond_destroy(&d->produced);
+    pthread_cond_destroy(&d->consumed);
+  }
+  for (i = 0; i < DATASET_BUFFERS; i++) {
+    if (d->batches[i].inputs != NULL) {
+      matrix_free(d->batches[i].inputs);
+    }
+    if (d->batches[i].targets != NULL) {
+      matrix_free(d->batches[i].targets);
+    }
+  }
+  if (d->mapping != NULL) {
+    munmap(d->mapping, d->mapping_size);
+  }
+  close(d->file);
+  allocator_release(d->chunk);
+  allocator_release(d->chunks);
+  allocator_release(d->samples);
+  allocator_release(d);
+}
@@ -0,0 +1,49 @@
+#ifndef __DATASET_H__
+#define __DATASET_H__
+#include "matrix.h"
+#include <pthread.h>
+#include <stdint.h>
+
+#define DATASET_BUFFERS 3
+#define DATASET_CHUNK (4 << 20)
+
+typedef struct dataset_batch {
+  matrix *inputs;
+  matrix *targets;
+  int columns;
+} dataset_batch;
+
+typedef struct dataset {
+  int features;
+  int labels;
+  int batch;
+  int window;
+  long count;
+  long record;
+  int file;
+  char *mapping;
+  long mapping_size;
+  float *chunk;
+  long chunk_records;
+  long *chunks;
+  long chunk_count;
+  float *samples;
+  uint64_t random;
+  dataset_batch batches[DATASET_BUFFERS];
+  int head;
+  int filled;
+  int holding;
+  int stop;
+  int started;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t produced;
+  pthread_cond_t consumed;
+} dataset;
+
+int dataset_write(char *path, matrix *inputs, matrix *targets);
+dataset *dataset_open(char *path, int batch, int window, unsigned long seed);
+int dataset_next(dataset *d, matrix **inputs, matrix **targets);
+void dataset_free(dataset *d);
+
+#endif
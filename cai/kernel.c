@@ -0,0 +1,102 @@
+#include "kernel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#ifndef bit_AVX512VNNI
+#define bit_AVX512VNNI (1 << 11)
+#endif
+#endif
+
+/*
+ * kernel_tables lists the variants built for this architecture, NULL where
+ * there is none.
+ */
+static const kernel_table *kernel_tables[KERNEL_ISAS] = {
+  &kernel_baseline,
+#if defined(__x86_64__) || defined(__i386__)
+  &kernel_sse42,
+  &kernel_avx2,
+  &kernel_avx512,
+  &kernel_avx512vnni
+#endif
+};
+
+const kernel_table *kernel_active = &kernel_baseline;
+
+/*
+ * kernel_supported reports whether both the processor and the operating system
+ * run isa, from the cpuid feature bits and, for the AVX register state the
+ * operating system saves, xgetbv.
+ */
+static int kernel_supported(int isa) {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int a, b, c, d, xcr0 = 0, high;
+  int avx;
+  if (isa == KERNEL_BASELINE) {
+    return 1;
+  }
+  if (!__get_cpuid(1, &a, &b, &c, &d)) {
+    return 0;
+  }
+  if (c & bit_OSXSAVE) {
+    __asm__ volatile ("xgetbv" : "=a"(xcr0), "=d"(high) : "c"(0));
+  }
+  avx = (c & bit_AVX) && (c & bit_FMA) && (xcr0 & 0x6) == 0x6;
+  if (isa == KERNEL_SSE42) {
+    return (c & bit_SSE4_2) != 0;
+  }
+  if (!avx || !__get_cpuid_count(7, 0, &a, &b, &c, &d)) {
+    return 0;
+  }
+  if (isa == KERNEL_AVX2) {
+    return (b & bit_AVX2) != 0;
+  }
+  if (!(b & bit_AVX2) || !(b & bit_AVX512F) || !(b & bit_AVX512BW) || (xcr0 & 0xe6) != 0xe6) {
+    return 0;
+  }
+  return isa == KERNEL_AVX512 || (isa == KERNEL_AVX512VNNI && (c & bit_AVX512VNNI));
+#else
+  return isa == KERNEL_BASELINE;
+#endif
+}
+
+/*
+ * kernel_select picks the widest variant the machine runs when the library is
+ * loaded, or the one CAI_ISA names (baseline, sse4.2, avx2, avx512 or
+ * avx512vnni) when the machine runs it.
+ */
+static void kernel_select() __attribute__((constructor));
+
+static void kernel_select() {
+  char *name = getenv("CAI_ISA");
+  int isa, best = KERNEL_BASELINE;
+  for (isa = 0; isa < KERNEL_ISAS; isa++) {
+    if (kernel_tables[isa] != NULL && kernel_supported(isa)) {
+      best = isa;
+    }
+  }
+  if (name != NULL && name[0] != '\0') {
+    for (isa = 0; isa < KERNEL_ISAS; isa++) {
+      if (kernel_tables[isa] != NULL && strcmp(kernel_tables[isa]->name, name) == 0) {
+        break;
+      }
+    }
+    if (isa == KERNEL_ISAS) {
+      fprintf(stderr, "CAI_ISA: unknown instruction set %s, using %s\n", name, kernel_tables[best]->name);
+    } else if (!kernel_supported(isa)) {
+      fprintf(stderr, "CAI_ISA: %s isn't supported here, using %s\n", name, kernel_tables[best]->name);
+    } else {
+      best = isa;
+    }
+  }
+  kernel_active = kernel_tables[best];
+}
+
+/*
+ * cai_kernel_isa returns the name of the instruction set the kernels run on.
+ */
+const char *cai_kernel_isa() {
+  return kernel_active->name;
+}
@@ -0,0 +1,87 @@
+#ifndef __KERNEL_H_
+#define __KERNEL_H_
+#include <stdint.h>
+#include "matrix.h"
+
+/*
+ * Instruction sets the hot kernels are built for, each one a superset of the
+ * one before. Only KERNEL_BASELINE is built off x86.
+ */
+enum {
+  KERNEL_BASELINE,
+  KERNEL_SSE42,
+  KERNEL_AVX2,
+  KERNEL_AVX512,
+  KERNEL_AVX512VNNI,
+  KERNEL_ISAS
+};
+
+/*
+ * kernel_update is one fused optimizer step over contiguous parameters, see
+ * optimizer_step. first, second and compute are NULL when there are none.
+ */
+typedef struct kernel_update {
+  int kind;
+  float *weights;
+  const float *gradients;
+  float *first;
+  float *second;
+  bfloat16 *compute;
+  float rate;
+  float scale;
+  float decay;
+  float momentum;
+  float beta1;
+  float beta2;
+  float epsilon;
+  float correction1;
+  float correction2;
+} kernel_update;
+
+/*
+ * kernel_table holds the hot kernels built for one instruction set, by
+ * kernel_<isa>.c from kernel_template.h. The elementwise kernels and the mse
+ * take contiguous arrays, their callers check shapes and split the work
+ * across threads. gemm takes operands matrix_gemm_fused has checked, dots the
+ * padded int8 rows of quantize_gemm.
+ */
+typedef struct kernel_table {
+  const char *name;
+  int vector;
+  matrix_blocking blocking;
+  void (*gemm)(int, int, float, matrix *, matrix *, float, matrix *, matrix *, int);
+  int (*gemm_packed)(int m, int n, int k);
+  void (*gemm_warm)(void);
+  void (*add)(float *c, const float *a, const float *b, long n);
+  void (*scale)(float *c, const float *a, float alpha, long n);
+  void (*axpy)(float *y, const float *x, float alpha, long n);
+  void (*fill)(float *c, float value, long n);
+  void (*activation_exp)(float *y, const float *x, long n);
+  void (*activation_log)(float *y, const float *x, long n);
+  void (*activation_forward)(int kind, float *y, const float *x, long n);
+  void (*activation_backward)(int kind, float *dx, const float *dy, const float *x, const float *y, long n);
+  float (*mse)(const float *output, const float *target, float *gradient, float norm, long n);
+  void (*dots)(const int8_t *w, const uint8_t *x, int stride, int count, int32_t *dots);
+  void (*update)(const kernel_update *u, long begin, long end);
+  void (*update_columns)(const kernel_update *u, const int *columns, int count, long stride, long begin, long end);
+  float (*squares)(const float *x, long n);
+} kernel_table;
+
+extern const kernel_table kernel_baseline;
+extern const kernel_table kernel_sse42;
+extern const kernel_table kernel_avx2;
+extern const kernel_table kernel_avx512;
+extern const kernel_table kernel_avx512vnni;
+
+/*
+ * kernel_active is the table picked when the library is loaded.
+ */
+extern const kernel_table *kernel_active;
+
+static inline const kernel_table *kernel_get() {
+  return kernel_active;
+}
+
+const char *cai_kernel_isa();
+
+#endif
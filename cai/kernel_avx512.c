@@ -0,0 +1,22 @@
+/*
+ * The kernels built for AVX-512, sixteen floats to a vector.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx512f,avx512bw,avx2,fma"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512bw,avx2,fma")
+#endif
+
+#define KERNEL_TABLE kernel_avx512
+#define KERNEL_NAME "avx512"
+#define KERNEL_VECTOR 16
+#include "kernel_template.h"
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+#endif
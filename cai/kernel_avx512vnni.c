@@ -0,0 +1,24 @@
+/*
+ * The kernels built for AVX-512 with VNNI, sixteen floats to a vector and the
+ * int8 products of quantize_gemm summed by vpdpbusd.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx512f,avx512bw,avx512vnni,avx2,fma"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512bw,avx512vnni,avx2,fma")
+#endif
+
+#define KERNEL_TABLE kernel_avx512vnni
+#define KERNEL_NAME "avx512vnni"
+#define KERNEL_VECTOR 16
+#define KERNEL_VNNI
+#include "kernel_template.h"
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+#endif
@@ -0,0 +1,8 @@
+/*
+ * The kernels built with the compiler's default target, four floats to a
+ * vector, SSE2 on x86-64.
+ */
+#define KERNEL_TABLE kernel_baseline
+#define KERNEL_NAME "baseline"
+#define KERNEL_VECTOR 4
+#include "kernel_template.h"
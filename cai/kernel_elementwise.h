@@ -0,0 +1,85 @@
+#ifndef __KERNEL_ELEMENTWISE_H_
+#define __KERNEL_ELEMENTWISE_H_
+
+/*
+ * Elementwise kernels over contiguous float arrays, built once per instruction
+ * set by kernel_template.h with the vfloat helpers of kernel_activation.h. The
+ * loops are written in vectors, the compiler won't vectorize them itself at -O2
+ * when the output may alias an input, which it may.
+ */
+
+static void kernel_add(float *c, const float *a, const float *b, long n) {
+  long i = 0;
+  for (; i + KERNEL_VECTOR <= n; i += KERNEL_VECTOR) {
+    v_store(c + i, v_load(a + i) + v_load(b + i));
+  }
+  for (; i < n; i++) {
+    c[i] = a[i] + b[i];
+  }
+}
+
+static void kernel_scale(float *c, const float *a, float alpha, long n) {
+  long i = 0;
+  for (; i + KERNEL_VECTOR <= n; i += KERNEL_VECTOR) {
+    v_store(c + i, v_load(a + i) * alpha);
+  }
+  for (; i < n; i++) {
+    c[i] = a[i] * alpha;
+  }
+}
+
+static void kernel_axpy(float *y, const float *x, float alpha, long n) {
+  long i = 0;
+  for (; i + KERNEL_VECTOR <= n; i += KERNEL_VECTOR) {
+    v_store(y + i, v_load(y + i) + alpha * v_load(x + i));
+  }
+  for (; i < n; i++) {
+    y[i] += alpha * x[i];
+  }
+}
+
+static void kernel_fill(float *c, float value, long n) {
+  vfloat v = v_set(value);
+  long i = 0;
+  for (; i + KERNEL_VECTOR <= n; i += KERNEL_VECTOR) {
+    v_store(c + i, v);
+  }
+  for (; i < n; i++) {
+    c[i] = value;
+  }
+}
+
+/*
+ * kernel_mse returns the sum of the squared differences of output and target,
+ * and writes norm times each difference into gradient unless it is NULL.
+ */
+static float kernel_mse(const float *output, const float *target, float *gradient, float norm, long n) {
+  vfloat s0 = {0}, s1 = {0};
+  float sum = 0;
+  long i = 0;
+  int q;
+  for (; i + 2 * KERNEL_VECTOR <= n; i += 2 * KERNEL_VECTOR) {
+    vfloat e0 = v_load(output + i) - v_load(target + i);
+    vfloat e1 = v_load(output + i + KERNEL_VECTOR) - v_load(target + i + KERNEL_VECTOR);
+    s0 += e0 * e0;
+    s1 += e1 * e1;
+    if (gradient != NULL) {
+      v_store(gradient + i, norm * e0);
+      v_store(gradient + i + KERNEL_VECTOR, norm * e1);
+    }
+  }
+  s0 += s1;
+  for (q = 0; q < KERNEL_VECTOR; q++) {
+    sum += s0[q];
+  }
+  for (; i < n; i++) {
+    float error = output[i] - target[i];
+    sum += error * error;
+    if (gradient != NULL) {
+      gradient[i] = norm * error;
+    }
+  }
+  return sum;
+}
+
+#endif
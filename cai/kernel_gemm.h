@@ -0,0 +1,700 @@
+#ifndef __KERNEL_GEMM_H_
+#define __KERNEL_GEMM_H_
+
+/*
+ * The packed GEMM, built once per instruction set by kernel_template.h with
+ * KERNEL_VECTOR floats to a vector.
+ */
+
+/*
+ * GEMM register tile (MR x NR) and default cache blocking (MC x KC panels of a,
+ * KC x NC panels of b). The tile is sized to the vector width of the variant,
+ * so MR * NR / GEMM_VECTOR accumulators stay in registers. The blocking can be
+ * tuned per shape, see autotune.h.
+ */
+#define GEMM_VECTOR KERNEL_VECTOR
+#if KERNEL_VECTOR == 16
+#define GEMM_MR 8
+#define GEMM_NR 32
+#elif KERNEL_VECTOR == 8
+#define GEMM_MR 6
+#define GEMM_NR 16
+#else
+#define GEMM_MR 4
+#define GEMM_NR 8
+#endif
+#define GEMM_MC (GEMM_MR * 24)
+#define GEMM_KC 256
+#define GEMM_NC 4096
+#define GEMM_SMALL (32 * 32 * 32)
+#define GEMM_PARALLEL (64 * 64 * 64)
+#define GEMM_TILE_N (GEMM_NR * 4)
+#define GEMM_TILES 4
+
+typedef float gemm_vector __attribute__((vector_size(GEMM_VECTOR * sizeof(float))));
+
+static __thread float *gemm_pack_a = NULL;
+static __thread float *gemm_pack_b = NULL;
+static __thread long gemm_pack_a_capacity = 0;
+static __thread long gemm_pack_b_capacity = 0;
+
+/*
+ * gemm_operand describes op(m) as a base pointer and a pair of strides, half
+ * instead of data for bfloat16 elements. Those are widened as they are packed,
+ * so the kernels always accumulate in float.
+ */
+typedef struct gemm_operand {
+  float *data;
+  bfloat16 *half;
+  long row_stride;
+  long column_stride;
+} gemm_operand;
+
+static gemm_operand gemm_operand_create(matrix *m, int transpose) {
+  gemm_operand o;
+  o.data = m->data;
+  o.half = m->half;
+  o.row_stride = transpose ? m->column_stride : m->row_stride;
+  o.column_stride = transpose ? m->row_stride : m->column_stride;
+  return o;
+}
+
+/*
+ * gemm_offset returns o moved to element (i, j).
+ */
+static gemm_operand gemm_offset(gemm_operand o, long i, long j) {
+  long offset = i * o.row_stride + j * o.column_stride;
+  if (o.half != NULL) {
+    o.half += offset;
+  } else {
+    o.data += offset;
+  }
+  return o;
+}
+
+/*
+ * gemm_pack_rows packs an mc x kc block of a into MR-row micro-panels, scaled by
+ * alpha and zero padded to a whole number of panels.
+ */
+static void gemm_pack_rows(gemm_operand a, int mc, int kc, float alpha, float *pack) {
+  int ir, i, p;
+  for (ir = 0; ir < mc; ir += GEMM_MR) {
+    int mr = mc - ir < GEMM_MR ? mc - ir : GEMM_MR;
+    for (p = 0; p < kc; p++) {
+      if (a.half != NULL) {
+        const bfloat16 *column = a.half + (ir * a.row_stride) + (p * a.column_stride);
+        for (i = 0; i < mr; i++) {
+          pack[i] = alpha * bfloat16_float(column[i * a.row_stride]);
+        }
+      } else {
+        const float *column = a.data + (ir * a.row_stride) + (p * a.column_stride);
+        for (i = 0; i < mr; i++) {
+          pack[i] = alpha * column[i * a.row_stride];
+        }
+      }
+      for (; i < GEMM_MR; i++) {
+        pack[i] = 0;
+      }
+      pack += GEMM_MR;
+    }
+  }
+}
+
+/*
+ * gemm_pack_columns packs a kc x nc block of b into NR-column micro-panels, zero
+ * padded to a whole number of panels.
+ */
+static void gemm_pack_columns(gemm_operand b, int kc, int nc, float *pack) {
+  int jr, j, p;
+  for (jr = 0; jr < nc; jr += GEMM_NR) {
+    int nr = nc - jr < GEMM_NR ? nc - jr : GEMM_NR;
+    for (p = 0; p < kc; p++) {
+      long offset = (p * b.row_stride) + (jr * b.column_stride);
+      if (b.half != NULL && b.column_stride == 1) {
+        bfloat16_decode(pack, b.half + offset, nr);
+      } else if (b.half != NULL) {
+        for (j = 0; j < nr; j++) {
+          pack[j] = bfloat16_float(b.half[offset + j * b.column_stride]);
+        }
+      } else if (b.column_stride == 1) {
+        for (j = 0; j < nr; j++) {
+          pack[j] = b.data[offset + j];
+        }
+      } else {
+        for (j = 0; j < nr; j++) {
+          pack[j] = b.data[offset + j * b.column_stride];
+        }
+      }
+      for (j = nr; j < GEMM_NR; j++) {
+        pack[j] = 0;
+      }
+      pack += GEMM_NR;
+    }
+  }
+}
+
+/*
+ * gemm_kernel multiplies an MR x kc micro-panel by a kc x NR micro-panel into
+ * the contiguous MR x NR tile ab, holding every accumulator in a register.
+ */
+static void gemm_kernel(int kc, const float *restrict a, const float *restrict b, float *restrict ab) {
+  int p, i, j;
+  gemm_vector c[GEMM_MR][GEMM_NR / GEMM_VECTOR];
+  for (i = 0; i < GEMM_MR; i++) {
+    for (j = 0; j < GEMM_NR / GEMM_VECTOR; j++) {
+      c[i][j] = (gemm_vector){0};
+    }
+  }
+  for (p = 0; p < kc; p++) {
+    const gemm_vector *bv = (const gemm_vector *)(b + p * GEMM_NR);
+    #pragma GCC unroll 8
+    for (i = 0; i < GEMM_MR; i++) {
+      gemm_vector av = (gemm_vector){0} + a[p * GEMM_MR + i];
+      #pragma GCC unroll 4
+      for (j = 0; j < GEMM_NR / GEMM_VECTOR; j++) {
+        c[i][j] += av * bv[j];
+      }
+    }
+  }
+  for (i = 0; i < GEMM_MR; i++) {
+    for (j = 0; j < GEMM_NR / GEMM_VECTOR; j++) {
+      ((gemm_vector *)ab)[i * (GEMM_NR / GEMM_VECTOR) + j] = c[i][j];
+    }
+  }
+}
+
+/*
+ * gemm_epilogue is applied to c once its product is complete, c = f(c + bias)
+ * with the bias broadcast across the columns of c.
+ */
+typedef struct gemm_epilogue {
+  const float *bias;
+  long bias_stride;
+  int activation;
+} gemm_epilogue;
+
+static int gemm_epilogue_empty(gemm_epilogue e) {
+  return e.bias == NULL && e.activation == ACTIVATION_NONE;
+}
+
+/*
+ * gemm_store writes the valid mr x nr corner of a tile into c, c = tile + beta * c.
+ * With an epilogue the bias and activation are applied to the tile first, while
+ * it is still in L1. A bfloat16 c is widened into the tile and rounded once on
+ * the way out.
+ */
+static void gemm_store(float *ab, int mr, int nr, float beta, gemm_operand c, const gemm_epilogue *e) {
+  long row_stride = c.row_stride, column_stride = c.column_stride;
+  int i, j;
+  if (c.half != NULL && beta != 0) {
+    for (i = 0; i < mr; i++) {
+      const bfloat16 *row = c.half + i * row_stride;
+      float *tile = ab + i * GEMM_NR;
+      for (j = 0; j < nr; j++) {
+        tile[j] += beta * bfloat16_float(row[j * column_stride]);
+      }
+    }
+    beta = 0;
+  }
+  if (e != NULL) {
+    for (i = 0; i < mr; i++) {
+      float *tile = ab + i * GEMM_NR;
+      float bias = e->bias == NULL ? 0 : e->bias[i * e->bias_stride];
+      if (beta == 0) {
+        for (j = 0; j < nr; j++) {
+          tile[j] += bias;
+        }
+      } else {
+        const float *row = c.data + i * row_stride;
+        for (j = 0; j < nr; j++) {
+          tile[j] += bias + beta * row[j * column_stride];
+        }
+      }
+    }
+    kernel_activation_forward(e->activation, ab, ab, mr * GEMM_NR);
+    beta = 0;
+  }
+  if (c.half != NULL) {
+    for (i = 0; i < mr; i++) {
+      bfloat16 *row = c.half + i * row_stride;
+      const float *tile = ab + i * GEMM_NR;
+      if (column_stride == 1) {
+        bfloat16_encode(row, tile, nr);
+      } else {
+        for (j = 0; j < nr; j++) {
+          row[j * column_stride] = bfloat16_round(tile[j]);
+        }
+      }
+    }
+    return;
+  }
+  for (i = 0; i < mr; i++) {
+    float *row = c.data + i * row_stride;
+    const float *tile = ab + i * GEMM_NR;
+    if (beta == 0) {
+      for (j = 0; j < nr; j++) {
+        row[j * column_stride] = tile[j];
+      }
+    } else {
+      for (j = 0; j < nr; j++) {
+        row[j * column_stride] = tile[j] + beta * row[j * column_stride];
+      }
+    }
+  }
+}
+
+static pthread_key_t gemm_key;
+static pthread_key_t gemm_stage_key;
+static pthread_once_t gemm_once = PTHREAD_ONCE_INIT;
+static __thread float *gemm_stage = NULL;
+static __thread long gemm_stage_capacity = 0;
+
+static void gemm_buffers_free(void *storage) {
+  allocator_release(storage);
+}
+
+static void gemm_key_create(void) {
+  pthread_key_create(&gemm_key, &gemm_buffers_free);
+  pthread_key_create(&gemm_stage_key, &gemm_buffers_free);
+}
+
+/*
+ * gemm_buffers grows the pack buffers of the calling thread to at least a and b
+ * floats, never below the default blocking. a is rounded to whole vectors so
+ * the b panels the kernel loads stay aligned. They are released when the
+ * thread exits.
+ */
+static void gemm_buffers(long a, long b) {
+  if (a > gemm_pack_a_capacity || b > gemm_pack_b_capacity) {
+    a = a > gemm_pack_a_capacity ? a : gemm_pack_a_capacity;
+    a = a > GEMM_MC * GEMM_KC ? a : GEMM_MC * GEMM_KC;
+    a = (a + GEMM_VECTOR - 1) / GEMM_VECTOR * GEMM_VECTOR;
+    b = b > gemm_pack_b_capacity ? b : gemm_pack_b_capacity;
+    b = b > (long)GEMM_KC * GEMM_NC ? b : (long)GEMM_KC * GEMM_NC;
+    float *storage = (float *)allocator_allocate(allocator_system(), (size_t)(a + b) * sizeof(float));
+    if (storage == NULL) {
+      perror("Out of memory\n");
+      abort();
+    }
+    pthread_once(&gemm_once, &gemm_key_create);
+    allocator_release(gemm_pack_a);
+    pthread_setspecific(gemm_key, storage);
+    gemm_pack_a = storage;
+    gemm_pack_b = storage + a;
+    gemm_pack_a_capacity = a;
+    gemm_pack_b_capacity = b;
+  }
+}
+
+/*
+ * gemm_warm allocates the pack buffers of the calling thread at the default
+ * blocking, what its first GEMM would.
+ */
+static void gemm_warm(void) {
+  gemm_buffers(1, 1);
+}
+
+/*
+ * gemm_staging returns the staging buffer of the calling thread grown to count
+ * floats, where gemm_small_half widens bfloat16 operands and gemm_blocked
+ * accumulates a bfloat16 c.
+ */
+static float *gemm_staging(long count) {
+  if (count > gemm_stage_capacity) {
+    float *storage = (float *)allocator_allocate(allocator_system(), (size_t)count * sizeof(float));
+    if (storage == NULL) {
+      perror("Out of memory\n");
+      abort();
+    }
+    pthread_once(&gemm_once, &gemm_key_create);
+    allocator_release(gemm_stage);
+    pthread_setspecific(gemm_stage_key, storage);
+    gemm_stage = storage;
+    gemm_stage_capacity = count;
+  }
+  return gemm_stage;
+}
+
+static inline gemm_vector gemm_load(const float *p) {
+  gemm_vector v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/*
+ * gemm_dot returns the dot product of two strided vectors of length k, with
+ * vector accumulators when both are unit stride.
+ */
+static float gemm_dot(const float *a, long a_stride, const float *b, long b_stride, int k) {
+  float partial[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  float sum = 0;
+  int p = 0, q;
+  if (a_stride == 1 && b_stride == 1) {
+    gemm_vector s0 = {0}, s1 = {0};
+    for (; p + 2 * GEMM_VECTOR <= k; p += 2 * GEMM_VECTOR) {
+      s0 += gemm_load(a + p) * gemm_load(b + p);
+      s1 += gemm_load(a + p + GEMM_VECTOR) * gemm_load(b + p + GEMM_VECTOR);
+    }
+    s0 += s1;
+    for (q = 0; q < GEMM_VECTOR; q++) {
+      sum += s0[q];
+    }
+  }
+  for (; p + 8 <= k; p += 8) {
+    for (q = 0; q < 8; q++) {
+      partial[q] += a[(p + q) * a_stride] * b[(p + q) * b_stride];
+    }
+  }
+  for (; p < k; p++) {
+    sum += a[p * a_stride] * b[p * b_stride];
+  }
+  return sum + ((partial[0] + partial[1]) + (partial[2] + partial[3])) +
+    ((partial[4] + partial[5]) + (partial[6] + partial[7]));
+}
+
+/*
+ * gemm_small handles products too small or too skinny to amortize packing, like
+ * the matrix-vector products of single sample training. When rows of b and c
+ * are unit stride a row of c is accumulated a vector of columns at a time,
+ * otherwise each element is a dot product, with the columns of b copied to unit
+ * stride first when they are narrower than a vector.
+ */
+static void gemm_small(gemm_operand a, gemm_operand b, int m, int n, int k, float alpha, float beta, gemm_operand c, gemm_epilogue e) {
+  int i, j, p;
+  int columns = b.column_stride == 1 && c.column_stride == 1 ? n - n % GEMM_VECTOR : 0;
+  int dense = c.column_stride == 1 && c.row_stride == n;
+  gemm_operand bt = b;
+  if (a.column_stride == 1 && b.row_stride != 1 && columns < n &&
+      (long)k * n <= (long)GEMM_KC * GEMM_NC) {
+    gemm_buffers(0, (long)k * n);
+    for (j = columns; j < n; j++) {
+      for (p = 0; p < k; p++) {
+        gemm_pack_b[(long)j * k + p] = b.data[p * b.row_stride + j * b.column_stride];
+      }
+    }
+    bt.data = gemm_pack_b;
+    bt.row_stride = 1;
+    bt.column_stride = k;
+  }
+  for (i = 0; i < m; i++) {
+    const float *ai = a.data + i * a.row_stride;
+    float *ci = c.data + i * c.row_stride;
+    float bias = e.bias == NULL ? 0 : e.bias[i * e.bias_stride];
+    for (j = 0; j < columns; j += GEMM_VECTOR) {
+      gemm_vector s0 = {0}, s1 = {0}, s2 = {0}, s3 = {0}, cv;
+      const float *bj = b.data + j;
+      for (p = 0; p + 4 <= k; p += 4) {
+        s0 += ai[p * a.column_stride] * gemm_load(bj + p * b.row_stride);
+        s1 += ai[(p + 1) * a.column_stride] * gemm_load(bj + (p + 1) * b.row_stride);
+        s2 += ai[(p + 2) * a.column_stride] * gemm_load(bj + (p + 2) * b.row_stride);
+        s3 += ai[(p + 3) * a.column_stride] * gemm_load(bj + (p + 3) * b.row_stride);
+      }
+      for (; p < k; p++) {
+        s0 += ai[p * a.column_stride] * gemm_load(bj + p * b.row_stride);
+      }
+      cv = alpha * ((s0 + s1) + (s2 + s3)) + bias;
+      if (beta != 0) {
+        cv += beta * gemm_load(ci + j);
+      }
+      memcpy(ci + j, &cv, sizeof(cv));
+    }
+    for (; j < n; j++) {
+      float sum = gemm_dot(ai, a.column_stride, bt.data + j * bt.column_stride, bt.row_stride, k);
+      float *cij = ci + j * c.column_stride;
+      *cij = alpha * sum + (beta == 0 ? 0 : beta * *cij) + bias;
+    }
+    if (e.activation != ACTIVATION_NONE && !dense) {
+      if (c.column_stride == 1) {
+        kernel_activation_forward(e.activation, ci, ci, n);
+      } else {
+        for (j = 0; j < n; j++) {
+          kernel_activation_forward(e.activation, ci + j * c.column_stride, ci + j * c.column_stride, 1);
+        }
+      }
+    }
+  }
+  if (e.activation != ACTIVATION_NONE && dense) {
+    kernel_activation_forward(e.activation, c.data, c.data, (long)m * n);
+  }
+}
+
+/*
+ * gemm_widen copies a rows x columns block of o into the dense row-major out.
+ */
+static void gemm_widen(gemm_operand o, int rows, int columns, float *out) {
+  int i, j;
+  for (i = 0; i < rows; i++) {
+    float *row = out + (long)i * columns;
+    if (o.half != NULL && o.column_stride == 1) {
+      bfloat16_decode(row, o.half + i * o.row_stride, columns);
+    } else if (o.half != NULL) {
+      for (j = 0; j < columns; j++) {
+        row[j] = bfloat16_float(o.half[i * o.row_stride + j * o.column_stride]);
+      }
+    } else {
+      for (j = 0; j < columns; j++) {
+        row[j] = o.data[i * o.row_stride + j * o.column_stride];
+      }
+    }
+  }
+}
+
+/*
+ * gemm_narrow rounds the dense row-major rows x columns block in into the
+ * bfloat16 o.
+ */
+static void gemm_narrow(gemm_operand o, int rows, int columns, const float *in) {
+  int i, j;
+  for (i = 0; i < rows; i++) {
+    const float *row = in + (long)i * columns;
+    if (o.column_stride == 1) {
+      bfloat16_encode(o.half + i * o.row_stride, row, columns);
+    } else {
+      for (j = 0; j < columns; j++) {
+        o.half[i * o.row_stride + j * o.column_stride] = bfloat16_round(row[j]);
+      }
+    }
+  }
+}
+
+/*
+ * gemm_small_half runs gemm_small with its bfloat16 operands widened to float,
+ * b once and a and c a panel of rows at a time, so the copies stay in cache.
+ */
+static void gemm_small_half(gemm_operand a, gemm_operand b, int m, int n, int k, float alpha, float beta, gemm_operand c, gemm_epilogue e) {
+  long rows = (long)GEMM_MC * GEMM_KC / (k + n + 1);
+  long staged = b.half != NULL ? (long)k * n : 0;
+  float *stage;
+  int i;
+  rows = rows < 1 ? 1 : rows > m ? m : rows;
+  stage = gemm_staging(staged + rows * (k + n));
+  if (b.half != NULL) {
+    gemm_widen(b, k, n, stage);
+    b.data = stage;
+    b.half = NULL;
+    b.row_stride = n;
+    b.column_stride = 1;
+  }
+  for (i = 0; i < m; i += rows) {
+    int mr = m - i < rows ? m - i : rows;
+    gemm_operand ap = gemm_offset(a, i, 0), cp = gemm_offset(c, i, 0), cf = cp;
+    gemm_epilogue ep = e;
+    if (ep.bias != NULL) {
+      ep.bias += i * e.bias_stride;
+    }
+    if (a.half != NULL) {
+      gemm_widen(ap, mr, k, stage + staged);
+      ap.data = stage + staged;
+      ap.half = NULL;
+      ap.row_stride = k;
+      ap.column_stride = 1;
+    }
+    if (c.half != NULL) {
+      cf.data = stage + staged + rows * k;
+      cf.half = NULL;
+      cf.row_stride = n;
+      cf.column_stride = 1;
+      if (beta != 0) {
+        gemm_widen(cp, mr, n, cf.data);
+      }
+    }
+    gemm_small(ap, b, mr, n, k, alpha, beta, cf, ep);
+    if (c.half != NULL) {
+      gemm_narrow(cp, mr, n, cf.data);
+    }
+  }
+}
+
+/*
+ * gemm_direct runs gemm_small, through gemm_small_half for bfloat16 operands.
+ */
+static void gemm_direct(gemm_operand a, gemm_operand b, int m, int n, int k, float alpha, float beta, gemm_operand c, gemm_epilogue e) {
+  if (a.half != NULL || b.half != NULL || c.half != NULL) {
+    gemm_small_half(a, b, m, n, k, alpha, beta, c, e);
+  } else {
+    gemm_small(a, b, m, n, k, alpha, beta, c, e);
+  }
+}
+
+/*
+ * gemm_blocked runs the packed product of an m x k block of a and a k x n block
+ * of b into c, cache blocked by blocking. When k spans several KC panels a
+ * bfloat16 c is accumulated in a float staging block of m x NC and rounded once
+ * after the last panel, the same as a single panel rounds in gemm_store. NC is
+ * narrowed so the staging block stays within one default b panel.
+ */
+static void gemm_blocked(gemm_operand a, gemm_operand b, int m, int n, int k, float alpha, float beta, gemm_operand c, gemm_epilogue e, matrix_blocking blocking) {
+  int ic, jc, pc, ir, jr;
+  int staged = c.half != NULL && k > blocking.kc;
+  float ab[GEMM_MR * GEMM_NR] __attribute__((aligned(MATRIX_ALIGNMENT)));
+  float *stage = NULL;
+
+  if (staged) {
+    int nc = (int)((long)GEMM_KC * GEMM_NC / m) / GEMM_NR * GEMM_NR;
+    nc = nc < GEMM_NR ? GEMM_NR : nc;
+    blocking.nc = blocking.nc < nc ? blocking.nc : nc;
+    stage = gemm_staging((long)m * blocking.nc);
+  }
+  gemm_buffers((long)blocking.mc * blocking.kc, (long)blocking.kc * blocking.nc);
+  for (jc = 0; jc < n; jc += blocking.nc) {
+    int nc = n - jc < blocking.nc ? n - jc : blocking.nc;
+    gemm_operand cj = gemm_offset(c, 0, jc);
+    if (staged) {
+      if (beta != 0) {
+        gemm_widen(cj, m, nc, stage);
+      }
+      cj.data = stage;
+      cj.half = NULL;
+      cj.row_stride = nc;
+      cj.column_stride = 1;
+    }
+    for (pc = 0; pc < k; pc += blocking.kc) {
+      int kc = k - pc < blocking.kc ? k - pc : blocking.kc;
+      float beta_block = pc == 0 ? beta : 1;
+      int last = pc + kc == k && !gemm_epilogue_empty(e);
+      gemm_pack_columns(gemm_offset(b, pc, jc), kc, nc, gemm_pack_b);
+
+      for (ic = 0; ic < m; ic += blocking.mc) {
+        int mc = m - ic < blocking.mc ? m - ic : blocking.mc;
+        gemm_pack_rows(gemm_offset(a, ic, pc), mc, kc, alpha, gemm_pack_a);
+
+        for (jr = 0; jr < nc; jr += GEMM_NR) {
+          int nr = nc - jr < GEMM_NR ? nc - jr : GEMM_NR;
+          for (ir = 0; ir < mc; ir += GEMM_MR) {
+            int mr = mc - ir < GEMM_MR ? mc - ir : GEMM_MR;
+            gemm_epilogue tile = e;
+            if (tile.bias != NULL) {
+              tile.bias += (ic + ir) * e.bias_stride;
+            }
+            gemm_kernel(kc, gemm_pack_a + ir * kc, gemm_pack_b + jr * kc, ab);
+            gemm_store(ab, mr, nr, beta_block, gemm_offset(cj, ic + ir, jr), last ? &tile : NULL);
+          }
+        }
+      }
+    }
+    if (staged) {
+      gemm_narrow(gemm_offset(c, 0, jc), m, nc, stage);
+    }
+  }
+}
+
+/*
+ * gemm_packed reports whether an m x n x k product runs on the packed, cache
+ * blocked path, the only one the blocking matters to.
+ */
+static int gemm_packed(int m, int n, int k) {
+  return (long)m * n * k > GEMM_SMALL && m >= GEMM_MR && n >= GEMM_NR * 2;
+}
+
+/*
+ * gemm_blocking returns the tuned blocking of an m x n x k product, rounded to
+ * whole register tiles and kc to whole vectors.
+ */
+static matrix_blocking gemm_blocking(int m, int n, int k) {
+  matrix_blocking blocking = autotune_lookup(m, n, k);
+  blocking.mc = blocking.mc < GEMM_MR ? GEMM_MR : (blocking.mc + GEMM_MR - 1) / GEMM_MR * GEMM_MR;
+  blocking.kc = blocking.kc < 1 ? GEMM_KC : (blocking.kc + GEMM_VECTOR - 1) / GEMM_VECTOR * GEMM_VECTOR;
+  blocking.nc = blocking.nc < GEMM_NR ? GEMM_NR : (blocking.nc + GEMM_NR - 1) / GEMM_NR * GEMM_NR;
+  return blocking;
+}
+
+/*
+ * gemm_block picks the direct or the packed path for an m x n block of c.
+ */
+static void gemm_block(gemm_operand a, gemm_operand b, int m, int n, int k, float alpha, float beta, gemm_operand c, gemm_epilogue e, matrix_blocking blocking) {
+  if (!gemm_packed(m, n, k)) {
+    gemm_direct(a, b, m, n, k, alpha, beta, c, e);
+  } else {
+    gemm_blocked(a, b, m, n, k, alpha, beta, c, e, blocking);
+  }
+}
+
+typedef struct gemm_task {
+  gemm_operand a;
+  gemm_operand b;
+  gemm_operand c;
+  gemm_epilogue e;
+  matrix_blocking blocking;
+  int m;
+  int n;
+  int k;
+  int tile_n;
+  int tiles_n;
+  float alpha;
+  float beta;
+} gemm_task;
+
+/*
+ * gemm_tiles computes tiles [begin, end) of c, each tile packs its own panels
+ * so tiles are independent and can run on any thread.
+ */
+static void gemm_tiles(void *context, long begin, long end) {
+  gemm_task *t = (gemm_task *)context;
+  long tile;
+  for (tile = begin; tile < end; tile++) {
+    int i = (int)(tile / t->tiles_n) * t->blocking.mc;
+    int j = (int)(tile % t->tiles_n) * t->tile_n;
+    int m = t->m - i < t->blocking.mc ? t->m - i : t->blocking.mc;
+    int n = t->n - j < t->tile_n ? t->n - j : t->tile_n;
+    gemm_operand a = gemm_offset(t->a, i, 0), b = gemm_offset(t->b, 0, j), c = gemm_offset(t->c, i, j);
+    gemm_epilogue e = t->e;
+    if (e.bias != NULL) {
+      e.bias += i * e.bias_stride;
+    }
+    gemm_block(a, b, m, n, t->k, t->alpha, t->beta, c, e, t->blocking);
+  }
+}
+
+/*
+ * gemm runs matrix_gemm_fused once its shapes are checked, splitting large
+ * products into tiles of c across the thread pool.
+ */
+static void gemm(
+  int transpose_a,
+  int transpose_b,
+  float alpha,
+  matrix *a,
+  matrix *b,
+  float beta,
+  matrix *c,
+  matrix *bias,
+  int activation
+) {
+  int m = c->rows, n = c->columns;
+  int k = transpose_a ? a->rows : a->columns;
+  gemm_operand ao = gemm_operand_create(a, transpose_a);
+  gemm_operand bo = gemm_operand_create(b, transpose_b);
+  gemm_operand co = gemm_operand_create(c, 0);
+  gemm_epilogue e = {NULL, 0, activation};
+  matrix_blocking blocking = {GEMM_MC, GEMM_KC, GEMM_NC};
+
+  if (bias != NULL) {
+    e.bias = bias->data;
+    e.bias_stride = bias->row_stride;
+  }
+  if (m == 0 || n == 0) {
+    return;
+  }
+  if (k == 0 || alpha == 0) {
+    gemm_direct(ao, bo, m, n, 0, alpha, beta, co, e);
+    return;
+  }
+  int threads = cai_threads_get();
+  if (gemm_packed(m, n, k)) {
+    blocking = gemm_blocking(m, n, k);
+  }
+  if ((long)m * n * k < GEMM_PARALLEL || threads == 1) {
+    gemm_block(ao, bo, m, n, k, alpha, beta, co, e, blocking);
+    return;
+  }
+
+  int tiles_m = (m + blocking.mc - 1) / blocking.mc;
+  int tiles_n = (GEMM_TILES * threads + tiles_m - 1) / tiles_m;
+  int tile_n = (n + tiles_n - 1) / tiles_n;
+  tile_n = ((tile_n + GEMM_NR - 1) / GEMM_NR) * GEMM_NR;
+  tile_n = tile_n < GEMM_TILE_N ? GEMM_TILE_N : tile_n;
+  gemm_task task = {ao, bo, co, e, blocking, m, n, k, tile_n, (n + tile_n - 1) / tile_n, alpha, beta};
+  thread_parallel_for((long)tiles_m * task.tiles_n, 1, &gemm_tiles, &task);
+}
+
+#endif
@@ -0,0 +1,236 @@
+#ifndef __KERNEL_OPTIMIZER_H_
+#define __KERNEL_OPTIMIZER_H_
+
+/*
+ * The fused optimizer update, built once per instruction set by
+ * kernel_template.h with the vfloat helpers of kernel_activation.h. Each
+ * parameter tensor is updated in one pass, OPTIMIZER_BLOCK elements at a
+ * time: the gradient is scaled for clipping, weight decay and the step are
+ * applied and the moments written back. A bfloat16 compute copy of the weights
+ * is refreshed from each block while it is still in L1.
+ */
+#define OPTIMIZER_BLOCK 1024
+
+static inline vfloat optimizer_sqrt(vfloat x) {
+#if KERNEL_VECTOR == 16
+  return _mm512_sqrt_ps(x);
+#elif KERNEL_VECTOR == 8
+  return _mm256_sqrt_ps(x);
+#elif defined(__SSE2__)
+  return _mm_sqrt_ps(x);
+#else
+  int i;
+  for (i = 0; i < KERNEL_VECTOR; i++) {
+    x[i] = sqrtf(x[i]);
+  }
+  return x;
+#endif
+}
+
+/*
+ * optimizer_kernel updates one vector of weights w from its gradients g and
+ * moments m and v. kind is a constant wherever it is inlined.
+ */
+static inline __attribute__((always_inline)) void optimizer_kernel(
+  const kernel_update *t,
+  int kind,
+  float *w,
+  const float *g,
+  float *m,
+  float *v
+) {
+  vfloat wv = v_load(w), gv = t->scale * v_load(g), mv, vv;
+  if (kind != OPTIMIZER_ADAMW) {
+    gv += t->decay * wv;
+  }
+  switch (kind) {
+  case OPTIMIZER_SGD:
+    wv -= t->rate * gv;
+    break;
+  case OPTIMIZER_MOMENTUM:
+    mv = t->momentum * v_load(m) + gv;
+    v_store(m, mv);
+    wv -= t->rate * mv;
+    break;
+  case OPTIMIZER_NESTEROV:
+    mv = t->momentum * v_load(m) + gv;
+    v_store(m, mv);
+    wv -= t->rate * (gv + t->momentum * mv);
+    break;
+  default:
+    mv = t->beta1 * v_load(m) + (1 - t->beta1) * gv;
+    vv = t->beta2 * v_load(v) + (1 - t->beta2) * gv * gv;
+    v_store(m, mv);
+    v_store(v, vv);
+    if (kind == OPTIMIZER_ADAMW) {
+      wv -= (t->rate * t->decay) * wv;
+    }
+    wv -= (t->rate * t->correction1) * mv / (optimizer_sqrt(t->correction2 * vv) + t->epsilon);
+    break;
+  }
+  v_store(w, wv);
+}
+
+/*
+ * optimizer_run updates elements [begin, end), the tail through a padded vector.
+ */
+static inline __attribute__((always_inline)) void optimizer_run(const kernel_update *t, int kind, long begin, long end) {
+  long i;
+  for (i = begin; i + KERNEL_VECTOR <= end; i += KERNEL_VECTOR) {
+    optimizer_kernel(t, kind, t->weights + i, t->gradients + i,
+      t->first == NULL ? NULL : t->first + i, t->second == NULL ? NULL : t->second + i);
+  }
+  if (i < end) {
+    float w[KERNEL_VECTOR] = {0}, g[KERNEL_VECTOR] = {0};
+    float m[KERNEL_VECTOR] = {0}, v[KERNEL_VECTOR] = {0};
+    size_t size = (end - i) * sizeof(float);
+    memcpy(w, t->weights + i, size);
+    memcpy(g, t->gradients + i, size);
+    if (t->first != NULL) {
+      memcpy(m, t->first + i, size);
+    }
+    if (t->second != NULL) {
+      memcpy(v, t->second + i, size);
+    }
+    optimizer_kernel(t, kind, w, g, m, v);
+    memcpy(t->weights + i, w, size);
+    if (t->first != NULL) {
+      memcpy(t->first + i, m, size);
+    }
+    if (t->second != NULL) {
+      memcpy(t->second + i, v, size);
+    }
+  }
+}
+
+/*
+ * kernel_optimizer_update applies the update t describes to elements
+ * [begin, end) of its parameters.
+ */
+static void kernel_optimizer_update(const kernel_update *t, long begin, long end) {
+  long block;
+  for (block = begin; block < end; block += OPTIMIZER_BLOCK) {
+    long last = end - block < OPTIMIZER_BLOCK ? end : block + OPTIMIZER_BLOCK;
+    switch (t->kind) {
+    case OPTIMIZER_SGD:
+      optimizer_run(t, OPTIMIZER_SGD, block, last);
+      break;
+    case OPTIMIZER_MOMENTUM:
+      optimizer_run(t, OPTIMIZER_MOMENTUM, block, last);
+      break;
+    case OPTIMIZER_NESTEROV:
+      optimizer_run(t, OPTIMIZER_NESTEROV, block, last);
+      break;
+    case OPTIMIZER_ADAM:
+      optimizer_run(t, OPTIMIZER_ADAM, block, last);
+      break;
+    default:
+      optimizer_run(t, OPTIMIZER_ADAMW, block, last);
+      break;
+    }
+    if (t->compute != NULL) {
+      bfloat16_encode(t->compute + block, t->weights + block, last - block);
+    }
+  }
+}
+
+/*
+ * optimizer_columns updates the columns listed in columns of rows [begin, end),
+ * stride floats apart, gathering KERNEL_VECTOR of them at a time.
+ */
+static inline __attribute__((always_inline)) void optimizer_columns(
+  const kernel_update *t,
+  int kind,
+  const int *columns,
+  int count,
+  long stride,
+  long begin,
+  long end
+) {
+  long row;
+  int k, q;
+  for (row = begin; row < end; row++) {
+    for (k = 0; k < count; k += KERNEL_VECTOR) {
+      float w[KERNEL_VECTOR] = {0}, g[KERNEL_VECTOR] = {0};
+      float m[KERNEL_VECTOR] = {0}, v[KERNEL_VECTOR] = {0};
+      int lanes = count - k < KERNEL_VECTOR ? count - k : KERNEL_VECTOR;
+      for (q = 0; q < lanes; q++) {
+        long i = row * stride + columns[k + q];
+        w[q] = t->weights[i];
+        g[q] = t->gradients[i];
+        m[q] = t->first != NULL ? t->first[i] : 0;
+        v[q] = t->second != NULL ? t->second[i] : 0;
+      }
+      optimizer_kernel(t, kind, w, g, m, v);
+      for (q = 0; q < lanes; q++) {
+        long i = row * stride + columns[k + q];
+        t->weights[i] = w[q];
+        if (t->first != NULL) {
+          t->first[i] = m[q];
+        }
+        if (t->second != NULL) {
+          t->second[i] = v[q];
+        }
+        if (t->compute != NULL) {
+          t->compute[i] = bfloat16_round(w[q]);
+        }
+      }
+    }
+  }
+}
+
+/*
+ * kernel_optimizer_update_columns applies the update t describes to only the
+ * columns listed in columns of rows [begin, end) of its parameters, a row
+ * being stride floats. The other columns, their moments included, are left
+ * as they are.
+ */
+static void kernel_optimizer_update_columns(
+  const kernel_update *t,
+  const int *columns,
+  int count,
+  long stride,
+  long begin,
+  long end
+) {
+  switch (t->kind) {
+  case OPTIMIZER_SGD:
+    optimizer_columns(t, OPTIMIZER_SGD, columns, count, stride, begin, end);
+    break;
+  case OPTIMIZER_MOMENTUM:
+    optimizer_columns(t, OPTIMIZER_MOMENTUM, columns, count, stride, begin, end);
+    break;
+  case OPTIMIZER_NESTEROV:
+    optimizer_columns(t, OPTIMIZER_NESTEROV, columns, count, stride, begin, end);
+    break;
+  case OPTIMIZER_ADAM:
+    optimizer_columns(t, OPTIMIZER_ADAM, columns, count, stride, begin, end);
+    break;
+  default:
+    optimizer_columns(t, OPTIMIZER_ADAMW, columns, count, stride, begin, end);
+    break;
+  }
+}
+
+/*
+ * kernel_optimizer_squares returns the sum of the squares of x.
+ */
+static float kernel_optimizer_squares(const float *x, long n) {
+  vfloat sum = {0};
+  float tail = 0;
+  long k;
+  int q;
+  for (k = 0; k + KERNEL_VECTOR <= n; k += KERNEL_VECTOR) {
+    vfloat v = v_load(x + k);
+    sum += v * v;
+  }
+  for (; k < n; k++) {
+    tail += x[k] * x[k];
+  }
+  for (q = 0; q < KERNEL_VECTOR; q++) {
+    tail += sum[q];
+  }
+  return tail;
+}
+
+#endif
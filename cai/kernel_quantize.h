@@ -0,0 +1,127 @@
+#ifndef __KERNEL_QUANTIZE_H_
+#define __KERNEL_QUANTIZE_H_
+
+/*
+ * The int8 dot product kernel of quantize_gemm, built once per instruction set
+ * by kernel_template.h. It accumulates uint8 x int8 products into int32 lanes.
+ * With VNNI one instruction multiplies and sums four byte pairs per lane.
+ * Without it the bytes are widened to int16 and summed in pairs by madd, which
+ * can't saturate like maddubs can with a zero point of 128. AVX-512 and AVX2
+ * do so 64 and 32 bytes at a time, SSE2 16, anything else is scalar.
+ */
+#if defined(KERNEL_VNNI)
+#define QUANTIZE_STEP 64
+typedef __m512i quantize_accumulator;
+static inline quantize_accumulator quantize_zero(void) {
+  return _mm512_setzero_si512();
+}
+static inline quantize_accumulator quantize_madd(quantize_accumulator a, const uint8_t *x, const int8_t *w) {
+  return _mm512_dpbusd_epi32(a, _mm512_loadu_si512(x), _mm512_loadu_si512(w));
+}
+static inline int32_t quantize_sum(quantize_accumulator a) {
+  return _mm512_reduce_add_epi32(a);
+}
+#elif KERNEL_VECTOR == 16
+#define QUANTIZE_STEP 64
+typedef __m512i quantize_accumulator;
+static inline quantize_accumulator quantize_zero(void) {
+  return _mm512_setzero_si512();
+}
+static inline quantize_accumulator quantize_madd(quantize_accumulator a, const uint8_t *x, const int8_t *w) {
+  __m512i x0 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)x));
+  __m512i x1 = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)(x + 32)));
+  __m512i w0 = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i *)w));
+  __m512i w1 = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i *)(w + 32)));
+  a = _mm512_add_epi32(a, _mm512_madd_epi16(x0, w0));
+  return _mm512_add_epi32(a, _mm512_madd_epi16(x1, w1));
+}
+static inline int32_t quantize_sum(quantize_accumulator a) {
+  return _mm512_reduce_add_epi32(a);
+}
+#elif KERNEL_VECTOR == 8
+#define QUANTIZE_STEP 32
+typedef __m256i quantize_accumulator;
+static inline quantize_accumulator quantize_zero(void) {
+  return _mm256_setzero_si256();
+}
+static inline quantize_accumulator quantize_madd(quantize_accumulator a, const uint8_t *x, const int8_t *w) {
+  __m256i x0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)x));
+  __m256i x1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(x + 16)));
+  __m256i w0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)w));
+  __m256i w1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(w + 16)));
+  a = _mm256_add_epi32(a, _mm256_madd_epi16(x0, w0));
+  return _mm256_add_epi32(a, _mm256_madd_epi16(x1, w1));
+}
+static inline int32_t quantize_sum(quantize_accumulator a) {
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+  return _mm_cvtsi128_si32(s);
+}
+#elif defined(__SSE2__)
+#define QUANTIZE_STEP 16
+typedef __m128i quantize_accumulator;
+static inline quantize_accumulator quantize_zero(void) {
+  return _mm_setzero_si128();
+}
+static inline quantize_accumulator quantize_madd(quantize_accumulator a, const uint8_t *x, const int8_t *w) {
+  __m128i xv = _mm_loadu_si128((const __m128i *)x);
+  __m128i wv = _mm_loadu_si128((const __m128i *)w);
+  __m128i zero = _mm_setzero_si128();
+  __m128i x0 = _mm_unpacklo_epi8(xv, zero), x1 = _mm_unpackhi_epi8(xv, zero);
+  __m128i w0 = _mm_srai_epi16(_mm_unpacklo_epi8(wv, wv), 8), w1 = _mm_srai_epi16(_mm_unpackhi_epi8(wv, wv), 8);
+  a = _mm_add_epi32(a, _mm_madd_epi16(x0, w0));
+  return _mm_add_epi32(a, _mm_madd_epi16(x1, w1));
+}
+static inline int32_t quantize_sum(quantize_accumulator a) {
+  a = _mm_add_epi32(a, _mm_shuffle_epi32(a, 0x4e));
+  a = _mm_add_epi32(a, _mm_shuffle_epi32(a, 0xb1));
+  return _mm_cvtsi128_si32(a);
+}
+#else
+#define QUANTIZE_STEP 4
+typedef int32_t quantize_accumulator;
+static inline quantize_accumulator quantize_zero(void) {
+  return 0;
+}
+static inline quantize_accumulator quantize_madd(quantize_accumulator a, const uint8_t *x, const int8_t *w) {
+  return a + x[0] * w[0] + x[1] * w[1] + x[2] * w[2] + x[3] * w[3];
+}
+static inline int32_t quantize_sum(quantize_accumulator a) {
+  return a;
+}
+#endif
+
+/*
+ * kernel_dots writes the int32 dot products of the weight row w with count
+ * packed columns of x, stride bytes apart, four columns at a time so each
+ * weight load is reused. stride is a multiple of QUANTIZE_BLOCK.
+ */
+static void kernel_dots(const int8_t *w, const uint8_t *x, int stride, int count, int32_t *dots) {
+  int j, k;
+  for (j = 0; j + 4 <= count; j += 4) {
+    const uint8_t *x0 = x + (long)j * stride;
+    quantize_accumulator a0 = quantize_zero(), a1 = quantize_zero();
+    quantize_accumulator a2 = quantize_zero(), a3 = quantize_zero();
+    for (k = 0; k < stride; k += QUANTIZE_STEP) {
+      a0 = quantize_madd(a0, x0 + k, w + k);
+      a1 = quantize_madd(a1, x0 + stride + k, w + k);
+      a2 = quantize_madd(a2, x0 + 2 * stride + k, w + k);
+      a3 = quantize_madd(a3, x0 + 3 * stride + k, w + k);
+    }
+    dots[j] = quantize_sum(a0);
+    dots[j + 1] = quantize_sum(a1);
+    dots[j + 2] = quantize_sum(a2);
+    dots[j + 3] = quantize_sum(a3);
+  }
+  for (; j < count; j++) {
+    const uint8_t *x0 = x + (long)j * stride;
+    quantize_accumulator a0 = quantize_zero();
+    for (k = 0; k < stride; k += QUANTIZE_STEP) {
+      a0 = quantize_madd(a0, x0 + k, w + k);
+    }
+    dots[j] = quantize_sum(a0);
+  }
+}
+
+#endif
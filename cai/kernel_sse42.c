@@ -0,0 +1,22 @@
+/*
+ * The kernels built for SSE4.2, four floats to a vector.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("sse4.2"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("sse4.2")
+#endif
+
+#define KERNEL_TABLE kernel_sse42
+#define KERNEL_NAME "sse4.2"
+#define KERNEL_VECTOR 4
+#include "kernel_template.h"
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+#endif
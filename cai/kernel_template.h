@@ -0,0 +1,54 @@
+#ifndef __KERNEL_TEMPLATE_H_
+#define __KERNEL_TEMPLATE_H_
+#include "kernel.h"
+#include "activation.h"
+#include "allocator.h"
+#include "autotune.h"
+#include "bfloat16.h"
+#include "matrix.h"
+#include "optimizer.h"
+#include "thread.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+/*
+ * kernel_template.h is the body of every kernel_<isa>.c. It builds the hot
+ * kernels with KERNEL_VECTOR floats to a vector, under the target options the
+ * including file turned on, into the table KERNEL_TABLE named KERNEL_NAME.
+ * Everything but the table is static, so the variants never clash.
+ */
+#include "kernel_activation.h"
+#include "kernel_elementwise.h"
+#include "kernel_gemm.h"
+#include "kernel_optimizer.h"
+#include "kernel_quantize.h"
+
+const kernel_table KERNEL_TABLE = {
+  .name = KERNEL_NAME,
+  .vector = KERNEL_VECTOR,
+  .blocking = {GEMM_MC, GEMM_KC, GEMM_NC},
+  .gemm = &gemm,
+  .gemm_packed = &gemm_packed,
+  .gemm_warm = &gemm_warm,
+  .add = &kernel_add,
+  .scale = &kernel_scale,
+  .axpy = &kernel_axpy,
+  .fill = &kernel_fill,
+  .activation_exp = &kernel_activation_exp,
+  .activation_log = &kernel_activation_log,
+  .activation_forward = &kernel_activation_forward,
+  .activation_backward = &kernel_activation_backward,
+  .mse = &kernel_mse,
+  .dots = &kernel_dots,
+  .update = &kernel_optimizer_update,
+  .update_columns = &kernel_optimizer_update_columns,
+  .squares = &kernel_optimizer_squares,
+};
+
+#endif
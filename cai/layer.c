@@ -1,22 +1,26 @@
 #include "layer.h"
+#include "activation.h"
 #include "matrix.h"
-#include <math.h>
+#include "allocator.h"
+#include "thread.h"
 #include <stdio.h>
 #include <stdlib.h>
 
+#define LAYER_CHUNK 256
+
 /*
  * layer_create
  */
 layer *layer_create(
-  matrix *(*forward)(layer *, matrix *),
-  matrix *(*backward)(layer *, matrix *, matrix *),
+  matrix *(*forward)(layer *, matrix *, matrix *),
+  matrix *(*backward)(layer *, matrix *, matrix *, matrix *),
   matrix *(*update)(layer *, matrix *, matrix *, float),
   float (*parameter_function)(int, int),
   int input,
   int output
 ) {
   layer *l;
-  if ((l = malloc(sizeof(*l))) == NULL) {
+  if ((l = allocator_allocate(cai_allocator_get(), sizeof(*l))) == NULL) {
     perror("Out of memory\n");
     return NULL;
   }
@@ -25,7 +29,7 @@ layer *layer_create(
   l->backward = backward == NULL ?
     &layer_backward_none : backward;
   l->output = matrix_create(output, 1, NULL);
-  l->gradient = matrix_create(output, 1, NULL);
+  l->gradient = matrix_create(input, 1, NULL);
   l->weights = update == NULL ?
     NULL : matrix_create(output, input, parameter_function == NULL ?
       &matrix_zeros : parameter_function);
@@ -36,138 +40,725 @@ layer *layer_create(
     NULL : matrix_create(output, input, &matrix_zeros);
   l->gradient_biases = update == NULL ?
     NULL : matrix_create(output, 1, &matrix_zeros);
+  l->compute_weights = NULL;
   l->update = update;
+  l->delta = NULL;
+  l->quantized = NULL;
+  l->touched = NULL;
+  l->convolution = NULL;
+  l->activation = ACTIVATION_NONE;
+  l->input_size = input;
+  l->output_size = output;
+  return l;
+}
+
+/*
+ * layer_fusable reports whether activation can be differentiated from its
+ * output, so it can be fused into a product.
+ */
+static int layer_fusable(int activation) {
+  return activation == ACTIVATION_NONE || activation == ACTIVATION_SIGMOID ||
+    activation == ACTIVATION_TANH || activation == ACTIVATION_RELU ||
+    activation == ACTIVATION_LEAKY_RELU;
+}
+
+/*
+ * layer_create_dense creates a linear layer with the bias and activation fused
+ * into its product. The activation derivative is taken from the output, so only
+ * activations that can be differentiated from their output are accepted.
+ */
+layer *layer_create_dense(
+  int activation,
+  float (*parameter_function)(int, int),
+  int input,
+  int output
+) {
+  layer *l;
+  if (!layer_fusable(activation)) {
+    fprintf(stderr, "layer_create_dense: activation %d can't be fused\n", activation);
+    return NULL;
+  }
+  if ((l = layer_create(&layer_forward_dense, &layer_backward_dense, &layer_update_dense,
+      parameter_function, input, output)) == NULL) {
+    return NULL;
+  }
+  l->activation = activation;
+  l->delta = matrix_create(output, 1, NULL);
+  return l;
+}
+
+/*
+ * layer_create_conv2d creates a 2D convolution over geometry, see convolution,
+ * with geometry->filters kernels of kernel x kernel x channels weights shared
+ * across the image, one bias per filter and a fused activation as for
+ * layer_create_dense. The layer takes ownership of geometry.
+ */
+layer *layer_create_conv2d(
+  int activation,
+  float (*parameter_function)(int, int),
+  convolution *geometry
+) {
+  layer *l;
+  int size;
+  if (geometry == NULL) {
+    return NULL;
+  }
+  if (!layer_fusable(activation)) {
+    fprintf(stderr, "layer_create_conv2d: activation %d can't be fused\n", activation);
+    convolution_free(geometry);
+    return NULL;
+  }
+  if ((l = layer_create(&layer_forward_conv2d, &layer_backward_conv2d, NULL, NULL,
+      convolution_input_size(geometry), convolution_output_size(geometry))) == NULL) {
+    convolution_free(geometry);
+    return NULL;
+  }
+  size = geometry->kernel * geometry->kernel * geometry->channels;
+  l->update = &layer_update_conv2d;
+  l->weights = matrix_create(geometry->filters, size, parameter_function == NULL ?
+    &matrix_zeros : parameter_function);
+  l->biases = matrix_create(geometry->filters, 1, parameter_function == NULL ?
+    &matrix_zeros : parameter_function);
+  l->gradient_weights = matrix_create(geometry->filters, size, &matrix_zeros);
+  l->gradient_biases = matrix_create(geometry->filters, 1, &matrix_zeros);
+  l->delta = matrix_create(l->output_size, 1, NULL);
+  l->activation = activation;
+  l->convolution = geometry;
+  return l;
+}
+
+/*
+ * layer_create_pool creates a CONVOLUTION_MAX or CONVOLUTION_AVERAGE pooling
+ * layer over geometry, whose filters must be its channels. The layer takes
+ * ownership of geometry.
+ */
+layer *layer_create_pool(int kind, convolution *geometry) {
+  layer *l;
+  if (geometry == NULL) {
+    return NULL;
+  }
+  if ((kind != CONVOLUTION_MAX && kind != CONVOLUTION_AVERAGE) || geometry->filters != geometry->channels) {
+    fprintf(stderr, "layer_create_pool: pooling keeps the %d channels\n", geometry->channels);
+    convolution_free(geometry);
+    return NULL;
+  }
+  if ((l = layer_create(kind == CONVOLUTION_MAX ? &layer_forward_max_pool : &layer_forward_avg_pool,
+      kind == CONVOLUTION_MAX ? &layer_backward_max_pool : &layer_backward_avg_pool, NULL, NULL,
+      convolution_input_size(geometry), convolution_output_size(geometry))) == NULL) {
+    convolution_free(geometry);
+    return NULL;
+  }
+  l->convolution = geometry;
+  return l;
+}
+
+typedef struct layer_callbacks {
+  matrix *(*forward)(layer *, matrix *, matrix *);
+  matrix *(*backward)(layer *, matrix *, matrix *, matrix *);
+  matrix *(*update)(layer *, matrix *, matrix *, float);
+} layer_callbacks;
+
+/*
+ * layer_types maps the built in layer types to their callbacks, so a layer can
+ * be described by its type when it is saved and created from it when loaded.
+ */
+static const layer_callbacks layer_types[LAYER_TYPES] = {
+  [LAYER_NONE] = {&layer_forward_none, &layer_backward_none, NULL},
+  [LAYER_LINEAR] = {&layer_forward_linear, &layer_backward_linear, &layer_update_linear},
+  [LAYER_SIGMOID] = {&layer_forward_sigmoid, &layer_backward_sigmoid, NULL},
+  [LAYER_TANH] = {&layer_forward_tanh, &layer_backward_tanh, NULL},
+  [LAYER_RELU] = {&layer_forward_relu, &layer_backward_relu, NULL},
+  [LAYER_LEAKY_RELU] = {&layer_forward_leaky_relu, &layer_backward_leaky_relu, NULL},
+  [LAYER_GELU] = {&layer_forward_gelu, &layer_backward_gelu, NULL},
+  [LAYER_SOFTPLUS] = {&layer_forward_softplus, &layer_backward_softplus, NULL},
+  [LAYER_DENSE] = {&layer_forward_dense, &layer_backward_dense, &layer_update_dense},
+  [LAYER_CONV2D] = {&layer_forward_conv2d, &layer_backward_conv2d, &layer_update_conv2d},
+  [LAYER_MAX_POOL] = {&layer_forward_max_pool, &layer_backward_max_pool, NULL},
+  [LAYER_AVG_POOL] = {&layer_forward_avg_pool, &layer_backward_avg_pool, NULL},
+};
+
+/*
+ * layer_create_type creates a built in layer with zero parameters. Convolution
+ * and pooling layers need their geometry, see layer_create_conv2d.
+ */
+layer *layer_create_type(int type, int activation, int input, int output) {
+  if (type < 0 || type >= LAYER_TYPES) {
+    fprintf(stderr, "layer_create_type: unknown layer type %d\n", type);
+    return NULL;
+  }
+  if (type == LAYER_CONV2D || type == LAYER_MAX_POOL || type == LAYER_AVG_POOL) {
+    fprintf(stderr, "layer_create_type: layer type %d needs a geometry\n", type);
+    return NULL;
+  }
+  if (type == LAYER_DENSE) {
+    return layer_create_dense(activation, NULL, input, output);
+  }
+  return layer_create(layer_types[type].forward, layer_types[type].backward,
+    layer_types[type].update, NULL, input, output);
+}
+
+/*
+ * layer_type returns the built in type of l, or -1 for custom callbacks.
+ */
+int layer_type(layer *l) {
+  int type;
+  for (type = 0; type < LAYER_TYPES; type++) {
+    if (l->forward == layer_types[type].forward) {
+      return type;
+    }
+  }
+  return -1;
+}
+
+/*
+ * layer_replicate returns a layer sharing the weights and biases of l through
+ * views, with its own output and gradient buffers, so replicas of one layer can
+ * run forward and backward on different threads at once.
+ */
+layer *layer_replicate(layer *l) {
+  layer *r;
+  if (l->quantized != NULL) {
+    fprintf(stderr, "layer_replicate: a quantized layer is only for inference\n");
+    return NULL;
+  }
+  if ((r = allocator_allocate(cai_allocator_get(), sizeof(*r))) == NULL) {
+    perror("Out of memory\n");
+    return NULL;
+  }
+  *r = *l;
+  r->output = matrix_create_type(l->output_size, 1, l->output->type);
+  r->gradient = matrix_create_type(l->input_size, 1, l->gradient->type);
+  r->weights = l->weights == NULL ? NULL : matrix_view(l->weights);
+  r->compute_weights = l->compute_weights == NULL ? NULL : matrix_view(l->compute_weights);
+  r->biases = l->biases == NULL ? NULL : matrix_view(l->biases);
+  r->gradient_weights = l->gradient_weights == NULL ?
+    NULL : matrix_create(l->gradient_weights->rows, l->gradient_weights->columns, &matrix_zeros);
+  r->gradient_biases = l->gradient_biases == NULL ?
+    NULL : matrix_create(l->gradient_biases->rows, l->gradient_biases->columns, &matrix_zeros);
+  r->delta = l->delta == NULL ? NULL : matrix_create_type(l->delta->rows, 1, l->delta->type);
+  r->touched = NULL;
+  r->convolution = l->convolution == NULL ? NULL : convolution_copy(l->convolution);
+  return r;
+}
+
+/*
+ * layer_inference frees every buffer l only needs for training: its output,
+ * gradients and compute weights. The float weights and biases stay. The
+ * forward callback then needs an output buffer from the caller, see
+ * network_context.
+ */
+layer *layer_inference(layer *l) {
+  matrix **buffers[6] = {&l->output, &l->gradient, &l->gradient_weights, &l->gradient_biases, &l->delta, &l->compute_weights};
+  int i;
+  for (i = 0; i < 6; i++) {
+    if (*buffers[i] != NULL) {
+      matrix_free(*buffers[i]);
+      *buffers[i] = NULL;
+    }
+  }
+  if (l->touched != NULL) {
+    sparse_set_free(l->touched);
+    l->touched = NULL;
+  }
+  l->update = NULL;
   return l;
 }
 
 /*
- * layer_forward
+ * layer_precision_set stores the activations, deltas and input gradients of l
+ * as type, and for bfloat16 keeps a bfloat16 compute copy of the weights the
+ * products read. The float weights stay the master copy that updates apply
+ * to, the compute copy is refreshed from them with matrix_copy_into.
+ */
+layer *layer_precision_set(layer *l, int type) {
+  matrix **buffers[3] = {&l->output, &l->gradient, &l->delta};
+  int i;
+  for (i = 0; i < 3; i++) {
+    matrix *m = *buffers[i], *c;
+    if (m == NULL || m->type == type) {
+      continue;
+    }
+    if (m->storage == NULL) {
+      fprintf(stderr, "layer_precision_set: set the precision before compiling\n");
+      return NULL;
+    }
+    if ((c = matrix_create_type(m->rows, m->columns, type)) == NULL ||
+        matrix_allocator_set(c, allocator_owner(m->storage)) == NULL) {
+      return NULL;
+    }
+    matrix_free(m);
+    *buffers[i] = c;
+  }
+  if (l->compute_weights != NULL && l->compute_weights->type != type) {
+    matrix_free(l->compute_weights);
+    l->compute_weights = NULL;
+  }
+  if (type != MATRIX_FLOAT32 && l->weights != NULL && l->compute_weights == NULL) {
+    if ((l->compute_weights = matrix_create_type(l->weights->rows, l->weights->columns, type)) == NULL) {
+      return NULL;
+    }
+    matrix_copy_into(l->weights, l->compute_weights);
+  }
+  return l;
+}
+
+/*
+ * layer_weights returns the weights products read, the compute copy if any.
+ */
+static matrix *layer_weights(layer *l) {
+  return l->compute_weights != NULL ? l->compute_weights : l->weights;
+}
+
+/*
+ * layer_quantize replaces the float weights of the linear or dense inference
+ * layer l by int8 weights, for inputs in about [-127, 127] * input_scale. The
+ * biases stay float and the activation is applied as the products are scaled
+ * back, see quantize_gemm.
+ */
+layer *layer_quantize(layer *l, float input_scale) {
+  quantized *q;
+  int type = layer_type(l);
+  if (type != LAYER_LINEAR && type != LAYER_DENSE) {
+    fprintf(stderr, "layer_quantize: only linear and dense layers can be quantized\n");
+    return NULL;
+  }
+  if (l->update != NULL) {
+    fprintf(stderr, "layer_quantize: layer isn't in inference mode\n");
+    return NULL;
+  }
+  if ((q = quantize_create(l->weights, input_scale)) == NULL) {
+    return NULL;
+  }
+  return layer_quantized_set(l, q);
+}
+
+/*
+ * layer_quantized_set makes q, quantized from the weights of l, the weights of
+ * l from then on, see layer_quantize. It can't fail.
+ */
+layer *layer_quantized_set(layer *l, quantized *q) {
+  l->quantized = q;
+  matrix_free(l->weights);
+  l->weights = NULL;
+  l->forward = &layer_forward_quantized;
+  return l;
+}
+
+/*
+ * layer_forward writes the layer output into l->output and returns it, the
+ * buffer belongs to the layer and is reused by the next call.
  */
 matrix *layer_forward(layer *l, matrix *input) {
-  *l->output = *l->forward(l, input);
-  return matrix_copy(l->output);
+  if (matrix_resize(l->output, l->output_size, input->columns) == NULL) {
+    return NULL;
+  }
+  return l->forward(l, input, l->output);
 }
 
 /*
- * layer_backward
+ * layer_backward writes the gradient w.r.t the layer input into l->gradient and
+ * returns it, l->output must still hold the output for this input.
  */
 matrix *layer_backward(layer *l, matrix *input, matrix *gradient) {
-  *l->gradient = *l->backward(l, input, gradient);
-  return matrix_copy(l->gradient);
+  if (matrix_resize(l->gradient, input->rows, input->columns) == NULL) {
+    return NULL;
+  }
+  return l->backward(l, input, gradient, l->gradient);
 }
 
 /*
- * layer_update
+ * layer_update accumulates the parameter gradients into l->gradient_weights and
+ * l->gradient_biases, it runs after layer_backward for the same input and gradient.
  */
 matrix *layer_update(layer *l, matrix *input, matrix *gradient, float scale) {
-  *l->gradient_weights = *l->update(l, input, gradient, scale);
-  return matrix_copy(l->gradient_weights);
+  return l->update(l, input, gradient, scale);
 }
 
+typedef struct layer_activation {
+  int kind;
+  matrix *result;
+  matrix *input;
+  matrix *output;
+  matrix *gradient;
+} layer_activation;
+
 /*
- * layer_forward_sigmoid
+ * layer_activation_float reports whether every matrix of a has float elements,
+ * otherwise rows are widened LAYER_CHUNK elements at a time.
+ */
+static int layer_activation_float(layer_activation *a) {
+  return a->result->type == MATRIX_FLOAT32 && a->input->type == MATRIX_FLOAT32 &&
+    a->output->type == MATRIX_FLOAT32 && (a->gradient == NULL || a->gradient->type == MATRIX_FLOAT32);
+}
+
+/*
+ * layer_activation_widened runs the activation kernel over rows [begin, end)
+ * through float copies of LAYER_CHUNK elements that stay in L1.
  */
-matrix *layer_forward_sigmoid(layer *l, matrix *input) {
-  int i, j;
-  matrix *output = matrix_create(input->rows, input->columns, NULL);
-  for (i = 0; i < input->rows; i++) {
-    for (j = 0; j < input->columns; j++) {
-      output->data[i][j] = 1 / (1 + exp(-input->data[i][j]));
+static void layer_activation_widened(layer_activation *a, long begin, long end) {
+  float x[LAYER_CHUNK], y[LAYER_CHUNK], g[LAYER_CHUNK], r[LAYER_CHUNK];
+  long i;
+  int j;
+  for (i = begin; i < end; i++) {
+    for (j = 0; j < a->result->columns; j += LAYER_CHUNK) {
+      int count = a->result->columns - j < LAYER_CHUNK ? a->result->columns - j : LAYER_CHUNK;
+      matrix_load_row(a->input, i, j, count, x);
+      if (a->gradient == NULL) {
+        activation_forward(a->kind, r, x, count);
+      } else {
+        matrix_load_row(a->output, i, j, count, y);
+        matrix_load_row(a->gradient, i, j, count, g);
+        activation_backward(a->kind, r, g, x, y, count);
+      }
+      matrix_store_row(a->result, i, j, count, r);
     }
   }
-  return output;
 }
 
 /*
- * layer_backward_sigmoid
+ * layer_activation_range runs the activation kernel over rows [begin, end), or
+ * over elements [begin, end) when every matrix is contiguous. Backward passes
+ * are the ones with a gradient.
  */
-matrix *layer_backward_sigmoid(layer *l, matrix *output, matrix *gradient) {
-  int i, j;
-  matrix *gradient_update = matrix_create(output->rows, output->columns, NULL);
-  for (i = 0; i < output->rows; i++) {
-    for (j = 0; j < output->columns; j++) {
-      gradient_update->data[i][j] = gradient->data[i][j] * output->data[i][j] * (1 - output->data[i][j]);
+static void layer_activation_range(void *context, long begin, long end) {
+  layer_activation *a = (layer_activation *)context;
+  matrix *x = a->input, *y = a->output, *g = a->gradient, *r = a->result;
+  long i, j;
+  if (!layer_activation_float(a)) {
+    layer_activation_widened(a, begin, end);
+    return;
+  }
+  if (matrix_contiguous(r) && matrix_contiguous(x) && matrix_contiguous(y) &&
+      (g == NULL || matrix_contiguous(g))) {
+    if (g == NULL) {
+      activation_forward(a->kind, r->data + begin, x->data + begin, end - begin);
+    } else {
+      activation_backward(a->kind, r->data + begin, g->data + begin,
+        x->data + begin, y->data + begin, end - begin);
+    }
+    return;
+  }
+  for (i = begin; i < end; i++) {
+    int rows = r->column_stride == 1 && x->column_stride == 1 &&
+      y->column_stride == 1 && (g == NULL || g->column_stride == 1);
+    long n = rows ? r->columns : 1;
+    for (j = 0; j < r->columns; j += n) {
+      if (g == NULL) {
+        activation_forward(a->kind, &matrix_at(r, i, j), &matrix_at(x, i, j), n);
+      } else {
+        activation_backward(a->kind, &matrix_at(r, i, j), &matrix_at(g, i, j),
+          &matrix_at(x, i, j), &matrix_at(y, i, j), n);
+      }
     }
-  };
-  return gradient_update;
+  }
 }
 
 /*
- * layer_forward_linear
+ * layer_activation_run applies kind to input into result, or its derivative to
+ * gradient when gradient is not NULL, across the thread pool.
  */
-matrix *layer_forward_linear(layer *l, matrix *input) {
-  matrix *res = matrix_multiply(l->weights, input);
-  matrix *output = matrix_add(res, l->biases);
-  matrix_free(res);
-  return output;
+static matrix *layer_activation_run(
+  int kind,
+  matrix *input,
+  matrix *output,
+  matrix *gradient,
+  matrix *result
+) {
+  layer_activation a = {kind, result, input, output, gradient};
+  long count = (long)result->rows * result->columns;
+  if (layer_activation_float(&a) && matrix_contiguous(result) && matrix_contiguous(input) &&
+      matrix_contiguous(output) && (gradient == NULL || matrix_contiguous(gradient))) {
+    thread_parallel_for(count, THREAD_GRAIN, &layer_activation_range, &a);
+  } else {
+    long grain = result->columns >= THREAD_GRAIN ? 1 : THREAD_GRAIN / (result->columns + 1) + 1;
+    thread_parallel_for(result->rows, grain, &layer_activation_range, &a);
+  }
+  return result;
+}
+
+/*
+ * layer_forward_sigmoid
+ */
+matrix *layer_forward_sigmoid(layer *l, matrix *input, matrix *output) {
+  return layer_activation_run(ACTIVATION_SIGMOID, input, output, NULL, output);
+}
+
+/*
+ * layer_backward_sigmoid
+ */
+matrix *layer_backward_sigmoid(layer *l, matrix *input, matrix *gradient, matrix *result) {
+  return layer_activation_run(ACTIVATION_SIGMOID, input, l->output, gradient, result);
+}
+
+/*
+ * layer_forward_linear computes weights * input + biases for a features x batch
+ * input, broadcasting the biases across the batch columns.
+ */
+matrix *layer_forward_linear(layer *l, matrix *input, matrix *output) {
+  return matrix_gemm_fused(0, 0, 1, layer_weights(l), input, 0, output, l->biases, ACTIVATION_NONE);
 }
 
 /*
  * layer_backward_linear
  */
-matrix *layer_backward_linear(layer *l, matrix *output, matrix *gradient) {
-  matrix *wt = matrix_transpose(l->weights);
-  matrix *g = matrix_multiply(wt, gradient);
-  matrix_free(wt);
-  return g;
+matrix *layer_backward_linear(layer *l, matrix *input, matrix *gradient, matrix *result) {
+  return matrix_gemm(1, 0, 1, layer_weights(l), gradient, 0, result);
 }
 
 /*
- * layer_update_linear
+ * layer_update_biases accumulates the sum of the gradient columns into
+ * l->gradient_biases.
  */
-matrix *layer_update_linear(layer *l, matrix *input, matrix *gradient, float scale) {
-  int i, j;
-  matrix *gradient_weights = matrix_copy(l->gradient_weights);
-  matrix *gradient_biases = matrix_copy(l->gradient_biases);
-  for (i = 0; i < l->gradient_weights->rows; i++) {
-    for (j = 0; j < l->gradient_weights->columns; j++) {
-      gradient_weights->data[i][j] += (scale * gradient->data[i][0] * input->data[j][0]);
+static void layer_update_biases(layer *l, matrix *gradient, float scale) {
+  float row[LAYER_CHUNK];
+  int i, j, k;
+  for (i = 0; i < gradient->rows; i++) {
+    float sum = 0;
+    for (j = 0; j < gradient->columns; j += LAYER_CHUNK) {
+      int count = gradient->columns - j < LAYER_CHUNK ? gradient->columns - j : LAYER_CHUNK;
+      matrix_load_row(gradient, i, j, count, row);
+      for (k = 0; k < count; k++) {
+        sum += row[k];
+      }
     }
+    matrix_at(l->gradient_biases, i, 0) += scale * sum;
   }
-  *l->gradient_biases = *matrix_add(l->gradient_biases, matrix_scale(gradient, scale));
-  return gradient_weights;
 }
 
 /*
- * layer_forward_tanh
+ * layer_update_linear accumulates the gradients of a whole batch, the weight
+ * gradient as one gradient * input^T product and the bias gradient as the sum
+ * of the gradient columns.
  */
-matrix *layer_forward_tanh(layer *l, matrix *input) {
-  int i, j;
-  matrix *layer_output = matrix_create(input->rows, input->columns, NULL);
-  for (i = 0; i < layer_output->rows; i++) {
-    for (j = 0; j < layer_output->columns; j++) {
-      layer_output->data[i][j] = (float)tanh((double)input->data[i][j]);
-    }
+matrix *layer_update_linear(layer *l, matrix *input, matrix *gradient, float scale) {
+  matrix_gemm(0, 1, scale, gradient, input, 1, l->gradient_weights);
+  if (l->touched != NULL) {
+    l->touched->all = 1;
   }
-  return layer_output;
+  layer_update_biases(l, gradient, scale);
+  return l->gradient_weights;
 }
 
 /*
- * layer_backward_tanh
+ * layer_forward_dense computes activation(weights * input + biases) in one pass,
+ * the bias and activation are applied to each GEMM tile before it is stored.
+ */
+matrix *layer_forward_dense(layer *l, matrix *input, matrix *output) {
+  return matrix_gemm_fused(0, 0, 1, layer_weights(l), input, 0, output, l->biases, l->activation);
+}
+
+/*
+ * layer_backward_dense folds the activation derivative into the gradient once,
+ * into l->delta, and multiplies it back through the weights. layer_update_dense
+ * reuses the same l->delta.
+ */
+matrix *layer_backward_dense(layer *l, matrix *input, matrix *gradient, matrix *result) {
+  if (matrix_resize(l->delta, gradient->rows, gradient->columns) == NULL) {
+    return NULL;
+  }
+  layer_activation_run(l->activation, l->output, l->output, gradient, l->delta);
+  return matrix_gemm(1, 0, 1, layer_weights(l), l->delta, 0, result);
+}
+
+/*
+ * layer_update_dense
+ */
+matrix *layer_update_dense(layer *l, matrix *input, matrix *gradient, float scale) {
+  return layer_update_linear(l, input, l->delta, scale);
+}
+
+/*
+ * layer_forward_conv2d lowers the input onto one fused GEMM per tile of output
+ * positions, see convolution_forward.
  */
-matrix *layer_backward_tanh(layer *l, matrix *output, matrix *gradient) {
-  int i, j;
-  matrix *gradient_update = matrix_create(output->rows, output->columns, NULL);
-  for (i = 0; i < gradient_update->rows; i++) {
-    for (j = 0; j < gradient_update->columns; j++) {
-      gradient_update->data[i][j] = gradient->data[i][j] * (1 - output->data[i][j] * output->data[i][j]);
+matrix *layer_forward_conv2d(layer *l, matrix *input, matrix *output) {
+  return convolution_forward(l->convolution, layer_weights(l), input, output, l->biases, l->activation);
+}
+
+/*
+ * layer_backward_conv2d folds the activation derivative into l->delta as
+ * layer_backward_dense does, and folds it back through the shared weights.
+ */
+matrix *layer_backward_conv2d(layer *l, matrix *input, matrix *gradient, matrix *result) {
+  if (matrix_resize(l->delta, gradient->rows, gradient->columns) == NULL) {
+    return NULL;
+  }
+  layer_activation_run(l->activation, l->output, l->output, gradient, l->delta);
+  return convolution_backward(l->convolution, layer_weights(l), l->delta, result);
+}
+
+/*
+ * layer_update_conv2d
+ */
+matrix *layer_update_conv2d(layer *l, matrix *input, matrix *gradient, float scale) {
+  return convolution_update(l->convolution, l->gradient_weights, l->gradient_biases, input, l->delta, scale);
+}
+
+/*
+ * layer_forward_max_pool
+ */
+matrix *layer_forward_max_pool(layer *l, matrix *input, matrix *output) {
+  return convolution_pool(l->convolution, CONVOLUTION_MAX, input, output);
+}
+
+/*
+ * layer_backward_max_pool
+ */
+matrix *layer_backward_max_pool(layer *l, matrix *input, matrix *gradient, matrix *result) {
+  return convolution_pool_backward(l->convolution, CONVOLUTION_MAX, input, l->output, gradient, result);
+}
+
+/*
+ * layer_forward_avg_pool
+ */
+matrix *layer_forward_avg_pool(layer *l, matrix *input, matrix *output) {
+  return convolution_pool(l->convolution, CONVOLUTION_AVERAGE, input, output);
+}
+
+/*
+ * layer_backward_avg_pool
+ */
+matrix *layer_backward_avg_pool(layer *l, matrix *input, matrix *gradient, matrix *result) {
+  return convolution_pool_backward(l->convolution, CONVOLUTION_AVERAGE, input, l->output, gradient, result);
+}
+
+/*
+ * layer_forward_sparse writes the output of the linear or dense layer l for a
+ * sparse batch, one sample per row, into l->output and returns it. Only the
+ * weight columns of nonzero features are read.
+ */
+matrix *layer_forward_sparse(layer *l, sparse *input) {
+  int type = layer_type(l);
+  if (type != LAYER_LINEAR && type != LAYER_DENSE) {
+    fprintf(stderr, "layer_forward_sparse: only linear and dense layers take sparse inputs\n");
+    return NULL;
+  }
+  if (matrix_resize(l->output, l->output_size, input->rows) == NULL) {
+    return NULL;
+  }
+  return sparse_gemm_fused(l->weights, input, l->output, l->biases, l->activation);
+}
+
+/*
+ * layer_update_sparse accumulates the parameter gradients of l for the sparse
+ * batch of layer_forward_sparse, writing only the weight gradient columns of
+ * its nonzero features. Those columns are kept in l->touched, so the network
+ * can zero and apply just them. There's no gradient w.r.t a sparse input.
+ */
+matrix *layer_update_sparse(layer *l, sparse *input, matrix *gradient, float scale) {
+  int type = layer_type(l);
+  if ((type != LAYER_LINEAR && type != LAYER_DENSE) || l->update == NULL) {
+    fprintf(stderr, "layer_update_sparse: only trainable linear and dense layers take sparse inputs\n");
+    return NULL;
+  }
+  if (type == LAYER_DENSE) {
+    if (matrix_resize(l->delta, gradient->rows, gradient->columns) == NULL) {
+      return NULL;
     }
+    layer_activation_run(l->activation, l->output, l->output, gradient, l->delta);
+    gradient = l->delta;
+  }
+  if (l->touched == NULL && (l->touched = sparse_set_create(l->input_size)) == NULL) {
+    return NULL;
+  }
+  if (sparse_gemm_update(l->gradient_weights, input, gradient, scale) == NULL) {
+    return NULL;
   }
-  return gradient_update;
+  sparse_set_add(l->touched, input);
+  layer_update_biases(l, gradient, scale);
+  return l->gradient_weights;
+}
+
+/*
+ * layer_forward_quantized
+ */
+matrix *layer_forward_quantized(layer *l, matrix *input, matrix *output) {
+  return quantize_gemm(l->quantized, input, output, l->biases, l->activation);
+}
+
+/*
+ * layer_forward_tanh
+ */
+matrix *layer_forward_tanh(layer *l, matrix *input, matrix *output) {
+  return layer_activation_run(ACTIVATION_TANH, input, output, NULL, output);
+}
+
+/*
+ * layer_backward_tanh
+ */
+matrix *layer_backward_tanh(layer *l, matrix *input, matrix *gradient, matrix *result) {
+  return layer_activation_run(ACTIVATION_TANH, input, l->output, gradient, result);
+}
+
+/*
+ * layer_forward_relu
+ */
+matrix *layer_forward_relu(layer *l, matrix *input, matrix *output) {
+  return layer_activation_run(ACTIVATION_RELU, input, output, NULL, output);
+}
+
+/*
+ * layer_backward_relu
+ */
+matrix *layer_backward_relu(layer *l, matrix *input, matrix *gradient, matrix *result) {
+  return layer_activation_run(ACTIVATION_RELU, input, l->output, gradient, result);
+}
+
+/*
+ * layer_forward_leaky_relu, negative inputs are scaled by
+ * ACTIVATION_LEAKY_RELU_SLOPE.
+ */
+matrix *layer_forward_leaky_relu(layer *l, matrix *input, matrix *output) {
+  return layer_activation_run(ACTIVATION_LEAKY_RELU, input, output, NULL, output);
+}
+
+/*
+ * layer_backward_leaky_relu
+ */
+matrix *layer_backward_leaky_relu(layer *l, matrix *input, matrix *gradient, matrix *result) {
+  return layer_activation_run(ACTIVATION_LEAKY_RELU, input, l->output, gradient, result);
+}
+
+/*
+ * layer_forward_gelu uses the tanh approximation of GELU.
+ */
+matrix *layer_forward_gelu(layer *l, matrix *input, matrix *output) {
+  return layer_activation_run(ACTIVATION_GELU, input, output, NULL, output);
+}
+
+/*
+ * layer_backward_gelu differentiates the input, not the output.
+ */
+matrix *layer_backward_gelu(layer *l, matrix *input, matrix *gradient, matrix *result) {
+  return layer_activation_run(ACTIVATION_GELU, input, l->output, gradient, result);
+}
+
+/*
+ * layer_forward_softplus
+ */
+matrix *layer_forward_softplus(layer *l, matrix *input, matrix *output) {
+  return layer_activation_run(ACTIVATION_SOFTPLUS, input, output, NULL, output);
+}
+
+/*
+ * layer_backward_softplus
+ */
+matrix *layer_backward_softplus(layer *l, matrix *input, matrix *gradient, matrix *result) {
+  return layer_activation_run(ACTIVATION_SOFTPLUS, input, l->output, gradient, result);
 }
 
 /*
  * layer_forward_none
  */
-matrix *layer_forward_none(layer *l, matrix *output) {
-  return matrix_copy(output);
+matrix *layer_forward_none(layer *l, matrix *input, matrix *output) {
+  return matrix_copy_into(input, output);
 }
 
 /*
  * layer_backward_none
  */
-matrix *layer_backward_none(layer *l, matrix *output, matrix *gradient) {
-  return matrix_copy(gradient);
+matrix *layer_backward_none(layer *l, matrix *input, matrix *gradient, matrix *result) {
+  return matrix_copy_into(gradient, result);
 }
 
 /*
@@ -196,14 +787,42 @@ void layer_free(layer *l) {
     matrix_free(l->weights);
     l->weights = NULL;
   }
+  if (l->compute_weights != NULL) {
+    matrix_free(l->compute_weights);
+    l->compute_weights = NULL;
+  }
+  if (l->biases != NULL) {
+    matrix_free(l->biases);
+    l->biases = NULL;
+  }
   if (l->gradient_weights != NULL) {
     matrix_free(l->gradient_weights);
     l->gradient_weights = NULL;
   }
+  if (l->gradient_biases != NULL) {
+    matrix_free(l->gradient_biases);
+    l->gradient_biases = NULL;
+  }
+  if (l->touched != NULL) {
+    sparse_set_free(l->touched);
+    l->touched = NULL;
+  }
   if (l->gradient != NULL) {
     matrix_free(l->gradient);
     l->gradient = NULL;
   }
-  free(l);
+  if (l->delta != NULL) {
+    matrix_free(l->delta);
+    l->delta = NULL;
+  }
+  if (l->quantized != NULL) {
+    quantize_free(l->quantized);
+    l->quantized = NULL;
+  }
+  if (l->convolution != NULL) {
+    convolution_free(l->convolution);
+    l->convolution = NULL;
+  }
+  allocator_release(l);
   l = NULL;
 }
@@ -1,39 +1,107 @@
 #ifndef __LAYER_H__
 #define __LAYER_H__
 #include "matrix.h"
+#include "activation.h"
+#include "quantize.h"
+#include "sparse.h"
+#include "convolution.h"
+
+enum {
+  LAYER_NONE,
+  LAYER_LINEAR,
+  LAYER_SIGMOID,
+  LAYER_TANH,
+  LAYER_RELU,
+  LAYER_LEAKY_RELU,
+  LAYER_GELU,
+  LAYER_SOFTPLUS,
+  LAYER_DENSE,
+  LAYER_CONV2D,
+  LAYER_MAX_POOL,
+  LAYER_AVG_POOL,
+  LAYER_TYPES
+};
 
 typedef struct layer {
-  matrix *(*forward)(struct layer *l, matrix *);
-  matrix *(*backward)(struct layer *l, matrix *, matrix *);
-  matrix *(*update)(struct layer *l, matrix *input, matrix *gradient, float learning_rate);
+  matrix *(*forward)(struct layer *l, matrix *input, matrix *output);
+  matrix *(*backward)(struct layer *l, matrix *input, matrix *gradient, matrix *result);
+  matrix *(*update)(struct layer *l, matrix *input, matrix *gradient, float scale);
   matrix *weights;
+  matrix *compute_weights;
   matrix *biases;
   matrix *output;
   matrix *gradient;
   matrix *gradient_weights;
   matrix *gradient_biases;
+  matrix *delta;
+  quantized *quantized;
+  sparse_set *touched;
+  convolution *convolution;
+  int activation;
+  int input_size;
+  int output_size;
 } layer;
 
 layer *layer_create(
-  matrix *(*forward)(layer *l, matrix *),
-  matrix *(*backward)(layer *l, matrix *, matrix *),
-  matrix *(*update)(layer *l, matrix *input, matrix *gradient, float learning_rate),
+  matrix *(*forward)(layer *l, matrix *input, matrix *output),
+  matrix *(*backward)(layer *l, matrix *input, matrix *gradient, matrix *result),
+  matrix *(*update)(layer *l, matrix *input, matrix *gradient, float scale),
   float (*parameter_function)(int, int),
   int input,
   int output
 );
+layer *layer_create_dense(
+  int activation,
+  float (*parameter_function)(int, int),
+  int input,
+  int output
+);
+layer *layer_create_conv2d(
+  int activation,
+  float (*parameter_function)(int, int),
+  convolution *geometry
+);
+layer *layer_create_pool(int kind, convolution *geometry);
+layer *layer_create_type(int type, int activation, int input, int output);
+int layer_type(layer *l);
+layer *layer_replicate(layer *l);
+layer *layer_inference(layer *l);
+layer *layer_precision_set(layer *l, int type);
+layer *layer_quantize(layer *l, float input_scale);
+layer *layer_quantized_set(layer *l, quantized *q);
 matrix *layer_forward(layer *l, matrix *input);
-matrix *layer_backward(layer *l, matrix *output, matrix *gradient);
-matrix *layer_update(layer *l, matrix *output, matrix *gradient, float learning_rate);
-matrix *layer_forward_sigmoid(layer *l, matrix *output);
-matrix *layer_backward_sigmoid(layer *l, matrix *output, matrix *gradient);
-matrix *layer_forward_linear(layer *l, matrix *output);
-matrix *layer_backward_linear(layer *l, matrix *output, matrix *gradient);
-matrix *layer_update_linear(layer *l, matrix *input, matrix *gradient, float learning_rate);
-matrix *layer_forward_tanh(layer *l, matrix *output);
-matrix *layer_backward_tanh(layer *l, matrix *output, matrix *gradient);
-matrix *layer_forward_none(layer *l, matrix *output);
-matrix *layer_backward_none(layer *l, matrix *output, matrix *gradient);
+matrix *layer_backward(layer *l, matrix *input, matrix *gradient);
+matrix *layer_update(layer *l, matrix *input, matrix *gradient, float scale);
+matrix *layer_forward_sparse(layer *l, sparse *input);
+matrix *layer_update_sparse(layer *l, sparse *input, matrix *gradient, float scale);
+matrix *layer_forward_sigmoid(layer *l, matrix *input, matrix *output);
+matrix *layer_backward_sigmoid(layer *l, matrix *input, matrix *gradient, matrix *result);
+matrix *layer_forward_linear(layer *l, matrix *input, matrix *output);
+matrix *layer_backward_linear(layer *l, matrix *input, matrix *gradient, matrix *result);
+matrix *layer_update_linear(layer *l, matrix *input, matrix *gradient, float scale);
+matrix *layer_forward_dense(layer *l, matrix *input, matrix *output);
+matrix *layer_backward_dense(layer *l, matrix *input, matrix *gradient, matrix *result);
+matrix *layer_update_dense(layer *l, matrix *input, matrix *gradient, float scale);
+matrix *layer_forward_conv2d(layer *l, matrix *input, matrix *output);
+matrix *layer_backward_conv2d(layer *l, matrix *input, matrix *gradient, matrix *result);
+matrix *layer_update_conv2d(layer *l, matrix *input, matrix *gradient, float scale);
+matrix *layer_forward_max_pool(layer *l, matrix *input, matrix *output);
+matrix *layer_backward_max_pool(layer *l, matrix *input, matrix *gradient, matrix *result);
+matrix *layer_forward_avg_pool(layer *l, matrix *input, matrix *output);
+matrix *layer_backward_avg_pool(layer *l, matrix *input, matrix *gradient, matrix *result);
+matrix *layer_forward_quantized(layer *l, matrix *input, matrix *output);
+matrix *layer_forward_tanh(layer *l, matrix *input, matrix *output);
+matrix *layer_backward_tanh(layer *l, matrix *input, matrix *gradient, matrix *result);
+matrix *layer_forward_relu(layer *l, matrix *input, matrix *output);
+matrix *layer_backward_relu(layer *l, matrix *input, matrix *gradient, matrix *result);
+matrix *layer_forward_leaky_relu(layer *l, matrix *input, matrix *output);
+matrix *layer_backward_leaky_relu(layer *l, matrix *input, matrix *gradient, matrix *result);
+matrix *layer_forward_gelu(layer *l, matrix *input, matrix *output);
+matrix *layer_backward_gelu(layer *l, matrix *input, matrix *gradient, matrix *result);
+matrix *layer_forward_softplus(layer *l, matrix *input, matrix *output);
+matrix *layer_backward_softplus(layer *l, matrix *input, matrix *gradient, matrix *result);
+matrix *layer_forward_none(layer *l, matrix *input, matrix *output);
+matrix *layer_backward_none(layer *l, matrix *input, matrix *gradient, matrix *result);
 float layer_random(int i, int j);
 float layer_ones(int i, int j);
 void layer_free(layer *l);
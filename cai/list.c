@@ -1,4 +1,5 @@
 #include "list.h"
+#include "allocator.h"
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -7,7 +8,7 @@
  */
 list *list_create() {
   list *l;
-  if ((l = malloc(sizeof(*l))) == NULL) {
+  if ((l = allocator_allocate(cai_allocator_get(), sizeof(*l))) == NULL) {
     perror("Out of memory\n");
     return NULL;
   }
@@ -21,7 +22,7 @@ list *list_create() {
  */
 list *list_add(list *l, void *value) {
   list_node *n;
-  if ((n = malloc(sizeof(*n))) == NULL) {
+  if ((n = allocator_allocate(cai_allocator_get(), sizeof(*n))) == NULL) {
     perror("Out of memory\n");
     return NULL;
   }
@@ -54,10 +55,11 @@ list *list_remove(list *l, list_node *n) {
     } else {
       l->tail = n->previous;
     }
-    free(n);
+    allocator_release(n);
     n = NULL;
     l->length--;
   }
+  return l;
 }
 
 /*
@@ -65,14 +67,10 @@ list *list_remove(list *l, list_node *n) {
  */
 void list_free(list *l) {
   if (l != NULL) {
-    if (l->length > 0) {
-      list_node *n = l->head;
-      while (n->next != NULL) {
-        list_remove(l, n);
-        n = n->next;
-      }
-      free(l);
-      l = NULL;
+    while (l->head != NULL) {
+      list_remove(l, l->head);
     }
+    allocator_release(l);
+    l = NULL;
   }
 }
@@ -1,50 +1,438 @@
 #include "matrix.h"
+#include "activation.h"
+#include "allocator.h"
+#include "kernel.h"
+#include "thread.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+
+#define MATRIX_CHUNK 256
+
+/*
+ * matrix_type_size returns the bytes of one element of type.
+ */
+static size_t matrix_type_size(int type) {
+  return type == MATRIX_BFLOAT16 ? sizeof(bfloat16) : sizeof(float);
+}
+
+/*
+ * matrix_storage returns an aligned buffer from a large enough for count
+ * elements of type.
+ */
+static float *matrix_storage(allocator *a, long count, int type) {
+  return (float *)allocator_allocate(a, (size_t)count * matrix_type_size(type));
+}
+
+/*
+ * matrix_bind points the elements of m at the start of its storage.
+ */
+static void matrix_bind(matrix *m) {
+  m->data = m->type == MATRIX_FLOAT32 ? m->storage : NULL;
+  m->half = m->type == MATRIX_BFLOAT16 ? (bfloat16 *)m->storage : NULL;
+}
+
+/*
+ * matrix_offset moves the elements of the view v to element (i, j).
+ */
+static void matrix_offset(matrix *v, long i, long j) {
+  long offset = i * v->row_stride + j * v->column_stride;
+  if (v->half != NULL) {
+    v->half += offset;
+  } else {
+    v->data += offset;
+  }
+}
 
 /*
- * matrix_create returns a new matrix.
+ * matrix_create returns a new matrix backed by one contiguous, aligned buffer.
  */
 matrix *matrix_create(int rows, int columns, float (*initialize_function)(int, int)) {
   matrix *m;
-  if ((m = malloc(sizeof(*m))) == NULL) {
+  if ((m = allocator_allocate(cai_allocator_get(), sizeof(*m))) == NULL) {
     perror("Out of memory\n");
     return NULL;
   }
   int i, j;
   m->rows = rows;
   m->columns = columns;
+  m->row_stride = columns;
+  m->column_stride = 1;
+  m->type = MATRIX_FLOAT32;
   initialize_function = initialize_function != NULL ? initialize_function : &matrix_zeros;
 
-  float **data = (float **)malloc(rows * sizeof(float *));
+  if ((m->storage = matrix_storage(cai_allocator_get(), (long)rows * columns, m->type)) == NULL) {
+    perror("Out of memory\n");
+    allocator_release(m);
+    return NULL;
+  }
+  matrix_bind(m);
+  m->capacity = (long)rows * columns;
 
   for (i = 0; i < rows; i++) {
-    data[i] = (float *)malloc(columns * sizeof(float));
+    float *row = m->data + (long)i * m->row_stride;
     for (j = 0; j < columns; j++) {
-      data[i][j] = initialize_function(i, j);
+      row[j] = initialize_function(i, j);
     }
   }
+  return m;
+}
 
-  m->data = data;
+/*
+ * matrix_create_type returns a new zero matrix with elements of type.
+ */
+matrix *matrix_create_type(int rows, int columns, int type) {
+  matrix *m;
+  if (type == MATRIX_FLOAT32) {
+    return matrix_create(rows, columns, NULL);
+  }
+  if (type != MATRIX_BFLOAT16) {
+    fprintf(stderr, "matrix_create_type: unknown type %d\n", type);
+    return NULL;
+  }
+  if ((m = allocator_allocate(cai_allocator_get(), sizeof(*m))) == NULL) {
+    perror("Out of memory\n");
+    return NULL;
+  }
+  m->rows = rows;
+  m->columns = columns;
+  m->row_stride = columns;
+  m->column_stride = 1;
+  m->type = type;
+  if ((m->storage = matrix_storage(cai_allocator_get(), (long)rows * columns, type)) == NULL) {
+    perror("Out of memory\n");
+    allocator_release(m);
+    return NULL;
+  }
+  matrix_bind(m);
+  m->capacity = (long)rows * columns;
+  memset(m->storage, 0, (size_t)m->capacity * matrix_type_size(type));
   return m;
 }
 
+/*
+ * matrix_view returns a matrix sharing the storage of m, it never owns the data.
+ */
+matrix *matrix_view(matrix *m) {
+  matrix *v;
+  if ((v = allocator_allocate(cai_allocator_get(), sizeof(*v))) == NULL) {
+    perror("Out of memory\n");
+    return NULL;
+  }
+  *v = *m;
+  v->storage = NULL;
+  v->capacity = 0;
+  return v;
+}
+
+/*
+ * matrix_view_rows returns a view of rows [row, row + rows) of m.
+ */
+matrix *matrix_view_rows(matrix *m, int row, int rows) {
+  matrix *v;
+  if (row < 0 || rows < 0 || row + rows > m->rows) {
+    fprintf(stderr, "matrix_view_rows: rows [%d, %d) out of range %d\n", row, row + rows, m->rows);
+    return NULL;
+  }
+  if ((v = matrix_view(m)) == NULL) {
+    return NULL;
+  }
+  v->rows = rows;
+  matrix_offset(v, row, 0);
+  return v;
+}
+
+/*
+ * matrix_view_columns_into points the caller's v at columns
+ * [column, column + columns) of m without allocating.
+ */
+matrix *matrix_view_columns_into(matrix *m, int column, int columns, matrix *v) {
+  if (column < 0 || columns < 0 || column + columns > m->columns) {
+    fprintf(stderr, "matrix_view_columns: columns [%d, %d) out of range %d\n", column, column + columns, m->columns);
+    return NULL;
+  }
+  *v = *m;
+  v->storage = NULL;
+  v->capacity = 0;
+  v->columns = columns;
+  matrix_offset(v, 0, column);
+  return v;
+}
+
+/*
+ * matrix_view_columns returns a view of columns [column, column + columns) of m.
+ */
+matrix *matrix_view_columns(matrix *m, int column, int columns) {
+  matrix *v;
+  if ((v = matrix_view(m)) == NULL) {
+    return NULL;
+  }
+  if (matrix_view_columns_into(m, column, columns, v) == NULL) {
+    allocator_release(v);
+    return NULL;
+  }
+  return v;
+}
+
+/*
+ * matrix_view_reshape returns a rows x columns view of m, m must be contiguous.
+ */
+matrix *matrix_view_reshape(matrix *m, int rows, int columns) {
+  matrix *v;
+  if ((long)rows * columns != (long)m->rows * m->columns || !matrix_contiguous(m)) {
+    fprintf(stderr, "matrix_view_reshape: can't view (%d, %d) as (%d, %d)\n", m->rows, m->columns, rows, columns);
+    return NULL;
+  }
+  if ((v = matrix_view(m)) == NULL) {
+    return NULL;
+  }
+  v->rows = rows;
+  v->columns = columns;
+  v->row_stride = columns;
+  v->column_stride = 1;
+  return v;
+}
+
+/*
+ * matrix_view_transpose returns the transpose of m by swapping its strides.
+ */
+matrix *matrix_view_transpose(matrix *m) {
+  matrix *v;
+  if ((v = matrix_view(m)) == NULL) {
+    return NULL;
+  }
+  v->rows = m->columns;
+  v->columns = m->rows;
+  v->row_stride = m->column_stride;
+  v->column_stride = m->row_stride;
+  return v;
+}
+
+/*
+ * matrix_contiguous returns 1 when m is dense and row-major.
+ */
+int matrix_contiguous(matrix *m) {
+  return m->column_stride == 1 && (m->row_stride == m->columns || m->rows <= 1);
+}
+
+/*
+ * matrix_load_row widens count elements of row i of m, from column j on, into
+ * row as floats.
+ */
+void matrix_load_row(matrix *m, int i, int j, int count, float *row) {
+  int k;
+  if (m->type == MATRIX_BFLOAT16) {
+    const bfloat16 *x = m->half + (long)i * m->row_stride + (long)j * m->column_stride;
+    if (m->column_stride == 1) {
+      bfloat16_decode(row, x, count);
+    } else {
+      for (k = 0; k < count; k++) {
+        row[k] = bfloat16_float(x[(long)k * m->column_stride]);
+      }
+    }
+    return;
+  }
+  if (m->column_stride == 1) {
+    memcpy(row, matrix_element(m, i, j), count * sizeof(float));
+  } else {
+    for (k = 0; k < count; k++) {
+      row[k] = matrix_at(m, i, j + k);
+    }
+  }
+}
+
+/*
+ * matrix_store_row narrows count floats of row into row i of m, from column j on.
+ */
+void matrix_store_row(matrix *m, int i, int j, int count, const float *row) {
+  int k;
+  if (m->type == MATRIX_BFLOAT16) {
+    bfloat16 *y = m->half + (long)i * m->row_stride + (long)j * m->column_stride;
+    if (m->column_stride == 1) {
+      bfloat16_encode(y, row, count);
+    } else {
+      for (k = 0; k < count; k++) {
+        y[(long)k * m->column_stride] = bfloat16_round(row[k]);
+      }
+    }
+    return;
+  }
+  if (m->column_stride == 1) {
+    memcpy(matrix_element(m, i, j), row, count * sizeof(float));
+  } else {
+    for (k = 0; k < count; k++) {
+      matrix_at(m, i, j + k) = row[k];
+    }
+  }
+}
+
+/*
+ * matrix_gemm_blocking returns the default cache blocking of the packed GEMM.
+ */
+matrix_blocking matrix_gemm_blocking() {
+  return kernel_get()->blocking;
+}
+
+/*
+ * matrix_gemm_packed reports whether an m x n x k product runs on the packed,
+ * cache blocked path, the only one the blocking matters to.
+ */
+int matrix_gemm_packed(int m, int n, int k) {
+  return kernel_get()->gemm_packed(m, n, k);
+}
+
+/*
+ * matrix_gemm computes c = alpha * op(a) * op(b) + beta * c in place, where op(x)
+ * is x or, when the matching transpose flag is set, its transpose. Transposes are
+ * never materialized, the packing routines read through the strides instead.
+ * Large products are split into tiles of c across the thread pool, MC rows high
+ * and as wide as still gives every thread a few tiles to balance with, with the
+ * blocking tuned for the whole product.
+ */
+matrix *matrix_gemm(
+  int transpose_a,
+  int transpose_b,
+  float alpha,
+  matrix *a,
+  matrix *b,
+  float beta,
+  matrix *c
+) {
+  return matrix_gemm_fused(transpose_a, transpose_b, alpha, a, b, beta, c, NULL, ACTIVATION_NONE);
+}
+
+/*
+ * matrix_gemm_fused computes c = activation(alpha * op(a) * op(b) + beta * c + bias)
+ * in one pass over c, bias is a column vector with a row per row of c or NULL.
+ * The bias and activation run in the epilogue of each register tile. Any of a,
+ * b and c may be bfloat16, the products still accumulate in float.
+ */
+matrix *matrix_gemm_fused(
+  int transpose_a,
+  int transpose_b,
+  float alpha,
+  matrix *a,
+  matrix *b,
+  float beta,
+  matrix *c,
+  matrix *bias,
+  int activation
+) {
+  int m = c->rows, n = c->columns;
+  int k = transpose_a ? a->rows : a->columns;
+
+  if ((transpose_a ? a->columns : a->rows) != m ||
+      (transpose_b ? b->rows : b->columns) != n ||
+      (transpose_b ? b->columns : b->rows) != k) {
+    fprintf(stderr, "matrix_gemm: shape mismatch (%d, %d) x (%d, %d) -> (%d, %d)\n",
+      transpose_a ? a->columns : a->rows, k,
+      transpose_b ? b->columns : b->rows, transpose_b ? b->rows : b->columns,
+      m, n);
+    return NULL;
+  }
+  if (bias != NULL) {
+    if (bias->rows != m || bias->columns != 1 || bias->type != MATRIX_FLOAT32) {
+      fprintf(stderr, "matrix_gemm: bias (%d, %d) doesn't match (%d, %d)\n",
+        bias->rows, bias->columns, m, n);
+      return NULL;
+    }
+  }
+  kernel_get()->gemm(transpose_a, transpose_b, alpha, a, b, beta, c, bias, activation);
+  return c;
+}
+
+/*
+ * matrix_shape_check reports whether a and b have the same shape.
+ */
+static int matrix_shape_check(char *name, matrix *a, matrix *b) {
+  if (a->rows != b->rows || a->columns != b->columns) {
+    fprintf(stderr, "%s: shape mismatch (%d, %d) and (%d, %d)\n", name, a->rows, a->columns, b->rows, b->columns);
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * matrix_float_check reports whether m has float elements, for the operations
+ * that don't convert.
+ */
+static int matrix_float_check(char *name, matrix *m) {
+  if (m->type != MATRIX_FLOAT32) {
+    fprintf(stderr, "%s: expected a float matrix, got type %d\n", name, m->type);
+    return 0;
+  }
+  return 1;
+}
+
+typedef struct matrix_elementwise {
+  float *c;
+  float *a;
+  float *b;
+  float alpha;
+} matrix_elementwise;
+
+static void matrix_add_range(void *context, long begin, long end) {
+  matrix_elementwise *e = (matrix_elementwise *)context;
+  kernel_get()->add(e->c + begin, e->a + begin, e->b + begin, end - begin);
+}
+
+static void matrix_scale_range(void *context, long begin, long end) {
+  matrix_elementwise *e = (matrix_elementwise *)context;
+  kernel_get()->scale(e->c + begin, e->a + begin, e->alpha, end - begin);
+}
+
+static void matrix_axpy_range(void *context, long begin, long end) {
+  matrix_elementwise *e = (matrix_elementwise *)context;
+  kernel_get()->axpy(e->c + begin, e->a + begin, e->alpha, end - begin);
+}
+
+static void matrix_fill_range(void *context, long begin, long end) {
+  matrix_elementwise *e = (matrix_elementwise *)context;
+  kernel_get()->fill(e->c + begin, e->alpha, end - begin);
+}
+
+/*
+ * matrix_multiply_into writes the product of a and b into c.
+ */
+matrix *matrix_multiply_into(matrix *a, matrix *b, matrix *c) {
+  return matrix_gemm(0, 0, 1, a, b, 0, c);
+}
+
 /*
  * matrix_multiply returns a product matrix of a and b.
  */
 matrix *matrix_multiply(matrix *a, matrix *b) {
-  int i, j, k;
-  matrix *c = matrix_create(a->rows, b->columns, &matrix_zeros);
-  matrix *bT = matrix_transpose(b);
-	for (i = 0; i < a->rows; i++) {
-		for (j = 0; j < b->columns; j++) {
-      c->data[i][j] = 0;
-      for (k = 0; k < a->columns; k++) {
-        c->data[i][j] += (a->data[i][k] * bT->data[j][k]);
-      }
+  matrix *c = matrix_create(a->rows, b->columns, NULL);
+  if (c == NULL) {
+    return NULL;
+  }
+  if (matrix_multiply_into(a, b, c) == NULL) {
+    matrix_free(c);
+    return NULL;
+  }
+  return c;
+}
+
+/*
+ * matrix_add_into writes the sum of a and b into c, c may alias a or b.
+ */
+matrix *matrix_add_into(matrix *a, matrix *b, matrix *c) {
+  int i, j;
+  if (!matrix_shape_check("matrix_add", a, b) || !matrix_shape_check("matrix_add", a, c) ||
+      !matrix_float_check("matrix_add", a) || !matrix_float_check("matrix_add", b) ||
+      !matrix_float_check("matrix_add", c)) {
+    return NULL;
+  }
+  if (matrix_contiguous(a) && matrix_contiguous(b) && matrix_contiguous(c)) {
+    matrix_elementwise e = {c->data, a->data, b->data, 0};
+    thread_parallel_for((long)a->rows * a->columns, THREAD_GRAIN, &matrix_add_range, &e);
+    return c;
+  }
+  for (i = 0; i < a->rows; i++) {
+    for (j = 0; j < a->columns; j++) {
+      matrix_at(c, i, j) = matrix_at(a, i, j) + matrix_at(b, i, j);
     }
   }
-  matrix_free(bT);
   return c;
 }
 
@@ -52,11 +440,34 @@ matrix *matrix_multiply(matrix *a, matrix *b) {
  * matrix_add returns a additive matrix of a and b.
  */
 matrix *matrix_add(matrix *a, matrix *b) {
-  int i, j;
   matrix *c = matrix_create(a->rows, a->columns, NULL);
+  if (c == NULL) {
+    return NULL;
+  }
+  if (matrix_add_into(a, b, c) == NULL) {
+    matrix_free(c);
+    return NULL;
+  }
+  return c;
+}
+
+/*
+ * matrix_scale_into writes a scaled by b into c, c may alias a.
+ */
+matrix *matrix_scale_into(matrix *a, float b, matrix *c) {
+  int i, j;
+  if (!matrix_shape_check("matrix_scale", a, c) ||
+      !matrix_float_check("matrix_scale", a) || !matrix_float_check("matrix_scale", c)) {
+    return NULL;
+  }
+  if (matrix_contiguous(a) && matrix_contiguous(c)) {
+    matrix_elementwise e = {c->data, a->data, NULL, b};
+    thread_parallel_for((long)a->rows * a->columns, THREAD_GRAIN, &matrix_scale_range, &e);
+    return c;
+  }
   for (i = 0; i < a->rows; i++) {
     for (j = 0; j < a->columns; j++) {
-      c->data[i][j] = a->data[i][j] + b->data[i][j];
+      matrix_at(c, i, j) = matrix_at(a, i, j) * b;
     }
   }
   return c;
@@ -66,11 +477,75 @@ matrix *matrix_add(matrix *a, matrix *b) {
  * matrix_scale returns a scaled matrix of a.
  */
 matrix *matrix_scale(matrix *a, float b) {
-  int i, j;
   matrix *c = matrix_create(a->rows, a->columns, NULL);
-  for (i = 0; i < a->rows; i++) {
-    for (j = 0; j < a->columns; j++) {
-      c->data[i][j] = a->data[i][j] * b;
+  if (c == NULL) {
+    return NULL;
+  }
+  if (matrix_scale_into(a, b, c) == NULL) {
+    matrix_free(c);
+    return NULL;
+  }
+  return c;
+}
+
+/*
+ * matrix_axpy accumulates alpha * x into y in place.
+ */
+matrix *matrix_axpy(float alpha, matrix *x, matrix *y) {
+  int i, j;
+  if (!matrix_shape_check("matrix_axpy", x, y) ||
+      !matrix_float_check("matrix_axpy", x) || !matrix_float_check("matrix_axpy", y)) {
+    return NULL;
+  }
+  if (matrix_contiguous(x) && matrix_contiguous(y)) {
+    matrix_elementwise e = {y->data, x->data, NULL, alpha};
+    thread_parallel_for((long)x->rows * x->columns, THREAD_GRAIN, &matrix_axpy_range, &e);
+    return y;
+  }
+  for (i = 0; i < x->rows; i++) {
+    for (j = 0; j < x->columns; j++) {
+      matrix_at(y, i, j) += alpha * matrix_at(x, i, j);
+    }
+  }
+  return y;
+}
+
+/*
+ * matrix_fill sets every element of m to value.
+ */
+matrix *matrix_fill(matrix *m, float value) {
+  int i, j;
+  if (!matrix_float_check("matrix_fill", m)) {
+    return NULL;
+  }
+  if (matrix_contiguous(m)) {
+    matrix_elementwise e = {m->data, NULL, NULL, value};
+    thread_parallel_for((long)m->rows * m->columns, THREAD_GRAIN, &matrix_fill_range, &e);
+    return m;
+  }
+  for (i = 0; i < m->rows; i++) {
+    for (j = 0; j < m->columns; j++) {
+      matrix_at(m, i, j) = value;
+    }
+  }
+  return m;
+}
+
+/*
+ * matrix_transpose_into writes the transpose of m into c, c must not alias m.
+ */
+matrix *matrix_transpose_into(matrix *m, matrix *c) {
+  int i, j;
+  if (c->rows != m->columns || c->columns != m->rows) {
+    fprintf(stderr, "matrix_transpose: shape mismatch (%d, %d) and (%d, %d)\n", m->rows, m->columns, c->rows, c->columns);
+    return NULL;
+  }
+  if (!matrix_float_check("matrix_transpose", m) || !matrix_float_check("matrix_transpose", c)) {
+    return NULL;
+  }
+  for (i = 0; i < m->rows; i++) {
+    for (j = 0; j < m->columns; j++) {
+      matrix_at(c, j, i) = matrix_at(m, i, j);
     }
   }
   return c;
@@ -80,37 +555,143 @@ matrix *matrix_scale(matrix *a, float b) {
  * matrix_transpose returns a transpose matrix of m.
  */
 matrix *matrix_transpose(matrix *m) {
-  int i, j;
   matrix *c = matrix_create(m->columns, m->rows, NULL);
+  if (c == NULL) {
+    return NULL;
+  }
+  if (matrix_transpose_into(m, c) == NULL) {
+    matrix_free(c);
+    return NULL;
+  }
+  return c;
+}
+
+typedef struct matrix_conversion {
+  matrix *m;
+  matrix *c;
+} matrix_conversion;
+
+/*
+ * matrix_convert_range converts elements [begin, end) of the contiguous m into c.
+ */
+static void matrix_convert_range(void *context, long begin, long end) {
+  matrix_conversion *v = (matrix_conversion *)context;
+  if (v->m->type == v->c->type) {
+    memcpy(v->c->half + begin, v->m->half + begin, (end - begin) * sizeof(bfloat16));
+  } else if (v->c->type == MATRIX_BFLOAT16) {
+    bfloat16_encode(v->c->half + begin, v->m->data + begin, end - begin);
+  } else {
+    bfloat16_decode(v->c->data + begin, v->m->half + begin, end - begin);
+  }
+}
+
+/*
+ * matrix_copy_into copies the elements of m into c, converting between element
+ * types, a float to bfloat16 copy rounds to nearest even.
+ */
+matrix *matrix_copy_into(matrix *m, matrix *c) {
+  int i, j;
+  if (!matrix_shape_check("matrix_copy", m, c)) {
+    return NULL;
+  }
+  if (m == c) {
+    return c;
+  }
+  if (m->type != MATRIX_FLOAT32 || c->type != MATRIX_FLOAT32) {
+    float row[MATRIX_CHUNK];
+    if (matrix_contiguous(m) && matrix_contiguous(c)) {
+      matrix_conversion v = {m, c};
+      thread_parallel_for((long)m->rows * m->columns, THREAD_GRAIN, &matrix_convert_range, &v);
+      return c;
+    }
+    for (i = 0; i < m->rows; i++) {
+      for (j = 0; j < m->columns; j += MATRIX_CHUNK) {
+        int count = m->columns - j < MATRIX_CHUNK ? m->columns - j : MATRIX_CHUNK;
+        matrix_load_row(m, i, j, count, row);
+        matrix_store_row(c, i, j, count, row);
+      }
+    }
+    return c;
+  }
+  if (matrix_contiguous(m) && matrix_contiguous(c)) {
+    memcpy(c->data, m->data, (size_t)m->rows * m->columns * sizeof(float));
+    return c;
+  }
   for (i = 0; i < m->rows; i++) {
     for (j = 0; j < m->columns; j++) {
-      c->data[j][i] = m->data[i][j];
+      matrix_at(c, i, j) = matrix_at(m, i, j);
     }
   }
   return c;
 }
 
 /*
- * matrix_copy returns a deep copy of m.
+ * matrix_copy returns a deep, contiguous copy of m with the same element type.
  */
 matrix *matrix_copy(matrix *m) {
-  matrix *copy;
-  if ((copy = malloc(sizeof(*copy))) == NULL) {
-    perror("Out of memory\n");
+  matrix *copy = matrix_create_type(m->rows, m->columns, m->type);
+  if (copy == NULL) {
     return NULL;
   }
-  int i, j;
-  copy->rows = m->rows;
-  copy->columns = m->columns;
-  copy->data = (float **)malloc(copy->rows * sizeof(float *));
+  if (matrix_copy_into(m, copy) == NULL) {
+    matrix_free(copy);
+    return NULL;
+  }
+  return copy;
+}
 
-  for (i = 0; i < copy->rows; i++) {
-    copy->data[i] = (float *)malloc(copy->columns * sizeof(float));
-    for (j = 0; j < copy->columns; j++) {
-      copy->data[i][j] = m->data[i][j];
+/*
+ * matrix_resize reshapes an owned matrix to rows x columns, the storage is only
+ * reallocated when it is too small, so a resize back and forth between batch
+ * sizes settles without allocating. The contents are undefined afterwards.
+ */
+matrix *matrix_resize(matrix *m, int rows, int columns) {
+  long size = (long)rows * columns;
+  if (m->rows == rows && m->columns == columns) {
+    return m;
+  }
+  if (m->storage == NULL) {
+    fprintf(stderr, "matrix_resize: can't resize a view (%d, %d) to (%d, %d)\n", m->rows, m->columns, rows, columns);
+    return NULL;
+  }
+  if (size > m->capacity) {
+    float *storage = matrix_storage(allocator_owner(m->storage), size, m->type);
+    if (storage == NULL) {
+      perror("Out of memory\n");
+      return NULL;
     }
+    allocator_release(m->storage);
+    m->storage = storage;
+    m->capacity = size;
   }
-  return copy;
+  m->rows = rows;
+  m->columns = columns;
+  m->row_stride = columns;
+  m->column_stride = 1;
+  matrix_bind(m);
+  return m;
+}
+
+/*
+ * matrix_allocator_set moves the storage of an owned matrix into a, so later
+ * resizes are served by a as well.
+ */
+matrix *matrix_allocator_set(matrix *m, allocator *a) {
+  long size = (long)m->rows * m->columns;
+  if (m->storage == NULL || allocator_owner(m->storage) == a) {
+    return m;
+  }
+  float *storage = matrix_storage(a, size, m->type);
+  if (storage == NULL) {
+    perror("Out of memory\n");
+    return NULL;
+  }
+  memcpy(storage, m->storage, (size_t)size * matrix_type_size(m->type));
+  allocator_release(m->storage);
+  m->storage = storage;
+  matrix_bind(m);
+  m->capacity = size;
+  return m;
 }
 
 /*
@@ -121,22 +702,20 @@ void matrix_print(char *name, matrix *input) {
   printf("%s (%d, %d)\n", name, input->rows, input->columns);
   for (i = 0; i < input->rows; i++) {
     for (j = 0; j < input->columns; j++) {
-      printf("%f ", input->data[i][j]);
+      float x;
+      matrix_load_row(input, i, j, 1, &x);
+      printf("%f ", x);
     }
     printf("\n");
   }
 }
 
 /*
- * matrix_free
+ * matrix_free releases m, and its storage if m is not a view.
  */
 void matrix_free(matrix *m) {
-  int i;
-  for (i = 0; i < m->rows; i++) {
-    free(m->data[i]);
-  }
-  free(m->data);
-  free(m);
+  allocator_release(m->storage);
+  allocator_release(m);
   m = NULL;
 }
 
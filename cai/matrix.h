@@ -1,21 +1,104 @@
 #ifndef __MATRIX_H_
 #define __MATRIX_H_
+#include "allocator.h"
+#include "bfloat16.h"
+
+#define MATRIX_ALIGNMENT 64
+
+/*
+ * Element types, a MATRIX_BFLOAT16 matrix has its elements in half and a NULL
+ * data, so only the kernels that convert (GEMM, activations, copies and row
+ * loads and stores) accept it.
+ */
+enum {
+  MATRIX_FLOAT32,
+  MATRIX_BFLOAT16
+};
 
 typedef struct matrix {
   int rows;
   int columns;
-  float **data;
+  int row_stride;
+  int column_stride;
+  float *data;
+  bfloat16 *half;
+  float *storage;
+  long capacity;
+  int type;
 } matrix;
 
+/*
+ * matrix_blocking is the cache blocking of the packed GEMM, MC x KC panels of
+ * a and KC x NC panels of b, see autotune.h for tuning it per shape.
+ */
+typedef struct matrix_blocking {
+  int mc;
+  int kc;
+  int nc;
+} matrix_blocking;
+
+/*
+ * matrix_element returns the address of element (i, j) of m through its strides.
+ */
+static inline float *matrix_element(matrix *m, long i, long j) {
+  return m->data + i * m->row_stride + j * m->column_stride;
+}
+
+/*
+ * matrix_at is element (i, j) of m as an lvalue, m is evaluated once.
+ */
+#define matrix_at(m, i, j) (*matrix_element((m), (i), (j)))
+
 float matrix_zeros(int i, int j);
 float matrix_ones(int i, int j);
 float matrix_random(int i, int j);
 matrix *matrix_create(int rows, int columns, float (*initialize_function)(int, int));
+matrix *matrix_create_type(int rows, int columns, int type);
+matrix *matrix_view(matrix *m);
+matrix *matrix_view_rows(matrix *m, int row, int rows);
+matrix *matrix_view_columns(matrix *m, int column, int columns);
+matrix *matrix_view_columns_into(matrix *m, int column, int columns, matrix *v);
+matrix *matrix_view_reshape(matrix *m, int rows, int columns);
+matrix *matrix_view_transpose(matrix *m);
+int matrix_contiguous(matrix *m);
+void matrix_load_row(matrix *m, int i, int j, int count, float *row);
+void matrix_store_row(matrix *m, int i, int j, int count, const float *row);
+matrix_blocking matrix_gemm_blocking();
+int matrix_gemm_packed(int m, int n, int k);
+matrix *matrix_gemm(
+  int transpose_a,
+  int transpose_b,
+  float alpha,
+  matrix *a,
+  matrix *b,
+  float beta,
+  matrix *c
+);
+matrix *matrix_gemm_fused(
+  int transpose_a,
+  int transpose_b,
+  float alpha,
+  matrix *a,
+  matrix *b,
+  float beta,
+  matrix *c,
+  matrix *bias,
+  int activation
+);
 matrix *matrix_multiply(matrix *a, matrix *b);
+matrix *matrix_multiply_into(matrix *a, matrix *b, matrix *c);
 matrix *matrix_add(matrix *a, matrix *b);
+matrix *matrix_add_into(matrix *a, matrix *b, matrix *c);
 matrix *matrix_scale(matrix *a, float b);
+matrix *matrix_scale_into(matrix *a, float b, matrix *c);
+matrix *matrix_axpy(float alpha, matrix *x, matrix *y);
+matrix *matrix_fill(matrix *m, float value);
 matrix *matrix_transpose(matrix *m);
+matrix *matrix_transpose_into(matrix *m, matrix *c);
 matrix *matrix_copy(matrix *m);
+matrix *matrix_copy_into(matrix *m, matrix *c);
+matrix *matrix_resize(matrix *m, int rows, int columns);
+matrix *matrix_allocator_set(matrix *m, allocator *a);
 void matrix_print(char *name, matrix *input);
 void matrix_free(matrix *m);
 
@@ -2,101 +2,937 @@
 #include "network.h"
 #include "list.h"
 #include "matrix.h"
+#include "allocator.h"
+#include "profile.h"
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define NETWORK_MAGIC "CAIMODEL"
+#define NETWORK_VERSION 1
+#define NETWORK_ENDIAN 0x01020304
 
 /*
  * network_create
  */
 network *network_create() {
   network *n;
-  if ((n = malloc(sizeof(*n))) == NULL) {
+  if ((n = allocator_allocate(cai_allocator_get(), sizeof(*n))) == NULL) {
     perror("Out of memory\n");
     return NULL;
   }
   n->layers = list_create();
+  n->allocator = cai_allocator_get();
+  n->plan = NULL;
+  n->count = 0;
+  n->features = 0;
+  n->batch = 0;
+  n->columns = 0;
+  n->checkpoints = NULL;
+  n->slab = NULL;
+  n->workspace = 0;
+  n->inference = 0;
+  n->precision = MATRIX_FLOAT32;
+  n->mapping = NULL;
+  n->mapping_size = 0;
   return n;
 }
 
+/*
+ * network_replicate returns a network sharing the parameters of n, with its own
+ * activations and gradients, see layer_replicate. Updating n updates every
+ * replica, the replicas must be freed before n.
+ */
+network *network_replicate(network *n) {
+  list_node *layer_node;
+  network *r;
+  if (n->inference) {
+    fprintf(stderr, "network_replicate: share an inference network through contexts instead\n");
+    return NULL;
+  }
+  if ((r = network_create()) == NULL) {
+    return NULL;
+  }
+  network_allocator_set(r, n->allocator);
+  r->precision = n->precision;
+  list_for_each (n->layers, layer_node) {
+    layer *l = layer_replicate((layer *)layer_node->value);
+    if (l == NULL) {
+      network_free(r);
+      return NULL;
+    }
+    network_layer_add(r, l);
+  }
+  return r;
+}
+
 /*
  * network_layer_add
  */
 network *network_layer_add(network *n, layer *l) {
+  if (n->plan != NULL) {
+    fprintf(stderr, "network_layer_add: can't add a layer to a compiled network\n");
+    return NULL;
+  }
+  if (layer_precision_set(l, n->precision) == NULL) {
+    return NULL;
+  }
   list_add(n->layers, (void *)l);
+  matrix_allocator_set(l->output, n->allocator);
+  matrix_allocator_set(l->gradient, n->allocator);
+  if (l->delta != NULL) {
+    matrix_allocator_set(l->delta, n->allocator);
+  }
   return n;
 }
 
 /*
- * network_forward
+ * network_allocator_set serves the activation and gradient buffers of every
+ * layer, and of layers added later, from a. A pool keeps batch size changes
+ * from reaching malloc, an arena should only be used for per step temporaries.
  */
-matrix *network_forward(network *n, matrix *input) {
+network *network_allocator_set(network *n, allocator *a) {
   list_node *layer_node;
-  matrix *outputs = matrix_copy(input);
+  n->allocator = a;
   list_for_each (n->layers, layer_node) {
     layer *l = (layer *)layer_node->value;
-    *outputs = *layer_forward(l, outputs);
+    matrix_allocator_set(l->output, a);
+    matrix_allocator_set(l->gradient, a);
+    if (l->delta != NULL) {
+      matrix_allocator_set(l->delta, a);
+    }
   }
-  return outputs;
+  return n;
 }
 
 /*
- * network_backward, two-pass
+ * network_precision_set stores the activations, deltas and input gradients of
+ * every layer of n, and of layers added later, as type, see layer_precision_set.
+ * Parameter gradients and updates stay float. Compiling plans the buffers with
+ * their type, so the precision is set before network_compile.
  */
-matrix *network_backward(network *n, matrix *input, matrix *gradient) {
+network *network_precision_set(network *n, int type) {
   list_node *layer_node;
-  matrix *gradient_update = matrix_copy(gradient);
-  matrix *output;
+  if (n->plan != NULL) {
+    fprintf(stderr, "network_precision_set: set the precision before compiling\n");
+    return NULL;
+  }
+  if (type != MATRIX_FLOAT32 && type != MATRIX_BFLOAT16) {
+    fprintf(stderr, "network_precision_set: unknown type %d\n", type);
+    return NULL;
+  }
+  list_for_each (n->layers, layer_node) {
+    if (layer_precision_set((layer *)layer_node->value, type) == NULL) {
+      return NULL;
+    }
+  }
+  n->precision = type;
+  return n;
+}
 
-  // Update gradients
-  list_for_each_reverse (n->layers, layer_node) {
-    layer *l = (layer *)layer_node->value;
-    if (layer_node->previous != NULL) {
-      layer *pl = (layer *)layer_node->previous->value;
-      output = pl->output;
-    } else {
-      output = input;
+/*
+ * network_buffer is one activation or gradient buffer of a compiled network,
+ * live from step first to step last inclusive, and again from step
+ * recompute_first to recompute_last when its layer is recomputed.
+ */
+typedef struct network_buffer {
+  matrix **m;
+  int type;
+  int rows;
+  int first;
+  int last;
+  int recompute_first;
+  int recompute_last;
+  long size;
+  long offset;
+} network_buffer;
+
+static int network_buffer_compare(const void *a, const void *b) {
+  const network_buffer *x = (const network_buffer *)a, *y = (const network_buffer *)b;
+  return x->size < y->size ? 1 : x->size > y->size ? -1 : 0;
+}
+
+/*
+ * network_buffer_live reports whether a and b are ever live at the same step.
+ */
+static int network_buffer_live(network_buffer *a, network_buffer *b) {
+  int x[2][2] = {{a->first, a->last}, {a->recompute_first, a->recompute_last}};
+  int y[2][2] = {{b->first, b->last}, {b->recompute_first, b->recompute_last}};
+  int i, j;
+  for (i = 0; i < 2; i++) {
+    for (j = 0; j < 2; j++) {
+      if (x[i][0] >= 0 && y[j][0] >= 0 && x[i][0] <= y[j][1] && y[j][0] <= x[i][1]) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * network_buffer_place gives each buffer, largest first, the lowest offset that
+ * doesn't overlap a placed buffer with an overlapping lifetime, and returns the
+ * size of the slab in floats.
+ */
+static long network_buffer_place(network_buffer *buffers, int count) {
+  long total = 0;
+  int i, j;
+  qsort(buffers, count, sizeof(*buffers), &network_buffer_compare);
+  for (i = 0; i < count; i++) {
+    long offset = 0;
+    int moved = 1;
+    while (moved) {
+      moved = 0;
+      for (j = 0; j < i; j++) {
+        network_buffer *p = &buffers[j];
+        if (p->offset < offset + buffers[i].size && offset < p->offset + p->size &&
+            network_buffer_live(p, &buffers[i])) {
+          offset = p->offset + p->size;
+          moved = 1;
+        }
+      }
+    }
+    buffers[i].offset = offset;
+    total = offset + buffers[i].size > total ? offset + buffers[i].size : total;
+  }
+  return total;
+}
+
+/*
+ * network_kept reports whether the output of layer i of count is kept from the
+ * forward to the backward pass, the last output always is.
+ */
+static int network_kept(unsigned char *checkpoints, int i, int count) {
+  return checkpoints == NULL || i == count - 1 || checkpoints[i];
+}
+
+/*
+ * network_plan fills buffers with every buffer of the count layers of plan and
+ * places them for batch samples, returning the size of the slab in floats or -1.
+ * Forward of layer i is step i. Backward then runs from the last layer down,
+ * and before the backward of a kept layer, the layers since the previous kept
+ * one run forward again, one step each.
+ */
+static long network_plan(layer **plan, int count, int batch, unsigned char *checkpoints,
+    network_buffer *buffers, int *buffer_count) {
+  int *recompute, *backward, step = count, from, end, i, j;
+  long alignment = MATRIX_ALIGNMENT / sizeof(float);
+
+  if ((recompute = allocator_allocate(cai_allocator_get(), 2 * count * sizeof(*recompute))) == NULL) {
+    perror("Out of memory\n");
+    return -1;
+  }
+  backward = recompute + count;
+  for (i = 0; i < count; i++) {
+    recompute[i] = -1;
+  }
+  for (i = count - 1; i >= 0; i--) {
+    if (network_kept(checkpoints, i, count)) {
+      for (from = i - 1; from >= 0 && !network_kept(checkpoints, from, count); from--) {
+      }
+      for (j = from + 1; j < i; j++) {
+        recompute[j] = step++;
+      }
     }
-    *gradient_update = *layer_backward(l, output, gradient_update);
+    backward[i] = step++;
   }
-  *gradient_update = *matrix_copy(gradient);
+  end = step - 1;
 
-  // Update gradient weights
-  list_for_each_reverse (n->layers, layer_node) {
+  *buffer_count = 0;
+  for (i = 0; i < count; i++) {
+    layer *l = plan[i];
+    network_buffer output = {&l->output, l->output->type, l->output->rows, i, i == count - 1 ? end : backward[i], -1, -1, 0, 0};
+    network_buffer gradient = {&l->gradient, l->gradient->type, l->gradient->rows, backward[i], i == 0 ? end : backward[i - 1], -1, -1, 0, 0};
+    if (!network_kept(checkpoints, i, count)) {
+      output.last = i + 1;
+      output.recompute_first = recompute[i];
+      output.recompute_last = backward[i];
+    }
+    buffers[(*buffer_count)++] = output;
+    buffers[(*buffer_count)++] = gradient;
+    if (l->delta != NULL) {
+      network_buffer delta = {&l->delta, l->delta->type, l->delta->rows, backward[i], backward[i], -1, -1, 0, 0};
+      buffers[(*buffer_count)++] = delta;
+    }
+  }
+  allocator_release(recompute);
+  for (i = 0; i < *buffer_count; i++) {
+    long size = (long)buffers[i].rows * batch;
+    size = buffers[i].type == MATRIX_BFLOAT16 ? (size + 1) / 2 : size;
+    buffers[i].size = (size + alignment - 1) / alignment * alignment;
+  }
+  return network_buffer_place(buffers, *buffer_count);
+}
+
+/*
+ * network_columns sets the batch of every planned buffer, a compiled network
+ * runs any batch up to the one it was compiled for.
+ */
+static void network_columns(network *n, int columns) {
+  int i;
+  matrix *buffers[3];
+  if (n->columns == columns) {
+    return;
+  }
+  for (i = 0; i < n->count; i++) {
+    int j;
+    buffers[0] = n->plan[i]->output;
+    buffers[1] = n->plan[i]->gradient;
+    buffers[2] = n->plan[i]->delta;
+    for (j = 0; j < 3; j++) {
+      if (buffers[j] != NULL) {
+        buffers[j]->columns = columns;
+        buffers[j]->row_stride = columns;
+      }
+    }
+  }
+  n->columns = columns;
+}
+
+/*
+ * network_compile freezes the layers of n into an array, checks the shape of
+ * every layer for a features x batch input and places every activation, delta
+ * and input gradient buffer into one slab, sharing memory between buffers that
+ * are never live at the same step. The layer buffers become views into the slab,
+ * so compiled passes don't allocate. Layers can't be added afterwards, compiling
+ * again replans for a new shape.
+ */
+network *network_compile(network *n, int features, int batch) {
+  list_node *layer_node;
+  network_buffer *buffers;
+  layer **plan;
+  matrix *slab = NULL, **views;
+  long total;
+  int count = 0, buffer_count = 0, rows = features, i;
+
+  if (n->inference) {
+    fprintf(stderr, "network_compile: an inference network has no buffers to plan\n");
+    return NULL;
+  }
+  list_for_each (n->layers, layer_node) {
     layer *l = (layer *)layer_node->value;
-    if (layer_node->previous != NULL) {
-      layer *pl = (layer *)layer_node->previous->value;
-      output = pl->output;
-    } else {
-      output = input;
+    if (l->input_size != rows) {
+      fprintf(stderr, "network_compile: layer %d takes %d features, got %d\n", count, l->input_size, rows);
+      return NULL;
     }
+    rows = l->output_size;
+    count++;
+  }
+  if (count == 0 || batch <= 0) {
+    fprintf(stderr, "network_compile: nothing to compile\n");
+    return NULL;
+  }
+  plan = allocator_allocate(cai_allocator_get(), count * sizeof(*plan));
+  buffers = allocator_allocate(cai_allocator_get(), 3 * count * sizeof(*buffers));
+  views = allocator_allocate(cai_allocator_get(), 3 * count * sizeof(*views));
+  if (plan == NULL || buffers == NULL || views == NULL) {
+    perror("Out of memory\n");
+    goto fail;
+  }
 
-    if (l->update != NULL) {
-      layer_update(l, output, gradient_update, 1);
+  i = 0;
+  list_for_each (n->layers, layer_node) {
+    plan[i++] = (layer *)layer_node->value;
+  }
+  if ((total = network_plan(plan, count, batch, n->checkpoints, buffers, &buffer_count)) < 0 ||
+      (slab = matrix_create(1, total, NULL)) == NULL ||
+      matrix_allocator_set(slab, n->allocator) == NULL) {
+    goto fail;
+  }
+  /* Every view is made before any layer buffer is swapped, so failing leaves n as it was. */
+  for (i = 0; i < buffer_count; i++) {
+    matrix *v = views[i] = matrix_view(slab);
+    if (v == NULL) {
+      while (i-- > 0) {
+        matrix_free(views[i]);
+      }
+      goto fail;
+    }
+    v->type = buffers[i].type;
+    v->data = v->type == MATRIX_FLOAT32 ? slab->data + buffers[i].offset : NULL;
+    v->half = v->type == MATRIX_BFLOAT16 ? (bfloat16 *)(slab->data + buffers[i].offset) : NULL;
+    v->rows = buffers[i].rows;
+    v->columns = batch;
+    v->row_stride = batch;
+    v->column_stride = 1;
+  }
+  for (i = 0; i < buffer_count; i++) {
+    matrix_free(*buffers[i].m);
+    *buffers[i].m = views[i];
+  }
+  allocator_release(buffers);
+  allocator_release(views);
+
+  if (n->slab != NULL) {
+    matrix_free(n->slab);
+  }
+  allocator_release(n->plan);
+  n->plan = plan;
+  n->count = count;
+  n->features = features;
+  n->batch = batch;
+  n->columns = batch;
+  n->slab = slab;
+  n->workspace = total * sizeof(float);
+  return n;
+
+fail:
+  if (slab != NULL) {
+    matrix_free(slab);
+  }
+  allocator_release(plan);
+  allocator_release(buffers);
+  allocator_release(views);
+  return NULL;
+}
+
+/*
+ * network_workspace returns the bytes of activation and gradient memory a
+ * compiled network uses at its peak, 0 when it isn't compiled.
+ */
+long network_workspace(network *n) {
+  return n->workspace;
+}
+
+/*
+ * network_checkpoint_every fills checkpoints to keep the output of every
+ * every-th layer of count, NULL keeps them all.
+ */
+static unsigned char *network_checkpoint_every(unsigned char *checkpoints, int count, int every) {
+  int i;
+  if (every <= 1) {
+    return NULL;
+  }
+  for (i = 0; i < count; i++) {
+    checkpoints[i] = (i + 1) % every == 0;
+  }
+  return checkpoints;
+}
+
+/*
+ * network_checkpoint_replan makes checkpoints, owned by n from then on, the
+ * checkpoints of n and compiles n again for them.
+ */
+static network *network_checkpoint_replan(network *n, unsigned char *checkpoints) {
+  if (n->checkpoints != checkpoints) {
+    allocator_release(n->checkpoints);
+    n->checkpoints = checkpoints;
+  }
+  return network_compile(n, n->features, n->batch);
+}
+
+/*
+ * network_checkpoint keeps only the output of every every-th layer of the
+ * compiled network n, and the last one, from the forward to the backward pass.
+ * network_backward runs the layers in between forward again before it needs
+ * them, so their outputs share memory with later buffers and the workspace
+ * shrinks from every layer to the kept ones and one segment. An every of 1
+ * keeps every output again.
+ */
+network *network_checkpoint(network *n, int every) {
+  unsigned char *checkpoints = NULL;
+  if (n->plan == NULL || n->inference) {
+    fprintf(stderr, "network_checkpoint: compile the network first\n");
+    return NULL;
+  }
+  if (every <= 0) {
+    fprintf(stderr, "network_checkpoint: every must be positive, got %d\n", every);
+    return NULL;
+  }
+  if (every > 1 && (checkpoints = allocator_allocate(cai_allocator_get(), n->count)) == NULL) {
+    perror("Out of memory\n");
+    return NULL;
+  }
+  return network_checkpoint_replan(n, network_checkpoint_every(checkpoints, n->count, every));
+}
+
+/*
+ * network_checkpoint_set keeps, or with keep 0 recomputes, the output of layer
+ * index of the compiled network n, see network_checkpoint.
+ */
+network *network_checkpoint_set(network *n, int index, int keep) {
+  unsigned char *checkpoints = n->checkpoints;
+  if (n->plan == NULL || n->inference) {
+    fprintf(stderr, "network_checkpoint_set: compile the network first\n");
+    return NULL;
+  }
+  if (index < 0 || index >= n->count) {
+    fprintf(stderr, "network_checkpoint_set: no layer %d in %d layers\n", index, n->count);
+    return NULL;
+  }
+  if (checkpoints == NULL) {
+    if ((checkpoints = allocator_allocate(cai_allocator_get(), n->count)) == NULL) {
+      perror("Out of memory\n");
+      return NULL;
+    }
+    memset(checkpoints, 1, n->count);
+  }
+  checkpoints[index] = keep != 0;
+  return network_checkpoint_replan(n, checkpoints);
+}
+
+/*
+ * network_checkpoint_budget picks the checkpoints of the compiled network n
+ * that recompute the fewest layers while its workspace fits in bytes, keeping
+ * every every-th output for the smallest every that fits.
+ */
+network *network_checkpoint_budget(network *n, long bytes) {
+  unsigned char *checkpoints;
+  network_buffer *buffers;
+  long total = -1, least = -1;
+  int every, buffer_count;
+  if (n->plan == NULL || n->inference) {
+    fprintf(stderr, "network_checkpoint_budget: compile the network first\n");
+    return NULL;
+  }
+  checkpoints = allocator_allocate(cai_allocator_get(), n->count);
+  buffers = allocator_allocate(cai_allocator_get(), 3 * n->count * sizeof(*buffers));
+  if (checkpoints == NULL || buffers == NULL) {
+    perror("Out of memory\n");
+    allocator_release(checkpoints);
+    allocator_release(buffers);
+    return NULL;
+  }
+  for (every = 1; every <= n->count; every++) {
+    unsigned char *keep = network_checkpoint_every(checkpoints, n->count, every);
+    if ((total = network_plan(n->plan, n->count, n->batch, keep, buffers, &buffer_count)) < 0) {
+      break;
+    }
+    least = least < 0 || total < least ? total : least;
+    if (total * (long)sizeof(float) <= bytes) {
+      break;
+    }
+  }
+  allocator_release(buffers);
+  if (total < 0 || total * (long)sizeof(float) > bytes) {
+    if (total >= 0) {
+      fprintf(stderr, "network_checkpoint_budget: %ld bytes don't fit, %ld are needed\n",
+        bytes, least * (long)sizeof(float));
+    }
+    allocator_release(checkpoints);
+    return NULL;
+  }
+  if (every == 1) {
+    allocator_release(checkpoints);
+    checkpoints = NULL;
+  }
+  return network_checkpoint_replan(n, checkpoints);
+}
+
+/*
+ * network_inference drops every training buffer of n, see layer_inference, and
+ * freezes its layers into an array. The weights are only read from then on, so
+ * any number of threads can run n at once, each through its own network_context.
+ */
+network *network_inference(network *n) {
+  list_node *layer_node;
+  int i = 0;
+  if (n->inference) {
+    return n;
+  }
+  if (n->slab != NULL) {
+    matrix_free(n->slab);
+    n->slab = NULL;
+    n->workspace = 0;
+  }
+  allocator_release(n->plan);
+  allocator_release(n->checkpoints);
+  n->checkpoints = NULL;
+  n->count = 0;
+  list_for_each (n->layers, layer_node) {
+    n->count++;
+  }
+  if ((n->plan = allocator_allocate(cai_allocator_get(), n->count * sizeof(*n->plan))) == NULL) {
+    perror("Out of memory\n");
+    return NULL;
+  }
+  list_for_each (n->layers, layer_node) {
+    n->plan[i++] = layer_inference((layer *)layer_node->value);
+  }
+  n->features = n->count > 0 ? n->plan[0]->input_size : 0;
+  n->inference = 1;
+  return n;
+}
+
+/*
+ * network_context_create returns the activation scratch one thread needs to run
+ * the inference network n on up to batch samples, two buffers the layers write
+ * to in turn.
+ */
+network_context *network_context_create(network *n, int batch) {
+  network_context *c;
+  int i, rows = 0;
+  if (!n->inference) {
+    fprintf(stderr, "network_context_create: network isn't in inference mode\n");
+    return NULL;
+  }
+  if ((c = allocator_allocate(cai_allocator_get(), sizeof(*c))) == NULL) {
+    perror("Out of memory\n");
+    return NULL;
+  }
+  for (i = 0; i < n->count; i++) {
+    rows = n->plan[i]->output_size > rows ? n->plan[i]->output_size : rows;
+  }
+  c->network = n;
+  c->batch = batch;
+  c->buffers[0] = matrix_create(rows, batch, NULL);
+  c->buffers[1] = matrix_create(rows, batch, NULL);
+  if (c->buffers[0] == NULL || c->buffers[1] == NULL) {
+    network_context_free(c);
+    return NULL;
+  }
+  return c;
+}
+
+/*
+ * network_infer runs the inference network of c on input and returns the output,
+ * the buffer belongs to c and is reused by the next call. Calls on different
+ * contexts don't share any mutable state.
+ */
+matrix *network_infer(network_context *c, matrix *input) {
+  network *n = c->network;
+  matrix *outputs = input;
+  int i;
+  if (input->rows != n->features || input->columns > c->batch) {
+    fprintf(stderr, "network_infer: input (%d, %d) doesn't fit the context (%d, %d)\n",
+      input->rows, input->columns, n->features, c->batch);
+    return NULL;
+  }
+  for (i = 0; i < n->count; i++) {
+    layer *l = n->plan[i];
+    matrix *output = c->buffers[i % 2];
+    profile_mark mark;
+    matrix_resize(output, l->output_size, input->columns);
+    profile_begin(&mark);
+    if ((outputs = l->forward(l, outputs, output)) == NULL) {
+      return NULL;
+    }
+    if (mark.active) {
+      profile_layer(&mark, PROFILE_FORWARD, i, l, input->columns);
     }
+  }
+  return outputs;
+}
 
-    *gradient_update = *matrix_copy(l->gradient);
+/*
+ * network_context_free
+ */
+void network_context_free(network_context *c) {
+  if (c->buffers[0] != NULL) {
+    matrix_free(c->buffers[0]);
   }
+  if (c->buffers[1] != NULL) {
+    matrix_free(c->buffers[1]);
+  }
+  allocator_release(c);
+}
 
+/*
+ * network_quantize turns n into an inference network, see network_inference,
+ * with its linear and dense layers quantized to int8, see layer_quantize. The
+ * input scale of each layer is calibrated from its float inputs on the
+ * calibration batch, and when error isn't NULL it's set to the largest absolute
+ * difference between the float and quantized outputs on that batch. Every layer
+ * is quantized before any is swapped in, so on failure n stays a float network.
+ */
+network *network_quantize(network *n, matrix *calibration, float *error) {
+  network_context *c;
+  matrix *outputs, *expected = NULL;
+  quantized **weights;
+  float *scales;
+  int i, j, k;
+  if (network_inference(n) == NULL || (c = network_context_create(n, calibration->columns)) == NULL) {
+    return NULL;
+  }
+  scales = allocator_allocate(cai_allocator_get(), n->count * sizeof(*scales));
+  weights = allocator_allocate(cai_allocator_get(), n->count * sizeof(*weights));
+  if (scales == NULL || weights == NULL) {
+    perror("Out of memory\n");
+    allocator_release(scales);
+    allocator_release(weights);
+    network_context_free(c);
+    return NULL;
+  }
+  outputs = calibration;
+  for (i = 0; i < n->count && outputs != NULL; i++) {
+    layer *l = n->plan[i];
+    matrix *output = c->buffers[i % 2];
+    scales[i] = quantize_scale(outputs);
+    matrix_resize(output, l->output_size, calibration->columns);
+    outputs = l->forward(l, outputs, output);
+  }
+  if (outputs != NULL && error != NULL) {
+    expected = matrix_copy(outputs);
+  }
+  for (i = 0; i < n->count; i++) {
+    int type = layer_type(n->plan[i]);
+    weights[i] = NULL;
+    if (outputs != NULL && (type == LAYER_LINEAR || type == LAYER_DENSE) &&
+        (weights[i] = quantize_create(n->plan[i]->weights, scales[i])) == NULL) {
+      outputs = NULL;
+    }
+  }
+  for (i = 0; i < n->count; i++) {
+    if (weights[i] != NULL && outputs == NULL) {
+      quantize_free(weights[i]);
+    } else if (weights[i] != NULL) {
+      layer_quantized_set(n->plan[i], weights[i]);
+    }
+  }
+  if (outputs != NULL && expected != NULL) {
+    if ((outputs = network_infer(c, calibration)) != NULL) {
+      *error = 0;
+      for (j = 0; j < outputs->rows; j++) {
+        for (k = 0; k < outputs->columns; k++) {
+          float d = matrix_at(outputs, j, k) - matrix_at(expected, j, k);
+          d = d < 0 ? -d : d;
+          *error = d > *error ? d : *error;
+        }
+      }
+    }
+  }
+  if (expected != NULL) {
+    matrix_free(expected);
+  }
+  allocator_release(scales);
+  allocator_release(weights);
+  network_context_free(c);
+  return outputs == NULL ? NULL : n;
+}
+
+/*
+ * network_forward_layers runs the layers of n from index first on, starting
+ * from outputs, a batch of columns samples.
+ */
+static matrix *network_forward_layers(network *n, matrix *outputs, int first, int columns) {
+  list_node *layer_node = n->layers->head;
+  profile_mark mark;
+  int i;
+  for (i = 0; layer_node != NULL; i++, layer_node = layer_node->next) {
+    layer *l = n->plan != NULL ? n->plan[i] : (layer *)layer_node->value;
+    if (i < first) {
+      continue;
+    }
+    profile_begin(&mark);
+    if ((outputs = layer_forward(l, outputs)) == NULL) {
+      return NULL;
+    }
+    if (mark.active) {
+      profile_layer(&mark, PROFILE_FORWARD, i, l, columns);
+    }
+  }
+  return outputs;
+}
+
+/*
+ * network_forward returns the output of the last layer, the buffer belongs to
+ * that layer and is reused by the next call.
+ */
+matrix *network_forward(network *n, matrix *input) {
+  if (n->inference) {
+    fprintf(stderr, "network_forward: run an inference network through network_infer\n");
+    return NULL;
+  }
+  if (n->plan != NULL) {
+    if (input->rows != n->features || input->columns > n->batch) {
+      fprintf(stderr, "network_forward: input (%d, %d) doesn't fit the plan (%d, %d)\n",
+        input->rows, input->columns, n->features, n->batch);
+      return NULL;
+    }
+    network_columns(n, input->columns);
+  }
+  return network_forward_layers(n, input, 0, input->columns);
+}
+
+/*
+ * network_forward_first runs the sparse input into the first layer of n,
+ * recorded as phase.
+ */
+static matrix *network_forward_first(network *n, sparse *input, int phase) {
+  layer *l = (layer *)n->layers->head->value;
+  profile_mark mark;
+  matrix *outputs;
+  profile_begin(&mark);
+  if ((outputs = layer_forward_sparse(l, input)) == NULL) {
+    return NULL;
+  }
+  if (mark.active) {
+    profile_stop(&mark, phase, 0, l, 2.0 * l->output_size * input->count,
+      (double)l->output_size * (input->count * sizeof(float) + input->rows * sizeof(float)));
+  }
+  return outputs;
+}
+
+/*
+ * network_forward_sparse is network_forward for a sparse batch, one sample per
+ * row, into a first layer that is linear or dense, see layer_forward_sparse.
+ */
+matrix *network_forward_sparse(network *n, sparse *input) {
+  matrix *outputs;
+  if (n->inference || n->layers->head == NULL) {
+    fprintf(stderr, "network_forward_sparse: nothing to train\n");
+    return NULL;
+  }
+  if (n->plan != NULL) {
+    if (input->columns != n->features || input->rows > n->batch) {
+      fprintf(stderr, "network_forward_sparse: input (%d, %d) doesn't fit the plan (%d, %d)\n",
+        input->columns, input->rows, n->features, n->batch);
+      return NULL;
+    }
+    network_columns(n, input->rows);
+  }
+  if ((outputs = network_forward_first(n, input, PROFILE_FORWARD)) == NULL) {
+    return NULL;
+  }
+  return network_forward_layers(n, outputs, 1, input->rows);
+}
+
+/*
+ * network_recompute runs forward again the layers of a checkpointed n whose
+ * outputs the backward of the kept layer i reads, the ones since the previous
+ * kept layer. The first layer runs on input, or on sparse when it is sparse.
+ */
+static network *network_recompute(network *n, matrix *input, sparse *sparse_input, int i) {
+  profile_mark mark;
+  matrix *outputs;
+  int from, j;
+  if (n->checkpoints == NULL || !network_kept(n->checkpoints, i, n->count)) {
+    return n;
+  }
+  for (from = i - 1; from >= 0 && !network_kept(n->checkpoints, from, n->count); from--) {
+  }
+  for (j = from + 1; j < i; j++) {
+    layer *l = n->plan[j];
+    if (j == 0 && sparse_input != NULL) {
+      if (network_forward_first(n, sparse_input, PROFILE_RECOMPUTE) == NULL) {
+        return NULL;
+      }
+      continue;
+    }
+    outputs = j == 0 ? input : n->plan[j - 1]->output;
+    profile_begin(&mark);
+    if (layer_forward(l, outputs) == NULL) {
+      return NULL;
+    }
+    if (mark.active) {
+      profile_layer(&mark, PROFILE_RECOMPUTE, j, l, outputs->columns);
+    }
+  }
+  return n;
+}
+
+/*
+ * network_backward_layers runs backward and accumulates the parameter
+ * gradients of the layers of n down to index first, returning the gradient
+ * w.r.t the input of layer first.
+ */
+static matrix *network_backward_layers(network *n, matrix *input, sparse *sparse_input, matrix *gradient, int first) {
+  list_node *layer_node = n->layers->tail;
+  matrix *gradient_update = gradient;
+  profile_mark mark;
+  int i;
+
+  for (i = n->layers->length - 1; i >= first; i--, layer_node = layer_node->previous) {
+    layer *l = n->plan != NULL ? n->plan[i] : (layer *)layer_node->value;
+    matrix *gradient_output = gradient_update, *output = input;
+    if (network_recompute(n, input, sparse_input, i) == NULL) {
+      return NULL;
+    }
+    if (i > 0) {
+      output = n->plan != NULL ? n->plan[i - 1]->output : ((layer *)layer_node->previous->value)->output;
+    }
+
+    profile_begin(&mark);
+    if ((gradient_update = layer_backward(l, output, gradient_output)) == NULL) {
+      return NULL;
+    }
+    if (mark.active) {
+      profile_layer(&mark, PROFILE_BACKWARD, i, l, gradient_output->columns);
+    }
+
+    if (l->update != NULL) {
+      profile_begin(&mark);
+      layer_update(l, output, gradient_output, 1);
+      if (mark.active) {
+        profile_layer(&mark, PROFILE_GRADIENT, i, l, gradient_output->columns);
+      }
+    }
+  }
   return gradient_update;
 }
 
 /*
- * network_update
+ * network_backward accumulates the parameter gradients and returns the gradient
+ * w.r.t the network input, owned by the first layer.
+ */
+matrix *network_backward(network *n, matrix *input, matrix *gradient) {
+  if (n->inference) {
+    fprintf(stderr, "network_backward: an inference network has no gradients\n");
+    return NULL;
+  }
+  return network_backward_layers(n, input, NULL, gradient, 0);
+}
+
+/*
+ * network_backward_sparse is network_backward for the sparse batch of
+ * network_forward_sparse. A sparse input has no gradient, it returns the
+ * gradient w.r.t the output of the first layer.
+ */
+matrix *network_backward_sparse(network *n, sparse *input, matrix *gradient) {
+  profile_mark mark;
+  layer *l;
+  if (n->inference || n->layers->head == NULL) {
+    fprintf(stderr, "network_backward_sparse: an inference network has no gradients\n");
+    return NULL;
+  }
+  if ((gradient = network_backward_layers(n, NULL, input, gradient, 1)) == NULL) {
+    return NULL;
+  }
+  l = (layer *)n->layers->head->value;
+  profile_begin(&mark);
+  if (layer_update_sparse(l, input, gradient, 1) == NULL) {
+    return NULL;
+  }
+  if (mark.active) {
+    profile_stop(&mark, PROFILE_GRADIENT, 0, l, 2.0 * l->output_size * input->count,
+      2.0 * l->output_size * input->count * sizeof(float));
+  }
+  return gradient;
+}
+
+/*
+ * network_update applies the accumulated gradients, only to the weight columns
+ * a layer touched when it only saw sparse inputs.
  */
 network *network_update(network *n, float learning_rate) {
   list_node *layer_node;
+  profile_mark mark;
+  int i = 0;
   list_for_each (n->layers, layer_node) {
     layer *l = (layer *)layer_node->value;
-    if (l->weights != NULL) {
-      matrix *scaled_weights = matrix_scale(l->gradient_weights, -learning_rate);
-      *l->weights = *matrix_add(l->weights, scaled_weights);
-      matrix_free(scaled_weights);
+    profile_begin(&mark);
+    if (l->gradient_weights != NULL) {
+      if (l->touched != NULL && !l->touched->all) {
+        sparse_set_axpy(l->touched, -learning_rate, l->gradient_weights, l->weights);
+      } else {
+        matrix_axpy(-learning_rate, l->gradient_weights, l->weights);
+      }
+      if (l->compute_weights != NULL) {
+        matrix_copy_into(l->weights, l->compute_weights);
+      }
     }
-    if (l->biases != NULL) {
-      matrix *scaled_biases = matrix_scale(l->gradient_biases, -learning_rate);
-      *l->biases = *matrix_add(l->biases, scaled_biases);
-      matrix_free(scaled_biases);
+    if (l->gradient_biases != NULL) {
+      matrix_axpy(-learning_rate, l->gradient_biases, l->biases);
+    }
+    if (mark.active && (l->gradient_weights != NULL || l->gradient_biases != NULL)) {
+      profile_layer(&mark, PROFILE_UPDATE, i, l, 0);
     }
+    i++;
   }
   return n;
 }
@@ -109,20 +945,438 @@ void network_gradient_zero(network *n) {
   list_for_each (n->layers, layer_node) {
     layer *l = (layer *)layer_node->value;
     if (l->gradient_weights != NULL) {
-      *l->gradient_weights = *matrix_create(
-        l->gradient_weights->rows,
-        l->gradient_weights->columns,
-        &matrix_zeros
-      );
+      if (l->touched != NULL && !l->touched->all) {
+        sparse_set_zero(l->touched, l->gradient_weights);
+      } else {
+        matrix_fill(l->gradient_weights, 0);
+      }
+    }
+    if (l->touched != NULL) {
+      sparse_set_clear(l->touched);
     }
     if (l->gradient_biases != NULL) {
-      *l->gradient_biases = *matrix_create(
-        l->gradient_biases->rows,
-        l->gradient_biases->columns,
-        &matrix_zeros
-      );
+      matrix_fill(l->gradient_biases, 0);
+    }
+  }
+}
+
+/*
+ * network_profile_order sorts profile entries by layer, then phase, with the
+ * criterion last.
+ */
+static int network_profile_order(const void *a, const void *b) {
+  const profile_entry *x = (const profile_entry *)a, *y = (const profile_entry *)b;
+  unsigned int i = (unsigned int)x->index, j = (unsigned int)y->index;
+  if (i != j) {
+    return i < j ? -1 : 1;
+  }
+  return x->phase - y->phase;
+}
+
+/*
+ * network_profile_in reports whether e was recorded for a layer of n, or for
+ * the criterion.
+ */
+static int network_profile_in(network *n, profile_entry *e) {
+  list_node *layer_node;
+  if (e->layer == NULL) {
+    return 1;
+  }
+  list_for_each (n->layers, layer_node) {
+    if ((const layer *)layer_node->value == e->layer) {
+      return 1;
     }
   }
+  return 0;
+}
+
+/*
+ * network_profile_report writes a table of what p recorded for the layers of
+ * n, one row per layer and phase, with the share of the total time and the
+ * achieved GFLOP/s and GB/s from the profile's estimates. Other networks
+ * profiled alongside, replicas included, are left out, the criterion rows
+ * count every criterion.
+ */
+network *network_profile_report(network *n, profile *p, FILE *out) {
+  profile_entry *entries;
+  double total = 0;
+  int count = 0, i;
+
+  pthread_mutex_lock(&p->lock);
+  if ((entries = allocator_allocate(allocator_system(), (p->count + 1) * sizeof(*entries))) == NULL) {
+    pthread_mutex_unlock(&p->lock);
+    perror("Out of memory\n");
+    return NULL;
+  }
+  for (i = 0; i < p->count; i++) {
+    if (network_profile_in(n, &p->entries[i])) {
+      entries[count++] = p->entries[i];
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+  qsort(entries, count, sizeof(*entries), &network_profile_order);
+
+  for (i = 0; i < count; i++) {
+    total += entries[i].nanoseconds;
+  }
+  fprintf(out, "%5s %-10s %11s %-13s %8s %10s %10s %10s %6s %8s %8s %7s %10s\n",
+    "layer", "type", "shape", "phase", "calls", "total ms", "mean us", "max us",
+    "share", "GFLOP/s", "GB/s", "allocs", "alloc KB");
+  for (i = 0; i < count; i++) {
+    profile_entry *e = &entries[i];
+    char index[16], shape[32];
+    if (e->index >= 0) {
+      snprintf(index, sizeof(index), "%d", e->index);
+      snprintf(shape, sizeof(shape), "%dx%d", e->input_size, e->output_size);
+    } else {
+      snprintf(index, sizeof(index), "-");
+      snprintf(shape, sizeof(shape), "-");
+    }
+    fprintf(out, "%5s %-10s %11s %-13s %8ld %10.3f %10.2f %10.2f %5.1f%% %8.2f %8.2f %7ld %10.1f\n",
+      index, profile_entry_type(e), shape, profile_phase_name(e->phase), e->calls, e->nanoseconds / 1e6,
+      e->nanoseconds / 1e3 / e->calls, e->max_nanoseconds / 1e3,
+      total > 0 ? 100 * e->nanoseconds / total : 0.0,
+      e->nanoseconds > 0 ? e->flops / e->nanoseconds : 0.0,
+      e->nanoseconds > 0 ? e->bytes / e->nanoseconds : 0.0,
+      e->allocations, e->allocated_bytes / 1024.0);
+  }
+  fprintf(out, "%d layers, %.3f ms profiled\n", n->layers->length, total / 1e6);
+  allocator_release(entries);
+  return n;
+}
+
+/*
+ * network_header starts a saved network, followed by a network_record per layer
+ * and then the parameters, every section starting on a MATRIX_ALIGNMENT
+ * boundary so mapped parameters are as aligned as allocated ones. The checksum
+ * covers the whole file with the checksum itself read as zero.
+ */
+typedef struct network_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t endian;
+  uint32_t count;
+  uint32_t alignment;
+  uint64_t size;
+  uint64_t checksum;
+  uint8_t reserved[24];
+} network_header;
+
+typedef struct network_record {
+  int32_t type;
+  int32_t activation;
+  int32_t input;
+  int32_t output;
+  int32_t config[4];
+  uint64_t weights;
+  uint64_t biases;
+  uint64_t reserved[2];
+} network_record;
+
+static uint64_t network_align(uint64_t size) {
+  return (size + MATRIX_ALIGNMENT - 1) / MATRIX_ALIGNMENT * MATRIX_ALIGNMENT;
+}
+
+/*
+ * network_checksum folds size bytes, a multiple of 8, into hash a word at a time.
+ */
+static uint64_t network_checksum(uint64_t hash, const void *data, uint64_t size) {
+  const unsigned char *bytes = (const unsigned char *)data;
+  uint64_t i, word;
+  for (i = 0; i < size; i += sizeof(word)) {
+    memcpy(&word, bytes + i, sizeof(word));
+    hash = (hash ^ word) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/*
+ * network_write writes m and its zero padding to file through buffer, folding
+ * it into hash.
+ */
+static int network_write(FILE *file, matrix *m, float *buffer, uint64_t *hash) {
+  uint64_t size = network_align((uint64_t)m->rows * m->columns * sizeof(float));
+  int i, j;
+  memset(buffer, 0, size);
+  for (i = 0; i < m->rows; i++) {
+    for (j = 0; j < m->columns; j++) {
+      buffer[(long)i * m->columns + j] = matrix_at(m, i, j);
+    }
+  }
+  *hash = network_checksum(*hash, buffer, size);
+  return fwrite(buffer, 1, size, file) == size;
+}
+
+/*
+ * network_geometry_pack stores the geometry of a convolution or pooling layer
+ * in the config of its record, the filters follow from the output size.
+ */
+static void network_geometry_pack(convolution *c, int32_t *config) {
+  config[0] = c->height;
+  config[1] = c->width;
+  config[2] = c->channels;
+  config[3] = c->kernel | c->stride << 8 | c->padding << 16 | c->dilation << 24;
+}
+
+/*
+ * network_record_layer creates the layer of r with zero parameters.
+ */
+static layer *network_record_layer(network_record *r) {
+  int32_t *config = r->config;
+  convolution *c;
+  int positions;
+  if (r->type != LAYER_CONV2D && r->type != LAYER_MAX_POOL && r->type != LAYER_AVG_POOL) {
+    return layer_create_type(r->type, r->activation, r->input, r->output);
+  }
+  if ((c = convolution_create(config[0], config[1], config[2], 1, config[3] & 0xff,
+      (config[3] >> 8) & 0xff, (config[3] >> 16) & 0xff, (config[3] >> 24) & 0xff)) == NULL) {
+    return NULL;
+  }
+  positions = c->output_height * c->output_width;
+  c->filters = r->output / positions;
+  if (c->filters <= 0 || convolution_output_size(c) != r->output || convolution_input_size(c) != r->input) {
+    convolution_free(c);
+    return NULL;
+  }
+  return r->type == LAYER_CONV2D ? layer_create_conv2d(r->activation, NULL, c) :
+    layer_create_pool(r->type == LAYER_MAX_POOL ? CONVOLUTION_MAX : CONVOLUTION_AVERAGE, c);
+}
+
+/*
+ * network_save writes the layer types, shapes, activations and parameters of n
+ * to path. Only built in layer types can be saved.
+ */
+network *network_save(network *n, char *path) {
+  list_node *layer_node;
+  network_header header;
+  network_record *records;
+  FILE *file;
+  float *buffer = NULL;
+  uint64_t offset, largest = 0, hash;
+  int count = 0, i = 0, ok = 1;
+
+  list_for_each (n->layers, layer_node) {
+    convolution *c = ((layer *)layer_node->value)->convolution;
+    if (layer_type((layer *)layer_node->value) < 0) {
+      fprintf(stderr, "network_save: layer %d has no built in type\n", count);
+      return NULL;
+    }
+    if (c != NULL && (c->kernel > 255 || c->stride > 255 || c->padding > 255 || c->dilation > 255)) {
+      fprintf(stderr, "network_save: the geometry of layer %d doesn't fit a record\n", count);
+      return NULL;
+    }
+    count++;
+  }
+  if ((records = allocator_allocate(cai_allocator_get(), (count + 1) * sizeof(*records))) == NULL) {
+    perror("Out of memory\n");
+    return NULL;
+  }
+  memset(records, 0, count * sizeof(*records));
+  offset = sizeof(header) + count * sizeof(*records);
+  list_for_each (n->layers, layer_node) {
+    layer *l = (layer *)layer_node->value;
+    network_record *r = &records[i++];
+    r->type = layer_type(l);
+    r->activation = l->activation;
+    r->input = l->input_size;
+    r->output = l->output_size;
+    if (l->convolution != NULL) {
+      network_geometry_pack(l->convolution, r->config);
+    }
+    if (l->weights != NULL) {
+      uint64_t size = network_align((uint64_t)l->weights->rows * l->weights->columns * sizeof(float));
+      r->weights = offset;
+      offset += size;
+      largest = size > largest ? size : largest;
+    }
+    if (l->biases != NULL) {
+      uint64_t size = network_align((uint64_t)l->biases->rows * l->biases->columns * sizeof(float));
+      r->biases = offset;
+      offset += size;
+      largest = size > largest ? size : largest;
+    }
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, NETWORK_MAGIC, sizeof(header.magic));
+  header.version = NETWORK_VERSION;
+  header.endian = NETWORK_ENDIAN;
+  header.count = count;
+  header.alignment = MATRIX_ALIGNMENT;
+  header.size = offset;
+  hash = network_checksum(0xcbf29ce484222325ULL, &header, sizeof(header));
+  hash = network_checksum(hash, records, count * sizeof(*records));
+
+  if ((file = fopen(path, "wb")) == NULL) {
+    perror("network_save");
+    allocator_release(records);
+    return NULL;
+  }
+  if (largest > 0 && (buffer = allocator_allocate(cai_allocator_get(), largest)) == NULL) {
+    perror("Out of memory\n");
+    ok = 0;
+  }
+  ok = ok && fseek(file, sizeof(header) + count * sizeof(*records), SEEK_SET) == 0;
+  list_for_each (n->layers, layer_node) {
+    layer *l = (layer *)layer_node->value;
+    if (ok && l->weights != NULL) {
+      ok = network_write(file, l->weights, buffer, &hash);
+    }
+    if (ok && l->biases != NULL) {
+      ok = network_write(file, l->biases, buffer, &hash);
+    }
+  }
+  header.checksum = hash;
+  ok = ok && fseek(file, 0, SEEK_SET) == 0 &&
+    fwrite(&header, sizeof(header), 1, file) == 1 &&
+    (count == 0 || fwrite(records, sizeof(*records), count, file) == (size_t)count);
+  ok = fclose(file) == 0 && ok;
+  allocator_release(buffer);
+  allocator_release(records);
+  if (!ok) {
+    fprintf(stderr, "network_save: failed to write %s\n", path);
+    return NULL;
+  }
+  return n;
+}
+
+/*
+ * network_bounded is whether length bytes at offset fit in size bytes, without
+ * overflowing on offsets and lengths from the file.
+ */
+static int network_bounded(uint64_t offset, uint64_t length, uint64_t size) {
+  return offset <= size && length <= size - offset;
+}
+
+/*
+ * network_parameters points or copies the parameters at offset of the file in
+ * data into m.
+ */
+static matrix *network_parameters(matrix **m, char *data, uint64_t offset, int map) {
+  if (!map) {
+    memcpy((*m)->data, data + offset, (size_t)(*m)->rows * (*m)->columns * sizeof(float));
+    return *m;
+  }
+  matrix *v = matrix_view(*m);
+  if (v == NULL) {
+    return NULL;
+  }
+  v->data = (float *)(data + offset);
+  matrix_free(*m);
+  return *m = v;
+}
+
+/*
+ * network_load reads a network saved by network_save and checks its checksum.
+ * With map the file is mapped copy on write and the parameters are views into
+ * the mapped pages, so loading copies nothing and processes mapping one file
+ * share its pages until they write to them. The mapping lives as long as the
+ * returned network.
+ */
+network *network_load(char *path, int map) {
+  network_header header;
+  network_record *records;
+  struct stat status;
+  network *n = NULL;
+  char *data;
+  uint64_t hash, size, i;
+  int file;
+
+  if ((file = open(path, O_RDONLY)) < 0 || fstat(file, &status) != 0) {
+    perror("network_load");
+    if (file >= 0) {
+      close(file);
+    }
+    return NULL;
+  }
+  size = (uint64_t)status.st_size;
+  if (size < sizeof(header)) {
+    fprintf(stderr, "network_load: %s is too short\n", path);
+    close(file);
+    return NULL;
+  }
+  if (map) {
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+    data = data == MAP_FAILED ? NULL : data;
+  } else if ((data = allocator_allocate(cai_allocator_get(), size)) != NULL) {
+    for (i = 0; i < size; ) {
+      ssize_t read_size = read(file, data + i, size - i);
+      if (read_size <= 0) {
+        allocator_release(data);
+        data = NULL;
+        break;
+      }
+      i += read_size;
+    }
+  }
+  close(file);
+  if (data == NULL) {
+    perror("network_load");
+    return NULL;
+  }
+
+  memcpy(&header, data, sizeof(header));
+  records = (network_record *)(data + sizeof(header));
+  if (memcmp(header.magic, NETWORK_MAGIC, sizeof(header.magic)) != 0 ||
+      header.endian != NETWORK_ENDIAN || header.version > NETWORK_VERSION ||
+      header.alignment != MATRIX_ALIGNMENT || header.size != size || size % 8 != 0 ||
+      header.count > (size - sizeof(header)) / sizeof(*records)) {
+    fprintf(stderr, "network_load: %s isn't a version %d network\n", path, NETWORK_VERSION);
+    goto fail;
+  }
+  hash = header.checksum;
+  header.checksum = 0;
+  if (network_checksum(network_checksum(0xcbf29ce484222325ULL, &header, sizeof(header)),
+      data + sizeof(header), size - sizeof(header)) != hash) {
+    fprintf(stderr, "network_load: %s fails its checksum\n", path);
+    goto fail;
+  }
+
+  if ((n = network_create()) == NULL) {
+    goto fail;
+  }
+  for (i = 0; i < header.count; i++) {
+    network_record *r = &records[i];
+    uint64_t weights, biases;
+    layer *l;
+    if (r->input <= 0 || r->output <= 0 || (l = network_record_layer(r)) == NULL) {
+      fprintf(stderr, "network_load: layer %d of %s is invalid\n", (int)i, path);
+      goto fail;
+    }
+    if (network_layer_add(n, l) == NULL) {
+      layer_free(l);
+      goto fail;
+    }
+    weights = l->weights == NULL ? 0 : (uint64_t)l->weights->rows * l->weights->columns * sizeof(float);
+    biases = l->biases == NULL ? 0 : (uint64_t)l->biases->rows * sizeof(float);
+    if ((l->weights != NULL && (r->weights % MATRIX_ALIGNMENT != 0 || !network_bounded(r->weights, weights, size))) ||
+        (l->biases != NULL && (r->biases % MATRIX_ALIGNMENT != 0 || !network_bounded(r->biases, biases, size)))) {
+      fprintf(stderr, "network_load: layer %d of %s is out of bounds\n", (int)i, path);
+      goto fail;
+    }
+    if ((l->weights != NULL && network_parameters(&l->weights, data, r->weights, map) == NULL) ||
+        (l->biases != NULL && network_parameters(&l->biases, data, r->biases, map) == NULL)) {
+      goto fail;
+    }
+  }
+  if (map) {
+    n->mapping = data;
+    n->mapping_size = size;
+  } else {
+    allocator_release(data);
+  }
+  return n;
+
+fail:
+  if (n != NULL) {
+    network_free(n);
+  }
+  if (map) {
+    munmap(data, size);
+  } else {
+    allocator_release(data);
+  }
+  return NULL;
 }
 
 /*
@@ -134,6 +1388,14 @@ void network_free(network *n) {
     layer_free((layer *)layer_node->value);
   }
   list_free(n->layers);
-  free(n);
+  if (n->slab != NULL) {
+    matrix_free(n->slab);
+  }
+  allocator_release(n->plan);
+  allocator_release(n->checkpoints);
+  if (n->mapping != NULL) {
+    munmap(n->mapping, n->mapping_size);
+  }
+  allocator_release(n);
   n = NULL;
 }
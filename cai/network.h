@@ -3,17 +3,57 @@
 #include "list.h"
 #include "matrix.h"
 #include "layer.h"
+#include "allocator.h"
+#include "profile.h"
+#include "sparse.h"
 
 typedef struct network {
   list *layers;
+  allocator *allocator;
+  layer **plan;
+  int count;
+  int features;
+  int batch;
+  int columns;
+  unsigned char *checkpoints;
+  matrix *slab;
+  long workspace;
+  int inference;
+  int precision;
+  void *mapping;
+  long mapping_size;
 } network;
 
+typedef struct network_context {
+  network *network;
+  matrix *buffers[2];
+  int batch;
+} network_context;
+
 network *network_create();
+network *network_replicate(network *n);
 network *network_layer_add(network *n, layer *l);
+network *network_allocator_set(network *n, allocator *a);
+network *network_precision_set(network *n, int type);
+network *network_compile(network *n, int features, int batch);
+long network_workspace(network *n);
+network *network_checkpoint(network *n, int every);
+network *network_checkpoint_set(network *n, int index, int keep);
+network *network_checkpoint_budget(network *n, long bytes);
+network *network_inference(network *n);
+network_context *network_context_create(network *n, int batch);
+matrix *network_infer(network_context *c, matrix *input);
+void network_context_free(network_context *c);
+network *network_quantize(network *n, matrix *calibration, float *error);
+network *network_save(network *n, char *path);
+network *network_load(char *path, int map);
 matrix *network_forward(network *n, matrix *input);
 matrix *network_backward(network *n, matrix *output, matrix *gradient);
+matrix *network_forward_sparse(network *n, sparse *input);
+matrix *network_backward_sparse(network *n, sparse *input, matrix *gradient);
 network *network_update(network *n, float learning_rate);
 void network_gradient_zero(network *n);
+network *network_profile_report(network *n, profile *p, FILE *out);
 void network_free(network *n);
 
 #endif
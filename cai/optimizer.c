@@ -0,0 +1,240 @@
+#include "optimizer.h"
+#include "matrix.h"
+#include "layer.h"
+#include "network.h"
+#include "allocator.h"
+#include "thread.h"
+#include "profile.h"
+#include "kernel.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * OPTIMIZER_BLOCKS bounds the partial sums of optimizer_norm, the fused update
+ * itself is a kernel_table entry built for each instruction set, see
+ * kernel_optimizer.h.
+ */
+#define OPTIMIZER_BLOCKS 256
+
+static void optimizer_range(void *context, long begin, long end) {
+  kernel_get()->update((const kernel_update *)context, begin, end);
+}
+
+/*
+ * optimizer_columns is the update of the weights of a layer that only saw
+ * sparse inputs, restricted to the columns it touched.
+ */
+typedef struct optimizer_columns {
+  const kernel_update *update;
+  sparse_set *touched;
+  long stride;
+} optimizer_columns;
+
+static void optimizer_columns_range(void *context, long begin, long end) {
+  optimizer_columns *c = (optimizer_columns *)context;
+  kernel_get()->update_columns(c->update, c->touched->indices, c->touched->count, c->stride, begin, end);
+}
+
+/*
+ * optimizer_touched returns the columns the weights of s are updated in, or
+ * NULL when every column is.
+ */
+static sparse_set *optimizer_touched(optimizer_state *s) {
+  sparse_set *touched = s->layer->touched;
+  return !s->biases && touched != NULL && !touched->all ? touched : NULL;
+}
+
+/*
+ * optimizer_create returns an optimizer of kind for the parameters n has now,
+ * with zeroed moments. The defaults are a momentum of 0.9, Adam betas of 0.9
+ * and 0.999 with an epsilon of 1e-8, no clipping and no weight decay, except
+ * 0.01 for AdamW.
+ */
+optimizer *optimizer_create(network *n, int kind) {
+  list_node *layer_node;
+  optimizer *o;
+  int count = 0, index = 0, i;
+  if (kind < OPTIMIZER_SGD || kind > OPTIMIZER_ADAMW) {
+    fprintf(stderr, "optimizer_create: unknown optimizer %d\n", kind);
+    return NULL;
+  }
+  if (n->inference) {
+    fprintf(stderr, "optimizer_create: an inference network has no gradients\n");
+    return NULL;
+  }
+  list_for_each (n->layers, layer_node) {
+    layer *l = (layer *)layer_node->value;
+    count += (l->gradient_weights != NULL) + (l->gradient_biases != NULL);
+  }
+  if ((o = allocator_allocate(cai_allocator_get(), sizeof(*o))) == NULL ||
+      (o->states = allocator_allocate(cai_allocator_get(), (count + 1) * sizeof(*o->states))) == NULL) {
+    perror("Out of memory\n");
+    allocator_release(o);
+    return NULL;
+  }
+  o->network = n;
+  o->count = 0;
+  o->kind = kind;
+  o->momentum = 0.9f;
+  o->beta1 = 0.9f;
+  o->beta2 = 0.999f;
+  o->epsilon = 1e-8f;
+  o->weight_decay = kind == OPTIMIZER_ADAMW ? 0.01f : 0;
+  o->clip_norm = 0;
+  o->steps = 0;
+  list_for_each (n->layers, layer_node) {
+    layer *l = (layer *)layer_node->value;
+    for (i = 0; i < 2; i++) {
+      matrix *value = i ? l->biases : l->weights, *gradient = i ? l->gradient_biases : l->gradient_weights;
+      optimizer_state *s = &o->states[o->count];
+      if (gradient == NULL) {
+        continue;
+      }
+      if (!matrix_contiguous(value) || !matrix_contiguous(gradient)) {
+        fprintf(stderr, "optimizer_create: parameters must be contiguous\n");
+        optimizer_free(o);
+        return NULL;
+      }
+      s->layer = l;
+      s->index = index;
+      s->biases = i;
+      s->first = kind == OPTIMIZER_SGD ? NULL : matrix_create(value->rows, value->columns, NULL);
+      s->second = kind < OPTIMIZER_ADAM ? NULL : matrix_create(value->rows, value->columns, NULL);
+      o->count++;
+      if ((kind != OPTIMIZER_SGD && s->first == NULL) || (kind >= OPTIMIZER_ADAM && s->second == NULL)) {
+        optimizer_free(o);
+        return NULL;
+      }
+    }
+    index++;
+  }
+  return o;
+}
+
+typedef struct optimizer_squares {
+  const float *x;
+  float *partial;
+  long size;
+  long block;
+} optimizer_squares;
+
+static void optimizer_squares_range(void *context, long begin, long end) {
+  optimizer_squares *s = (optimizer_squares *)context;
+  long b;
+  for (b = begin; b < end; b++) {
+    long last = (b + 1) * s->block < s->size ? (b + 1) * s->block : s->size;
+    s->partial[b] = kernel_get()->squares(s->x + b * s->block, last - b * s->block);
+  }
+}
+
+/*
+ * optimizer_norm returns the global L2 norm of every gradient o updates from.
+ * The weight gradient of a layer that only saw sparse inputs is zero outside
+ * the columns it touched, only those are summed.
+ */
+float optimizer_norm(optimizer *o) {
+  float partial[OPTIMIZER_BLOCKS];
+  double total = 0;
+  int i, b;
+  for (i = 0; i < o->count; i++) {
+    optimizer_state *s = &o->states[i];
+    matrix *gradient = s->biases ? s->layer->gradient_biases : s->layer->gradient_weights;
+    sparse_set *touched = optimizer_touched(s);
+    long size = (long)gradient->rows * gradient->columns;
+    long block = size / OPTIMIZER_BLOCKS > THREAD_GRAIN ? size / OPTIMIZER_BLOCKS + 1 : THREAD_GRAIN;
+    long blocks = (size + block - 1) / block;
+    optimizer_squares e = {gradient->data, partial, size, block};
+    if (touched != NULL) {
+      long row;
+      int k;
+      for (row = 0; row < gradient->rows; row++) {
+        const float *g = gradient->data + row * gradient->columns;
+        for (k = 0; k < touched->count; k++) {
+          total += (double)g[touched->indices[k]] * g[touched->indices[k]];
+        }
+      }
+      continue;
+    }
+    thread_parallel_for(blocks, 1, &optimizer_squares_range, &e);
+    for (b = 0; b < blocks; b++) {
+      total += partial[b];
+    }
+  }
+  return (float)sqrt(total);
+}
+
+/*
+ * optimizer_step applies one update to the parameters of the network from the
+ * gradients accumulated since they were last zeroed, scaled down first so their
+ * global norm is at most clip_norm when it is set. Like network_update, the
+ * weights of a layer that only saw sparse inputs are updated in the columns it
+ * touched alone: the moments and weight decay of the other columns are lazy,
+ * they stay as they are until a batch touches them.
+ */
+optimizer *optimizer_step(optimizer *o, float learning_rate) {
+  profile_mark mark = {0};
+  double flops = 0, bytes = 0;
+  float scale = 1;
+  int i;
+  o->steps++;
+  if (o->clip_norm > 0) {
+    float norm = optimizer_norm(o);
+    scale = norm > o->clip_norm ? o->clip_norm / norm : 1;
+  }
+  for (i = 0; i < o->count; i++) {
+    optimizer_state *s = &o->states[i];
+    layer *l = s->layer;
+    matrix *value = s->biases ? l->biases : l->weights;
+    matrix *gradient = s->biases ? l->gradient_biases : l->gradient_weights;
+    matrix *compute = s->biases ? NULL : l->compute_weights;
+    kernel_update t = {
+      o->kind, value->data, gradient->data,
+      s->first == NULL ? NULL : s->first->data,
+      s->second == NULL ? NULL : s->second->data,
+      compute == NULL ? NULL : compute->half,
+      learning_rate, scale, s->biases ? 0 : o->weight_decay, o->momentum, o->beta1, o->beta2, o->epsilon,
+      1 / (1 - powf(o->beta1, (float)o->steps)), 1 / (1 - powf(o->beta2, (float)o->steps))
+    };
+    sparse_set *touched = optimizer_touched(s);
+    long size = (long)value->rows * (touched != NULL ? touched->count : value->columns);
+    int moments = (s->first != NULL) + (s->second != NULL);
+    if (i == 0 || o->states[i - 1].layer != l) {
+      profile_begin(&mark);
+    }
+    if (touched != NULL) {
+      optimizer_columns c = {&t, touched, value->columns};
+      long grain = THREAD_GRAIN / (touched->count + 1);
+      thread_parallel_for(value->rows, grain > 0 ? grain : 1, &optimizer_columns_range, &c);
+    } else {
+      thread_parallel_for(size, THREAD_GRAIN, &optimizer_range, &t);
+    }
+    if (mark.active) {
+      flops += (2.0 + 4 * moments) * size;
+      bytes += (3.0 + 2 * moments) * size * sizeof(float) + (compute != NULL ? size * sizeof(bfloat16) : 0);
+      if (i + 1 == o->count || o->states[i + 1].layer != l) {
+        profile_stop(&mark, PROFILE_UPDATE, s->index, l, flops, bytes);
+        flops = bytes = 0;
+      }
+    }
+  }
+  return o;
+}
+
+/*
+ * optimizer_free releases the moments, not the network.
+ */
+void optimizer_free(optimizer *o) {
+  int i;
+  for (i = 0; i < o->count; i++) {
+    if (o->states[i].first != NULL) {
+      matrix_free(o->states[i].first);
+    }
+    if (o->states[i].second != NULL) {
+      matrix_free(o->states[i].second);
+    }
+  }
+  allocator_release(o->states);
+  allocator_release(o);
+}
@@ -0,0 +1,52 @@
+#ifndef __OPTIMIZER_H__
+#define __OPTIMIZER_H__
+#include "matrix.h"
+#include "layer.h"
+#include "network.h"
+
+enum {
+  OPTIMIZER_SGD,
+  OPTIMIZER_MOMENTUM,
+  OPTIMIZER_NESTEROV,
+  OPTIMIZER_ADAM,
+  OPTIMIZER_ADAMW
+};
+
+/*
+ * optimizer_state is the state of one parameter tensor, the weights or the
+ * biases of a layer, with its first and second moments when the kind uses them.
+ * index is the position of the layer in the network.
+ */
+typedef struct optimizer_state {
+  layer *layer;
+  int index;
+  int biases;
+  matrix *first;
+  matrix *second;
+} optimizer_state;
+
+/*
+ * optimizer updates the parameters of a network from their accumulated
+ * gradients. The hyperparameters can be changed between steps, weight_decay
+ * only applies to weights and clip_norm of 0 disables clipping.
+ */
+typedef struct optimizer {
+  network *network;
+  optimizer_state *states;
+  int count;
+  int kind;
+  float momentum;
+  float beta1;
+  float beta2;
+  float epsilon;
+  float weight_decay;
+  float clip_norm;
+  long steps;
+} optimizer;
+
+optimizer *optimizer_create(network *n, int kind);
+optimizer *optimizer_step(optimizer *o, float learning_rate);
+float optimizer_norm(optimizer *o);
+void optimizer_free(optimizer *o);
+
+#endif
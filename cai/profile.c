@@ -0,0 +1,276 @@
+#include "profile.h"
+#include "allocator.h"
+#include "layer.h"
+#include "matrix.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * profile_active is the profile instrumented calls record into, NULL when
+ * profiling is off.
+ */
+profile *profile_active = NULL;
+
+static const char *profile_phases[PROFILE_PHASES] = {
+  "forward", "backward", "gradient", "update", "loss", "loss_gradient", "recompute"
+};
+
+static const char *profile_types[LAYER_TYPES] = {
+  "none", "linear", "sigmoid", "tanh", "relu", "leaky_relu", "gelu", "softplus", "dense",
+  "conv2d", "max_pool", "avg_pool"
+};
+
+/*
+ * profile_thread numbers the threads that record trace events, in the order
+ * they first record one.
+ */
+static __thread int profile_thread = 0;
+static int profile_threads = 0;
+
+static double profile_now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec * 1e9 + (double)t.tv_nsec;
+}
+
+/*
+ * profile_create
+ */
+profile *profile_create() {
+  profile *p;
+  if ((p = allocator_allocate(allocator_system(), sizeof(*p))) == NULL) {
+    perror("Out of memory\n");
+    return NULL;
+  }
+  p->entries = NULL;
+  p->count = p->capacity = 0;
+  p->trace = NULL;
+  p->events = 0;
+  p->origin = profile_now();
+  pthread_mutex_init(&p->lock, NULL);
+  return p;
+}
+
+/*
+ * profile_trace streams every recorded call of p to path as Chrome trace JSON,
+ * which chrome://tracing and Perfetto open once p is freed.
+ */
+profile *profile_trace(profile *p, char *path) {
+  FILE *f;
+  if ((f = fopen(path, "w")) == NULL) {
+    fprintf(stderr, "profile_trace: cannot open %s\n", path);
+    return NULL;
+  }
+  pthread_mutex_lock(&p->lock);
+  if (p->trace != NULL) {
+    fprintf(p->trace, "\n]}\n");
+    fclose(p->trace);
+  }
+  fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+  p->trace = f;
+  p->events = 0;
+  pthread_mutex_unlock(&p->lock);
+  return p;
+}
+
+/*
+ * profile_reset drops the aggregated entries, the trace keeps streaming.
+ */
+void profile_reset(profile *p) {
+  pthread_mutex_lock(&p->lock);
+  p->count = 0;
+  pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * profile_free closes the trace and releases p, deactivating it if needed.
+ */
+void profile_free(profile *p) {
+  if (profile_active == p) {
+    cai_profile_set(NULL);
+  }
+  if (p->trace != NULL) {
+    fprintf(p->trace, "\n]}\n");
+    fclose(p->trace);
+  }
+  pthread_mutex_destroy(&p->lock);
+  allocator_release(p->entries);
+  allocator_release(p);
+}
+
+/*
+ * cai_profile_set makes p the active profile, NULL turns profiling off, and
+ * returns the previous one.
+ */
+profile *cai_profile_set(profile *p) {
+  return __atomic_exchange_n(&profile_active, p, __ATOMIC_ACQ_REL);
+}
+
+/*
+ * cai_profile_get
+ */
+profile *cai_profile_get() {
+  return __atomic_load_n(&profile_active, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * profile_phase_name
+ */
+const char *profile_phase_name(int phase) {
+  return phase >= 0 && phase < PROFILE_PHASES ? profile_phases[phase] : "unknown";
+}
+
+/*
+ * profile_type_name names the layer type recorded for layer index.
+ */
+static const char *profile_type_name(int type, int index) {
+  if (index < 0) {
+    return "criterion";
+  }
+  if (type == LAYER_TYPES) {
+    return "quantized";
+  }
+  return type >= 0 && type < LAYER_TYPES ? profile_types[type] : "custom";
+}
+
+/*
+ * profile_entry_type names the layer type of e.
+ */
+const char *profile_entry_type(profile_entry *e) {
+  return profile_type_name(e->type, e->index);
+}
+
+/*
+ * profile_start
+ */
+void profile_start(profile_mark *m) {
+  allocator *a = cai_allocator_get();
+  m->active = 1;
+  m->allocations = __atomic_load_n(&a->allocations, __ATOMIC_RELAXED);
+  m->allocated_bytes = __atomic_load_n(&a->allocated_bytes, __ATOMIC_RELAXED);
+  m->start = profile_now();
+}
+
+/*
+ * profile_entry_find returns the entry of phase of l at index, adding it.
+ */
+static profile_entry *profile_entry_find(profile *p, int phase, int index, const layer *l) {
+  profile_entry *e;
+  int i;
+  for (i = 0; i < p->count; i++) {
+    if (p->entries[i].layer == l && p->entries[i].index == index && p->entries[i].phase == phase) {
+      return &p->entries[i];
+    }
+  }
+  if (p->count == p->capacity) {
+    int capacity = p->capacity > 0 ? 2 * p->capacity : 32;
+    if ((e = allocator_allocate(allocator_system(), capacity * sizeof(*e))) == NULL) {
+      perror("Out of memory\n");
+      return NULL;
+    }
+    if (p->count > 0) {
+      memcpy(e, p->entries, p->count * sizeof(*e));
+    }
+    allocator_release(p->entries);
+    p->entries = e;
+    p->capacity = capacity;
+  }
+  e = &p->entries[p->count++];
+  memset(e, 0, sizeof(*e));
+  e->layer = l;
+  e->index = index;
+  e->phase = phase;
+  return e;
+}
+
+/*
+ * profile_stop records the call started at m into the active profile. flops
+ * and bytes, the memory it reads and writes, are estimates from the shapes.
+ */
+void profile_stop(profile_mark *m, int phase, int index, layer *l, double flops, double bytes) {
+  double end = profile_now(), nanoseconds = end - m->start;
+  allocator *a = cai_allocator_get();
+  long allocations = (long)(__atomic_load_n(&a->allocations, __ATOMIC_RELAXED) - m->allocations);
+  long allocated = (long)(__atomic_load_n(&a->allocated_bytes, __ATOMIC_RELAXED) - m->allocated_bytes);
+  profile *p = cai_profile_get();
+  profile_entry *e;
+
+  if (p == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&p->lock);
+  if ((e = profile_entry_find(p, phase, index, l)) != NULL) {
+    if (l != NULL) {
+      e->type = l->quantized != NULL ? LAYER_TYPES : layer_type(l);
+      e->input_size = l->input_size;
+      e->output_size = l->output_size;
+    }
+    e->calls++;
+    e->nanoseconds += nanoseconds;
+    e->max_nanoseconds = nanoseconds > e->max_nanoseconds ? nanoseconds : e->max_nanoseconds;
+    e->flops += flops;
+    e->bytes += bytes;
+    e->allocations += allocations;
+    e->allocated_bytes += allocated;
+  }
+  if (p->trace != NULL) {
+    if (profile_thread == 0) {
+      profile_thread = __atomic_add_fetch(&profile_threads, 1, __ATOMIC_RELAXED);
+    }
+    fprintf(p->trace,
+      "%s{\"name\": \"%s %d %s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+      "\"pid\": 1, \"tid\": %d, \"args\": {\"flops\": %.0f, \"bytes\": %.0f, \"allocations\": %ld}}",
+      p->events++ > 0 ? ",\n" : "", profile_type_name(e != NULL ? e->type : -1, index), index,
+      profile_phase_name(phase), profile_phase_name(phase), (m->start - p->origin) / 1e3,
+      nanoseconds / 1e3, profile_thread, flops, bytes, allocations);
+  }
+  pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * profile_layer records a call of l over columns samples, estimating the
+ * flops and bytes touched of phase from the layer shape.
+ */
+void profile_layer(profile_mark *m, int phase, int index, layer *l, int columns) {
+  double in = l->input_size, out = l->output_size, cols = columns;
+  double element = l->output != NULL && l->output->type == MATRIX_BFLOAT16 ? 2 : 4;
+  double weight = l->quantized != NULL ? 1 : l->compute_weights != NULL ? 2 : 4;
+  double flops, bytes;
+  int type = l->quantized != NULL ? LAYER_LINEAR : layer_type(l);
+
+  if (type == LAYER_LINEAR || type == LAYER_DENSE || type == LAYER_CONV2D) {
+    convolution *c = l->convolution;
+    double params = c != NULL ? (double)l->weights->rows * l->weights->columns : in * out;
+    double biases = c != NULL ? c->filters : out;
+    double macs = c != NULL ? params * c->output_height * c->output_width : params;
+    switch (phase) {
+      case PROFILE_FORWARD:
+      case PROFILE_RECOMPUTE:
+        flops = 2 * macs * cols + out * cols;
+        bytes = params * weight + (in + out) * cols * element;
+        break;
+      case PROFILE_BACKWARD:
+        flops = 2 * macs * cols;
+        bytes = params * weight + (in + 2 * out) * cols * element;
+        break;
+      case PROFILE_GRADIENT:
+        flops = 2 * macs * cols + out * cols;
+        bytes = 2 * (params + biases) * 4 + (in + out) * cols * element;
+        break;
+      default:
+        flops = 2 * (params + biases);
+        bytes = 3 * (params + biases) * 4 + params * (l->compute_weights != NULL ? 2 : 0);
+        break;
+    }
+  } else if (type == LAYER_MAX_POOL || type == LAYER_AVG_POOL) {
+    double window = (double)l->convolution->kernel * l->convolution->kernel;
+    flops = phase == PROFILE_UPDATE ? 0 : window * out * cols;
+    bytes = phase == PROFILE_UPDATE ? 0 : (phase == PROFILE_BACKWARD ? 2 * in + 2 * out : in + out) * cols * element;
+  } else {
+    flops = phase == PROFILE_UPDATE ? 0 : out * cols;
+    bytes = phase == PROFILE_UPDATE ? 0 : (phase == PROFILE_FORWARD || phase == PROFILE_RECOMPUTE ? 2 : 3) * out * cols * element;
+  }
+  profile_stop(m, phase, index, l, flops, bytes);
+}
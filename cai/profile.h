@@ -0,0 +1,95 @@
+#ifndef __PROFILE_H_
+#define __PROFILE_H_
+#include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "layer.h"
+
+enum {
+  PROFILE_FORWARD,
+  PROFILE_BACKWARD,
+  PROFILE_GRADIENT,
+  PROFILE_UPDATE,
+  PROFILE_LOSS,
+  PROFILE_LOSS_GRADIENT,
+  PROFILE_RECOMPUTE,
+  PROFILE_PHASES
+};
+
+/*
+ * profile_entry aggregates every call of one phase of one layer, at index in
+ * its network. Entries are keyed by the layer, so networks profiled together,
+ * or a network and its replicas, keep their own. layer is NULL and index -1
+ * for the criterion, whichever criterion it was.
+ */
+typedef struct profile_entry {
+  const layer *layer;
+  int index;
+  int phase;
+  int type;
+  int input_size;
+  int output_size;
+  long calls;
+  double nanoseconds;
+  double max_nanoseconds;
+  double flops;
+  double bytes;
+  long allocations;
+  long allocated_bytes;
+} profile_entry;
+
+/*
+ * profile collects entries while it is the active profile, and streams Chrome
+ * trace events to trace when one is open.
+ */
+typedef struct profile {
+  profile_entry *entries;
+  int count;
+  int capacity;
+  FILE *trace;
+  long events;
+  double origin;
+  pthread_mutex_t lock;
+} profile;
+
+/*
+ * profile_mark is the start of one measured call, active is 0 when nothing
+ * is being profiled.
+ */
+typedef struct profile_mark {
+  int active;
+  double start;
+  size_t allocations;
+  size_t allocated_bytes;
+} profile_mark;
+
+extern profile *profile_active;
+
+profile *profile_create();
+profile *profile_trace(profile *p, char *path);
+void profile_reset(profile *p);
+void profile_free(profile *p);
+profile *cai_profile_set(profile *p);
+profile *cai_profile_get();
+void profile_start(profile_mark *m);
+void profile_stop(profile_mark *m, int phase, int index, layer *l, double flops, double bytes);
+void profile_layer(profile_mark *m, int phase, int index, layer *l, int columns);
+const char *profile_phase_name(int phase);
+const char *profile_entry_type(profile_entry *e);
+
+/*
+ * profile_begin starts a mark, building with -DCAI_PROFILE_DISABLE compiles
+ * profiling out, otherwise it costs one predictable branch when no profile is
+ * active.
+ */
+static inline void profile_begin(profile_mark *m) {
+#ifndef CAI_PROFILE_DISABLE
+  if (__builtin_expect(profile_active != NULL, 0)) {
+    profile_start(m);
+    return;
+  }
+#endif
+  m->active = 0;
+}
+
+#endif
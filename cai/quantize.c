@@ -0,0 +1,225 @@
+#include "quantize.h"
+#include "matrix.h"
+#include "activation.h"
+#include "allocator.h"
+#include "kernel.h"
+#include "thread.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * QUANTIZE_ROWS is the number of output rows whose tile is dequantized and
+ * activated together, sized so the tile stays in L1.
+ */
+#define QUANTIZE_ROWS 16
+
+/*
+ * quantize_round rounds x to the nearest integer in [-127, 127].
+ */
+static inline int quantize_round(float x) {
+  x = x > 127 ? 127 : x < -127 ? -127 : x;
+  return (int)(x + (x < 0 ? -0.5f : 0.5f));
+}
+
+/*
+ * quantize_scale returns the symmetric int8 scale covering the largest
+ * magnitude in m, 1 when m is all zeros.
+ */
+float quantize_scale(matrix *m) {
+  float largest = 0;
+  int i, j;
+  for (i = 0; i < m->rows; i++) {
+    for (j = 0; j < m->columns; j++) {
+      float x = matrix_at(m, i, j);
+      x = x < 0 ? -x : x;
+      largest = x > largest ? x : largest;
+    }
+  }
+  return largest > 0 ? largest / 127 : 1;
+}
+
+/*
+ * quantize_create quantizes weights row by row, each output channel with the
+ * scale of its own largest magnitude, for inputs quantized with input_scale.
+ */
+quantized *quantize_create(matrix *weights, float input_scale) {
+  quantized *q;
+  int i, j;
+  if (input_scale <= 0) {
+    fprintf(stderr, "quantize_create: input scale %g isn't positive\n", input_scale);
+    return NULL;
+  }
+  if ((q = allocator_allocate(cai_allocator_get(), sizeof(*q))) == NULL) {
+    perror("Out of memory\n");
+    return NULL;
+  }
+  q->rows = weights->rows;
+  q->columns = weights->columns;
+  q->stride = (weights->columns + QUANTIZE_BLOCK - 1) / QUANTIZE_BLOCK * QUANTIZE_BLOCK;
+  q->input_scale = input_scale;
+  q->weights = allocator_allocate(cai_allocator_get(), (size_t)q->rows * q->stride);
+  q->scales = allocator_allocate(cai_allocator_get(), q->rows * sizeof(*q->scales));
+  q->sums = allocator_allocate(cai_allocator_get(), q->rows * sizeof(*q->sums));
+  if (q->weights == NULL || q->scales == NULL || q->sums == NULL) {
+    perror("Out of memory\n");
+    quantize_free(q);
+    return NULL;
+  }
+  memset(q->weights, 0, (size_t)q->rows * q->stride);
+  for (i = 0; i < q->rows; i++) {
+    int8_t *row = q->weights + (long)i * q->stride;
+    float largest = 0, inverse;
+    int32_t sum = 0;
+    for (j = 0; j < q->columns; j++) {
+      float w = matrix_at(weights, i, j);
+      w = w < 0 ? -w : w;
+      largest = w > largest ? w : largest;
+    }
+    q->scales[i] = largest > 0 ? largest / 127 : 1;
+    inverse = 1 / q->scales[i];
+    for (j = 0; j < q->columns; j++) {
+      row[j] = (int8_t)quantize_round(matrix_at(weights, i, j) * inverse);
+      sum += row[j];
+    }
+    q->sums[i] = sum;
+  }
+  return q;
+}
+
+static pthread_key_t quantize_key;
+static pthread_once_t quantize_once = PTHREAD_ONCE_INIT;
+static __thread uint8_t *quantize_pack = NULL;
+static __thread long quantize_capacity = 0;
+
+static void quantize_pack_free(void *storage) {
+  allocator_release(storage);
+}
+
+static void quantize_key_create(void) {
+  pthread_key_create(&quantize_key, &quantize_pack_free);
+}
+
+/*
+ * quantize_buffer returns the input pack buffer of the calling thread, grown to
+ * at least size bytes. It is released when the thread exits.
+ */
+static uint8_t *quantize_buffer(long size) {
+  if (size > quantize_capacity) {
+    uint8_t *storage = allocator_allocate(allocator_system(), size);
+    if (storage == NULL) {
+      perror("Out of memory\n");
+      return NULL;
+    }
+    pthread_once(&quantize_once, &quantize_key_create);
+    if (quantize_pack != NULL) {
+      allocator_release(quantize_pack);
+    }
+    pthread_setspecific(quantize_key, storage);
+    quantize_pack = storage;
+    quantize_capacity = size;
+  }
+  return quantize_pack;
+}
+
+/*
+ * quantize_input packs columns [column, column + count) of input as uint8, one
+ * padded row per column, x = round(input / scale) + 128. The padding is never
+ * read into the result since the weight padding is zero.
+ */
+static void quantize_input(quantized *q, matrix *input, int column, int count, uint8_t *pack) {
+  float inverse = 1 / q->input_scale;
+  int i, j;
+  for (i = 0; i < q->columns; i++) {
+    const float *row = matrix_element(input, i, column);
+    for (j = 0; j < count; j++) {
+      pack[(long)j * q->stride + i] = (uint8_t)(quantize_round(row[(long)j * input->column_stride] * inverse) + 128);
+    }
+  }
+}
+
+typedef struct quantize_task {
+  quantized *q;
+  const uint8_t *pack;
+  int column;
+  int count;
+  matrix *output;
+  matrix *bias;
+  int activation;
+} quantize_task;
+
+/*
+ * quantize_range computes output rows [begin, end) for the packed columns. Each
+ * tile of QUANTIZE_ROWS rows is requantized to float, biased and activated in
+ * one pass before it is stored.
+ */
+static void quantize_range(void *context, long begin, long end) {
+  quantize_task *t = context;
+  quantized *q = t->q;
+  float tile[QUANTIZE_ROWS * QUANTIZE_NB] __attribute__((aligned(MATRIX_ALIGNMENT)));
+  int32_t dots[QUANTIZE_NB];
+  long i0, i;
+  int j;
+  for (i0 = begin; i0 < end; i0 += QUANTIZE_ROWS) {
+    long rows = end - i0 < QUANTIZE_ROWS ? end - i0 : QUANTIZE_ROWS;
+    for (i = 0; i < rows; i++) {
+      float scale = q->scales[i0 + i] * q->input_scale;
+      int32_t zero = 128 * q->sums[i0 + i];
+      float bias = t->bias == NULL ? 0 : matrix_at(t->bias, i0 + i, 0);
+      float *row = tile + i * t->count;
+      kernel_get()->dots(q->weights + (i0 + i) * q->stride, t->pack, q->stride, t->count, dots);
+      for (j = 0; j < t->count; j++) {
+        row[j] = scale * (float)(dots[j] - zero) + bias;
+      }
+    }
+    activation_forward(t->activation, tile, tile, rows * t->count);
+    for (i = 0; i < rows; i++) {
+      float *row = matrix_element(t->output, i0 + i, t->column);
+      for (j = 0; j < t->count; j++) {
+        row[(long)j * t->output->column_stride] = tile[i * t->count + j];
+      }
+    }
+  }
+}
+
+/*
+ * quantize_gemm computes output = activation(W * input + bias) with the int8
+ * weights of q, quantizing input on the fly QUANTIZE_NB columns at a time.
+ */
+matrix *quantize_gemm(quantized *q, matrix *input, matrix *output, matrix *bias, int activation) {
+  quantize_task t = {q, NULL, 0, 0, output, bias, activation};
+  long grain;
+  if (input->rows != q->columns || output->rows != q->rows || output->columns != input->columns) {
+    fprintf(stderr, "quantize_gemm: can't multiply (%d, %d) by (%d, %d) into (%d, %d)\n",
+      q->rows, q->columns, input->rows, input->columns, output->rows, output->columns);
+    return NULL;
+  }
+  if ((t.pack = quantize_buffer((long)q->stride * QUANTIZE_NB)) == NULL) {
+    return NULL;
+  }
+  for (t.column = 0; t.column < input->columns; t.column += QUANTIZE_NB) {
+    t.count = input->columns - t.column < QUANTIZE_NB ? input->columns - t.column : QUANTIZE_NB;
+    quantize_input(q, input, t.column, t.count, (uint8_t *)t.pack);
+    grain = (long)q->stride * t.count >= THREAD_GRAIN ?
+      QUANTIZE_ROWS : THREAD_GRAIN / ((long)q->stride * t.count) + 1;
+    thread_parallel_for(q->rows, grain, &quantize_range, &t);
+  }
+  return output;
+}
+
+/*
+ * quantize_free
+ */
+void quantize_free(quantized *q) {
+  if (q->weights != NULL) {
+    allocator_release(q->weights);
+  }
+  if (q->scales != NULL) {
+    allocator_release(q->scales);
+  }
+  if (q->sums != NULL) {
+    allocator_release(q->sums);
+  }
+  allocator_release(q);
+}
@@ -0,0 +1,35 @@
+#ifndef __QUANTIZE_H__
+#define __QUANTIZE_H__
+#include <stdint.h>
+#include "matrix.h"
+
+/*
+ * Rows of quantized weights and packed inputs are padded to QUANTIZE_BLOCK
+ * bytes, so the kernels never handle a tail. Inputs are packed QUANTIZE_NB
+ * columns at a time.
+ */
+#define QUANTIZE_BLOCK 64
+#define QUANTIZE_NB 64
+
+/*
+ * quantized holds a rows x columns weight matrix as int8 with one scale per row
+ * (output channel), w = scales[i] * weights[i][j]. Inputs are quantized to uint8
+ * around a zero point of 128 with one input_scale calibrated ahead of time, and
+ * sums[i] holds the row sums that cancel the zero point out of the product.
+ */
+typedef struct quantized {
+  int8_t *weights;
+  float *scales;
+  int32_t *sums;
+  float input_scale;
+  int rows;
+  int columns;
+  int stride;
+} quantized;
+
+quantized *quantize_create(matrix *weights, float input_scale);
+float quantize_scale(matrix *m);
+matrix *quantize_gemm(quantized *q, matrix *input, matrix *output, matrix *bias, int activation);
+void quantize_free(quantized *q);
+
+#endif
@@ -0,0 +1,486 @@
+#include "server.h"
+#include "allocator.h"
+#include "list.h"
+#include "matrix.h"
+#include "network.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * server_request is one sample waiting for its batch, on the stack of the
+ * server_infer call that queued it.
+ */
+struct server_request {
+  const float *input;
+  float *output;
+  double arrival;
+  int done;
+  int failed;
+  server_request *next;
+};
+
+/*
+ * server_connection is one client of the socket, served by its own thread
+ * that reads a sample, waits for its batch and writes the output back.
+ */
+typedef struct server_connection {
+  server *server;
+  int socket;
+  int finished;
+  pthread_t thread;
+} server_connection;
+
+/*
+ * server_now is in CLOCK_REALTIME seconds, the clock pthread_cond_timedwait
+ * waits on.
+ */
+static double server_now() {
+  struct timespec t;
+  clock_gettime(CLOCK_REALTIME, &t);
+  return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+static struct timespec server_timespec(double seconds) {
+  struct timespec t;
+  t.tv_sec = (time_t)seconds;
+  t.tv_nsec = (long)((seconds - (double)t.tv_sec) * 1e9);
+  if (t.tv_nsec >= 1000000000L) {
+    t.tv_sec++;
+    t.tv_nsec -= 1000000000L;
+  }
+  return t;
+}
+
+/*
+ * server_bucket returns the histogram bucket of value, see SERVER_BUCKETS.
+ */
+static int server_bucket(long value) {
+  int bucket = 0;
+  while (value > 0 && bucket < SERVER_BUCKETS - 1) {
+    value >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+static int server_outputs(server *s) {
+  return s->network->plan[s->network->count - 1]->output_size;
+}
+
+/*
+ * server_run gathers the count samples from first on into the columns of one
+ * input, runs the network once and scatters the output columns back.
+ */
+static int server_run(server *s, server_request *first, int count) {
+  matrix *input = s->input, *output;
+  server_request *r;
+  int i, j;
+  matrix_resize(input, s->network->features, count);
+  for (j = 0, r = first; j < count; j++, r = r->next) {
+    for (i = 0; i < input->rows; i++) {
+      matrix_at(input, i, j) = r->input[i];
+    }
+  }
+  if ((output = network_infer(s->context, input)) == NULL) {
+    return -1;
+  }
+  for (i = 0; i < output->rows; i++) {
+    matrix_load_row(output, i, 0, count, s->row);
+    for (j = 0, r = first; j < count; j++, r = r->next) {
+      r->output[i] = s->row[j];
+    }
+  }
+  return 0;
+}
+
+/*
+ * server_work is the batching thread. It waits for a first request, then for
+ * the queue to fill a batch or for that request's deadline, and runs whatever
+ * is queued by then, up to a batch. Requests queued while a batch runs make up
+ * the next one. Once stopped it drains the queue before it returns.
+ */
+static void *server_work(void *argument) {
+  server *s = (server *)argument;
+  pthread_mutex_lock(&s->lock);
+  for (;;) {
+    server_request *first, *last, *r, *next;
+    int count, failed, j;
+    while (s->running && s->head == NULL) {
+      pthread_cond_wait(&s->arrived, &s->lock);
+    }
+    if (s->head == NULL) {
+      break;
+    }
+    double deadline = s->head->arrival + s->deadline;
+    while (s->running && s->stats.depth < s->batch && server_now() < deadline) {
+      struct timespec until = server_timespec(deadline);
+      pthread_cond_timedwait(&s->arrived, &s->lock, &until);
+    }
+    count = s->stats.depth < s->batch ? s->stats.depth : s->batch;
+    first = last = s->head;
+    for (j = 1; j < count; j++) {
+      last = last->next;
+    }
+    s->head = last->next;
+    if (s->head == NULL) {
+      s->tail = NULL;
+    }
+    s->stats.queue_depths[server_bucket(s->stats.depth)]++;
+    s->stats.batch_sizes[server_bucket(count)]++;
+    s->stats.batches++;
+    s->stats.requests += count;
+    s->stats.depth -= count;
+    pthread_mutex_unlock(&s->lock);
+
+    failed = server_run(s, first, count);
+
+    pthread_mutex_lock(&s->lock);
+    for (j = 0, r = first; j < count; j++, r = next) {
+      next = r->next;
+      r->failed = failed;
+      r->done = 1;
+    }
+    pthread_cond_broadcast(&s->finished);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+/*
+ * server_create returns a server running the inference network n, see
+ * network_inference, on batches of up to batch samples. A request waits at
+ * most deadline seconds for others to share its batch, on top of the batch
+ * running before it.
+ */
+server *server_create(network *n, int batch, double deadline) {
+  server *s;
+  if (batch < 1 || deadline < 0) {
+    fprintf(stderr, "server_create: expected a positive batch and deadline, got %d and %g\n", batch, deadline);
+    return NULL;
+  }
+  if ((s = allocator_allocate(cai_allocator_get(), sizeof(*s))) == NULL) {
+    perror("Out of memory\n");
+    return NULL;
+  }
+  memset(s, 0, sizeof(*s));
+  s->network = n;
+  s->batch = batch;
+  s->deadline = deadline;
+  s->socket = -1;
+  s->wake[0] = s->wake[1] = -1;
+  if ((s->context = network_context_create(n, batch)) == NULL) {
+    allocator_release(s);
+    return NULL;
+  }
+  s->input = matrix_create(n->features, batch, NULL);
+  s->row = allocator_allocate(cai_allocator_get(), batch * sizeof(*s->row));
+  if (s->input == NULL || s->row == NULL) {
+    perror("Out of memory\n");
+    server_free(s);
+    return NULL;
+  }
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->arrived, NULL);
+  pthread_cond_init(&s->finished, NULL);
+  s->running = 1;
+  if (pthread_create(&s->worker, NULL, &server_work, s) != 0) {
+    fprintf(stderr, "server_create: can't start the batching thread\n");
+    s->running = 0;
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->arrived);
+    pthread_cond_destroy(&s->finished);
+    server_free(s);
+    return NULL;
+  }
+  s->started = 1;
+  return s;
+}
+
+/*
+ * server_infer queues one sample of the network's features, waits for the
+ * batch it lands in and writes the sample's outputs into output. Any number of
+ * threads can call it at once, that is what fills the batches. It returns 0,
+ * or -1 when the server is stopped or the forward failed.
+ */
+int server_infer(server *s, const float *input, float *output) {
+  server_request r = {input, output, 0, 0, 0, NULL};
+  pthread_mutex_lock(&s->lock);
+  if (!s->running) {
+    pthread_mutex_unlock(&s->lock);
+    fprintf(stderr, "server_infer: server is stopped\n");
+    return -1;
+  }
+  r.arrival = server_now();
+  if (s->tail != NULL) {
+    s->tail->next = &r;
+  } else {
+    s->head = &r;
+  }
+  s->tail = &r;
+  s->stats.depth++;
+  /* The batching thread only waits for a first request or for a full batch. */
+  if (s->stats.depth == 1 || s->stats.depth == s->batch) {
+    pthread_cond_signal(&s->arrived);
+  }
+  while (!r.done) {
+    pthread_cond_wait(&s->finished, &s->lock);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return r.failed ? -1 : 0;
+}
+
+/*
+ * server_transfer moves size bytes between buffer and socket, all of them or
+ * none when the peer goes away.
+ */
+static int server_transfer(int socket, void *buffer, size_t size, int sending) {
+  char *p = (char *)buffer;
+  while (size > 0) {
+    ssize_t moved;
+#if defined(MSG_NOSIGNAL)
+    moved = sending ? send(socket, p, size, MSG_NOSIGNAL) : recv(socket, p, size, 0);
+#else
+    moved = sending ? send(socket, p, size, 0) : recv(socket, p, size, 0);
+#endif
+    if (moved < 0 && errno == EINTR) {
+      continue;
+    }
+    if (moved <= 0) {
+      return -1;
+    }
+    p += moved;
+    size -= (size_t)moved;
+  }
+  return 0;
+}
+
+/*
+ * server_serve answers the requests of one connection in order until it
+ * closes. The client writes each sample as features native floats and reads
+ * back the outputs the same way. A failed forward closes the connection.
+ */
+static void *server_serve(void *argument) {
+  server_connection *c = (server_connection *)argument;
+  server *s = c->server;
+  size_t in = s->network->features * sizeof(float), out = server_outputs(s) * sizeof(float);
+  float *input = allocator_allocate(cai_allocator_get(), in);
+  float *output = allocator_allocate(cai_allocator_get(), out);
+  while (input != NULL && output != NULL && server_transfer(c->socket, input, in, 0) == 0) {
+    if (server_infer(s, input, output) != 0 || server_transfer(c->socket, output, out, 1) != 0) {
+      break;
+    }
+  }
+  allocator_release(input);
+  allocator_release(output);
+  pthread_mutex_lock(&s->lock);
+  c->finished = 1;
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+/*
+ * server_reap joins the connections that closed, with s->lock held.
+ */
+static void server_reap(server *s, int all) {
+  list_node *node = s->connections->head, *next;
+  while (node != NULL) {
+    server_connection *c = (server_connection *)node->value;
+    next = node->next;
+    if (all || c->finished) {
+      pthread_mutex_unlock(&s->lock);
+      pthread_join(c->thread, NULL);
+      pthread_mutex_lock(&s->lock);
+      close(c->socket);
+      list_remove(s->connections, node);
+      allocator_release(c);
+    }
+    node = next;
+  }
+}
+
+/*
+ * server_accept is the listening thread, it starts a thread per connection
+ * until server_free writes to the wake pipe.
+ */
+static void *server_accept(void *argument) {
+  server *s = (server *)argument;
+  struct pollfd fds[2];
+  fds[0].fd = s->socket;
+  fds[0].events = POLLIN;
+  fds[1].fd = s->wake[0];
+  fds[1].events = POLLIN;
+  for (;;) {
+    server_connection *c;
+    int socket;
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (fds[1].revents != 0) {
+      break;
+    }
+    if ((socket = accept(s->socket, NULL, NULL)) < 0) {
+      continue;
+    }
+    pthread_mutex_lock(&s->lock);
+    server_reap(s, 0);
+    if ((c = allocator_allocate(cai_allocator_get(), sizeof(*c))) == NULL) {
+      perror("Out of memory\n");
+      close(socket);
+    } else {
+      c->server = s;
+      c->socket = socket;
+      c->finished = 0;
+      if (pthread_create(&c->thread, NULL, &server_serve, c) != 0) {
+        fprintf(stderr, "server_listen: can't start a connection thread\n");
+        close(socket);
+        allocator_release(c);
+      } else {
+        list_add(s->connections, c);
+      }
+    }
+    pthread_mutex_unlock(&s->lock);
+  }
+  return NULL;
+}
+
+/*
+ * server_listen_fail undoes a partial server_listen, removing the socket file
+ * only when it was bound.
+ */
+static server *server_listen_fail(server *s, int bound) {
+  if (s->socket >= 0) {
+    close(s->socket);
+    s->socket = -1;
+  }
+  if (s->wake[0] >= 0) {
+    close(s->wake[0]);
+    close(s->wake[1]);
+    s->wake[0] = s->wake[1] = -1;
+  }
+  if (bound) {
+    unlink(s->path);
+  }
+  allocator_release(s->path);
+  s->path = NULL;
+  return NULL;
+}
+
+/*
+ * server_listen serves s on the Unix domain socket at path as well, see
+ * server_serve for the protocol. A stale socket file at path is replaced, any
+ * other file is left alone and fails the bind.
+ */
+server *server_listen(server *s, char *path) {
+  struct sockaddr_un address;
+  struct stat status;
+  if (s->socket >= 0) {
+    fprintf(stderr, "server_listen: already listening on %s\n", s->path);
+    return NULL;
+  }
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "server_listen: socket path too long %s\n", path);
+    return NULL;
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+  if (stat(path, &status) == 0 && S_ISSOCK(status.st_mode)) {
+    unlink(path);
+  }
+  if ((s->connections == NULL && (s->connections = list_create()) == NULL) ||
+      (s->path = allocator_allocate(cai_allocator_get(), strlen(path) + 1)) == NULL) {
+    perror("Out of memory\n");
+    return NULL;
+  }
+  strcpy(s->path, path);
+  if ((s->socket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    fprintf(stderr, "server_listen: can't listen on %s: %s\n", path, strerror(errno));
+    return server_listen_fail(s, 0);
+  }
+  if (bind(s->socket, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    fprintf(stderr, "server_listen: can't listen on %s: %s\n", path, strerror(errno));
+    return server_listen_fail(s, 0);
+  }
+  if (listen(s->socket, SOMAXCONN) != 0 || pipe(s->wake) != 0) {
+    fprintf(stderr, "server_listen: can't listen on %s: %s\n", path, strerror(errno));
+    return server_listen_fail(s, 1);
+  }
+  if (pthread_create(&s->listener, NULL, &server_accept, s) != 0) {
+    fprintf(stderr, "server_listen: can't start the listening thread\n");
+    return server_listen_fail(s, 1);
+  }
+  s->listening = 1;
+  return s;
+}
+
+/*
+ * server_stats_get returns a snapshot of the counters of s.
+ */
+server_stats server_stats_get(server *s) {
+  server_stats stats;
+  pthread_mutex_lock(&s->lock);
+  stats = s->stats;
+  pthread_mutex_unlock(&s->lock);
+  return stats;
+}
+
+/*
+ * server_free stops listening, closes the connections, runs the requests
+ * still queued and releases s.
+ */
+void server_free(server *s) {
+  if (s->listening) {
+    char stop = 0;
+    while (write(s->wake[1], &stop, 1) < 0 && errno == EINTR) {
+    }
+    pthread_join(s->listener, NULL);
+    pthread_mutex_lock(&s->lock);
+    list_node *node;
+    list_for_each(s->connections, node) {
+      shutdown(((server_connection *)node->value)->socket, SHUT_RDWR);
+    }
+    server_reap(s, 1);
+    pthread_mutex_unlock(&s->lock);
+  }
+  if (s->socket >= 0) {
+    close(s->socket);
+    unlink(s->path);
+  }
+  if (s->wake[0] >= 0) {
+    close(s->wake[0]);
+    close(s->wake[1]);
+  }
+  if (s->connections != NULL) {
+    list_free(s->connections);
+  }
+  allocator_release(s->path);
+  if (s->started) {
+    pthread_mutex_lock(&s->lock);
+    s->running = 0;
+    pthread_cond_signal(&s->arrived);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->worker, NULL);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->arrived);
+    pthread_cond_destroy(&s->finished);
+  }
+  if (s->context != NULL) {
+    network_context_free(s->context);
+  }
+  if (s->input != NULL) {
+    matrix_free(s->input);
+  }
+  allocator_release(s->row);
+  allocator_release(s);
+}
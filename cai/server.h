@@ -0,0 +1,63 @@
+#ifndef __SERVER_H_
+#define __SERVER_H_
+#include <pthread.h>
+#include "list.h"
+#include "matrix.h"
+#include "network.h"
+
+/*
+ * SERVER_BUCKETS is the length of the histograms, bucket 0 counts zeros and
+ * bucket b counts values in [2^(b - 1), 2^b), the last one everything above.
+ */
+#define SERVER_BUCKETS 16
+
+/*
+ * server_stats counts the requests and batches a server ran, with histograms
+ * of the batch sizes and of the queue depth each batch was taken from.
+ */
+typedef struct server_stats {
+  long requests;
+  long batches;
+  int depth;
+  long batch_sizes[SERVER_BUCKETS];
+  long queue_depths[SERVER_BUCKETS];
+} server_stats;
+
+typedef struct server_request server_request;
+
+/*
+ * server coalesces single sample requests into batched forwards of an
+ * inference network. A batch runs once batch requests are queued, or once the
+ * oldest queued request has waited deadline seconds.
+ */
+typedef struct server {
+  network *network;
+  network_context *context;
+  matrix *input;
+  float *row;
+  int batch;
+  double deadline;
+  server_request *head;
+  server_request *tail;
+  server_stats stats;
+  int running;
+  int started;
+  pthread_t worker;
+  pthread_mutex_t lock;
+  pthread_cond_t arrived;
+  pthread_cond_t finished;
+  int socket;
+  int wake[2];
+  int listening;
+  char *path;
+  pthread_t listener;
+  list *connections;
+} server;
+
+server *server_create(network *n, int batch, double deadline);
+int server_infer(server *s, const float *input, float *output);
+server *server_listen(server *s, char *path);
+server_stats server_stats_get(server *s);
+void server_free(server *s);
+
+#endif
@@ -0,0 +1,394 @@
+#include "sparse.h"
+#include "matrix.h"
+#include "activation.h"
+#include "allocator.h"
+#include "thread.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SPARSE_CHUNK 256
+
+/*
+ * sparse_grow returns a copy of the first used bytes of old in a buffer of
+ * size bytes, releasing old.
+ */
+static void *sparse_grow(void *old, size_t used, size_t size) {
+  void *p;
+  if ((p = allocator_allocate(cai_allocator_get(), size)) == NULL) {
+    perror("Out of memory\n");
+    return NULL;
+  }
+  if (used > 0) {
+    memcpy(p, old, used);
+  }
+  allocator_release(old);
+  return p;
+}
+
+/*
+ * sparse_create returns an empty sparse matrix with columns columns, rows are
+ * added with sparse_row_add.
+ */
+sparse *sparse_create(int columns) {
+  sparse *s;
+  if ((s = allocator_allocate(cai_allocator_get(), sizeof(*s))) == NULL) {
+    perror("Out of memory\n");
+    return NULL;
+  }
+  s->rows = 0;
+  s->columns = columns;
+  s->row_capacity = 16;
+  s->count = s->capacity = 0;
+  s->indices = NULL;
+  s->values = NULL;
+  if ((s->offsets = allocator_allocate(cai_allocator_get(), (s->row_capacity + 1) * sizeof(long))) == NULL) {
+    perror("Out of memory\n");
+    allocator_release(s);
+    return NULL;
+  }
+  s->offsets[0] = 0;
+  return s;
+}
+
+/*
+ * sparse_row_add appends a row with count nonzeros, at columns indices with
+ * values values. The indices needn't be sorted, repeated ones add up.
+ */
+sparse *sparse_row_add(sparse *s, const int *indices, const float *values, int count) {
+  int k;
+  for (k = 0; k < count; k++) {
+    if (indices[k] < 0 || indices[k] >= s->columns) {
+      fprintf(stderr, "sparse_row_add: column %d out of [0, %d)\n", indices[k], s->columns);
+      return NULL;
+    }
+  }
+  if (s->rows == s->row_capacity) {
+    long *offsets = sparse_grow(s->offsets, (s->rows + 1) * sizeof(long), (2 * s->row_capacity + 1) * sizeof(long));
+    if (offsets == NULL) {
+      return NULL;
+    }
+    s->offsets = offsets;
+    s->row_capacity *= 2;
+  }
+  if (s->count + count > s->capacity) {
+    long capacity = s->capacity > 0 ? s->capacity : 256;
+    int *new_indices;
+    float *new_values;
+    while (capacity < s->count + count) {
+      capacity *= 2;
+    }
+    if ((new_indices = sparse_grow(s->indices, s->count * sizeof(int), capacity * sizeof(int))) == NULL) {
+      return NULL;
+    }
+    s->indices = new_indices;
+    if ((new_values = sparse_grow(s->values, s->count * sizeof(float), capacity * sizeof(float))) == NULL) {
+      return NULL;
+    }
+    s->values = new_values;
+    s->capacity = capacity;
+  }
+  if (count > 0) {
+    memcpy(s->indices + s->count, indices, count * sizeof(int));
+    memcpy(s->values + s->count, values, count * sizeof(float));
+  }
+  s->count += count;
+  s->offsets[++s->rows] = s->count;
+  return s;
+}
+
+/*
+ * sparse_from_matrix returns the nonzeros of the features x batch matrix m as
+ * a sparse batch, one row per column of m.
+ */
+sparse *sparse_from_matrix(matrix *m) {
+  float row[SPARSE_CHUNK];
+  sparse *s;
+  long total;
+  int i, j, k;
+
+  if ((s = allocator_allocate(cai_allocator_get(), sizeof(*s))) == NULL ||
+      (s->offsets = allocator_allocate(cai_allocator_get(), (m->columns + 1) * sizeof(long))) == NULL) {
+    perror("Out of memory\n");
+    allocator_release(s);
+    return NULL;
+  }
+  memset(s->offsets, 0, (m->columns + 1) * sizeof(long));
+  for (i = 0; i < m->rows; i++) {
+    for (j = 0; j < m->columns; j += SPARSE_CHUNK) {
+      int n = m->columns - j < SPARSE_CHUNK ? m->columns - j : SPARSE_CHUNK;
+      matrix_load_row(m, i, j, n, row);
+      for (k = 0; k < n; k++) {
+        s->offsets[j + k + 1] += row[k] != 0;
+      }
+    }
+  }
+  for (j = 0; j < m->columns; j++) {
+    s->offsets[j + 1] += s->offsets[j];
+  }
+  total = s->offsets[m->columns];
+  s->rows = m->columns;
+  s->columns = m->rows;
+  s->row_capacity = m->columns;
+  s->count = s->capacity = total;
+  s->indices = allocator_allocate(cai_allocator_get(), (total + 1) * sizeof(int));
+  s->values = allocator_allocate(cai_allocator_get(), (total + 1) * sizeof(float));
+  if (s->indices == NULL || s->values == NULL) {
+    perror("Out of memory\n");
+    sparse_free(s);
+    return NULL;
+  }
+
+  // Fill with offsets[j] as the cursor of row j, which leaves it at the start
+  // of row j + 1, then shift them back.
+  for (i = 0; i < m->rows; i++) {
+    for (j = 0; j < m->columns; j += SPARSE_CHUNK) {
+      int n = m->columns - j < SPARSE_CHUNK ? m->columns - j : SPARSE_CHUNK;
+      matrix_load_row(m, i, j, n, row);
+      for (k = 0; k < n; k++) {
+        if (row[k] != 0) {
+          s->indices[s->offsets[j + k]] = i;
+          s->values[s->offsets[j + k]++] = row[k];
+        }
+      }
+    }
+  }
+  memmove(s->offsets + 1, s->offsets, m->columns * sizeof(long));
+  s->offsets[0] = 0;
+  return s;
+}
+
+/*
+ * sparse_clear removes every row, keeping the memory for the next batch.
+ */
+void sparse_clear(sparse *s) {
+  s->rows = 0;
+  s->count = 0;
+}
+
+/*
+ * sparse_free
+ */
+void sparse_free(sparse *s) {
+  allocator_release(s->offsets);
+  allocator_release(s->indices);
+  allocator_release(s->values);
+  allocator_release(s);
+}
+
+typedef struct sparse_task {
+  matrix *weights;
+  sparse *input;
+  matrix *output;
+  matrix *biases;
+  int activation;
+  float scale;
+} sparse_task;
+
+/*
+ * sparse_gemm_fused_range computes output rows [begin, end), gathering each
+ * sample's nonzero features from one weight row at a time.
+ */
+static void sparse_gemm_fused_range(void *context, long begin, long end) {
+  sparse_task *t = (sparse_task *)context;
+  sparse *x = t->input;
+  float row[SPARSE_CHUNK];
+  long o, k;
+  int i, j;
+
+  for (o = begin; o < end; o++) {
+    const float *w = matrix_element(t->weights, o, 0);
+    long stride = t->weights->column_stride;
+    float bias = t->biases != NULL ? matrix_at(t->biases, o, 0) : 0;
+    for (i = 0; i < x->rows; i += SPARSE_CHUNK) {
+      int n = x->rows - i < SPARSE_CHUNK ? x->rows - i : SPARSE_CHUNK;
+      for (j = 0; j < n; j++) {
+        float sum = bias;
+        for (k = x->offsets[i + j]; k < x->offsets[i + j + 1]; k++) {
+          sum += x->values[k] * w[x->indices[k] * stride];
+        }
+        row[j] = sum;
+      }
+      activation_forward(t->activation, row, row, n);
+      matrix_store_row(t->output, (int)o, i, n, row);
+    }
+  }
+}
+
+/*
+ * sparse_gemm_fused computes activation(weights * input^T + biases) for a
+ * sparse batch input, one sample per row, into the outputs x batch output.
+ * Only the weight columns of nonzero features are read, biases may be NULL.
+ */
+matrix *sparse_gemm_fused(matrix *weights, sparse *input, matrix *output, matrix *biases, int activation) {
+  sparse_task t = {weights, input, output, biases, activation, 1};
+  long grain;
+  if (weights->type != MATRIX_FLOAT32 || weights->columns != input->columns ||
+      output->rows != weights->rows || output->columns != input->rows) {
+    fprintf(stderr, "sparse_gemm_fused: (%d, %d) x (%d, %d)^T doesn't fit (%d, %d)\n",
+      weights->rows, weights->columns, input->rows, input->columns, output->rows, output->columns);
+    return NULL;
+  }
+  grain = THREAD_GRAIN / (input->count + input->rows + 1);
+  thread_parallel_for(weights->rows, grain > 0 ? grain : 1, &sparse_gemm_fused_range, &t);
+  return output;
+}
+
+/*
+ * sparse_gemm_update_range accumulates gradient weight rows [begin, end).
+ */
+static void sparse_gemm_update_range(void *context, long begin, long end) {
+  sparse_task *t = (sparse_task *)context;
+  sparse *x = t->input;
+  float row[SPARSE_CHUNK];
+  long o, k;
+  int i, j;
+
+  for (o = begin; o < end; o++) {
+    float *w = matrix_element(t->weights, o, 0);
+    long stride = t->weights->column_stride;
+    for (i = 0; i < x->rows; i += SPARSE_CHUNK) {
+      int n = x->rows - i < SPARSE_CHUNK ? x->rows - i : SPARSE_CHUNK;
+      matrix_load_row(t->output, (int)o, i, n, row);
+      for (j = 0; j < n; j++) {
+        float g = t->scale * row[j];
+        if (g == 0) {
+          continue;
+        }
+        for (k = x->offsets[i + j]; k < x->offsets[i + j + 1]; k++) {
+          w[x->indices[k] * stride] += g * x->values[k];
+        }
+      }
+    }
+  }
+}
+
+/*
+ * sparse_gemm_update accumulates scale * gradient * input into
+ * gradient_weights, for the outputs x batch gradient of a sparse batch input.
+ * Only the columns of nonzero features are written.
+ */
+matrix *sparse_gemm_update(matrix *gradient_weights, sparse *input, matrix *gradient, float scale) {
+  sparse_task t = {gradient_weights, input, gradient, NULL, ACTIVATION_NONE, scale};
+  long grain;
+  if (gradient_weights->type != MATRIX_FLOAT32 || gradient_weights->columns != input->columns ||
+      gradient->rows != gradient_weights->rows || gradient->columns != input->rows) {
+    fprintf(stderr, "sparse_gemm_update: (%d, %d) x (%d, %d) doesn't fit (%d, %d)\n",
+      gradient->rows, gradient->columns, input->rows, input->columns,
+      gradient_weights->rows, gradient_weights->columns);
+    return NULL;
+  }
+  grain = THREAD_GRAIN / (input->count + input->rows + 1);
+  thread_parallel_for(gradient_weights->rows, grain > 0 ? grain : 1, &sparse_gemm_update_range, &t);
+  return gradient_weights;
+}
+
+/*
+ * sparse_set_create returns an empty set of columns in [0, size).
+ */
+sparse_set *sparse_set_create(int size) {
+  sparse_set *set;
+  if ((set = allocator_allocate(cai_allocator_get(), sizeof(*set))) == NULL) {
+    perror("Out of memory\n");
+    return NULL;
+  }
+  set->indices = allocator_allocate(cai_allocator_get(), (size + 1) * sizeof(int));
+  set->marks = allocator_allocate(cai_allocator_get(), size + 1);
+  if (set->indices == NULL || set->marks == NULL) {
+    perror("Out of memory\n");
+    sparse_set_free(set);
+    return NULL;
+  }
+  memset(set->marks, 0, size + 1);
+  set->count = 0;
+  set->size = size;
+  set->all = 0;
+  return set;
+}
+
+/*
+ * sparse_set_add adds the columns of the nonzeros of s.
+ */
+sparse_set *sparse_set_add(sparse_set *set, sparse *s) {
+  long k;
+  for (k = 0; k < s->count; k++) {
+    int i = s->indices[k];
+    if (!set->marks[i]) {
+      set->marks[i] = 1;
+      set->indices[set->count++] = i;
+    }
+  }
+  return set;
+}
+
+typedef struct sparse_set_task {
+  sparse_set *set;
+  float a;
+  matrix *x;
+  matrix *y;
+} sparse_set_task;
+
+static void sparse_set_zero_range(void *context, long begin, long end) {
+  sparse_set_task *t = (sparse_set_task *)context;
+  long o, stride = t->y->column_stride;
+  int k;
+  for (o = begin; o < end; o++) {
+    float *y = matrix_element(t->y, o, 0);
+    for (k = 0; k < t->set->count; k++) {
+      y[t->set->indices[k] * stride] = 0;
+    }
+  }
+}
+
+static void sparse_set_axpy_range(void *context, long begin, long end) {
+  sparse_set_task *t = (sparse_set_task *)context;
+  long o, x_stride = t->x->column_stride, y_stride = t->y->column_stride;
+  int k;
+  for (o = begin; o < end; o++) {
+    const float *x = matrix_element(t->x, o, 0);
+    float *y = matrix_element(t->y, o, 0);
+    for (k = 0; k < t->set->count; k++) {
+      int i = t->set->indices[k];
+      y[i * y_stride] += t->a * x[i * x_stride];
+    }
+  }
+}
+
+/*
+ * sparse_set_zero zeroes the columns of m in set.
+ */
+void sparse_set_zero(sparse_set *set, matrix *m) {
+  sparse_set_task t = {set, 0, NULL, m};
+  long grain = THREAD_GRAIN / (set->count + 1);
+  thread_parallel_for(m->rows, grain > 0 ? grain : 1, &sparse_set_zero_range, &t);
+}
+
+/*
+ * sparse_set_axpy adds a * x to y in the columns in set.
+ */
+void sparse_set_axpy(sparse_set *set, float a, matrix *x, matrix *y) {
+  sparse_set_task t = {set, a, x, y};
+  long grain = THREAD_GRAIN / (set->count + 1);
+  thread_parallel_for(y->rows, grain > 0 ? grain : 1, &sparse_set_axpy_range, &t);
+}
+
+/*
+ * sparse_set_clear empties set.
+ */
+void sparse_set_clear(sparse_set *set) {
+  int k;
+  for (k = 0; k < set->count; k++) {
+    set->marks[set->indices[k]] = 0;
+  }
+  set->count = 0;
+  set->all = 0;
+}
+
+/*
+ * sparse_set_free
+ */
+void sparse_set_free(sparse_set *set) {
+  allocator_release(set->indices);
+  allocator_release(set->marks);
+  allocator_release(set);
+}
@@ -0,0 +1,48 @@
+#ifndef __SPARSE_H_
+#define __SPARSE_H_
+#include "matrix.h"
+
+/*
+ * sparse is a compressed sparse row matrix, the nonzeros of row i are
+ * indices and values [offsets[i], offsets[i + 1]). As a layer input each row
+ * is one sample and each column a feature, the transpose of a dense features x
+ * batch input, so a batch is built a sample at a time with sparse_row_add.
+ */
+typedef struct sparse {
+  int rows;
+  int columns;
+  long *offsets;
+  int *indices;
+  float *values;
+  long count;
+  long capacity;
+  int row_capacity;
+} sparse;
+
+/*
+ * sparse_set is a set of column indices, listed in indices and marked in
+ * marks. all stands for every column, when dense updates were mixed in.
+ */
+typedef struct sparse_set {
+  int *indices;
+  unsigned char *marks;
+  int count;
+  int size;
+  int all;
+} sparse_set;
+
+sparse *sparse_create(int columns);
+sparse *sparse_from_matrix(matrix *m);
+sparse *sparse_row_add(sparse *s, const int *indices, const float *values, int count);
+void sparse_clear(sparse *s);
+void sparse_free(sparse *s);
+matrix *sparse_gemm_fused(matrix *weights, sparse *input, matrix *output, matrix *biases, int activation);
+matrix *sparse_gemm_update(matrix *gradient_weights, sparse *input, matrix *gradient, float scale);
+sparse_set *sparse_set_create(int size);
+sparse_set *sparse_set_add(sparse_set *set, sparse *s);
+void sparse_set_zero(sparse_set *set, matrix *m);
+void sparse_set_axpy(sparse_set *set, float a, matrix *x, matrix *y);
+void sparse_set_clear(sparse_set *set);
+void sparse_set_free(sparse_set *set);
+
+#endif
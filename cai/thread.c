@@ -0,0 +1,334 @@
+#define _GNU_SOURCE
+#include "thread.h"
+#include "kernel.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct thread_range {
+  pthread_mutex_t lock;
+  long begin;
+  long end;
+} thread_range;
+
+typedef struct thread_pool {
+  pthread_t threads[THREAD_MAX];
+  unsigned long generations[THREAD_MAX];
+  thread_range ranges[THREAD_MAX];
+  int size;
+  int pin;
+  int started;
+  int ready;
+  int stop;
+  int active;
+  unsigned long generation;
+  pthread_mutex_t lock;
+  pthread_mutex_t busy;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  void (*function)(void *, long, long);
+  void *context;
+  long grain;
+} thread_pool;
+
+static thread_pool pool = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .busy = PTHREAD_MUTEX_INITIALIZER,
+  .wake = PTHREAD_COND_INITIALIZER,
+  .done = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * thread_index is 0 outside the pool and the worker number inside it, parallel
+ * calls made from a worker run inline instead of waiting on the pool.
+ */
+static __thread int thread_index = 0;
+
+/*
+ * thread_take removes up to grain iterations from the front of range r.
+ */
+static int thread_take(thread_range *r, long grain, long *begin, long *end) {
+  int taken = 0;
+  pthread_mutex_lock(&r->lock);
+  if (r->begin < r->end) {
+    *begin = r->begin;
+    *end = r->end - r->begin > grain ? r->begin + grain : r->end;
+    r->begin = *end;
+    taken = 1;
+  }
+  pthread_mutex_unlock(&r->lock);
+  return taken;
+}
+
+/*
+ * thread_steal moves the back half of the fullest other range into range self.
+ */
+static int thread_steal(int self) {
+  int i, victim = -1;
+  long most = 0, begin = 0, end = 0;
+  for (i = 0; i < pool.size; i++) {
+    if (i != self) {
+      thread_range *r = &pool.ranges[i];
+      pthread_mutex_lock(&r->lock);
+      if (r->end - r->begin > most) {
+        most = r->end - r->begin;
+        victim = i;
+      }
+      pthread_mutex_unlock(&r->lock);
+    }
+  }
+  if (victim < 0) {
+    return 0;
+  }
+  thread_range *r = &pool.ranges[victim];
+  pthread_mutex_lock(&r->lock);
+  if (r->end - r->begin > 0) {
+    long remaining = r->end - r->begin;
+    begin = remaining <= pool.grain ? r->begin : r->end - remaining / 2;
+    end = r->end;
+    r->end = begin;
+  }
+  pthread_mutex_unlock(&r->lock);
+  if (end <= begin) {
+    return 1;
+  }
+  pthread_mutex_lock(&pool.ranges[self].lock);
+  pool.ranges[self].begin = begin;
+  pool.ranges[self].end = end;
+  pthread_mutex_unlock(&pool.ranges[self].lock);
+  return 1;
+}
+
+/*
+ * thread_work runs chunks from range self, then steals until all ranges are empty.
+ */
+static void thread_work(int self) {
+  long begin, end;
+  for (;;) {
+    while (thread_take(&pool.ranges[self], pool.grain, &begin, &end)) {
+      pool.function(pool.context, begin, end);
+    }
+    if (!thread_steal(self)) {
+      return;
+    }
+  }
+}
+
+/*
+ * thread_main allocates the GEMM scratch of the worker before it reports ready,
+ * so a worker that only gets work steps later doesn't allocate then.
+ */
+static void *thread_main(void *argument) {
+  thread_index = (int)(long)argument;
+  unsigned long generation = pool.generations[thread_index];
+  kernel_get()->gemm_warm();
+  pthread_mutex_lock(&pool.lock);
+  pool.ready++;
+  pthread_cond_signal(&pool.done);
+  pthread_mutex_unlock(&pool.lock);
+  for (;;) {
+    pthread_mutex_lock(&pool.lock);
+    while (!pool.stop && pool.generation == generation) {
+      pthread_cond_wait(&pool.wake, &pool.lock);
+    }
+    if (pool.stop) {
+      pthread_mutex_unlock(&pool.lock);
+      return NULL;
+    }
+    generation = pool.generation;
+    pthread_mutex_unlock(&pool.lock);
+
+    thread_work(thread_index);
+
+    pthread_mutex_lock(&pool.lock);
+    if (--pool.active == 0) {
+      pthread_cond_signal(&pool.done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+  }
+}
+
+/*
+ * thread_stop joins every worker.
+ */
+static void thread_stop() {
+  int i;
+  if (!pool.started) {
+    return;
+  }
+  pthread_mutex_lock(&pool.lock);
+  pool.stop = 1;
+  pthread_cond_broadcast(&pool.wake);
+  pthread_mutex_unlock(&pool.lock);
+  for (i = 1; i < pool.size; i++) {
+    pthread_join(pool.threads[i], NULL);
+  }
+  pool.stop = 0;
+  pool.started = 0;
+}
+
+/*
+ * thread_start launches size - 1 workers, the calling thread is the last one,
+ * and waits for them to be ready.
+ */
+static int thread_start(int size) {
+  int i;
+  size = size < 1 ? 1 : size > THREAD_MAX ? THREAD_MAX : size;
+  for (i = 0; i < size; i++) {
+    pthread_mutex_init(&pool.ranges[i].lock, NULL);
+    pool.ranges[i].begin = pool.ranges[i].end = 0;
+  }
+  pool.size = 1;
+  pool.ready = 0;
+  for (i = 1; i < size; i++) {
+    pool.generations[i] = pool.generation;
+    if (pthread_create(&pool.threads[i], NULL, &thread_main, (void *)(long)i) != 0) {
+      perror("pthread_create");
+      break;
+    }
+#ifdef __linux__
+    if (pool.pin) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(i % CPU_SETSIZE, &set);
+      pthread_setaffinity_np(pool.threads[i], sizeof(set), &set);
+    }
+#endif
+    pool.size++;
+  }
+  pthread_mutex_lock(&pool.lock);
+  while (pool.ready < pool.size - 1) {
+    pthread_cond_wait(&pool.done, &pool.lock);
+  }
+  pthread_mutex_unlock(&pool.lock);
+  __atomic_store_n(&pool.started, 1, __ATOMIC_RELEASE);
+  return pool.size;
+}
+
+/*
+ * thread_init sizes the pool from CAI_NUM_THREADS, or the online cores, and pins
+ * the workers when CAI_THREAD_PIN is set.
+ */
+static void thread_init() {
+  char *threads = getenv("CAI_NUM_THREADS");
+  char *pin = getenv("CAI_THREAD_PIN");
+  long size = threads != NULL ? atol(threads) : sysconf(_SC_NPROCESSORS_ONLN);
+  pool.pin = pin != NULL && atoi(pin) != 0;
+  thread_start(size > 0 ? (int)size : 1);
+}
+
+/*
+ * thread_parallel_for calls function over [0, count) in chunks of at most grain
+ * iterations across the pool. Every participant starts on an equal slice and
+ * steals half of the fullest slice when it runs dry. Calls no bigger than one
+ * grain, calls from inside the pool and calls while the pool is busy run inline.
+ */
+void thread_parallel_for(
+  long count,
+  long grain,
+  void (*function)(void *context, long begin, long end),
+  void *context
+) {
+  int i;
+  if (count <= 0) {
+    return;
+  }
+  grain = grain < 1 ? 1 : grain;
+  if (count <= grain || thread_index != 0) {
+    function(context, 0, count);
+    return;
+  }
+  if (pthread_mutex_trylock(&pool.busy) != 0) {
+    function(context, 0, count);
+    return;
+  }
+  if (!pool.started) {
+    thread_init();
+  }
+  if (pool.size == 1) {
+    pthread_mutex_unlock(&pool.busy);
+    function(context, 0, count);
+    return;
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  pool.function = function;
+  pool.context = context;
+  pool.grain = grain;
+  for (i = 0; i < pool.size; i++) {
+    pool.ranges[i].begin = count * i / pool.size;
+    pool.ranges[i].end = count * (i + 1) / pool.size;
+  }
+  pool.active = pool.size - 1;
+  pool.generation++;
+  pthread_cond_broadcast(&pool.wake);
+  pthread_mutex_unlock(&pool.lock);
+
+  thread_work(0);
+
+  pthread_mutex_lock(&pool.lock);
+  while (pool.active > 0) {
+    pthread_cond_wait(&pool.done, &pool.lock);
+  }
+  pthread_mutex_unlock(&pool.lock);
+  pthread_mutex_unlock(&pool.busy);
+}
+
+/*
+ * cai_threads_set resizes the pool to threads participants, counting the caller.
+ * Returns the size actually started.
+ */
+int cai_threads_set(int threads) {
+  int size;
+  pthread_mutex_lock(&pool.busy);
+  if (!pool.started) {
+    char *pin = getenv("CAI_THREAD_PIN");
+    pool.pin = pool.pin || (pin != NULL && atoi(pin) != 0);
+  }
+  thread_stop();
+  size = thread_start(threads);
+  pthread_mutex_unlock(&pool.busy);
+  return size;
+}
+
+/*
+ * cai_threads_get
+ */
+int cai_threads_get() {
+  if (!__atomic_load_n(&pool.started, __ATOMIC_ACQUIRE)) {
+    pthread_mutex_lock(&pool.busy);
+    if (!pool.started) {
+      thread_init();
+    }
+    pthread_mutex_unlock(&pool.busy);
+  }
+  return __atomic_load_n(&pool.size, __ATOMIC_RELAXED);
+}
+
+/*
+ * cai_threads_pin pins worker i to core i when pin is set, restarting the pool.
+ */
+int cai_threads_pin(int pin) {
+  int size;
+  pthread_mutex_lock(&pool.busy);
+  if (!pool.started) {
+    thread_init();
+  }
+  pool.pin = pin;
+  size = pool.size;
+  thread_stop();
+  size = thread_start(size);
+  pthread_mutex_unlock(&pool.busy);
+  return size;
+}
+
+/*
+ * cai_threads_free stops the pool, the next parallel call starts it again.
+ */
+void cai_threads_free() {
+  pthread_mutex_lock(&pool.busy);
+  thread_stop();
+  pthread_mutex_unlock(&pool.busy);
+}
@@ -0,0 +1,18 @@
+#ifndef __THREAD_H_
+#define __THREAD_H_
+
+#define THREAD_MAX 256
+#define THREAD_GRAIN 16384
+
+void thread_parallel_for(
+  long count,
+  long grain,
+  void (*function)(void *context, long begin, long end),
+  void *context
+);
+int cai_threads_set(int threads);
+int cai_threads_get();
+int cai_threads_pin(int pin);
+void cai_threads_free();
+
+#endif
@@ -0,0 +1,188 @@
+#include "trainer.h"
+#include "allocator.h"
+#include "thread.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * trainer_create returns a synchronous data-parallel trainer for n. Each of the
+ * workers gets a replica of n sharing its weights and a criterion like c, the
+ * first replica is n itself. workers <= 0 uses one worker per pool thread.
+ */
+trainer *trainer_create(network *n, criterion *c, int workers) {
+  trainer *t;
+  int w;
+  if ((t = allocator_allocate(cai_allocator_get(), sizeof(*t))) == NULL) {
+    perror("Out of memory\n");
+    return NULL;
+  }
+  workers = workers > 0 ? workers : cai_threads_get();
+  t->network = n;
+  t->optimizer = NULL;
+  t->workers = workers;
+  t->shards = t->columns = t->stride = t->failed = 0;
+  t->replicas = allocator_allocate(cai_allocator_get(), workers * sizeof(*t->replicas));
+  t->criteria = allocator_allocate(cai_allocator_get(), workers * sizeof(*t->criteria));
+  t->inputs = allocator_allocate(cai_allocator_get(), workers * sizeof(*t->inputs));
+  t->targets = allocator_allocate(cai_allocator_get(), workers * sizeof(*t->targets));
+  t->losses = allocator_allocate(cai_allocator_get(), workers * sizeof(*t->losses));
+  t->loss = matrix_create(1, 1, NULL);
+  if (t->replicas == NULL || t->criteria == NULL || t->inputs == NULL ||
+      t->targets == NULL || t->losses == NULL || t->loss == NULL) {
+    perror("Out of memory\n");
+    t->workers = 0;
+    trainer_free(t);
+    return NULL;
+  }
+  for (w = 0; w < workers; w++) {
+    t->replicas[w] = w == 0 ? n : network_replicate(n);
+    t->criteria[w] = criterion_create(c->criterion_output, c->criterion_gradient);
+    if (t->replicas[w] == NULL || t->criteria[w] == NULL) {
+      if (w > 0 && t->replicas[w] != NULL) {
+        network_free(t->replicas[w]);
+      }
+      if (t->criteria[w] != NULL) {
+        criterion_free(t->criteria[w]);
+      }
+      t->workers = w;
+      trainer_free(t);
+      return NULL;
+    }
+  }
+  return t;
+}
+
+/*
+ * trainer_optimizer_set updates the network through o instead of plain SGD, o
+ * must optimize the network of t and isn't freed with t.
+ */
+trainer *trainer_optimizer_set(trainer *t, optimizer *o) {
+  if (o != NULL && o->network != t->network) {
+    fprintf(stderr, "trainer_optimizer_set: optimizer is for another network\n");
+    return NULL;
+  }
+  t->optimizer = o;
+  return t;
+}
+
+/*
+ * trainer_worker runs forward, loss and backward for shards [begin, end). The
+ * loss gradient is weighted by the shard's share of the batch, so the reduced
+ * gradients equal those of the whole batch. A shard that fails marks the step
+ * failed.
+ */
+static void trainer_worker(void *context, long begin, long end) {
+  trainer *t = (trainer *)context;
+  long w;
+  for (w = begin; w < end; w++) {
+    network *n = t->replicas[w];
+    criterion *c = t->criteria[w];
+    matrix *input = &t->inputs[w], *target = &t->targets[w], *output, *gradient;
+    float share = (float)input->columns / (float)t->columns;
+    t->losses[w] = NAN;
+    network_gradient_zero(n);
+    if ((output = network_forward(n, input)) == NULL ||
+        (gradient = criterion_forward_backward(c, output, target)) == NULL ||
+        matrix_scale_into(gradient, share, gradient) == NULL ||
+        network_backward(n, input, gradient) == NULL) {
+      __atomic_store_n(&t->failed, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    t->losses[w] = share * matrix_at(c->output, 0, 0);
+  }
+}
+
+/*
+ * trainer_reduce adds the gradients of replica i + stride into replica i for
+ * pairs [begin, end) of the current tree level.
+ */
+static void trainer_reduce(void *context, long begin, long end) {
+  trainer *t = (trainer *)context;
+  long pair;
+  for (pair = begin; pair < end; pair++) {
+    long i = pair * 2 * t->stride, j = i + t->stride;
+    list_node *to, *from;
+    if (j >= t->shards) {
+      continue;
+    }
+    for (to = t->replicas[i]->layers->head, from = t->replicas[j]->layers->head;
+        to != NULL && from != NULL; to = to->next, from = from->next) {
+      layer *lt = (layer *)to->value, *lf = (layer *)from->value;
+      if (lt->gradient_weights != NULL) {
+        matrix_axpy(1, lf->gradient_weights, lt->gradient_weights);
+      }
+      if (lt->gradient_biases != NULL) {
+        matrix_axpy(1, lf->gradient_biases, lt->gradient_biases);
+      }
+    }
+  }
+}
+
+/*
+ * trainer_step trains on one features x batch mini-batch. The batch columns are
+ * split across the workers, each runs its replica on its shard, the gradients
+ * are tree-reduced into the network and a single update is applied, through
+ * the optimizer of t if it has one.
+ * Returns the batch loss, owned by the trainer, or NULL without updating the
+ * network when a shard failed.
+ */
+matrix *trainer_step(trainer *t, matrix *input, matrix *target, float learning_rate) {
+  int w;
+  float loss = 0;
+  t->columns = input->columns;
+  t->shards = t->workers < input->columns ? t->workers : input->columns;
+  t->failed = 0;
+  for (w = 0; w < t->shards; w++) {
+    int begin = (int)((long)input->columns * w / t->shards);
+    int end = (int)((long)input->columns * (w + 1) / t->shards);
+    if (matrix_view_columns_into(input, begin, end - begin, &t->inputs[w]) == NULL ||
+        matrix_view_columns_into(target, begin, end - begin, &t->targets[w]) == NULL) {
+      return NULL;
+    }
+  }
+
+  thread_parallel_for(t->shards, 1, &trainer_worker, t);
+  if (t->failed) {
+    fprintf(stderr, "trainer_step: a shard failed, the network wasn't updated\n");
+    return NULL;
+  }
+
+  for (t->stride = 1; t->stride < t->shards; t->stride *= 2) {
+    thread_parallel_for((t->shards + 2 * t->stride - 1) / (2 * t->stride), 1, &trainer_reduce, t);
+  }
+  if (t->optimizer != NULL) {
+    optimizer_step(t->optimizer, learning_rate);
+  } else {
+    network_update(t->network, learning_rate);
+  }
+
+  for (w = 0; w < t->shards; w++) {
+    loss += t->losses[w];
+  }
+  matrix_at(t->loss, 0, 0) = loss;
+  return t->loss;
+}
+
+/*
+ * trainer_free releases the replicas and criteria, not the network.
+ */
+void trainer_free(trainer *t) {
+  int w;
+  for (w = 0; w < t->workers; w++) {
+    if (w > 0) {
+      network_free(t->replicas[w]);
+    }
+    criterion_free(t->criteria[w]);
+  }
+  if (t->loss != NULL) {
+    matrix_free(t->loss);
+  }
+  allocator_release(t->replicas);
+  allocator_release(t->criteria);
+  allocator_release(t->inputs);
+  allocator_release(t->targets);
+  allocator_release(t->losses);
+  allocator_release(t);
+  t = NULL;
+}
@@ -0,0 +1,29 @@
+#ifndef __TRAINER_H__
+#define __TRAINER_H__
+#include "matrix.h"
+#include "network.h"
+#include "criterion.h"
+#include "optimizer.h"
+
+typedef struct trainer {
+  network *network;
+  optimizer *optimizer;
+  network **replicas;
+  criterion **criteria;
+  matrix *inputs;
+  matrix *targets;
+  matrix *loss;
+  float *losses;
+  int workers;
+  int shards;
+  int columns;
+  int stride;
+  int failed;
+} trainer;
+
+trainer *trainer_create(network *n, criterion *c, int workers);
+trainer *trainer_optimizer_set(trainer *t, optimizer *o);
+matrix *trainer_step(trainer *t, matrix *input, matrix *target, float learning_rate);
+void trainer_free(trainer *t);
+
+#endif
@@ -0,0 +1,595 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cai/autotune.h"
+#include "cai/bfloat16.h"
+#include "cai/convolution.h"
+#include "cai/criterion.h"
+#include "cai/kernel.h"
+#include "cai/matrix.h"
+#include "cai/network.h"
+#include "cai/optimizer.h"
+#include "cai/thread.h"
+#include "cai/trainer.h"
+
+/*
+ * test is one named check, run returns the number of failures it found.
+ */
+typedef struct test {
+  const char *name;
+  int (*run)();
+} test;
+
+static float test_uniform(int i, int j) {
+  return (float)rand() / (float)RAND_MAX * 2 - 1;
+}
+
+/*
+ * test_mlp returns a features -> hidden -> outputs network of dense layers, the
+ * same one for the same seed.
+ */
+static network *test_mlp(unsigned int seed, int features, int hidden, int outputs) {
+  network *n = network_create();
+  srand(seed);
+  network_layer_add(n, layer_create_dense(ACTIVATION_TANH, &test_uniform, features, hidden));
+  network_layer_add(n, layer_create_dense(ACTIVATION_NONE, &test_uniform, hidden, outputs));
+  return n;
+}
+
+/*
+ * test_sparse_batch returns a features x batch matrix with count nonzeros per
+ * sample, in the columns from first on that are a multiple of every apart.
+ */
+static matrix *test_sparse_batch(int features, int batch, int count, int first, int every) {
+  matrix *m = matrix_create(features, batch, NULL);
+  int j, k;
+  for (j = 0; j < batch; j++) {
+    for (k = 0; k < count; k++) {
+      matrix_at(m, first + (rand() % ((features - first) / every)) * every, j) = test_uniform(0, 0);
+    }
+  }
+  return m;
+}
+
+/*
+ * test_compare counts the elements of a and b further apart than tolerance,
+ * relative to the magnitude of b, and reports the first few as name.
+ */
+static int test_compare(const char *name, matrix *a, matrix *b, float tolerance) {
+  int failures = 0, i, j;
+  for (i = 0; i < a->rows; i++) {
+    for (j = 0; j < a->columns; j++) {
+      float x = matrix_at(a, i, j), y = matrix_at(b, i, j);
+      if (!(fabsf(x - y) <= tolerance * (1 + fabsf(y))) && failures++ < 4) {
+        fprintf(stderr, "  %s(%d, %d) is %g, expected %g\n", name, i, j, x, y);
+      }
+    }
+  }
+  return failures;
+}
+
+static layer *test_layer(network *n, int index) {
+  list_node *node = n->layers->head;
+  for (; index > 0; index--) {
+    node = node->next;
+  }
+  return (layer *)node->value;
+}
+
+static matrix *test_weights(network *n, int index) {
+  return test_layer(n, index)->weights;
+}
+
+/*
+ * test_gemm_bfloat16_accumulation multiplies with k over several KC panels into
+ * a bfloat16 c, with and without beta, and checks every element is the float
+ * product rounded to bfloat16 once.
+ */
+static int test_gemm_bfloat16_accumulation() {
+  int m = 64, n = 64, k = 4 * matrix_gemm_blocking().kc, failures = 0, i, j, beta;
+  matrix *a = matrix_create(m, k, &test_uniform);
+  matrix *b = matrix_create(k, n, &test_uniform);
+  matrix *start = matrix_create(m, n, &test_uniform);
+  matrix *expected = matrix_create(m, n, NULL);
+  matrix *c = matrix_create_type(m, n, MATRIX_BFLOAT16);
+  float row[64];
+  for (beta = 0; beta < 2; beta++) {
+    matrix_copy_into(start, c);
+    matrix_copy_into(c, expected);
+    matrix_gemm(0, 0, 1, a, b, (float)beta, expected);
+    matrix_gemm(0, 0, 1, a, b, (float)beta, c);
+    for (i = 0; i < m; i++) {
+      matrix_load_row(c, i, 0, n, row);
+      for (j = 0; j < n; j++) {
+        float once = bfloat16_float(bfloat16_round(matrix_at(expected, i, j)));
+        if (row[j] != once) {
+          if (failures++ < 4) {
+            fprintf(stderr, "  c(%d, %d) with beta %d is %g, rounded once %g\n", i, j, beta, row[j], once);
+          }
+        }
+      }
+    }
+  }
+  matrix_free(a);
+  matrix_free(b);
+  matrix_free(start);
+  matrix_free(expected);
+  matrix_free(c);
+  return failures;
+}
+
+/*
+ * test_convolution_padding checks padding as wide as the kernel is rejected,
+ * and that max and average pooling with dilated windows that miss the image
+ * output finite values, with 0 for the empty windows.
+ */
+static int test_convolution_padding() {
+  int failures = 0, kind, i, j;
+  convolution *c = convolution_create(4, 4, 1, 1, 2, 2, 3, 1);
+  matrix *input, *output, *gradient, *result;
+  if (c != NULL) {
+    fprintf(stderr, "  padding 3 around a 2 pixel kernel was accepted\n");
+    convolution_free(c);
+    failures++;
+  }
+  // a 2x2 kernel dilated by 3 over a 2x2 image padded by 2, the windows of
+  // output row and column 1 fall between the image pixels
+  c = convolution_create(2, 2, 1, 1, 2, 1, 2, 3);
+  input = matrix_create(convolution_input_size(c), 3, &test_uniform);
+  output = matrix_create(convolution_output_size(c), 3, NULL);
+  gradient = matrix_create(convolution_output_size(c), 3, &test_uniform);
+  result = matrix_create(convolution_input_size(c), 3, NULL);
+  for (kind = CONVOLUTION_MAX; kind <= CONVOLUTION_AVERAGE; kind++) {
+    convolution_pool(c, kind, input, output);
+    convolution_pool_backward(c, kind, input, output, gradient, result);
+    for (i = 0; i < output->rows; i++) {
+      int empty = i / c->output_width == 1 || i % c->output_width == 1;
+      for (j = 0; j < output->columns; j++) {
+        float y = matrix_at(output, i, j);
+        if (y - y != 0 || (empty && y != 0)) {
+          if (failures++ < 4) {
+            fprintf(stderr, "  pool %d output(%d, %d) is %g\n", kind, i, j, y);
+          }
+        }
+      }
+    }
+    for (i = 0; i < result->rows; i++) {
+      for (j = 0; j < result->columns; j++) {
+        float r = matrix_at(result, i, j);
+        if (r - r != 0 && failures++ < 4) {
+          fprintf(stderr, "  pool %d gradient(%d, %d) is %g\n", kind, i, j, r);
+        }
+      }
+    }
+  }
+  matrix_free(input);
+  matrix_free(output);
+  matrix_free(gradient);
+  matrix_free(result);
+  convolution_free(c);
+  return failures;
+}
+
+/*
+ * test_autotune_cache loads a cache with good lines and blockings that are zero
+ * or implausibly large, and checks only the good ones are taken. A kc that
+ * isn't a whole number of vectors has to multiply correctly.
+ */
+static int test_autotune_cache() {
+  char path[] = "/tmp/cai_test_autotune_XXXXXX";
+  int failures = 0, loaded, descriptor = mkstemp(path), i, j, p;
+  FILE *file = descriptor < 0 ? NULL : fdopen(descriptor, "w");
+  matrix_blocking blocking;
+  matrix *a, *b, *c;
+  if (file == NULL) {
+    fprintf(stderr, "  can't write %s\n", path);
+    return 1;
+  }
+  fprintf(file, "%s\t%s\t997 998 999\t48 128 512\t1.00\n", cai_autotune_cpu(), cai_kernel_isa());
+  fprintf(file, "%s\t%s\t997 998 1000\t48 0 512\t1.00\n", cai_autotune_cpu(), cai_kernel_isa());
+  fprintf(file, "%s\t%s\t997 998 1001\t48 1073741824 512\t1.00\n", cai_autotune_cpu(), cai_kernel_isa());
+  fprintf(file, "%s\t%s\t997 998 1002\t60000 60000 60000\t1.00\n", cai_autotune_cpu(), cai_kernel_isa());
+  fprintf(file, "%s\t%s\t400 400 600\t200 251 512\t1.00\n", cai_autotune_cpu(), cai_kernel_isa());
+  fclose(file);
+  loaded = cai_autotune_load(path);
+  remove(path);
+  if (loaded != 2) {
+    fprintf(stderr, "  loaded %d lines, expected 2\n", loaded);
+    failures++;
+  }
+  blocking = autotune_lookup(997, 998, 999);
+  if (blocking.mc != 48 || blocking.kc != 128 || blocking.nc != 512) {
+    fprintf(stderr, "  blocking is %d %d %d\n", blocking.mc, blocking.kc, blocking.nc);
+    failures++;
+  }
+  a = matrix_create(400, 600, &test_uniform);
+  b = matrix_create(600, 400, &test_uniform);
+  c = matrix_multiply(a, b);
+  for (i = 0; i < 400; i++) {
+    for (j = 0; j < 400; j++) {
+      double expected = 0;
+      for (p = 0; p < 600; p++) {
+        expected += (double)matrix_at(a, i, p) * matrix_at(b, p, j);
+      }
+      if (fabs(matrix_at(c, i, j) - expected) > 1e-3 && failures++ < 4) {
+        fprintf(stderr, "  c(%d, %d) with kc 251 is %g, expected %g\n", i, j, matrix_at(c, i, j), expected);
+      }
+    }
+  }
+  matrix_free(a);
+  matrix_free(b);
+  matrix_free(c);
+  return failures;
+}
+
+/*
+ * test_optimizer_sparse takes one Adam step on a sparse batch and on the same
+ * batch stored densely. From zero moments the dense step leaves the columns no
+ * sample touched as they are, so the lazy sparse step has to match it. A
+ * second sparse step with weight decay, on even columns only, has to leave the
+ * odd ones alone.
+ */
+static int test_optimizer_sparse() {
+  int features = 512, batch = 8, failures = 0, i, j;
+  matrix *before;
+  network *sparse_network = test_mlp(7, features, 16, 2), *dense_network = test_mlp(7, features, 16, 2);
+  criterion *c = criterion_create(&criterion_forward_mse, &criterion_backward_mse);
+  optimizer *sparse_optimizer = optimizer_create(sparse_network, OPTIMIZER_ADAM);
+  optimizer *dense_optimizer = optimizer_create(dense_network, OPTIMIZER_ADAM);
+  matrix *input = test_sparse_batch(features, batch, 5, 0, 1);
+  matrix *target = matrix_create(2, batch, &test_uniform);
+  sparse *x = sparse_from_matrix(input);
+  network_gradient_zero(sparse_network);
+  network_backward_sparse(sparse_network, x,
+    criterion_backward(c, network_forward_sparse(sparse_network, x), target));
+  optimizer_step(sparse_optimizer, 0.01f);
+  network_gradient_zero(dense_network);
+  network_backward(dense_network, input,
+    criterion_backward(c, network_forward(dense_network, input), target));
+  optimizer_step(dense_optimizer, 0.01f);
+  for (i = 0; i < 2; i++) {
+    failures += test_compare("weights", test_weights(sparse_network, i), test_weights(dense_network, i), 1e-5f);
+  }
+  sparse_free(x);
+  matrix_free(input);
+  input = test_sparse_batch(features, batch, 5, 0, 2);
+  x = sparse_from_matrix(input);
+  before = matrix_copy(test_weights(sparse_network, 0));
+  sparse_optimizer->weight_decay = 0.1f;
+  network_gradient_zero(sparse_network);
+  network_backward_sparse(sparse_network, x,
+    criterion_backward(c, network_forward_sparse(sparse_network, x), target));
+  optimizer_step(sparse_optimizer, 0.01f);
+  for (i = 0; i < before->rows; i++) {
+    for (j = 1; j < features; j += 2) {
+      if (matrix_at(test_weights(sparse_network, 0), i, j) != matrix_at(before, i, j) && failures++ < 4) {
+        fprintf(stderr, "  untouched weight (%d, %d) changed\n", i, j);
+      }
+    }
+  }
+  matrix_free(before);
+  sparse_free(x);
+  matrix_free(input);
+  matrix_free(target);
+  optimizer_free(sparse_optimizer);
+  optimizer_free(dense_optimizer);
+  criterion_free(c);
+  network_free(sparse_network);
+  network_free(dense_network);
+  return failures;
+}
+
+/*
+ * test_quantize_mlp quantizes a small MLP and checks the error network_quantize
+ * reports on the calibration batch, and the error network_infer makes on
+ * another batch, stay within TEST_QUANTIZE_ERROR of the float output range.
+ */
+#define TEST_QUANTIZE_ERROR 0.02f
+
+static int test_quantize_mlp() {
+  int features = 64, batch = 32, failures = 0, i, j;
+  network *n = test_mlp(11, features, 128, 8);
+  matrix *calibration = matrix_create(features, batch, &test_uniform);
+  matrix *input = matrix_create(features, batch, &test_uniform);
+  matrix *expected = matrix_copy(network_forward(n, input)), *output;
+  network_context *c;
+  float low = matrix_at(expected, 0, 0), high = low, reported = -1, measured = 0;
+  for (i = 0; i < expected->rows; i++) {
+    for (j = 0; j < expected->columns; j++) {
+      low = fminf(low, matrix_at(expected, i, j));
+      high = fmaxf(high, matrix_at(expected, i, j));
+    }
+  }
+  if (network_quantize(n, calibration, &reported) == NULL ||
+      (c = network_context_create(n, batch)) == NULL) {
+    fprintf(stderr, "  network_quantize failed\n");
+    failures++;
+  } else {
+    if ((output = network_infer(c, input)) == NULL) {
+      measured = INFINITY;
+    } else {
+      for (i = 0; i < output->rows; i++) {
+        for (j = 0; j < output->columns; j++) {
+          measured = fmaxf(measured, fabsf(matrix_at(output, i, j) - matrix_at(expected, i, j)));
+        }
+      }
+    }
+    if (!(reported >= 0 && reported <= TEST_QUANTIZE_ERROR * (high - low))) {
+      fprintf(stderr, "  reported error %g, output range %g\n", reported, high - low);
+      failures++;
+    }
+    if (!(measured <= TEST_QUANTIZE_ERROR * (high - low))) {
+      fprintf(stderr, "  measured error %g, output range %g\n", measured, high - low);
+      failures++;
+    }
+    network_context_free(c);
+  }
+  matrix_free(calibration);
+  matrix_free(input);
+  matrix_free(expected);
+  network_free(n);
+  return failures;
+}
+
+/*
+ * test_network_roundtrip saves a network of a dilated convolution, a pool and
+ * a dense layer, loads it read and mapped, and checks both give the outputs of
+ * the saved network. The filters of the convolution are rebuilt from its
+ * output size. A copy of the file with a byte flipped has to fail to load.
+ */
+static int test_network_roundtrip() {
+  char path[] = "/tmp/cai_test_network_XXXXXX", flipped[sizeof(path) + 8];
+  int batch = 4, failures = 0, map, descriptor = mkstemp(path);
+  network *n = network_create(), *loaded;
+  matrix *input, *expected;
+  FILE *file;
+  long size;
+  char *bytes;
+  srand(13);
+  network_layer_add(n, layer_create_conv2d(ACTIVATION_RELU, &test_uniform,
+    convolution_create(8, 8, 1, 4, 3, 1, 2, 2)));
+  network_layer_add(n, layer_create_pool(CONVOLUTION_AVERAGE, convolution_create(8, 8, 4, 4, 2, 2, 0, 1)));
+  network_layer_add(n, layer_create_dense(ACTIVATION_NONE, &test_uniform, 64, 3));
+  input = matrix_create(64, batch, &test_uniform);
+  expected = matrix_copy(network_forward(n, input));
+  if (descriptor < 0 || close(descriptor) != 0 || network_save(n, path) == NULL) {
+    fprintf(stderr, "  can't save %s\n", path);
+    failures++;
+  }
+  for (map = 0; map < 2 && failures == 0; map++) {
+    if ((loaded = network_load(path, map)) == NULL) {
+      fprintf(stderr, "  can't load %s with map %d\n", path, map);
+      failures++;
+      continue;
+    }
+    failures += test_compare(map ? "mapped" : "read", network_forward(loaded, input), expected, 0);
+    network_free(loaded);
+  }
+  snprintf(flipped, sizeof(flipped), "%s.flip", path);
+  if (failures == 0 && (file = fopen(path, "rb")) != NULL) {
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    rewind(file);
+    bytes = malloc(size);
+    if (fread(bytes, 1, size, file) != (size_t)size) {
+      failures++;
+    }
+    fclose(file);
+    bytes[size / 2] ^= 0x10;
+    if ((file = fopen(flipped, "wb")) != NULL) {
+      fwrite(bytes, 1, size, file);
+      fclose(file);
+    }
+    free(bytes);
+    for (map = 0; map < 2; map++) {
+      if ((loaded = network_load(flipped, map)) != NULL) {
+        fprintf(stderr, "  a flipped byte loaded with map %d\n", map);
+        network_free(loaded);
+        failures++;
+      }
+    }
+    remove(flipped);
+  }
+  remove(path);
+  matrix_free(input);
+  matrix_free(expected);
+  network_free(n);
+  return failures;
+}
+
+/*
+ * test_network_sparse trains a network on sparse batches and a copy on the same
+ * batches stored densely, and checks the outputs, gradients and weights match
+ * after each step. The second step touches other columns than the first, so
+ * the gradient columns the first one left have to have been zeroed.
+ */
+static int test_network_sparse() {
+  int features = 512, batch = 8, failures = 0, step, i;
+  network *sparse_network = test_mlp(17, features, 16, 2), *dense_network = test_mlp(17, features, 16, 2);
+  criterion *c = criterion_create(&criterion_forward_mse, &criterion_backward_mse);
+  matrix *target = matrix_create(2, batch, &test_uniform);
+  for (step = 0; step < 2 && failures == 0; step++) {
+    matrix *input = test_sparse_batch(features, batch, 5, step, 2), *expected, *output;
+    sparse *x = sparse_from_matrix(input);
+    network_gradient_zero(dense_network);
+    expected = matrix_copy(network_forward(dense_network, input));
+    network_backward(dense_network, input, criterion_backward(c, expected, target));
+    network_update(dense_network, 0.1f);
+    network_gradient_zero(sparse_network);
+    output = network_forward_sparse(sparse_network, x);
+    failures += test_compare("output", output, expected, 1e-5f);
+    network_backward_sparse(sparse_network, x, criterion_backward(c, output, target));
+    network_update(sparse_network, 0.1f);
+    for (i = 0; i < 2; i++) {
+      failures += test_compare("gradient", test_layer(sparse_network, i)->gradient_weights,
+        test_layer(dense_network, i)->gradient_weights, 1e-5f);
+      failures += test_compare("weights", test_weights(sparse_network, i), test_weights(dense_network, i), 1e-5f);
+    }
+    sparse_free(x);
+    matrix_free(input);
+    matrix_free(expected);
+  }
+  matrix_free(target);
+  criterion_free(c);
+  network_free(sparse_network);
+  network_free(dense_network);
+  return failures;
+}
+
+/*
+ * test_trainer_serial takes SGD steps with trainers of several workers, on a
+ * batch that doesn't divide evenly between them, and checks the loss and the
+ * weights match serial steps on a copy of the network.
+ */
+static int test_trainer_serial() {
+  int features = 32, batch = 10, workers[] = {2, 3, 4}, failures = 0, w, step, i;
+  criterion *c = criterion_create(&criterion_forward_mse, &criterion_backward_mse);
+  matrix *input = matrix_create(features, batch, &test_uniform);
+  matrix *target = matrix_create(2, batch, &test_uniform);
+  for (w = 0; w < 3; w++) {
+    network *parallel = test_mlp(19, features, 16, 2), *serial = test_mlp(19, features, 16, 2);
+    trainer *t = trainer_create(parallel, c, workers[w]);
+    for (step = 0; step < 2; step++) {
+      matrix *loss = trainer_step(t, input, target, 0.1f), *output;
+      network_gradient_zero(serial);
+      output = network_forward(serial, input);
+      criterion_forward(c, output, target);
+      if (loss == NULL || fabsf(matrix_at(loss, 0, 0) - matrix_at(c->output, 0, 0)) > 1e-5f) {
+        fprintf(stderr, "  %d workers, step %d: loss %g, serial %g\n", workers[w], step,
+          loss == NULL ? NAN : matrix_at(loss, 0, 0), matrix_at(c->output, 0, 0));
+        failures++;
+      }
+      network_backward(serial, input, criterion_backward(c, output, target));
+      network_update(serial, 0.1f);
+    }
+    for (i = 0; i < 2; i++) {
+      failures += test_compare("weights", test_weights(parallel, i), test_weights(serial, i), 1e-5f);
+    }
+    trainer_free(t);
+    network_free(parallel);
+    network_free(serial);
+  }
+  matrix_free(input);
+  matrix_free(target);
+  criterion_free(c);
+  return failures;
+}
+
+/*
+ * test_steady_allocations runs a training step of a compiled network, then a
+ * trainer step of fewer workers than pool threads, and checks that once warmed
+ * up neither allocates, whichever thread picks up which shard.
+ */
+static int test_steady_allocations() {
+  int features = 32, batch = 16, failures = 0, run, threads = cai_threads_get();
+  network *compiled = test_mlp(23, features, 64, 4), *parallel = test_mlp(23, features, 64, 4);
+  criterion *c = criterion_create(&criterion_forward_mse, &criterion_backward_mse);
+  trainer *t = trainer_create(parallel, c, 3);
+  matrix *input = matrix_create(features, batch, &test_uniform);
+  matrix *target = matrix_create(4, batch, &test_uniform);
+  network_compile(compiled, features, batch);
+  cai_threads_set(4);
+  for (run = 0; run < 8; run++) {
+    size_t allocations = allocator_system()->allocations, step;
+    matrix *output;
+    network_gradient_zero(compiled);
+    output = network_forward(compiled, input);
+    network_backward(compiled, input, criterion_forward_backward(c, output, target));
+    network_update(compiled, 0.01f);
+    step = allocator_system()->allocations - allocations;
+    if (run > 0 && step != 0) {
+      fprintf(stderr, "  compiled step %d made %zu allocations\n", run, step);
+      failures++;
+    }
+    allocations = allocator_system()->allocations;
+    trainer_step(t, input, target, 0.01f);
+    step = allocator_system()->allocations - allocations;
+    if (run > 0 && step != 0) {
+      fprintf(stderr, "  trainer step %d made %zu allocations\n", run, step);
+      failures++;
+    }
+  }
+  cai_threads_set(threads);
+  trainer_free(t);
+  matrix_free(input);
+  matrix_free(target);
+  criterion_free(c);
+  network_free(compiled);
+  network_free(parallel);
+  return failures;
+}
+
+/*
+ * test_profile_networks profiles a forward of two networks together, and checks
+ * each layer keeps its own entries and the report of one network only has its
+ * layers.
+ */
+static int test_profile_networks() {
+  int features = 16, failures = 0, rows = 0, i;
+  network *first = test_mlp(29, features, 8, 2), *second = test_mlp(31, features, 8, 2);
+  matrix *input = matrix_create(features, 4, &test_uniform);
+  profile *p = profile_create(), *previous = cai_profile_set(p);
+  FILE *report = tmpfile();
+  char line[256];
+  network_forward(first, input);
+  network_forward(second, input);
+  cai_profile_set(previous);
+  if (p->count != 4) {
+    fprintf(stderr, "  %d entries, expected 4\n", p->count);
+    failures++;
+  }
+  for (i = 0; i < p->count; i++) {
+    if (p->entries[i].calls != 1 && failures++ < 4) {
+      fprintf(stderr, "  entry %d of layer %d has %ld calls\n", i, p->entries[i].index, p->entries[i].calls);
+    }
+  }
+  network_profile_report(first, p, report);
+  rewind(report);
+  while (fgets(line, sizeof(line), report) != NULL) {
+    rows += strstr(line, " forward ") != NULL;
+  }
+  if (rows != 2) {
+    fprintf(stderr, "  the report has %d forward rows, expected 2\n", rows);
+    failures++;
+  }
+  fclose(report);
+  profile_free(p);
+  matrix_free(input);
+  network_free(first);
+  network_free(second);
+  return failures;
+}
+
+static test tests[] = {
+  {"gemm_bfloat16_accumulation", &test_gemm_bfloat16_accumulation},
+  {"convolution_padding", &test_convolution_padding},
+  {"autotune_cache", &test_autotune_cache},
+  {"network_sparse", &test_network_sparse},
+  {"optimizer_sparse", &test_optimizer_sparse},
+  {"quantize_mlp", &test_quantize_mlp},
+  {"network_roundtrip", &test_network_roundtrip},
+  {"trainer_serial", &test_trainer_serial},
+  {"steady_allocations", &test_steady_allocations},
+  {"profile_networks", &test_profile_networks},
+};
+
+/*
+ * Runs every test, or the ones whose name contains the first argument, and
+ * exits non-zero when any fails.
+ */
+int main(int argc, char **argv) {
+  int i, failed = 0;
+  srand(1);
+  for (i = 0; i < (int)(sizeof(tests) / sizeof(tests[0])); i++) {
+    int failures;
+    if (argc > 1 && strstr(tests[i].name, argv[1]) == NULL) {
+      continue;
+    }
+    failures = tests[i].run();
+    printf("%s %s (%s)\n", failures == 0 ? "ok  " : "FAIL", tests[i].name, cai_kernel_isa());
+    failed += failures != 0;
+  }
+  return failed != 0;
+}
@@ -15,6 +15,7 @@ int main(int argc, char **argv) {
   int input_dimensions = 2;
   int output_dimensions = 1;
   int hidden_dimensions = 20;
+  int batch_size = 16;
   int testing_iterations = 1000;
   int training_iterations = 2.0e3;
 
@@ -62,17 +63,22 @@ int main(int argc, char **argv) {
     )
   );
 
+  // Plan every activation and gradient buffer up front for this batch size
+  network_compile(n, input_dimensions, batch_size);
+
   // Train, no validation
   matrix *input, *target, *output, *loss, *gradient;
-  input = matrix_create(input_dimensions, 1, NULL);
-  target = matrix_create(output_dimensions, 1, NULL);
+  input = matrix_create(input_dimensions, batch_size, NULL);
+  target = matrix_create(output_dimensions, batch_size, NULL);
 
-  int epoch, correct = 0;
+  int epoch, sample;
   for (epoch = 0; epoch < training_iterations; epoch++) {
-    // Create an XOR input and target on the fly
-    input->data[0][0] = uniform();
-    input->data[1][0] = uniform();
-    target->data[0][0] = (input->data[0][0] * input->data[1][0] > 0) ? -1 : 1;
+    // Create a batch of XOR inputs and targets on the fly, one sample per column
+    for (sample = 0; sample < batch_size; sample++) {
+      matrix_at(input, 0, sample) = uniform();
+      matrix_at(input, 1, sample) = uniform();
+      matrix_at(target, 0, sample) = (matrix_at(input, 0, sample) * matrix_at(input, 1, sample) > 0) ? -1 : 1;
+    }
 
     // Forward pass
     output = network_forward(n, input);
@@ -81,25 +87,25 @@ int main(int argc, char **argv) {
 
     network_gradient_zero(n);
     network_backward(n, input, gradient);
-    network_update(n, 0.001);
+    network_update(n, 0.01);
   }
 
-  // Free up some extra space, the gradient return and loss are meta we won't really need.
-  matrix_free(loss);
-  matrix_free(gradient);
-
   // Test
-  int total_correct = 0;
-  for (epoch = 0; epoch < testing_iterations; epoch++) {
-    input->data[0][0] = uniform();
-    input->data[1][0] = uniform();
-    target->data[0][0] = (input->data[0][0] * input->data[1][0] > 0) ? -1 : 1;
+  int total_correct = 0, total_tested = 0;
+  for (epoch = 0; epoch < testing_iterations / batch_size; epoch++) {
+    for (sample = 0; sample < batch_size; sample++) {
+      matrix_at(input, 0, sample) = uniform();
+      matrix_at(input, 1, sample) = uniform();
+      matrix_at(target, 0, sample) = (matrix_at(input, 0, sample) * matrix_at(input, 1, sample) > 0) ? -1 : 1;
+    }
     output = network_forward(n, input);
-    total_correct += (output->data[0][0] > 0 ? 1 : -1) == target->data[0][0] ? 1 : 0;
+    for (sample = 0; sample < batch_size; sample++) {
+      total_correct += (matrix_at(output, 0, sample) > 0 ? 1 : -1) == matrix_at(target, 0, sample) ? 1 : 0;
+      total_tested++;
+    }
   }
 
-  // Clean up everything
-  matrix_free(output);
+  // Clean up everything, outputs, losses and gradients belong to the network and criterion
   matrix_free(input);
   matrix_free(target);
   criterion_free(c);
@@ -109,6 +115,6 @@ int main(int argc, char **argv) {
   printf(
     "%s %.2f %%\n",
     "Percent Correct",
-    ((float)total_correct / (float)testing_iterations) * 100.0
+    ((float)total_correct / (float)total_tested) * 100.0
   );
 }